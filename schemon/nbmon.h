@@ -0,0 +1,39 @@
+/*
+ * nbmon.h -- NBMON compact binary format shared by njmon (-C or command name nbmon)
+ *            and the nbmon_decode receiver.
+ *
+ * The stream is a series of frames:
+ *     4 byte little-endian length of the rest of the frame
+ *     1 byte frame type
+ *     payload
+ *
+ *   'T' tags        version byte, then length+string of the host tags (",host=...,mtm=...")
+ *                   and length+string of the -q additional tags
+ *   'D' dictionary  repeated: id, length, name bytes. Names are sent once and from then on
+ *                   samples refer to them by id. A later entry for the same id replaces it.
+ *   'R' reset       forget the dictionary, ids start again from 1
+ *   'S' sample      epoch seconds, then NB_* ops until the end of the frame
+ *
+ * All integers are LEB128 varints, signed values are zigzag encoded first.
+ * Doubles are sent as thousandths as the text modes only print %.3f, unless they are
+ * too big for that when the 8 raw IEEE bytes are sent (little-endian).
+ */
+#define NBMON_VERSION 1
+
+#define NB_FRAME_TAGS       'T'
+#define NB_FRAME_DICTIONARY 'D'
+#define NB_FRAME_RESET      'R'
+#define NB_FRAME_SAMPLE     'S'
+
+/* sample frame ops */
+#define NB_SECTION    1	/* id */
+#define NB_SUB        2	/* id */
+#define NB_SUBEND     3
+#define NB_SECTIONEND 4
+#define NB_LONG       5	/* field id, zigzag value */
+#define NB_DOUBLE     6	/* field id, zigzag value * 1000 */
+#define NB_STRING     7	/* field id, length, bytes */
+#define NB_HEX        8	/* field id, value */
+#define NB_RAWDOUBLE  9	/* field id, 8 bytes */
+
+#define NB_DOUBLE_MAX 9.0e12	/* beyond this thousandths do not fit in 64 bits with room to spare */
@@ -0,0 +1,263 @@
+/*
+ * nbmon_decode.c -- turns the NBMON compact binary stream (njmon -C or nbmon) back in to
+ *                   InfluxDB Line Protocol, the same lines nimon would have generated.
+ * (C) Copyright 2018 Nigel Griffiths
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    Find the GNU General Public License here <http://www.gnu.org/licenses/>.
+ */
+
+/* Compile example: cc -O4 -g -o nbmon_decode nbmon_decode.c
+ * Usage: nbmon -s 10 | nbmon_decode > data.influxlp
+ *        nbmon_decode file.nbmon
+ *        nc -l 8181 | nbmon_decode   with nbmon -i thishost -p 8181 on the monitored server
+ * Timestamps are in nanoseconds so the output can be loaded straight in to InfluxDB.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nbmon.h"
+
+char **dict = NULL;	/* id to name */
+long dict_size = 0;
+
+char tags[1024] = "";
+char additional_tags[1024] = "";
+
+char *frame = NULL;
+long frame_size = 0;
+long frame_len = 0;
+long pos = 0;
+
+char section[1024];
+char sub[1024];		/* section less the trailing s and processes -> process */
+char line[1024 * 1024];	/* the tags part of the current line */
+char fields[1024 * 1024];
+long fields_len = 0;
+int had_sub = 0;
+long epoch = 0;
+
+void bad(char *message)
+{
+    fprintf(stderr, "nbmon_decode: %s at frame offset %ld\n", message, pos);
+    exit(2);
+}
+
+unsigned long long varint()
+{
+    unsigned long long value = 0;
+    int shift = 0;
+
+    for (;;) {
+	if (pos >= frame_len || shift > 63)
+	    bad("truncated varint");
+	value |= (unsigned long long) (frame[pos] & 0x7f) << shift;
+	if ((frame[pos++] & 0x80) == 0)
+	    return value;
+	shift += 7;
+    }
+}
+
+long long zigzag()
+{
+    unsigned long long value = varint();
+
+    return (long long) (value >> 1) ^ -(long long) (value & 1);
+}
+
+/* copy a length prefixed string */
+void string(char *target, long size)
+{
+    long len = varint();
+
+    if (len > frame_len - pos)
+	bad("string past end of frame");
+    if (len >= size)
+	bad("string too long");
+    memcpy(target, &frame[pos], len);
+    target[len] = 0;
+    pos += len;
+}
+
+char *name()
+{
+    unsigned long long id = varint();
+
+    if (id >= dict_size || dict[id] == NULL)
+	bad("name id not in the dictionary");
+    return dict[id];
+}
+
+void dictionary()
+{
+    unsigned long long id;
+    long len;
+
+    while (pos < frame_len) {
+	id = varint();
+	len = varint();
+	if (len > frame_len - pos)
+	    bad("dictionary name past end of frame");
+	if (id >= dict_size) {
+	    long size = id * 2 + 1024;
+
+	    dict = realloc(dict, size * sizeof(char *));
+	    memset(&dict[dict_size], 0, (size - dict_size) * sizeof(char *));
+	    dict_size = size;
+	}
+	free(dict[id]);
+	dict[id] = malloc(len + 1);
+	memcpy(dict[id], &frame[pos], len);
+	dict[id][len] = 0;
+	pos += len;
+    }
+}
+
+void reset()
+{
+    long i;
+
+    for (i = 0; i < dict_size; i++) {
+	free(dict[i]);
+	dict[i] = NULL;
+    }
+}
+
+void line_end()
+{
+    if (fields_len > 0) {
+	fields[fields_len - 1] = 0;	/* remove the trailing comma */
+	printf("%s %s %ld000000000\n", line, fields, epoch);
+    }
+    fields_len = 0;
+}
+
+void sample()
+{
+    char *n;
+    char value[1024 * 64];
+    union {
+	double d;
+	unsigned long long u;
+    } bits;
+    int i;
+
+    epoch = varint();
+    while (pos < frame_len) {
+	switch (frame[pos++]) {
+	case NB_SECTION:
+	    strncpy(section, name(), sizeof(section) - 1);
+	    strcpy(sub, section);
+	    if (!strcmp("processes", sub))
+		strcpy(sub, "process");
+	    else if (sub[0] != 0 && sub[strlen(sub) - 1] == 's')
+		sub[strlen(sub) - 1] = 0;
+	    snprintf(line, sizeof(line), "%s%s%s", section, tags, additional_tags);
+	    fields_len = 0;
+	    had_sub = 0;
+	    break;
+	case NB_SUB:
+	    snprintf(line, sizeof(line), "%s%s,%s_name=%s%s", section, tags, sub, name(), additional_tags);
+	    fields_len = 0;	/* like nimon throw away any section level fields */
+	    had_sub = 1;
+	    break;
+	case NB_SUBEND:
+	    line_end();
+	    break;
+	case NB_SECTIONEND:
+	    if (!had_sub)
+		line_end();
+	    fields_len = 0;
+	    break;
+	case NB_LONG:
+	    n = name();
+	    fields_len += snprintf(&fields[fields_len], sizeof(fields) - fields_len, "%s=%lldi,", n, zigzag());
+	    break;
+	case NB_DOUBLE:
+	    n = name();
+	    fields_len += snprintf(&fields[fields_len], sizeof(fields) - fields_len, "%s=%.3f,", n, (double) zigzag() / 1000.0);
+	    break;
+	case NB_RAWDOUBLE:
+	    n = name();
+	    if (pos + 8 > frame_len)
+		bad("double past end of frame");
+	    bits.u = 0;
+	    for (i = 0; i < 8; i++)
+		bits.u |= (unsigned long long) (unsigned char) frame[pos++] << (i * 8);
+	    fields_len += snprintf(&fields[fields_len], sizeof(fields) - fields_len, "%s=%.3f,", n, bits.d);
+	    break;
+	case NB_STRING:
+	    n = name();
+	    string(value, sizeof(value));
+	    fields_len += snprintf(&fields[fields_len], sizeof(fields) - fields_len, "%s=\"%s\",", n, value);
+	    break;
+	case NB_HEX:
+	    n = name();
+	    fields_len += snprintf(&fields[fields_len], sizeof(fields) - fields_len, "%s=\"0x%08llx\",", n, varint());
+	    break;
+	default:
+	    bad("unknown sample op");
+	}
+	if (fields_len >= (long) sizeof(fields) - 1)
+	    bad("line too long");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char header[4];
+    FILE *fp = stdin;
+    int type;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+	fprintf(stderr, "Usage: %s [file.nbmon]   (default is stdin)\n", argv[0]);
+	exit(1);
+    }
+    if (argc == 2 && (fp = fopen(argv[1], "r")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+    while (fread(header, 4, 1, fp) == 1) {
+	frame_len = header[0] | (header[1] << 8) | (header[2] << 16) | ((long) header[3] << 24);
+	if (frame_len < 1)
+	    bad("empty frame");
+	if (frame_len > frame_size) {
+	    frame_size = frame_len + (1024 * 1024);
+	    frame = realloc(frame, frame_size);
+	}
+	if (fread(frame, frame_len, 1, fp) != 1)
+	    bad("stream ends part way through a frame");
+	type = frame[0];
+	pos = 1;
+	switch (type) {
+	case NB_FRAME_TAGS:
+	    if (frame[pos++] != NBMON_VERSION)
+		bad("unsupported NBMON version");
+	    string(tags, sizeof(tags));
+	    string(additional_tags, sizeof(additional_tags));
+	    break;
+	case NB_FRAME_DICTIONARY:
+	    dictionary();
+	    break;
+	case NB_FRAME_RESET:
+	    reset();
+	    break;
+	case NB_FRAME_SAMPLE:
+	    sample();
+	    fflush(stdout);
+	    break;
+	default:
+	    bad("unknown frame type");
+	}
+    }
+    return 0;
+}
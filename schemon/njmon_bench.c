@@ -0,0 +1,586 @@
+/*
+ * njmon_bench.c -- microbenchmarks for the njmon hot paths.
+ *                  Builds the real collector code by including it with main() renamed.
+ *
+ * Compile: make bench
+ * Usage:   ./njmon_bench [format|procfs|processes]
+ *   format  a synthetic 5,000 process sample through the p functions, compared with
+ *           the older sprintf() versions, in both NJMON and NIMON modes
+ *   procfs  microseconds per call of the hot /proc collectors with a synthetic 256 CPU
+ *           /proc/stat, 64 disk diskstats and 32 interface net/dev, plus fgets()+sscanf()
+ *           parsing the same /proc/stat as before the persistent fd parsers
+ *   processes  milliseconds per sample of processes_collect() over a synthetic 5,000 process
+ *           directory and the real /proc with 5,000 sleeping children, compared with the
+ *           two walks, per file opens and pid matching before
+ */
+#include <sys/wait.h>
+#define main njmon_main
+#include "njmon_linux_v81.c"
+#undef main
+
+#define BENCH_PROCESSES 5000
+#define BENCH_LOOPS 20
+
+double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1.0e9 + (double) ts.tv_nsec;
+}
+
+/* - - - - - format - - - - */
+/* the p functions as they were before the fast formatting, for comparison
+ * (pline_start() as NIMON lines now start at the first field) */
+void legacy_plong(char *name, long long value)
+{
+    njmon_long++;
+    if (line_pending)
+	pline_start();
+    if(mode == NJMON)
+	output_char += sprintf(&output[output_char], "\"%s\": %lld,", name, value);
+    else
+	output_char += sprintf(&output[output_char], "%s=%lldi,", name, value);
+}
+
+void legacy_pdouble(char *name, double value)
+{
+    njmon_double++;
+    if (isnan(value) || isinf(value))
+	return;
+    if (line_pending)
+	pline_start();
+    if(mode == NJMON)
+	output_char += sprintf(&output[output_char], "\"%s\": %.3f,", name, value);
+    else
+	output_char += sprintf(&output[output_char], "%s=%.3f,", name, value);
+}
+
+void legacy_pstring(char *name, char *value)
+{
+    int i;
+    int len;
+
+    buffer_check();
+    njmon_string++;
+    len = strlen(value);
+    for (i = 0; i < len; i++) {
+	if (value[i] == '\n' || iscntrl(value[i]))
+	    value[i] = '?';
+    }
+    if (line_pending)
+	pline_start();
+    if(mode == NJMON)
+	output_char += sprintf(&output[output_char], "\"%s\": \"%s\",", name, value);
+    else
+	output_char += sprintf(&output[output_char], "%s=\"%s\",", name, value);
+}
+
+/* the fields processes() sends with values of a realistic spread of sizes */
+#define BENCH_PROCESS(LONG, DOUBLE, STRING) \
+	LONG("pid", pid); \
+	STRING("cmd", cmd); \
+	LONG("ppid", pid / 3); \
+	LONG("pgrp", pid / 3); \
+	LONG("priority", 20); \
+	LONG("nice", 0); \
+	LONG("session", pid / 7); \
+	LONG("tty_nr", 34816); \
+	STRING("state", "Sleeping"); \
+	LONG("threads", 1 + i % 64); \
+	DOUBLE("cpu_percent", (i % 1000) * 0.0137); \
+	DOUBLE("cpu_usr", (i % 997) * 0.00731); \
+	DOUBLE("cpu_sys", (i % 13) * 0.25); \
+	DOUBLE("cpu_usr_total_secs", i * 12.345); \
+	DOUBLE("cpu_sys_total_secs", i * 3.21); \
+	LONG("statm_size_kb", 1000L + i * 4097L); \
+	LONG("statm_resident_kb", 500L + i * 1031L); \
+	LONG("statm_restext_kb", 128 + i % 4096); \
+	LONG("statm_resdata_kb", i * 777L); \
+	LONG("statm_share_kb", i * 33L); \
+	DOUBLE("minorfault", (i % 100) * 1.5); \
+	DOUBLE("majorfault", 0.0); \
+	LONG("it_real_value", 0); \
+	DOUBLE("starttime_secs", 1700000000.0 + i * 1.001); \
+	LONG("virtual_size_kb", 100000L + i * 65536L); \
+	LONG("rss_pages", 100L + i * 257L); \
+	LONG("rss_limit", -1LL); \
+	LONG("swap_pages", 0); \
+	LONG("child_swap_pages", 0); \
+	LONG("last_cpu", i % 256); \
+	LONG("realtime_priority", 0); \
+	LONG("sched_policy", 0); \
+	DOUBLE("delayacct_blkio_secs", (i % 50) * 0.01); \
+	LONG("uid", i % 2 ? 0 : 1000); \
+	STRING("username", i % 2 ? "root" : "nobody");
+#define BENCH_METRICS 35
+
+void bench_sample(int legacy)
+{
+    char cmd[64];
+    char name[sizeof(cmd) + 24];	/* cmd_pid */
+    long pid;
+    int i;
+
+    output_char = 0;
+    psample();
+    psection("processes");
+    for (i = 0; i < BENCH_PROCESSES; i++) {
+	pid = 1000 + i * 7;
+	sprintf(cmd, "worker-%d", i % 97);
+	sprintf(name, "%s_%ld", cmd, pid);
+	psub(name);
+	if (legacy) {
+	    BENCH_PROCESS(legacy_plong, legacy_pdouble, legacy_pstring)
+	} else {
+	    BENCH_PROCESS(plong, pdouble, pstring)
+	}
+	psubend();
+    }
+    psectionend();
+    psampleend();
+}
+
+double bench_run(int legacy)
+{
+    double best = 1.0e30;
+    double start;
+    double took;
+    int loop;
+
+    for (loop = 0; loop < BENCH_LOOPS; loop++) {
+	start = bench_now();
+	bench_sample(legacy);
+	took = bench_now() - start;
+	if (took < best)
+	    best = took;
+    }
+    return best;
+}
+
+void bench_format()
+{
+    char *saved;
+    long saved_len;
+    double legacy;
+    double fast;
+    int modes[2] = { NJMON, NIMON };
+    char *names[2] = { "NJMON", "NIMON" };
+    int m;
+
+    printf("format: %d processes x %d metrics, best of %d samples\n",
+	   BENCH_PROCESSES, BENCH_METRICS, BENCH_LOOPS);
+    printf("%-6s %12s %12s %10s %10s %8s %s\n",
+	   "mode", "legacy_ms", "fast_ms", "legacy_ns", "fast_ns", "speedup", "same_output");
+    for (m = 0; m < 2; m++) {
+	mode = modes[m];
+	legacy = bench_run(1);
+	saved_len = output_char;
+	saved = malloc(saved_len);
+	memcpy(saved, output, saved_len);
+	fast = bench_run(0);
+	printf("%-6s %12.3f %12.3f %10.1f %10.1f %7.2fx %s\n", names[m],
+	       legacy / 1.0e6, fast / 1.0e6,
+	       legacy / (BENCH_PROCESSES * BENCH_METRICS),
+	       fast / (BENCH_PROCESSES * BENCH_METRICS),
+	       legacy / fast,
+	       (saved_len == output_char && !memcmp(saved, output, saved_len)) ? "yes" : "NO");
+	free(saved);
+    }
+}
+
+/* - - - - - procfs - - - - */
+#define BENCH_CPUS 256
+#define BENCH_DISKS 64
+#define BENCH_NETS 32
+#define BENCH_CALLS 2000
+
+char bench_dir[256];
+
+void bench_file(char *name, void (*fill)(FILE *))
+{
+    char filename[512];
+    FILE *fp;
+
+    snprintf(filename, sizeof(filename), "%s/%s", bench_dir, name);
+    if ((fp = fopen(filename, "w")) == NULL) {
+	perror(filename);
+	exit(1);
+    }
+    fill(fp);
+    fclose(fp);
+}
+
+void bench_fill_stat(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "cpu  %d %d %d %d %d %d %d %d %d %d\n",
+	    123456789, 1234, 23456789, 987654321, 12345, 0, 54321, 0, 0, 0);
+    for (i = 0; i < BENCH_CPUS; i++)
+	fprintf(fp, "cpu%d %d %d %d %d %d %d %d %d %d %d\n", i,
+		482253 + i * 17, 5 + i % 3, 91635 + i * 11, 3858122 + i * 101, 48 + i, 0, 211 + i, 0, 0, 0);
+    fprintf(fp, "intr 1234567890");
+    for (i = 0; i < 1024; i++)	/* a big server has a few hundred to thousands of interrupts */
+	fprintf(fp, " %d", i % 5 ? 0 : 1000 + i * 37);
+    fprintf(fp, "\nctxt 9876543210\nbtime 1700000000\nprocesses 1234567\n"
+	    "procs_running 5\nprocs_blocked 0\n"
+	    "softirq 123456 1 23456 34 4567 5678 0 67 78901 0 8901\n");
+}
+
+void bench_fill_diskstats(FILE *fp)
+{
+    int i;
+
+    for (i = 0; i < BENCH_DISKS; i++)
+	fprintf(fp, "%4d %7d sd%c%c %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+		8 + i / 16, (i % 16) * 16, 'a' + i / 26, 'a' + i % 26,
+		1234567 + i, 123 + i, 98765432 + i, 456789, 2345678 + i, 3456, 87654321, 567890,
+		0, 1234567, 2345678, 0, 0, 0, 0, 12345, 6789);
+}
+
+void bench_fill_net_dev(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "Inter-|   Receive                                                |  Transmit\n"
+	    " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n");
+    for (i = 0; i < BENCH_NETS; i++)
+	fprintf(fp, "%6s%d: %llu %llu %d %d %d %d %d %d %llu %llu %d %d %d %d %d %d\n",
+		"eth", i, 123456789012LL + i, 98765432LL + i, 0, 12, 0, 0, 0, 345,
+		987654321098LL + i, 87654321LL + i, 0, 0, 0, 0, 0, 0);
+}
+
+/* /proc/stat parsing as it was, for comparison, the file kept open as before */
+void legacy_proc_stat_parse()
+{
+    static FILE *fp = NULL;
+    static char buf[1024 * 64];
+    long long user, nice, sys, idle, iowait, hardirq, softirq, steal, guest, guestnice;
+    long long value;
+    int cpuno;
+
+    if (fp == NULL)
+	fp = fopen(proc_stat_filename, "r");
+    else
+	rewind(fp);
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	if (!strncmp(buf, "cpu ", 4))
+	    sscanf(&buf[4], "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+		   &user, &nice, &sys, &idle, &iowait, &hardirq, &softirq, &steal, &guest, &guestnice);
+	else if (!strncmp(buf, "cpu", 3))
+	    sscanf(&buf[3], "%d %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+		   &cpuno, &user, &nice, &sys, &idle, &iowait, &hardirq, &softirq, &steal, &guest, &guestnice);
+	else if (!strncmp(buf, "ctxt", 4) || !strncmp(buf, "btime", 5) || !strncmp(buf, "processes", 9)
+		 || !strncmp(buf, "procs_", 6))
+	    sscanf(strchr(buf, ' ') + 1, "%lld", &value);
+    }
+}
+
+/* best microseconds per call */
+double bench_calls(void (*call)(void))
+{
+    double best = 1.0e30;
+    double start;
+    double took;
+    int i;
+
+    call();			/* first call opens the file and sizes the buffer */
+    for (i = 0; i < BENCH_CALLS; i++) {
+	output_char = 0;
+	start = bench_now();
+	call();
+	took = bench_now() - start;
+	if (took < best)
+	    best = took;
+    }
+    return best / 1000.0;
+}
+
+void bench_stat_parse()    { proc_stat(1.0, PRINT_FALSE, 0); }
+void bench_stat()          { proc_stat(1.0, PRINT_TRUE, 0); }
+void bench_meminfo()       { read_data_number("meminfo", 1.0); }
+void bench_vmstat()        { read_data_number("vmstat", 1.0); }
+void bench_diskstats()     { proc_diskstats_collect(1.0); }
+void bench_net_dev()       { proc_net_dev(1.0, PRINT_TRUE); }
+
+void bench_procfs()
+{
+    char stat_filename[512];
+    char diskstats_filename[512];
+    char net_dev_filename[512];
+
+    snprintf(bench_dir, sizeof(bench_dir), "/tmp/njmon_bench.%d", getpid());
+    mkdir(bench_dir, 0700);
+    bench_file("stat", bench_fill_stat);
+    bench_file("diskstats", bench_fill_diskstats);
+    bench_file("net_dev", bench_fill_net_dev);
+    snprintf(stat_filename, sizeof(stat_filename), "%s/stat", bench_dir);
+    snprintf(diskstats_filename, sizeof(diskstats_filename), "%s/diskstats", bench_dir);
+    snprintf(net_dev_filename, sizeof(net_dev_filename), "%s/net_dev", bench_dir);
+    proc_stat_filename = stat_filename;
+    proc_diskstats_filename = diskstats_filename;
+    proc_net_dev_filename = net_dev_filename;
+    mode = NJMON;
+    proc_diskstats_init();
+
+    printf("procfs: best of %d calls, %d CPU /proc/stat, %d disks, %d networks\n",
+	   BENCH_CALLS, BENCH_CPUS, BENCH_DISKS, BENCH_NETS);
+    printf("%-34s %10s\n", "collector", "usecs");
+    printf("%-34s %10.2f\n", "fgets+sscanf /proc/stat parse only", bench_calls(legacy_proc_stat_parse));
+    printf("%-34s %10.2f\n", "proc_stat parse only", bench_calls(bench_stat_parse));
+    printf("%-34s %10.2f\n", "proc_stat", bench_calls(bench_stat));
+    printf("%-34s %10.2f\n", "read_data_number meminfo", bench_calls(bench_meminfo));
+    printf("%-34s %10.2f\n", "read_data_number vmstat", bench_calls(bench_vmstat));
+    printf("%-34s %10.2f\n", "proc_diskstats_collect", bench_calls(bench_diskstats));
+    printf("%-34s %10.2f\n", "proc_net_dev", bench_calls(bench_net_dev));
+
+    unlink(stat_filename);
+    unlink(diskstats_filename);
+    unlink(net_dev_filename);
+    rmdir(bench_dir);
+}
+
+/* - - - - - processes - - - - */
+#define BENCH_PROCESS_LOOPS 10
+
+struct procsinfo *legacy_procs[2];
+long legacy_count[2];
+int legacy_now = 0;
+
+/* one process the way processes() read it before: open, read, fstat, sscanf, then statm and io */
+int legacy_procsinfo(int pid, struct procsinfo *pi)
+{
+    char filename[512];
+    char buf[1024 * 4];
+    struct stat statbuf;
+    struct passwd pw;
+    struct passwd *pwpointer;
+    char pwbuf[1024 * 4];
+    FILE *fp;
+    char *c;
+    int fd;
+    int size;
+
+    snprintf(filename, sizeof(filename), "%s/%d/stat", proc_dirname, pid);
+    if ((fd = open(filename, O_RDONLY)) == -1)
+	return 0;
+    size = read(fd, buf, 1024);
+    fstat(fd, &statbuf);
+    pi->uid = statbuf.st_uid;
+    if (pi->uid == 0)
+	strcpy(pi->username, "root");
+    else if (getpwuid_r(pi->uid, &pw, pwbuf, sizeof(pwbuf), &pwpointer) == 0 && pwpointer != 0)
+	strncpy(pi->username, pw.pw_name, 63);
+    close(fd);
+    if (size <= 0)
+	return 0;
+    buf[size] = 0;
+    if (sscanf(buf, "%d (%s)", &pi->pi_pid, pi->pi_comm) != 2 || (c = strstr(buf, ") ")) == NULL)
+	return 0;
+    if (sscanf(c + 2, "%c %d %d %d %d %d %lu %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d %lu %lu %llu",
+	       &pi->pi_state, &pi->pi_ppid, &pi->pi_pgrp, &pi->pi_session, &pi->pi_tty_nr, &pi->pi_tty_pgrp,
+	       &pi->pi_flags, &pi->pi_minflt, &pi->pi_child_min_flt, &pi->pi_majflt, &pi->pi_child_maj_flt,
+	       &pi->pi_utime, &pi->pi_stime, &pi->pi_child_utime, &pi->pi_child_stime, &pi->pi_priority,
+	       &pi->pi_nice, &pi->pi_num_threads, &pi->pi_it_real_value, &pi->pi_start_time, &pi->pi_vsize,
+	       &pi->pi_rss, &pi->pi_rsslimit, &pi->pi_start_code, &pi->pi_end_code, &pi->pi_start_stack,
+	       &pi->pi_esp, &pi->pi_eip, &pi->pi_signal_pending, &pi->pi_signal_blocked, &pi->pi_signal_ignore,
+	       &pi->pi_signal_catch, &pi->pi_wchan, &pi->pi_swap_pages, &pi->pi_child_swap_pages,
+	       &pi->pi_signal_exit, &pi->pi_last_cpu, &pi->pi_realtime_priority, &pi->pi_sched_policy,
+	       &pi->pi_delayacct_blkio_ticks) != 40)
+	return 0;
+    snprintf(filename, sizeof(filename), "%s/%d/statm", proc_dirname, pid);
+    if ((fd = open(filename, O_RDONLY)) == -1)
+	return 0;
+    size = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (size <= 0)
+	return 0;
+    buf[size] = 0;
+    if (sscanf(buf, "%lu %lu %lu %lu %lu %lu %lu", &pi->statm_size, &pi->statm_resident, &pi->statm_share,
+	       &pi->statm_trs, &pi->statm_lrs, &pi->statm_drs, &pi->statm_dt) != 7)
+	return 0;
+    if (uid == (uid_t) 0) {
+	snprintf(filename, sizeof(filename), "%s/%d/io", proc_dirname, pid);
+	if ((fp = fopen(filename, "r")) != NULL) {
+	    while (fgets(buf, 1024, fp) != NULL)
+		;
+	    fclose(fp);
+	}
+    }
+    return 1;
+}
+
+/* walk once to count, walk again to read, then match the pids of the two samples */
+void legacy_processes()
+{
+    struct procsinfo *now;
+    struct procsinfo *before;
+    struct dirent *dent;
+    DIR *dir;
+    long count = 0;
+    long i;
+    long j;
+    long busy = 0;
+
+    dir = opendir(proc_dirname);
+    while ((dent = readdir(dir)) != NULL)
+	if (dent->d_type == DT_DIR && isdigit(dent->d_name[0]))
+	    count++;
+    closedir(dir);
+    legacy_now = !legacy_now;
+    legacy_procs[legacy_now] = realloc(legacy_procs[legacy_now], sizeof(struct procsinfo) * (count + 64));
+    now = legacy_procs[legacy_now];
+    before = legacy_procs[!legacy_now];
+    count = 0;
+    dir = opendir(proc_dirname);
+    while ((dent = readdir(dir)) != NULL)
+	if (dent->d_type == DT_DIR && isdigit(dent->d_name[0]))
+	    count += legacy_procsinfo(atoi(dent->d_name), &now[count]);
+    closedir(dir);
+    legacy_count[legacy_now] = count;
+    for (i = 0; i < count; i++) {
+	for (j = 0; j < legacy_count[!legacy_now]; j++) {
+	    if (now[i].pi_pid == before[j].pi_pid) {
+		if (now[i].pi_utime + now[i].pi_stime - before[j].pi_utime - before[j].pi_stime > 0)
+		    busy++;
+		break;
+	    }
+	}
+    }
+}
+
+void bench_fill_process(int pid)
+{
+    char filename[512];
+    FILE *fp;
+
+    snprintf(filename, sizeof(filename), "%s/%d", bench_dir, pid);
+    mkdir(filename, 0700);
+    snprintf(filename, sizeof(filename), "%s/%d/stat", bench_dir, pid);
+    fp = fopen(filename, "w");
+    fprintf(fp, "%d (worker%d) S 1 %d %d 0 -1 4194560 %d 0 0 0 %d %d 0 0 20 0 %d 0 %d %d %d "
+	    "18446744073709551615 1 1 0 0 0 0 0 4096 0 0 0 17 %d 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+	    pid, pid, pid, pid, 1000 + pid, pid % 977, pid % 131, 1 + pid % 16, 12345 + pid,
+	    123456789 + pid * 4096, 1000 + pid % 5000, pid % 64);
+    fclose(fp);
+    snprintf(filename, sizeof(filename), "%s/%d/statm", bench_dir, pid);
+    fp = fopen(filename, "w");
+    fprintf(fp, "%d %d %d %d 0 %d 0\n", 30000 + pid, 1000 + pid % 5000, 500, 100, 2000);
+    fclose(fp);
+    snprintf(filename, sizeof(filename), "%s/%d/io", bench_dir, pid);
+    fp = fopen(filename, "w");
+    fprintf(fp, "rchar: 1234\nwchar: 5678\nsyscr: 12\nsyscw: 34\nread_bytes: %d\nwrite_bytes: %d\n"
+	    "cancelled_write_bytes: 0\n", pid * 4096, pid * 512);
+    fclose(fp);
+}
+
+void bench_remove_process(int pid)
+{
+    char filename[512];
+
+    snprintf(filename, sizeof(filename), "%s/%d/stat", bench_dir, pid);
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/%d/statm", bench_dir, pid);
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/%d/io", bench_dir, pid);
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/%d", bench_dir, pid);
+    rmdir(filename);
+}
+
+/* best milliseconds per sample */
+double bench_samples(void (*call)(void))
+{
+    double best = 1.0e30;
+    double start;
+    double took;
+    int i;
+
+    call();			/* the first has no previous sample */
+    for (i = 0; i < BENCH_PROCESS_LOOPS; i++) {
+	output_char = 0;
+	start = bench_now();
+	call();
+	took = bench_now() - start;
+	if (took < best)
+	    best = took;
+    }
+    return best / 1.0e6;
+}
+
+void bench_collect()    { processes_collect(1.0); processes_tidy(); }
+
+void bench_processes_compare(char *title)
+{
+    double legacy;
+    double fast;
+
+    legacy = bench_samples(legacy_processes);
+    fast = bench_samples(bench_collect);
+    printf("processes: best of %d samples, %s\n", BENCH_PROCESS_LOOPS, title);
+    printf("%-34s %10s\n", "collector", "msecs");
+    printf("%-34s %10.2f\n", "two walks + open/sscanf + match", legacy);
+    printf("%-34s %10.2f\n", "processes_collect", fast);
+    printf("%-34s %10.1fx\n", "faster", legacy / fast);
+}
+
+void bench_processes()
+{
+    pid_t *children;
+    char title[128];
+    int i;
+
+    snprintf(bench_dir, sizeof(bench_dir), "/tmp/njmon_bench.%d", getpid());
+    mkdir(bench_dir, 0700);
+    for (i = 1; i <= BENCH_PROCESSES; i++)
+	bench_fill_process(i);
+    proc_dirname = bench_dir;
+    processes_init();
+    snprintf(title, sizeof(title), "synthetic %d process directory", BENCH_PROCESSES);
+    bench_processes_compare(title);
+    for (i = 1; i <= BENCH_PROCESSES; i++)
+	bench_remove_process(i);
+    rmdir(bench_dir);
+    for (i = 0; i < proc_slots_count; i++)	/* forget the synthetic ones */
+	proc_slot_close(&proc_slots[i]);
+    proc_slots_count = 0;
+
+    /* the real /proc is slower to open and read, so also with that many sleeping children */
+    children = malloc(BENCH_PROCESSES * sizeof(pid_t));
+    for (i = 0; i < BENCH_PROCESSES; i++) {
+	if ((children[i] = fork()) == 0) {
+	    pause();
+	    _exit(0);
+	}
+	if (children[i] == -1)
+	    break;
+    }
+    proc_dirname = "/proc";
+    closedir(proc_dir);
+    processes_init();
+    snprintf(title, sizeof(title), "/proc with %d sleeping processes", i);
+    bench_processes_compare(title);
+    while (--i >= 0) {
+	kill(children[i], SIGKILL);
+	waitpid(children[i], NULL, 0);
+    }
+    free(children);
+}
+
+int main(int argc, char **argv)
+{
+    int all = (argc < 2);
+
+    output_size = INITIAL_BUFFER_SIZE;
+    output = malloc(output_size);
+    strcpy(hostname, "benchhost");
+    tag_prefix_build();
+    if (all || !strcmp(argv[1], "format"))
+	bench_format();
+    if (all || !strcmp(argv[1], "procfs"))
+	bench_procfs();
+    if (all || !strcmp(argv[1], "processes"))
+	bench_processes();
+    return 0;
+}
@@ -22,7 +22,7 @@
 
 #define NJMON 6
 #define NIMON 42
-#define NSMON 99 /* future splunk mode */
+#define NBMON 99 /* compact binary mode see nbmon.h */
 
 int mode = NJMON;
 
@@ -36,8 +36,10 @@ char *njmon_command;
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
 #include <mntent.h>
 #include <dirent.h>
+#include <sys/resource.h>
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -48,7 +50,11 @@ char *njmon_command;
 #include <fcntl.h>
 #include <signal.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <linux/perf_event.h>
 #include <asm/unistd.h>
 #include <memory.h>
@@ -57,6 +63,14 @@ char *njmon_command;
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <zlib.h>
+#include "nbmon.h"
+#include "njmon_shm.h"
 
 #define PRINT_FALSE 0
 #define PRINT_TRUE 1
@@ -111,7 +125,7 @@ char    msgbuf[1024];
 
 
 int sockfd = 1;			/*default is stdout, only changed if we are using a remote socket */
-char errorbuf[8 * 1024];
+__thread char errorbuf[8 * 1024];
 
 void error(char *buf)
 {
@@ -141,14 +155,17 @@ void interrupt(int signum)
 }
 
 int create_socket()
-{				/* returns 1 for error and 0 for OK */
+{				/* returns the connected socket or -1 for error */
     static struct sockaddr_in serv_addr;
+    struct timeval tv;
+    int one = 1;
+    int fd;
 
     if(debug || verbose) DEBUG fprintf(stderr, "socket: trying to connect to \"%s\":%ld\n",
 		target_ip, target_port);
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-	error("njmon:socket() call failed");
-	return 0;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	nwarning("njmon:socket() call failed");
+	return -1;
     }
 
     serv_addr.sin_family = AF_INET;
@@ -156,28 +173,37 @@ int create_socket()
     serv_addr.sin_port = htons(target_port);
 
     /* Connect tot he socket offered by the web server */
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-	DEBUG fprintf(stderr, "njmon: connect() call failed errno=%d", errno);
-	return 0;
+    if (connect(fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+	DEBUG fprintf(stderr, "njmon: connect() call failed errno=%d\n", errno);
+	close(fd);
+	return -1;
     }
-    return 1;
+    /* the connection is kept open between samples so stop it hanging the sender forever */
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
 }
 
 /* collect stats on the metrix */
 int njmon_internal_stats = 0;
-int njmon_sections = 0;
-int njmon_subsections = 0;
-int njmon_string = 0;
-int njmon_long = 0;
-int njmon_double = 0;
-int njmon_hex = 0;
+__thread int njmon_sections = 0;	/* per thread, -j workers hand theirs back */
+__thread int njmon_subsections = 0;
+__thread int njmon_string = 0;
+__thread int njmon_long = 0;
+__thread int njmon_double = 0;
+__thread int njmon_hex = 0;
 
 /* Output JSON test buffering to ensure ist a single write and allow EOL comma removal */
 #define INITIAL_BUFFER_SIZE (1024 * 1024)	/* 64 MB */
 
-char *output;
-long output_size = 0;
-long output_char = 0;
+/* per thread so -j collectors each fill their own buffer */
+__thread char *output;
+__thread long output_size = 0;
+__thread long output_char = 0;
 
 void buffer_check()
 {
@@ -189,9 +215,18 @@ void buffer_check()
     }
 }
 
+/* make room for bytes more at the end of output */
+void buffer_grow(long bytes)
+{
+    output_size = output_char + bytes + (1024 * 1024);
+    output = realloc((void *) output, output_size);
+}
+
+#define PRESERVE(bytes) do { if (output_char + (bytes) > output_size) buffer_grow(bytes); } while (0)
+
 void remove_ending_comma_if_any()
 {
-    if (output[output_char - 1] == ',') {
+    if (output_char > 0 && output[output_char - 1] == ',') {
 	output[output_char - 1] = 0;	/* remove the char */
 	output_char--;
     }
@@ -232,8 +267,8 @@ void remove_ending_comma_if_any()
 *	we can write the whole record in a single write (push()) to help down stream tools
 */
 
-int psubended = 0;		/* stop psubend and psectionend both enig the measure */
-int first_sub = 0;		/* need to remove the psection measure before adding psub measure */
+__thread int psubended = 0;		/* stop psubend and psectionend both enig the measure */
+__thread int first_sub = 0;		/* need to remove the psection measure before adding psub measure */
 
 /* the Influx login details */
 char influx_database[64];
@@ -244,8 +279,13 @@ char *saved_arch;
 
 int telegraf_mode = 0;
 
-char saved_section[1024];
-char saved_sub[1024];
+__thread char saved_section[1024];
+__thread char saved_sub[1024];
+__thread char saved_resource[1024];
+__thread long saved_section_len = 0;
+__thread long saved_sub_len = 0;
+__thread long saved_resource_len = 0;
+__thread int line_pending = 0;		/* NIMON: 1 section or 2 sub line not started until its first field */
 
 int ispower = 0;		/* from lscpu cmd */
 int isamd64 = 0;		/* from lscpu cmd */
@@ -341,6 +381,31 @@ void file_read_one_stat_save(char *file, char *name, char *output)
     }
 }
 char additional_tags[256];
+int additional_tags_len = 0;
+
+/* NIMON tags for every line, built once by save_tags() so psection() and psub() just copy them */
+char tag_prefix[1024];		/* ,host=...,os=...,architecture=...,serial_no=...,mtm=... */
+int tag_prefix_len = 0;
+
+void tag_prefix_build()
+{
+    char *h;
+
+    if(alias_hostname[0] != 0 ) {
+	h = alias_hostname;
+    } else {
+	if (fullhostname_tag)
+	    h = fullhostname;
+	else
+	    h = hostname;
+    }
+    tag_set(tag_hostname, h);
+    tag_prefix_len = snprintf(tag_prefix, sizeof(tag_prefix), ",host=%s,os=%s,architecture=%s,serial_no=%s,mtm=%s",
+		h, tag_os, tag_arch, tag_sn, tag_mtm);
+    if (tag_prefix_len >= sizeof(tag_prefix))
+	tag_prefix_len = sizeof(tag_prefix) - 1;
+    additional_tags_len = strlen(additional_tags);
+}
 
 void save_tags()
 {
@@ -512,363 +577,5242 @@ void save_tags()
         }
     }
 #endif /* MAINFRAME */
+    tag_prefix_build();
 }
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-void push()
+long sample_epoch = 0;		/* seconds since 1970 for the current sample */
+long hf_ms = 0;			/* -U high frequency sampling milliseconds */
+long long hf_line_ms = 0;	/* time of the high frequency line being output */
+
+/* - - - - - NBMON compact binary mode - - - - */
+/*
+ * Instead of text the p functions append varint ops to a sample frame (see nbmon.h).
+ * Section, resource and field names go in a dictionary the first time they are seen and
+ * after that cost a one or two byte id. New names are sent in a 'D' frame just in front
+ * of the sample that first used them. The whole dictionary is kept so the sender thread
+ * can resend it on a new connection.
+ */
+#define NB_DICT_MAX (1024 * 1024)	/* process names churn so start again after this many */
+
+struct nb_name {
+    char *name;
+    unsigned long long hash;
+    long id;
+} *nb_names = NULL;		/* open addressing hash table */
+long nb_names_size = 0;		/* power of two */
+long nb_names_used = 0;
+
+char *nb_dict = NULL;		/* every dictionary entry since the last reset */
+long nb_dict_len = 0;
+long nb_dict_size = 0;
+long nb_dict_new = 0;		/* offset of entries added during this sample */
+pthread_mutex_t nb_dict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char nb_tags[2048];		/* current 'T' frame including the length */
+long nb_tags_len = 0;
+int nb_tags_changed = 0;
+int nb_reset_pending = 0;
+long nb_frame_start = -1;	/* offset in output of the open sample frame */
+
+int push_write(int fd, struct iovec *iov, int count);	/* in the push pipeline below */
+
+void nb_put32(char *p, long value)
 {
-    char result[1024];
-    char buffer[1024 * 8];
-    int ret;
-    int i;
-    long total;
-    int sent;
-    int code;
-    char filename[1024];
-    int outfile;
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
 
-    FUNCTION_START;
-    buffer_check();
-    if (output_char == 0)	/* noting to send so skip this operation */
-	return;
-    if(mode == NJMON) {
-	    if (target_port) {
-		DEBUG fprintf(stderr, "push() NJMON socket mode size=%ld\n", output_char);
-		if (create_socket() == 1) {
-		    if (write(sockfd, output, output_char) < 0) {
-			/* if socket failed there is not much we can do but carry on */
-			nwarning("njmon write to stdout failed, stopping now.");
-		    }
-		    fflush(NULL);	/* force I/O output now */
-		    if (target_port)
-			close(sockfd);
-		    DEBUG fprintf(stderr, "push complete\n");
-		    VERBOSE fprintf(stderr, "push complete\n");
-		} else {
-			if( debug || verbose) 
-				fprintf(stderr, "socket create failed\n");
-		}
-	    } else {
-		DEBUG fprintf(stderr, "push() NJMON file mode size=%ld\n", output_char);
-                if(file_output >= 2) { /* -ff mode open file in the series */
-		    sprintf( filename, "%s_%06ld.json", filename_ff2, loop);
-		    /*if( (outfile = open(filename,  O_WRONLY | O_CREAT)) == -1 ) {*/
-		    if( (outfile = open(filename,  O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1 ) { 
-			nwarning2("opening file filename=%s\n", filename);
-			exit(33333);
-		    }
-		    if ( write(outfile, output, output_char) < 0) {
-			/* if stdout failed there is not much we can do hopefully more disk space next time */
-			nwarning("njmon write to stdout failed, stopping now.");
-		    }
-		    close(outfile);
-		} else {
-		    if ( write(sockfd, output, output_char) < 0) {
-		        /* if stdout failed there is not much we can do hopefully more disk space next time */
-			nwarning("njmon write to stdout failed, stopping now.");
-		    }
-		}	
-#ifdef JUNK
-		if (write(sockfd, output, output_char) < 0) {
-		    /* if stdout failed there is not much we can do hopefully more disk space next time */
-		    nwarning("njmon write to stdout failed, stopping now.");
-		}
-#endif
-		fflush(NULL);		/* force I/O output now */
-	    }
-    } else { /* NIMON */
-	    if (target_port) {
-		VERBOSE fprintf(stderr, "push() NIMON socket influx_version=%d Data size=%ld\n", influx_version, output_char);
-		if (create_socket() == 1) {
-
-		    if(!telegraf_mode) {
-			if(influx_version == 1) {
-			    sprintf(buffer, "POST /write?db=%s&u=%s&p=%s HTTP/1.1\r\nHost: %s:%ld\r\nContent-Length: %ld\r\n\r\n",
-			        influx_database, influx_username, influx_password, target_host, target_port, output_char);
-			} else { /* InfluxDB = 2 */
-			    sprintf(buffer, "POST /api/v2/write?bucket=%s&org=%s&precision=s HTTP/1.1\r\nHost: %s:%ld\r\nAuthorization: Token %s\r\nContent-Type: text/plain; charset=utf-8\r\nAccept: application/json\r\nContent-Length: %ld\r\n\r\n",
-				influx_database, influx_org, target_host, target_port, influx_token, output_char);
-			}
-			VERBOSE fprintf(stderr, "InfluxDB Header buffer size=%ld buffer=\n==========\n<%s>\n==========\n", strlen(buffer), buffer);
-			if ((ret = write(sockfd, buffer, strlen(buffer))) != strlen(buffer)) {
-				nwarning("njmon write POST to sockfd failed.");
-			}
-		    }
-		    total = output_char;
-		    sent = 0;
-		    if (verbose == 2)
-			fprintf(stderr, "output size=%ld output=\n<%s>\n", total, output);
-		    while (sent < total) {
-			ret = write(sockfd, &output[sent], total - sent);
-			VERBOSE fprintf(stderr, "Written=%d bytes sent=%d total=%ld\n", ret, sent, total);
-			if (ret < 0) {
-			    nwarning("njmon write body to sockfd failed.");
-			    break;
-			}
-			sent = sent + ret;
-		    }
-		    for (i = 0; i < 1024; i++)
-			result[i] = 0;
-		    if ((ret = read(sockfd, result, sizeof(result))) > 0) {
-			result[ret] = 0;
-			VERBOSE fprintf(stderr, "received bytes=%d data=<%s>\n", ret, result);
-
-			sscanf(result, "HTTP/1.1 %d", &code);
-			for (i = 13; i < 1024; i++)
-			    if (result[i] == '\r')
-				result[i] = 0;
-			if (verbose == 2)
-			    fprintf(stderr, "HTTP Code=%d Text=%s\n", code,
-				    &result[13]);
-			if (code != 204)
-			    fprintf(stderr, "Code %d -->%s<--\n", code, result);
-		    }
-		    close(sockfd);
-		    sockfd = 0;
-		    VERBOSE fprintf(stderr, "push complete\n");
-		} else {
-		    VERBOSE fprintf(stderr, "socket create failed\n");
-		}
-	    } else {
-		VERBOSE fprintf(stderr, "push() NIMON socket size=%ld\n", output_char);
-		/* save to local file */
-		if (write(1, output, output_char) < 0) {
-		    /* if stderr failed there is not much we can do hopefully more disk space next time */
-		    VERBOSE fprintf(stderr, "file output failed\n");
-		    nwarning("njmon write to stderr failed, stopping now.");
-		}
-		fflush(NULL);		/* force I/O output now */
+int nb_encode(char *p, unsigned long long value)
+{
+    int i = 0;
 
-	    }
+    while (value >= 0x80) {
+	p[i++] = (value & 0x7f) | 0x80;
+	value >>= 7;
     }
-    output[0] = 0;
-    output_char = 0;
+    p[i++] = value;
+    return i;
 }
 
-void replace_curly_with_square()
+void nb_varint(unsigned long long value)
 {
-    if (output[output_char - 1] == '{') {
-	output[output_char - 1] = '[';
-    }
+    output_char += nb_encode(&output[output_char], value);
 }
 
-void praw(char *string)
+void nb_zigzag(long long value)
 {
-    output_char += sprintf(&output[output_char], "%s", string);
+    nb_varint(((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63));
 }
 
-void psample()
+#define HASH_START 14695981039346656037ULL	/* FNV-1a */
+
+unsigned long long hash_bytes(unsigned long long hash, void *data, long len)
 {
-    DEBUG fprintf(stderr, "---- psample()\n) count=%ld\n", output_char);
-    if(mode == NJMON)
-	praw("{");			/* start of sample */
+    unsigned char *p = data;
+    long i;
+
+    for (i = 0; i < len; i++)
+	hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
 }
 
-void psampleend()
+unsigned long long nb_hash(char *name)
 {
-    DEBUG fprintf(stderr, "---- psampleend()\n) count=%ld\n", output_char);
-    remove_ending_comma_if_any();
-    if(mode == NJMON)
-	praw("}\n");
+    return hash_bytes(HASH_START, name, strlen(name));
 }
 
-void psection(char *section)
+void nb_insert(struct nb_name *table, long size, struct nb_name *entry)
 {
-    char *h;
+    long i;
 
-    DEBUG fprintf(stderr, "++++ psection(%s) count=%ld\n", section, output_char);
+    for (i = entry->hash & (size - 1); table[i].name != NULL; i = (i + 1) & (size - 1))
+	;
+    table[i] = *entry;
+}
 
-    buffer_check();
-    njmon_sections++;
+/* look up the id for a name adding it to the dictionary if new */
+long nb_id(char *name)
+{
+    unsigned long long hash;
+    struct nb_name entry;
+    struct nb_name *bigger;
+    long size;
+    long len;
+    long i;
 
-    if(mode == NJMON) {
-	    output_char += sprintf(&output[output_char], "\"%s\": {", section);
-    } else {
-            if(alias_hostname[0] != 0 ) {
-		h = alias_hostname;
-            } else {
-                if (fullhostname_tag)
-                    h = fullhostname;
-                else
-                    h = hostname;
-	    }
-	    tag_set(tag_hostname, h);
+    hash = nb_hash(name);
+    for (i = hash & (nb_names_size - 1); nb_names_size && nb_names[i].name != NULL; i = (i + 1) & (nb_names_size - 1)) {
+	if (nb_names[i].hash == hash && !strcmp(nb_names[i].name, name))
+	    return nb_names[i].id;
+    }
+    if (nb_names_used * 2 >= nb_names_size) {	/* keep it at least half empty */
+	size = nb_names_size ? nb_names_size * 2 : 1024;
+	bigger = calloc(size, sizeof(struct nb_name));
+	for (i = 0; i < nb_names_size; i++)
+	    if (nb_names[i].name != NULL)
+		nb_insert(bigger, size, &nb_names[i]);
+	free(nb_names);
+	nb_names = bigger;
+	nb_names_size = size;
+    }
+    len = strlen(name);
+    entry.name = malloc(len + 1);
+    strcpy(entry.name, name);
+    entry.hash = hash;
+    entry.id = ++nb_names_used;
+    nb_insert(nb_names, nb_names_size, &entry);
+
+    pthread_mutex_lock(&nb_dict_lock);
+    if (nb_dict_len + len + 20 > nb_dict_size) {
+	nb_dict_size = nb_dict_size + len + (64 * 1024);
+	nb_dict = realloc(nb_dict, nb_dict_size);
+    }
+    nb_dict_len += nb_encode(&nb_dict[nb_dict_len], entry.id);
+    nb_dict_len += nb_encode(&nb_dict[nb_dict_len], len);
+    memcpy(&nb_dict[nb_dict_len], name, len);
+    nb_dict_len += len;
+    pthread_mutex_unlock(&nb_dict_lock);
+    return entry.id;
+}
 
-	    output_char += sprintf(&output[output_char],
-			"%s,host=%s,os=%s,architecture=%s,serial_no=%s,mtm=%s%s ",
-			section, h, tag_os, tag_arch, tag_sn, tag_mtm, additional_tags);
-	    strcpy(saved_section, section);
-	    first_sub = 1;
-	    psubended = 0;
+void nb_reset()
+{
+    long i;
+
+    for (i = 0; i < nb_names_size; i++)
+	free(nb_names[i].name);
+    memset(nb_names, 0, sizeof(struct nb_name) * nb_names_size);
+    nb_names_used = 0;
+    pthread_mutex_lock(&nb_dict_lock);
+    nb_dict_len = 0;
+    pthread_mutex_unlock(&nb_dict_lock);
+    nb_reset_pending = 1;
+}
+
+/* rebuild the 'T' frame as the tags can change with save_tags() */
+void nb_tags_check()
+{
+    char buffer[2048];
+    long len;
+
+    len = 4;
+    buffer[len++] = NB_FRAME_TAGS;
+    buffer[len++] = NBMON_VERSION;
+    len += nb_encode(&buffer[len], tag_prefix_len);
+    memcpy(&buffer[len], tag_prefix, tag_prefix_len);
+    len += tag_prefix_len;
+    len += nb_encode(&buffer[len], additional_tags_len);
+    memcpy(&buffer[len], additional_tags, additional_tags_len);
+    len += additional_tags_len;
+    nb_put32(buffer, len - 4);
+    if (len != nb_tags_len || memcmp(buffer, nb_tags, len)) {
+	pthread_mutex_lock(&nb_dict_lock);
+	memcpy(nb_tags, buffer, len);
+	nb_tags_len = len;
+	pthread_mutex_unlock(&nb_dict_lock);
+	nb_tags_changed = 1;
     }
 }
 
-int sub_array = 0;
+void nb_sample_start()
+{
+    if (nb_names_used > NB_DICT_MAX)
+	nb_reset();
+    nb_tags_check();
+    nb_dict_new = nb_dict_len;
+    nb_frame_start = output_char;
+    output[output_char + 4] = NB_FRAME_SAMPLE;
+    output_char += 5;		/* length filled in by nb_sample_end() */
+    nb_varint(sample_epoch);
+}
 
-void psub(char *resource)
+/* close the sample frame and put any new tags and names in front of it */
+void nb_sample_end()
+{
+    long prefix = 0;
+    long at;
+
+    if (nb_frame_start < 0)
+	return;
+    nb_put32(&output[nb_frame_start], output_char - nb_frame_start - 4);
+    if (nb_reset_pending)
+	prefix += 5;
+    if (nb_tags_changed)
+	prefix += nb_tags_len;
+    if (nb_dict_len > nb_dict_new)
+	prefix += 5 + nb_dict_len - nb_dict_new;
+    if (prefix) {
+	if (output_char + prefix > output_size) {
+	    output_size = output_char + prefix + (1024 * 1024);
+	    output = realloc((void *) output, output_size);
+	}
+	memmove(&output[nb_frame_start + prefix], &output[nb_frame_start], output_char - nb_frame_start);
+	at = nb_frame_start;
+	if (nb_reset_pending) {
+	    nb_put32(&output[at], 1);
+	    output[at + 4] = NB_FRAME_RESET;
+	    at += 5;
+	}
+	if (nb_tags_changed) {
+	    memcpy(&output[at], nb_tags, nb_tags_len);
+	    at += nb_tags_len;
+	}
+	if (nb_dict_len > nb_dict_new) {
+	    nb_put32(&output[at], 1 + nb_dict_len - nb_dict_new);
+	    output[at + 4] = NB_FRAME_DICTIONARY;
+	    memcpy(&output[at + 5], &nb_dict[nb_dict_new], nb_dict_len - nb_dict_new);
+	}
+	output_char += prefix;
+    }
+    nb_reset_pending = 0;
+    nb_tags_changed = 0;
+    nb_frame_start = -1;
+}
+
+/* a new connection has not seen the earlier tags and names, returns 1 for OK */
+int nb_send_dictionary(int fd)
+{
+    char header[5];
+    struct iovec iov[3];
+    int ret;
+
+    pthread_mutex_lock(&nb_dict_lock);
+    nb_put32(header, 1 + nb_dict_len);
+    header[4] = NB_FRAME_DICTIONARY;
+    iov[0].iov_base = nb_tags;
+    iov[0].iov_len = nb_tags_len;
+    iov[1].iov_base = header;
+    iov[1].iov_len = 5;
+    iov[2].iov_base = nb_dict;
+    iov[2].iov_len = nb_dict_len;
+    ret = push_write(fd, iov, 3);
+    pthread_mutex_unlock(&nb_dict_lock);
+    return ret;
+}
+
+void nb_op(int op, char *name)
+{
+    if (nb_frame_start < 0)	/* stats after the last sample */
+	nb_sample_start();
+    PRESERVE(32);
+    output[output_char++] = op;
+    nb_varint(nb_id(name));
+}
+
+void nb_double(char *name, double value)
 {
+    union {
+	double d;
+	unsigned long long u;
+    } bits;
     int i;
-    char *h;
 
-    buffer_check();
-    DEBUG fprintf(stderr, ">> psubend(%s) count=%ld\n", resource, output_char); 
-    njmon_subsections++;
-    if(mode == NJMON) {
-	    if (elastic) {
-		replace_curly_with_square();
-		output_char +=
-		    sprintf(&output[output_char], "{ \"item\": \"%s\",", resource);
-		sub_array = 1;
-	    } else {
-		output_char +=
-		    sprintf(&output[output_char], "\"%s\": {", resource);
-	    }
+    if (value > NB_DOUBLE_MAX || value < -NB_DOUBLE_MAX) {
+	nb_op(NB_RAWDOUBLE, name);
+	bits.d = value;
+	for (i = 0; i < 8; i++)
+	    output[output_char++] = (bits.u >> (i * 8)) & 0xff;
     } else {
-            if(alias_hostname[0] != 0 ) {
-		h = alias_hostname;
-	    } else {
-                if (fullhostname_tag)
-                    h = fullhostname;
-                else
-                    h = hostname;
-            }
+	nb_op(NB_DOUBLE, name);
+	nb_zigzag(llround(value * 1000.0));
+    }
+}
 
-	    /* remove previously added section */
-	    if (first_sub) {
-		for (i = output_char - 1; i > 0; i--) {
-		    if (output[i] == '\n') {
-			output[i + 1] = 0;
-			output_char = i + 1;
-			break;
-		    }
-		}
-	    }
-	    first_sub = 0;
+void nb_string(char *name, char *value)
+{
+    long len;
 
-	    /* remove the trailing es and s */
-	    strcpy(saved_sub, saved_section);
-	    if(!strcmp("processes", saved_sub)) {
-		strcpy(saved_sub,"process");
-	    } else {
-		if (saved_sub[strlen(saved_sub) - 1] == 's') {
-		    saved_sub[strlen(saved_sub) - 1] = 0;
-		}
-	    }
+    len = strlen(value);
+    nb_op(NB_STRING, name);
+    PRESERVE(len + 16);
+    nb_varint(len);
+    memcpy(&output[output_char], value, len);
+    output_char += len;
+}
 
-	    output_char += sprintf(&output[output_char],
-			"%s,host=%s,os=%s,architecture=%s,serial_no=%s,mtm=%s,%s_name=%s%s ",
-			saved_section, h, tag_os, tag_arch, tag_sn, tag_mtm, saved_sub, resource, additional_tags);
-	    psubended = 0;
+/* - - - - - asynchronous push pipeline - - - - */
+/*
+ * Remote samples are not sent from the collection loop. push() copies the finished
+ * sample into a bounded single-producer/single-consumer ring of slots and the
+ * push_sender() thread sends them over a connection that is kept open between samples.
+ * If the network or InfluxDB is slow the loop carries on and samples queue up; anything
+ * already queued when the sender gets to it is sent in one request (up to push_batch).
+ * If the queue fills up the newest sample is dropped and counted. A 5xx, 408 or 429 reply
+ * keeps the samples queued and they are sent again after a growing wait; any other 4xx
+ * drops them (push_rejected) as sending the same lines again would not help.
+ *    NJMON_PUSH_QUEUE=samples   ring size (default 64)
+ *    NJMON_PUSH_BATCH=samples   max samples per request (default 16)
+ *
+ * With -L file samples the sink could not take go in to a memory mapped ring file instead of
+ * being dropped. When a connect fails the queue is moved to the spool and while the spool has
+ * samples new ones are added to its end, so the order is kept. Once the sink is back they are
+ * replayed oldest first and throttled so a recovering InfluxDB is not flooded. When the spool
+ * is full the oldest sample is dropped. The file is kept, a restarted njmon sends what the last
+ * one could not (except for NBMON where the name numbers would not match).
+ *    NJMON_SPOOL_MB=MB          spool size (default 64)
+ *    NJMON_REPLAY_RATE=samples  replayed per second (default 10)
+ *
+ * -Z level compresses what is sent with zlib using one z_stream for the life of the sender,
+ * reset rather than freed, and one output buffer that only grows. An InfluxDB POST body is
+ * gzip with Content-Encoding: gzip. The raw socket (njmond, Telegraf or NBMON) is one zlib
+ * stream per connection, flushed at the end of each send so the far end can decode it straight
+ * away and sent in frames of a 4 byte little endian length and the compressed bytes, as the
+ * stream carries on across samples the repeated -P process names cost next to nothing. The
+ * connection starts with the 4 bytes NJZ1 so the far end knows frames follow without guessing.
+ */
+struct push_slot {
+    char *data;
+    long len;
+    long size;		/* space allocated, only ever grows so steady state does not malloc */
+};
+
+struct push_slot *push_queue = NULL;
+long push_queue_size = 64;
+long push_batch = 16;
+long push_head = 0;	/* next slot to fill, only written by the collection loop */
+long push_tail = 0;	/* next slot to send, only written by the sender thread */
+int push_async = 0;	/* set once the sender thread is running */
+int push_stopping = 0;
+sem_t push_ready;
+pthread_mutex_t push_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t push_wake = PTHREAD_COND_INITIALIZER;	/* push_finish() cuts a backoff short */
+pthread_t push_thread;
+
+/* sender stats - read by pstats() */
+long push_dropped = 0;
+long push_reconnects = 0;
+long push_rejected = 0;
+long push_requests = 0;
+long push_samples = 0;
+long push_bytes = 0;
+
+#define SPOOL_MAGIC "NJSPOOL1"
+#define SPOOL_HEADER 4096	/* the header page then the ring */
+
+struct spool_header {
+    char magic[8];
+    long size;			/* bytes in the ring */
+    long mode;			/* of the samples, another mode's are thrown away */
+    long head;			/* bytes ever added */
+    long tail;			/* bytes ever sent or dropped */
+    long records;
+};
+
+char *spool_filename = NULL;	/* -L */
+struct spool_header *spool = NULL;
+char *spool_ring;
+pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+long spool_replay_rate = 10;
+struct push_slot spool_slot;	/* the sample being replayed */
+long spool_dropped = 0;
+long spool_replayed = 0;
+
+#define PUSH_ZMAGIC "NJZ1"	/* first on a -Z raw socket */
+
+int push_level = 0;		/* -Z */
+z_stream push_z;
+char *push_zbuf = NULL;
+long push_zsize = 0;
+long push_zin = 0;		/* for njmon_self */
+long push_zout = 0;
+long push_zcpu_ns = 0;
+
+void spool_put(long at, char *data, long len)
+{
+    long offset = at % spool->size;
+    long first = spool->size - offset;
+
+    if (first > len)
+	first = len;
+    memcpy(&spool_ring[offset], data, first);
+    memcpy(spool_ring, data + first, len - first);
+}
+
+void spool_get(long at, char *data, long len)
+{
+    long offset = at % spool->size;
+    long first = spool->size - offset;
+
+    if (first > len)
+	first = len;
+    memcpy(data, &spool_ring[offset], first);
+    memcpy(data + first, spool_ring, len - first);
+}
+
+void spool_open()
+{
+    struct spool_header *h;
+    long size = 64;
+    char *s;
+    int fd;
 
+    FUNCTION_START;
+    if ((s = getenv("NJMON_SPOOL_MB")) != 0 && atol(s) > 0)
+	size = atol(s);
+    if ((s = getenv("NJMON_REPLAY_RATE")) != 0 && atol(s) > 0)
+	spool_replay_rate = atol(s);
+    size = size * 1024 * 1024;
+    if ((fd = open(spool_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1
+	|| ftruncate(fd, SPOOL_HEADER + size) == -1) {
+	sprintf(errorbuf, "-L spool file %s failed errno=%d (%s) - no spool", spool_filename, errno, strerror(errno));
+	nwarning(errorbuf);
+	if (fd != -1)
+	    close(fd);
+	return;
+    }
+    h = mmap(NULL, SPOOL_HEADER + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+	sprintf(errorbuf, "-L spool file %s mmap() failed errno=%d (%s) - no spool", spool_filename, errno, strerror(errno));
+	nwarning(errorbuf);
+	return;
     }
+    if (memcmp(h->magic, SPOOL_MAGIC, 8) || h->size != size || h->mode != mode || mode == NBMON
+	|| h->head - h->tail < 0 || h->head - h->tail > size) {
+	if (!memcmp(h->magic, SPOOL_MAGIC, 8) && h->records > 0) {
+	    sprintf(errorbuf, "-L spool file %s has %ld samples of another size or mode - thrown away", spool_filename, h->records);
+	    nwarning(errorbuf);
+	}
+	memset(h, 0, sizeof(struct spool_header));
+	memcpy(h->magic, SPOOL_MAGIC, 8);
+	h->size = size;
+	h->mode = mode;
+    }
+    VERBOSE fprintf(stderr, "spool %s has %ld samples to replay\n", spool_filename, h->records);
+    spool_ring = (char *) h + SPOOL_HEADER;
+    spool = h;
 }
 
-void psubend()
+/* add to the end dropping the oldest to make room, the caller holds spool_lock */
+void spool_append(char *data, long len)
 {
-    DEBUG fprintf(stderr, "<< psubend() count=%ld\n", output_char);
-    remove_ending_comma_if_any();
-    if(mode == NJMON) {
-	    praw("},");
-    } else {
-	    if(file_output >= 2)
-		 output_char += sprintf(&output[output_char], " %ld000000000\n", (long)time(0));
-	    else
-		 output_char += sprintf(&output[output_char], "   \n");
-	    psubended = 1;
+    long reclen;
+
+    if (len + 8 > spool->size) {
+	spool_dropped++;
+	return;
+    }
+    while (spool->size - (spool->head - spool->tail) < len + 8) {
+	spool_get(spool->tail, (char *) &reclen, 8);
+	spool->tail += 8 + reclen;
+	spool->records--;
+	spool_dropped++;
+    }
+    spool_put(spool->head, (char *) &len, 8);
+    spool_put(spool->head + 8, data, len);
+    spool->head += 8 + len;
+    __atomic_store_n(&spool->records, spool->records + 1, __ATOMIC_RELEASE);
+}
+
+/* the sink is down so keep what is queued in the spool, new samples then go after it */
+void spool_move_queue()
+{
+    struct push_slot *slot;
+    long head;
+    long tail;
+
+    if (spool == NULL)
+	return;
+    pthread_mutex_lock(&spool_lock);
+    head = __atomic_load_n(&push_head, __ATOMIC_ACQUIRE);
+    for (tail = push_tail; tail < head; tail++) {
+	slot = &push_queue[tail % push_queue_size];
+	spool_append(slot->data, slot->len);
+    }
+    __atomic_store_n(&push_tail, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&spool_lock);
+}
+
+/* copy the oldest spooled sample in to spool_slot, returns where it was or -1 if there is none */
+long spool_take()
+{
+    long at = -1;
+    long len;
+
+    pthread_mutex_lock(&spool_lock);
+    if (spool->records > 0) {
+	at = spool->tail;
+	spool_get(at, (char *) &len, 8);
+	if (spool_slot.size < len) {
+	    spool_slot.size = len + (64 * 1024);
+	    spool_slot.data = realloc(spool_slot.data, spool_slot.size);
+	}
+	spool_get(at + 8, spool_slot.data, len);
+	spool_slot.len = len;
     }
+    pthread_mutex_unlock(&spool_lock);
+    return at;
 }
 
+/* spool_take()'s sample was sent, unless it was dropped to make room meanwhile */
+void spool_sent(long at)
+{
+    pthread_mutex_lock(&spool_lock);
+    if (spool->tail == at) {
+	spool->tail += 8 + spool_slot.len;
+	spool->records--;
+    }
+    spool_replayed++;
+    pthread_mutex_unlock(&spool_lock);
+}
 
-void psectionend()
+int push_queue_add(char *data, long len)
 {
-    remove_ending_comma_if_any();
-    DEBUG fprintf(stderr, "---- psectiondend() count=%ld\n", output_char);
-    if(mode == NJMON) {
-	    if (sub_array)
-		praw("],");
-	    else
-		praw("},");
-	    sub_array = 0;
-    } else {
-	    if (!psubended) {
-		if(file_output >= 2)
-		    output_char += sprintf(&output[output_char], " %ld000000000\n", (long)time(0));
-		else
-		    output_char += sprintf(&output[output_char], "   \n");
-	    }
-	    psubended = 0;
+    long tail;
+    struct push_slot *slot;
+
+    tail = __atomic_load_n(&push_tail, __ATOMIC_ACQUIRE);
+    if (push_head - tail >= push_queue_size) {
+	__atomic_add_fetch(&push_dropped, 1, __ATOMIC_RELAXED);
+	DEBUG fprintf(stderr, "push_enqueue() queue full - sample dropped\n");
+	return 0;
+    }
+    slot = &push_queue[push_head % push_queue_size];
+    if (slot->size < len) {
+	slot->size = len + (64 * 1024);
+	slot->data = realloc(slot->data, slot->size);
     }
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    __atomic_store_n(&push_head, push_head + 1, __ATOMIC_RELEASE);
+    sem_post(&push_ready);
+    return 1;
 }
 
-void phex(char *name, long long value)
+int push_enqueue(char *data, long len)
 {
-    njmon_hex++;
-    if( mode == NJMON) {
-	    output_char += sprintf(&output[output_char], "\"%s\": \"0x%08llx\",", name, value);
+    int ret = 1;
+
+    if (spool == NULL)
+	return push_queue_add(data, len);
+    pthread_mutex_lock(&spool_lock);
+    if (spool->records > 0 || push_head - __atomic_load_n(&push_tail, __ATOMIC_ACQUIRE) >= push_queue_size) {
+	spool_append(data, len);	/* after the samples already waiting */
+	sem_post(&push_ready);
     } else {
-	    output_char += sprintf(&output[output_char], "%s=\"0x%08llx\",", name, value);
+	ret = push_queue_add(data, len);
+    }
+    pthread_mutex_unlock(&spool_lock);
+    return ret;
+}
+
+/* writev() until everything is gone, returns 1 for OK and 0 for a broken connection */
+int push_writev(int fd, struct iovec *iov, int count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+	ret = writev(fd, iov, count);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	while (count > 0 && ret >= (ssize_t) iov->iov_len) {
+	    ret -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if (count > 0) {
+	    iov->iov_base = (char *) iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
+    }
+    return 1;
+}
+
+/* buffered reads of the response after its header */
+struct push_reader {
+    int fd;
+    char *buf;
+    long size;
+    long pos;
+    long got;
+};
+
+/* the next byte or -1 for a broken connection */
+int push_getc(struct push_reader *r)
+{
+    int ret;
+
+    if (r->pos == r->got) {
+	if ((ret = read(r->fd, r->buf, r->size)) <= 0)
+	    return -1;
+	r->pos = 0;
+	r->got = ret;
+    }
+    return (unsigned char) r->buf[r->pos++];
+}
+
+/* throw away length bytes, returns 0 for a broken connection */
+int push_skip(struct push_reader *r, long length)
+{
+    long n;
+    int ret;
+
+    while (length > 0) {
+	if (r->pos == r->got) {
+	    if ((ret = read(r->fd, r->buf, r->size)) <= 0)
+		return 0;
+	    r->pos = 0;
+	    r->got = ret;
+	}
+	n = r->got - r->pos < length ? r->got - r->pos : length;
+	r->pos += n;
+	length -= n;
+    }
+    return 1;
+}
+
+/* one CRLF ended line in to line (cut to size), returns its length or -1 for a broken connection */
+long push_line(struct push_reader *r, char *line, long size)
+{
+    long len = 0;
+    int c;
+
+    while ((c = push_getc(r)) != '\n') {
+	if (c == -1)
+	    return -1;
+	if (c != '\r' && len < size - 1)
+	    line[len++] = c;
+    }
+    line[len] = 0;
+    return len;
+}
+
+/* throw away a Transfer-Encoding: chunked body, returns 0 for a broken connection */
+int push_chunked(struct push_reader *r)
+{
+    char line[256];
+    long length;
+
+    for (;;) {
+	if (push_line(r, line, sizeof(line)) == -1)
+	    return 0;
+	length = strtol(line, NULL, 16);	/* any ;extension is ignored */
+	if (length <= 0)
+	    break;
+	if (push_skip(r, length + 2) == 0)	/* the chunk and its CRLF */
+	    return 0;
+    }
+    do {			/* trailers until the empty line */
+	if ((length = push_line(r, line, sizeof(line))) == -1)
+	    return 0;
+    } while (length > 0);
+    return 1;
+}
+
+/* the value of a header in the NUL ended headers, the names are not case sensitive, or NULL */
+char *push_header(char *headers, char *name)
+{
+    char *line = headers;
+    long len = strlen(name);
+
+    while ((line = strstr(line, "\r\n")) != NULL) {
+	line += 2;
+	if (!strncasecmp(line, name, len)) {
+	    for (line += len; *line == ' ' || *line == '\t'; line++);
+	    return line;
+	}
+    }
+    return NULL;
+}
+
+/* Read one HTTP response including its body so the next request lines up on a kept open connection.
+ * returns the HTTP code or -1 for a broken connection and clears *keep if the server is closing */
+int push_response(int fd, int *keep)
+{
+    char result[1024 * 8];
+    char *end;
+    char *s;
+    long got = 0;
+    long length = 0;
+    int chunked = 0;
+    int code = -1;
+    int ret;
+    struct push_reader r;
+
+    for (;;) {
+	ret = read(fd, &result[got], sizeof(result) - 1 - got);
+	if (ret <= 0)
+	    return -1;
+	got += ret;
+	result[got] = 0;
+	if ((end = strstr(result, "\r\n\r\n")) != NULL)
+	    break;
+	if (got == sizeof(result) - 1)
+	    return -1;	/* silly sized header */
+    }
+    VERBOSE fprintf(stderr, "received bytes=%ld data=<%s>\n", got, result);
+    sscanf(result, "HTTP/1.%*d %d", &code);
+    *end = 0;
+    if ((s = push_header(result, "Content-Length:")) != NULL)
+	length = atol(s);
+    if ((s = push_header(result, "Transfer-Encoding:")) != NULL && !strncasecmp(s, "chunked", 7))
+	chunked = 1;
+    if ((s = push_header(result, "Connection:")) != NULL && !strncasecmp(s, "close", 5))
+	*keep = 0;
+    if (code < 200 || code > 299)
+	fprintf(stderr, "Code %d -->%s<--\n", code, result);
+    /* throw away the rest of the body */
+    r.fd = fd;
+    r.buf = result;
+    r.size = sizeof(result);
+    r.pos = end + 4 - result;
+    r.got = got;
+    if (chunked) {
+	if (push_chunked(&r) == 0)
+	    return -1;
+    } else if (push_skip(&r, length) == 0) {
+	return -1;
+    }
+    return code;
+}
+
+#define PUSH_HTTP (mode == NIMON && !telegraf_mode)
+
+/* compress the iovecs in to push_zbuf from offset, returns the end of the compressed bytes */
+long push_deflate(struct iovec *iov, int count, long offset, int flush)
+{
+    struct timespec start;
+    struct timespec end;
+    long in = 0;
+    int i;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    for (i = 0; i < count; i++) {
+	push_z.next_in = (Bytef *) iov[i].iov_base;
+	push_z.avail_in = iov[i].iov_len;
+	in += iov[i].iov_len;
+	do {
+	    if (push_zsize - offset < 64 * 1024) {
+		push_zsize = push_zsize + (1024 * 1024);
+		push_zbuf = realloc(push_zbuf, push_zsize);
+	    }
+	    push_z.next_out = (Bytef *) &push_zbuf[offset];
+	    push_z.avail_out = push_zsize - offset;
+	    deflate(&push_z, i == count - 1 ? flush : Z_NO_FLUSH);
+	    offset = push_zsize - push_z.avail_out;
+	} while (push_z.avail_in > 0 || push_z.avail_out == 0);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    __atomic_add_fetch(&push_zin, in, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&push_zout, offset, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&push_zcpu_ns, (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+    return offset;
+}
+
+/* the next part of the raw socket stream as a length then compressed bytes frame */
+long push_frame(struct iovec *iov, int count)
+{
+    long len = push_deflate(iov, count, 4, Z_SYNC_FLUSH);
+
+    nb_put32(push_zbuf, len - 4);
+    return len;
+}
+
+/* raw socket writes that are not samples, like the NBMON dictionary */
+int push_write(int fd, struct iovec *iov, int count)
+{
+    struct iovec frame;
+
+    if (!push_level)
+	return push_writev(fd, iov, count);
+    frame.iov_len = push_frame(iov, count);
+    frame.iov_base = push_zbuf;
+    return push_writev(fd, &frame, 1);
+}
+
+/* send slots tail to tail+count-1 of a ring of slots_size in a single write or POST,
+ * returns 1 for OK, 0 for a broken connection and -1 if the server did not take them but may
+ * later. Any other 4xx (bad lines, token or database) will not get better by sending the same
+ * samples again so they are dropped, counted in push_rejected and 1 returned */
+int push_send(int fd, struct push_slot *slots, long slots_size, long tail, long count, int *keep)
+{
+    static struct iovec *iov = NULL;
+    static long iov_size = 0;
+    char header[1024 * 2];
+    long total = 0;
+    long length;
+    long i;
+    int n;
+    int code;
+    struct push_slot *slot;
+
+    if (iov_size < count + 1) {
+	iov_size = count + 1;
+	iov = realloc(iov, sizeof(struct iovec) * iov_size);
+    }
+    for (i = 0; i < count; i++) {	/* iov[0] is for the HTTP header */
+	slot = &slots[(tail + i) % slots_size];
+	iov[i + 1].iov_base = slot->data;
+	iov[i + 1].iov_len = slot->len;
+	total += slot->len;
+    }
+    n = count;
+    length = total;
+    if (push_level) {
+	if (PUSH_HTTP) {	/* a gzip body per POST */
+	    deflateReset(&push_z);
+	    length = push_deflate(&iov[1], count, 0, Z_FINISH);
+	} else {
+	    length = push_frame(&iov[1], count);
+	}
+	iov[1].iov_base = push_zbuf;
+	iov[1].iov_len = length;
+	n = 1;
+    }
+
+    if (PUSH_HTTP) {
+	if(influx_version == 1) {
+	    snprintf(header, sizeof(header), "POST /write?db=%s&u=%s&p=%s&precision=%s HTTP/1.1\r\nHost: %s:%ld\r\n%sContent-Length: %ld\r\n\r\n",
+		influx_database, influx_username, influx_password, hf_ms ? "ms" : "s", target_host, target_port,
+		push_level ? "Content-Encoding: gzip\r\n" : "", length);
+	} else { /* InfluxDB = 2 */
+	    snprintf(header, sizeof(header), "POST /api/v2/write?bucket=%s&org=%s&precision=%s HTTP/1.1\r\nHost: %s:%ld\r\nAuthorization: Token %s\r\nContent-Type: text/plain; charset=utf-8\r\n%sAccept: application/json\r\nContent-Length: %ld\r\n\r\n",
+		influx_database, influx_org, hf_ms ? "ms" : "s", target_host, target_port, influx_token,
+		push_level ? "Content-Encoding: gzip\r\n" : "", length);
+	}
+	VERBOSE fprintf(stderr, "InfluxDB Header buffer size=%ld buffer=\n==========\n<%s>\n==========\n", (long)strlen(header), header);
+	iov[0].iov_base = header;
+	iov[0].iov_len = strlen(header);
+    }
+    if (verbose == 2)
+	fprintf(stderr, "push samples=%ld size=%ld sent=%ld\n", count, total, length);
+    if (push_writev(fd, PUSH_HTTP ? iov : &iov[1], PUSH_HTTP ? n + 1 : n) == 0) {
+	nwarning("njmon write to sockfd failed.");
+	return 0;
+    }
+    if (PUSH_HTTP) {
+	if ((code = push_response(fd, keep)) == -1)
+	    return 0;
+	if (code >= 400 && code <= 499 && code != 408 && code != 429) {
+	    if (__atomic_add_fetch(&push_rejected, 1, __ATOMIC_RELAXED) == 1) {
+		sprintf(errorbuf, "InfluxDB answered %d - samples it refuses are dropped, see push_rejected", code);
+		nwarning(errorbuf);
+	    }
+	    return 1;
+	}
+	if (code < 200 || code > 299)
+	    return -1;	/* 5xx, 408 and 429 are worth another go */
+    }
+    __atomic_add_fetch(&push_requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&push_samples, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&push_bytes, total, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* wait before the next try, longer after each failure, new samples do not cut it short */
+void push_backoff(long *backoff)
+{
+    struct timespec retry;
+
+    clock_gettime(CLOCK_REALTIME, &retry);
+    retry.tv_sec += *backoff;
+    pthread_mutex_lock(&push_wait_lock);
+    while (!push_stopping && pthread_cond_timedwait(&push_wake, &push_wait_lock, &retry) != ETIMEDOUT);
+    pthread_mutex_unlock(&push_wait_lock);
+    if (*backoff < 64)
+	*backoff = *backoff * 2;
+}
+
+/* connect waiting longer after each failure, returns -1 if it failed */
+int push_connect(long *backoff)
+{
+    struct iovec magic;
+    int fd;
+
+    if ((fd = create_socket()) == -1) {
+	spool_move_queue();	/* with -L nothing is dropped while the sink is down */
+	if (push_stopping)
+	    return -1;		/* give up on anything left */
+	VERBOSE fprintf(stderr, "socket create failed - retry in %ld seconds\n", *backoff);
+	push_backoff(backoff);
+	return -1;
+    }
+    __atomic_add_fetch(&push_reconnects, 1, __ATOMIC_RELAXED);
+    *backoff = 1;
+    if (push_level && !PUSH_HTTP) {
+	deflateReset(&push_z);	/* a new stream for the new connection */
+	magic.iov_base = PUSH_ZMAGIC;
+	magic.iov_len = strlen(PUSH_ZMAGIC);
+	if (push_writev(fd, &magic, 1) == 0) {
+	    close(fd);
+	    return -1;
+	}
+    }
+    if (mode == NBMON && nb_send_dictionary(fd) == 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+void *push_sender(void *arg)
+{
+    int fd = -1;
+    int keep;
+    int ret;
+    long backoff = 1;
+    long refused = 1;	/* backoff after the server did not take a POST */
+    long head;
+    long tail;
+    long count;
+    long at;
+    struct timespec retry;
+
+    for (;;) {
+	if (spool == NULL || __atomic_load_n(&spool->records, __ATOMIC_ACQUIRE) == 0)
+	    sem_wait(&push_ready);
+	for (;;) {
+	    tail = push_tail;
+	    head = __atomic_load_n(&push_head, __ATOMIC_ACQUIRE);
+	    if (head == tail)
+		break;
+	    if (fd == -1 && (fd = push_connect(&backoff)) == -1) {
+		if (push_stopping)
+		    return NULL;
+		continue;
+	    }
+	    count = head - tail;
+	    if (count > push_batch)
+		count = push_batch;
+	    keep = 1;
+	    if ((ret = push_send(fd, push_queue, push_queue_size, tail, count, &keep)) == 0) {
+		close(fd);	/* samples stay queued and are sent after the reconnect */
+		fd = -1;
+		continue;
+	    }
+	    if (!keep) {
+		close(fd);
+		fd = -1;
+	    }
+	    if (ret == -1) {	/* samples stay queued and are sent again later */
+		if (push_stopping)
+		    break;
+		spool_move_queue();
+		push_backoff(&refused);
+		continue;
+	    }
+	    refused = 1;
+	    __atomic_store_n(&push_tail, tail + count, __ATOMIC_RELEASE);
+	    VERBOSE fprintf(stderr, "push complete\n");
+	}
+	if (push_stopping) {	/* the spool keeps the rest for next time */
+	    if (fd != -1)
+		close(fd);
+	    return NULL;
+	}
+	if (spool != NULL && (at = spool_take()) != -1) {	/* replay the oldest spooled sample */
+	    if (fd == -1 && (fd = push_connect(&backoff)) == -1)
+		continue;
+	    keep = 1;
+	    if ((ret = push_send(fd, &spool_slot, 1, 0, 1, &keep)) == 0) {
+		close(fd);
+		fd = -1;
+		continue;
+	    }
+	    if (!keep) {
+		close(fd);
+		fd = -1;
+	    }
+	    if (ret == -1) {
+		push_backoff(&refused);
+		continue;
+	    }
+	    refused = 1;
+	    spool_sent(at);
+	    clock_gettime(CLOCK_REALTIME, &retry);	/* throttle to NJMON_REPLAY_RATE */
+	    retry.tv_nsec += 1000000000L / spool_replay_rate;
+	    retry.tv_sec += retry.tv_nsec / 1000000000L;
+	    retry.tv_nsec = retry.tv_nsec % 1000000000L;
+	    sem_timedwait(&push_ready, &retry);
+	}
+    }
+}
+
+void push_init()
+{
+    char *s;
+
+    FUNCTION_START;
+    if ((s = getenv("NJMON_PUSH_QUEUE")) != 0 && atol(s) > 0)
+	push_queue_size = atol(s);
+    if ((s = getenv("NJMON_PUSH_BATCH")) != 0 && atol(s) > 0)
+	push_batch = atol(s);
+    push_queue = calloc(push_queue_size, sizeof(struct push_slot));
+    sem_init(&push_ready, 0, 0);
+    if (push_level && deflateInit2(&push_z, push_level, Z_DEFLATED, PUSH_HTTP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	nwarning("push_init() deflateInit2() failed - sending uncompressed");
+	push_level = 0;
+    }
+    if (spool_filename != NULL)
+	spool_open();
+    if (pthread_create(&push_thread, NULL, push_sender, NULL) != 0) {
+	nwarning("push_init() pthread_create failed - sending from the main loop");
+	spool = NULL;		/* replay needs the sender thread */
+	return;
+    }
+    push_async = 1;
+}
+
+/* let the sender empty the queue before we exit */
+void push_finish()
+{
+    FUNCTION_START;
+    if (!push_async)
+	return;
+    pthread_mutex_lock(&push_wait_lock);
+    push_stopping = 1;
+    pthread_cond_signal(&push_wake);
+    pthread_mutex_unlock(&push_wait_lock);
+    sem_post(&push_ready);
+    pthread_join(push_thread, NULL);
+    spool_move_queue();		/* anything the sender could not send is kept for next time */
+    push_async = 0;
+}
+
+void push()
+{
+    char filename[1024];
+    int outfile;
+
+    FUNCTION_START;
+    buffer_check();
+    if (output_char == 0)	/* noting to send so skip this operation */
+	return;
+    if (mode == NBMON)
+	nb_sample_end();	/* the final stats have no psampleend() */
+    if (target_port) {
+	DEBUG fprintf(stderr, "push() socket mode size=%ld\n", output_char);
+	push_enqueue(output, output_char);
+	if (!push_async) {	/* no sender thread so send it from here */
+	    push_stopping = 1;
+	    push_sender(NULL);
+	    push_stopping = 0;
+	}
+    } else if(mode == NJMON) {
+		DEBUG fprintf(stderr, "push() NJMON file mode size=%ld\n", output_char);
+                if(file_output >= 2) { /* -ff mode open file in the series */
+		    sprintf( filename, "%s_%06ld.json", filename_ff2, loop);
+		    /*if( (outfile = open(filename,  O_WRONLY | O_CREAT)) == -1 ) {*/
+		    if( (outfile = open(filename,  O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1 ) { 
+			nwarning2("opening file filename=%s\n", filename);
+			exit(33333);
+		    }
+		    if ( write(outfile, output, output_char) < 0) {
+			/* if stdout failed there is not much we can do hopefully more disk space next time */
+			nwarning("njmon write to stdout failed, stopping now.");
+		    }
+		    close(outfile);
+		} else {
+		    if ( write(sockfd, output, output_char) < 0) {
+		        /* if stdout failed there is not much we can do hopefully more disk space next time */
+			nwarning("njmon write to stdout failed, stopping now.");
+		    }
+		}	
+		fflush(NULL);		/* force I/O output now */
+    } else { /* NIMON */
+		VERBOSE fprintf(stderr, "push() NIMON file size=%ld\n", output_char);
+		/* save to local file */
+		if (write(1, output, output_char) < 0) {
+		    /* if stderr failed there is not much we can do hopefully more disk space next time */
+		    VERBOSE fprintf(stderr, "file output failed\n");
+		    nwarning("njmon write to stderr failed, stopping now.");
+		}
+		fflush(NULL);		/* force I/O output now */
+    }
+    output[0] = 0;
+    output_char = 0;
+}
+
+void replace_curly_with_square()
+{
+    if (output[output_char - 1] == '{') {
+	output[output_char - 1] = '[';
+    }
+}
+
+void praw(char *string)
+{
+    output_char += sprintf(&output[output_char], "%s", string);
+}
+
+/* - - - - - change-only emission - - - - */
+/*
+ * With -N keyframe most of meminfo, vmstat, disks and filesystems is the same as the last
+ * sample. Each number sent is remembered in an open addressing hash table keyed on a hash of
+ * the section, sub and field names and a value the same as last time is left out.
+ * Every keyframe samples the table is emptied so everything is sent, keys that have gone
+ * (like exited processes) fall out of the table and "last value" queries over a keyframe
+ * interval stay correct. Strings and the timestamp, hf and njmon stats sections are always sent.
+ */
+struct delta_entry {
+    unsigned long long key;	/* 0 = empty */
+    unsigned long long value;	/* the bits of the long or double */
+};
+
+long delta_keyframe = 0;	/* -N samples from one full sample to the next, 0 = off */
+long delta_samples = 0;
+int delta_full = 0;		/* this sample is a keyframe */
+int delta_skip = 0;		/* section always sent in full */
+struct delta_entry *delta_table = NULL;
+long delta_size = 0;		/* a power of 2 */
+long delta_used = 0;
+unsigned long long delta_section_key = 0;
+unsigned long long delta_sub_key = 0;
+long delta_suppressed = 0;
+
+/* from psample(), a keyframe empties the table */
+void delta_sample()
+{
+    if (delta_keyframe == 0)
+	return;
+    delta_full = (delta_samples++ % delta_keyframe) == 0;
+    if (delta_full && delta_used > 0) {
+	memset(delta_table, 0, sizeof(struct delta_entry) * delta_size);
+	delta_used = 0;
+    }
+}
+
+void delta_section(char *section)
+{
+    delta_section_key = hash_bytes(HASH_START, section, strlen(section));
+    delta_sub_key = delta_section_key;
+    delta_skip = !strcmp(section, "timestamp") || !strcmp(section, "hf")
+	|| !strcmp(section, "njmontime") || !strcmp(section, "njmon_internal_stats")
+	|| !strcmp(section, "njmon_self")
+	|| !strcmp(section, "psi_event");
+}
+
+void delta_sub(char *resource)
+{
+    delta_sub_key = hash_bytes(delta_section_key ^ 1, resource, strlen(resource));
+}
+
+void delta_grow()
+{
+    struct delta_entry *old = delta_table;
+    long old_size = delta_size;
+    long i;
+    long j;
+
+    delta_size = delta_size ? delta_size * 2 : 4096;
+    delta_table = calloc(delta_size, sizeof(struct delta_entry));
+    for (i = 0; i < old_size; i++) {
+	if (old[i].key == 0)
+	    continue;
+	for (j = old[i].key & (delta_size - 1); delta_table[j].key != 0; j = (j + 1) & (delta_size - 1))
+	    ;
+	delta_table[j] = old[i];
+    }
+    free(old);
+}
+
+/* returns 1 if the value is the same as last time so can be left out */
+int delta_same(char *name, unsigned long long value)
+{
+    unsigned long long key;
+    long i;
+
+    if (delta_keyframe == 0 || delta_skip)
+	return 0;
+    if (delta_used * 10 >= delta_size * 7)
+	delta_grow();
+    key = hash_bytes(delta_sub_key, name, strlen(name)) | 1;	/* never 0 = empty */
+    for (i = key & (delta_size - 1); delta_table[i].key != 0; i = (i + 1) & (delta_size - 1)) {
+	if (delta_table[i].key == key) {
+	    if (delta_table[i].value == value) {
+		delta_suppressed++;
+		return 1;
+	    }
+	    delta_table[i].value = value;
+	    return 0;
+	}
+    }
+    delta_table[i].key = key;
+    delta_table[i].value = value;
+    delta_used++;
+    return 0;
+}
+
+/* NIMON line ending, queued samples may be sent late so they need their own timestamp.
+ * With -U the InfluxDB precision is ms and high frequency lines always carry their time */
+void ptimestamp()
+{
+    long long ms = hf_line_ms ? hf_line_ms : sample_epoch * 1000LL;
+
+    if (target_port && !telegraf_mode) {
+	if (hf_ms)
+	    output_char += sprintf(&output[output_char], " %lld\n", ms);
+	else
+	    output_char += sprintf(&output[output_char], " %ld\n", sample_epoch);
+    } else if (file_output >= 2 || hf_line_ms) {
+	output_char += sprintf(&output[output_char], " %lld000000\n", ms);
+    } else {
+	output_char += sprintf(&output[output_char], "   \n");
+    }
+}
+
+/* start a record, psample() or an event between samples */
+void precord()
+{
+    sample_epoch = (long)time(0);
+    if(mode == NJMON)
+	praw("{");			/* start of sample */
+    if(mode == NBMON)
+	nb_sample_start();
+}
+
+void psample()
+{
+    DEBUG fprintf(stderr, "---- psample()\n) count=%ld\n", output_char);
+    delta_sample();
+    precord();
+}
+
+void psampleend()
+{
+    DEBUG fprintf(stderr, "---- psampleend()\n) count=%ld\n", output_char);
+    if(mode == NBMON) {	/* binary bytes can look like a comma */
+	nb_sample_end();
+	return;
+    }
+    remove_ending_comma_if_any();
+    if(mode == NJMON)
+	praw("}\n");
+}
+
+void psection(char *section)
+{
+    DEBUG fprintf(stderr, "++++ psection(%s) count=%ld\n", section, output_char);
+
+    buffer_check();
+    njmon_sections++;
+    if (delta_keyframe)
+	delta_section(section);
+
+    if(mode == NJMON) {
+	    output_char += sprintf(&output[output_char], "\"%s\": {", section);
+    } else if(mode == NBMON) {
+	    nb_op(NB_SECTION, section);
+    } else {
+	    saved_section_len = strlen(section);
+	    if (saved_section_len >= sizeof(saved_section))
+		saved_section_len = sizeof(saved_section) - 1;
+	    memcpy(saved_section, section, saved_section_len);
+	    saved_section[saved_section_len] = 0;
+
+	    /* remove the trailing es and s for the sub tag name */
+	    strcpy(saved_sub, saved_section);
+	    if(!strcmp("processes", saved_sub)) {
+		strcpy(saved_sub,"process");
+	    } else {
+		if (saved_sub[0] != 0 && saved_sub[strlen(saved_sub) - 1] == 's') {
+		    saved_sub[strlen(saved_sub) - 1] = 0;
+		}
+	    }
+	    saved_sub_len = strlen(saved_sub);
+	    line_pending = 1;
+	    first_sub = 1;
+	    psubended = 0;
+    }
+}
+
+/* NIMON: start the measure line at its first field, so no bytes are written for
+ * a section line that psub() replaces or for a section or sub with no fields */
+void pline_start()
+{
+    char *p;
+
+    PRESERVE(saved_section_len + tag_prefix_len + saved_sub_len + saved_resource_len + additional_tags_len + 16);
+    p = &output[output_char];
+    memcpy(p, saved_section, saved_section_len);
+    p += saved_section_len;
+    memcpy(p, tag_prefix, tag_prefix_len);
+    p += tag_prefix_len;
+    if (line_pending == 2) {
+	*p++ = ',';
+	memcpy(p, saved_sub, saved_sub_len);
+	p += saved_sub_len;
+	memcpy(p, "_name=", 6);
+	p += 6;
+	memcpy(p, saved_resource, saved_resource_len);
+	p += saved_resource_len;
+    }
+    memcpy(p, additional_tags, additional_tags_len);
+    p += additional_tags_len;
+    *p++ = ' ';
+    output_char = p - output;
+    line_pending = 0;
+}
+
+__thread int sub_array = 0;
+
+void psub(char *resource)
+{
+    int i;
+
+    buffer_check();
+    DEBUG fprintf(stderr, ">> psubend(%s) count=%ld\n", resource, output_char); 
+    njmon_subsections++;
+    if (delta_keyframe)
+	delta_sub(resource);
+    if(mode == NJMON) {
+	    if (elastic) {
+		replace_curly_with_square();
+		output_char +=
+		    sprintf(&output[output_char], "{ \"item\": \"%s\",", resource);
+		sub_array = 1;
+	    } else {
+		output_char +=
+		    sprintf(&output[output_char], "\"%s\": {", resource);
+	    }
+    } else if(mode == NBMON) {
+	    nb_op(NB_SUB, resource);
+    } else {
+	    /* remove the section line if it had fields before the first sub */
+	    if (first_sub && line_pending == 0) {
+		for (i = output_char - 1; i >= 0; i--)	/* a -j collector buffer starts with the line */
+		    if (output[i] == '\n')
+			break;
+		output[i + 1] = 0;
+		output_char = i + 1;
+	    }
+	    first_sub = 0;
+
+	    saved_resource_len = strlen(resource);
+	    if (saved_resource_len >= sizeof(saved_resource))
+		saved_resource_len = sizeof(saved_resource) - 1;
+	    memcpy(saved_resource, resource, saved_resource_len);
+	    line_pending = 2;
+	    psubended = 0;
+    }
+}
+
+void psubend()
+{
+    DEBUG fprintf(stderr, "<< psubend() count=%ld\n", output_char);
+    if(mode == NBMON) {
+	output[output_char++] = NB_SUBEND;
+	return;
+    }
+    remove_ending_comma_if_any();
+    if(mode == NJMON) {
+	    praw("},");
+    } else {
+	    if (line_pending)	/* no fields so no line */
+		line_pending = 0;
+	    else
+		ptimestamp();
+	    psubended = 1;
+    }
+}
+
+
+void psectionend()
+{
+    if(mode == NBMON) {
+	output[output_char++] = NB_SECTIONEND;
+	return;
+    }
+    remove_ending_comma_if_any();
+    DEBUG fprintf(stderr, "---- psectiondend() count=%ld\n", output_char);
+    if(mode == NJMON) {
+	    if (sub_array)
+		praw("],");
+	    else
+		praw("},");
+	    sub_array = 0;
+    } else {
+	    if (!psubended && !line_pending) {
+		ptimestamp();
+	    }
+	    line_pending = 0;
+	    psubended = 0;
+    }
+}
+
+/* - - - - - pull mode HTTP endpoint - - - - */
+/*
+ * -u port listens for HTTP on a thread of its own so a scheduler can get the newest sample
+ * when it wants it without going through InfluxDB. The data is not protected so it is only on
+ * 127.0.0.1 unless an address is given as -u address:port (0.0.0.0:port for every interface):
+ *    /metrics      Prometheus text, njmon_<section>_<field>{host="...",<sub>_name="..."} value
+ *    / or /json    the sample as njmon writes it (njmon mode)
+ *    /lp           the sample as line protocol (nimon mode)
+ * At the end of each sample the collection loop copies it in to whichever of the two snapshot
+ * buffers no scrape is reading and then makes that the current one, so it never waits on a
+ * scrape. If a scrape is still copying the other buffer the sample is not published and the
+ * previous one stays current. A scrape copies the current buffer, lets it go and then does the
+ * Prometheus conversion and the sending from its copy with epoll and non-blocking sockets, so a
+ * slow client only holds up itself. A connection that does nothing for SERVE_IDLE seconds is
+ * closed so idle clients can not use up the SERVE_CONNECTIONS. Not with -C or -N as their
+ * samples can not be read alone.
+ */
+#define SERVE_CONNECTIONS 64
+#define SERVE_REQUEST 4096
+#define SERVE_IDLE 5
+
+struct serve_snapshot {
+    char *data;
+    long len;
+    long size;
+    int readers;		/* scrapes copying it */
+};
+
+struct serve_text {
+    char *buf;
+    long len;
+    long size;
+};
+
+struct serve_conn {
+    int fd;
+    int slot;			/* in serve_conns[] */
+    time_t active;		/* CLOCK_MONOTONIC seconds of the last read or write */
+    char request[SERVE_REQUEST];
+    long request_len;
+    struct serve_text response;
+    long sent;
+};
+
+/* a number of a Prometheus metric family, offsets in to serve_names */
+struct serve_metric {
+    long labels;
+    long field;
+    long value;
+};
+
+int serve_port = 0;		/* -u */
+char serve_address[64] = "127.0.0.1";	/* -u address:port */
+int serve_fd = -1;
+struct serve_conn *serve_conns[SERVE_CONNECTIONS];
+struct serve_snapshot serve_snapshots[2];
+int serve_current = -1;		/* -1 until the first sample */
+int serve_connections = 0;
+long serve_requests = 0;
+long serve_skipped = 0;
+pthread_t serve_thread;
+
+/* the scrape thread's working space, only grows */
+struct serve_text serve_names;
+struct serve_metric *serve_metrics = NULL;
+long serve_metrics_count = 0;
+long serve_metrics_size = 0;
+long *serve_fields = NULL;
+long serve_fields_size = 0;
+
+/* collection loop: make the finished sample in output the current snapshot */
+void serve_publish()
+{
+    struct serve_snapshot *s;
+    int next;
+
+    if (serve_fd == -1 || output_char == 0)
+	return;
+    next = (__atomic_load_n(&serve_current, __ATOMIC_SEQ_CST) == 0) ? 1 : 0;
+    s = &serve_snapshots[next];
+    if (__atomic_load_n(&s->readers, __ATOMIC_SEQ_CST) != 0) {
+	serve_skipped++;
+	return;
+    }
+    if (s->size < output_char + 1) {
+	s->size = output_char + 1;
+	s->data = realloc(s->data, s->size);
+    }
+    memcpy(s->data, output, output_char);
+    s->data[output_char] = 0;
+    s->len = output_char;
+    __atomic_store_n(&serve_current, next, __ATOMIC_SEQ_CST);
+}
+
+/* scrape thread: copy the current snapshot, returns 0 if there is not one yet */
+int serve_take(struct serve_text *copy)
+{
+    struct serve_snapshot *s;
+    int current;
+
+    for (;;) {
+	if ((current = __atomic_load_n(&serve_current, __ATOMIC_SEQ_CST)) == -1)
+	    return 0;
+	s = &serve_snapshots[current];
+	__atomic_add_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&serve_current, __ATOMIC_SEQ_CST) == current)
+	    break;
+	__atomic_sub_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);	/* swapped under us, try again */
+    }
+    if (copy->size < s->len + 1) {
+	copy->size = s->len + 1;
+	copy->buf = realloc(copy->buf, copy->size);
+    }
+    memcpy(copy->buf, s->data, s->len + 1);
+    copy->len = s->len;
+    __atomic_sub_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+void serve_add(struct serve_text *t, char *data, long len)
+{
+    if (t->len + len + 1 > t->size) {
+	t->size = (t->len + len + 1) * 2;
+	t->buf = realloc(t->buf, t->size);
+    }
+    memcpy(&t->buf[t->len], data, len);
+    t->len += len;
+    t->buf[t->len] = 0;
+}
+
+void serve_adds(struct serve_text *t, char *string)
+{
+    serve_add(t, string, strlen(string));
+}
+
+/* add a name to serve_names with anything Prometheus does not allow made _, returns its offset */
+long serve_name(char *name, long len)
+{
+    long offset = serve_names.len;
+    long i;
+
+    serve_add(&serve_names, name, len);
+    for (i = offset; i < serve_names.len; i++)
+	if (!isalnum(serve_names.buf[i]) && serve_names.buf[i] != '_')
+	    serve_names.buf[i] = '_';
+    serve_add(&serve_names, "", 1);	/* keep the 0 */
+    return offset;
+}
+
+/* add name="value" to the labels being built at the end of serve_names */
+void serve_label(char *name, long name_len, char *value, long value_len)
+{
+    long i;
+
+    if (serve_names.len > 0 && serve_names.buf[serve_names.len - 1] != 0)	/* not the first */
+	serve_add(&serve_names, ",", 1);
+    serve_add(&serve_names, name, name_len);
+    serve_add(&serve_names, "=\"", 2);
+    for (i = 0; i < value_len; i++) {
+	if (value[i] == '\\' && i + 1 < value_len)	/* line protocol escapes */
+	    i++;
+	if (value[i] == '"' || value[i] == '\\')
+	    serve_add(&serve_names, "\\", 1);
+	serve_add(&serve_names, &value[i], 1);
+    }
+    serve_add(&serve_names, "\"", 1);
+}
+
+void serve_metric_add(long labels, long field, long value)
+{
+    if (serve_metrics_count == serve_metrics_size) {
+	serve_metrics_size = serve_metrics_size * 2 + 1024;
+	serve_metrics = realloc(serve_metrics, sizeof(struct serve_metric) * serve_metrics_size);
+    }
+    serve_metrics[serve_metrics_count].labels = labels;
+    serve_metrics[serve_metrics_count].field = field;
+    serve_metrics[serve_metrics_count].value = value;
+    serve_metrics_count++;
+}
+
+/* write out a section's numbers a field at a time, as the lines of a family must be together */
+void serve_family(struct serve_text *out, char *section, long section_len)
+{
+    char *field;
+    long fields = 0;
+    long i;
+    long j;
+
+    for (i = 0; i < serve_metrics_count; i++) {
+	field = &serve_names.buf[serve_metrics[i].field];
+	for (j = 0; j < fields; j++)
+	    if (!strcmp(&serve_names.buf[serve_fields[j]], field))
+		break;
+	if (j < fields)
+	    continue;
+	if (fields == serve_fields_size) {
+	    serve_fields_size = serve_fields_size * 2 + 64;
+	    serve_fields = realloc(serve_fields, sizeof(long) * serve_fields_size);
+	}
+	serve_fields[fields++] = serve_metrics[i].field;
+    }
+    for (j = 0; j < fields; j++) {
+	field = &serve_names.buf[serve_fields[j]];
+	serve_adds(out, "# TYPE njmon_");
+	serve_add(out, section, section_len);
+	serve_adds(out, "_");
+	serve_adds(out, field);
+	serve_adds(out, " gauge\n");
+	for (i = 0; i < serve_metrics_count; i++) {
+	    if (strcmp(&serve_names.buf[serve_metrics[i].field], field))
+		continue;
+	    serve_adds(out, "njmon_");
+	    serve_add(out, section, section_len);
+	    serve_adds(out, "_");
+	    serve_adds(out, field);
+	    serve_adds(out, "{");
+	    serve_adds(out, &serve_names.buf[serve_metrics[i].labels]);
+	    serve_adds(out, "} ");
+	    serve_adds(out, &serve_names.buf[serve_metrics[i].value]);
+	    serve_adds(out, "\n");
+	}
+    }
+    serve_metrics_count = 0;
+    serve_names.len = 0;
+}
+
+/* JSON: skip a string, returns the character after it */
+char *serve_json_string(char *p, char **start, long *len)
+{
+    *start = ++p;
+    while (*p != 0 && *p != '"') {
+	if (*p == '\\' && p[1] != 0)
+	    p++;
+	p++;
+    }
+    *len = p - *start;
+    return *p == '"' ? p + 1 : p;
+}
+
+/* JSON: skip any value, returns the , or } after it */
+char *serve_json_skip(char *p)
+{
+    char *start;
+    long len;
+    int depth = 0;
+
+    while (*p != 0) {
+	if (*p == '"') {
+	    p = serve_json_string(p, &start, &len);
+	    continue;
+	}
+	if (*p == '{' || *p == '[') {
+	    depth++;
+	} else if (*p == '}' || *p == ']') {
+	    if (depth == 0)
+		return p;
+	    if (--depth == 0)
+		return p + 1;
+	} else if (*p == ',' && depth == 0) {
+	    return p;
+	}
+	p++;
+    }
+    return p;
+}
+
+/* JSON: the next "name": of an object and p at its value, or 0 and p after the } */
+int serve_json_member(char **pp, char **name, long *name_len)
+{
+    char *p = *pp;
+
+    while (isspace(*p) || *p == ',')
+	p++;
+    if (*p != '"') {
+	*pp = (*p == '}') ? p + 1 : p;
+	return 0;
+    }
+    p = serve_json_string(p, name, name_len);
+    while (isspace(*p) || *p == ':')
+	p++;
+    *pp = p;
+    return 1;
+}
+
+/* JSON: a number value in to serve_names, returns the character after it or NULL if not a number */
+char *serve_json_number(char *p, long *value)
+{
+    char *end = p;
+
+    if (!isdigit(*p) && *p != '-')
+	return NULL;
+    while (*end == '-' || *end == '+' || *end == '.' || *end == 'e' || *end == 'E' || isdigit(*end))
+	end++;
+    *value = serve_names.len;
+    serve_add(&serve_names, p, end - p);
+    serve_add(&serve_names, "", 1);
+    return end;
+}
+
+/* the labels of a section (sub NULL) or of one of its subs, like nimon's cpu_name="cpu0" */
+long serve_json_labels(char *section, long section_len, char *sub, long sub_len)
+{
+    char tag[256];
+    long labels = serve_names.len;
+
+    serve_label("host", 4, hostname, strlen(hostname));
+    if (sub != NULL) {
+	snprintf(tag, sizeof(tag) - 8, "%.*s", (int) section_len, section);
+	if (!strcmp(tag, "processes"))
+	    strcpy(tag, "process");
+	else if (tag[0] != 0 && tag[strlen(tag) - 1] == 's')
+	    tag[strlen(tag) - 1] = 0;
+	strcat(tag, "_name");
+	serve_label(tag, strlen(tag), sub, sub_len);
+    }
+    serve_add(&serve_names, "", 1);
+    return labels;
+}
+
+/* njmon JSON: sections of numbers or of subs of numbers, strings are left out */
+void serve_prometheus_json(char *p, struct serve_text *out)
+{
+    char *section;
+    char *name;
+    char *field;
+    char *next;
+    long section_len;
+    long name_len;
+    long field_len;
+    long section_labels;
+    long labels;
+    long value;
+
+    while (isspace(*p))
+	p++;
+    if (*p++ != '{')
+	return;
+    while (serve_json_member(&p, &section, &section_len)) {
+	if (*p != '{') {
+	    p = serve_json_skip(p);
+	    continue;
+	}
+	p++;
+	section_labels = serve_json_labels(section, section_len, NULL, 0);
+	while (serve_json_member(&p, &name, &name_len)) {
+	    if ((next = serve_json_number(p, &value)) != NULL) {
+		serve_metric_add(section_labels, serve_name(name, name_len), value);
+		p = next;
+	    } else if (*p == '{') {
+		p++;
+		labels = serve_json_labels(section, section_len, name, name_len);
+		while (serve_json_member(&p, &field, &field_len)) {
+		    if ((next = serve_json_number(p, &value)) != NULL) {
+			serve_metric_add(labels, serve_name(field, field_len), value);
+			p = next;
+		    } else {
+			p = serve_json_skip(p);
+		    }
+		}
+	    } else {
+		p = serve_json_skip(p);
+	    }
+	}
+	serve_family(out, section, section_len);
+    }
+}
+
+/* line protocol: the end of a part, stopping at an unescaped stop character outside quotes */
+char *serve_lp_part(char *p, char *stops)
+{
+    int quoted = 0;
+
+    for (; *p != 0 && *p != '\n'; p++) {
+	if (*p == '\\' && p[1] != 0 && p[1] != '\n')
+	    p++;
+	else if (*p == '"')
+	    quoted = !quoted;
+	else if (!quoted && strchr(stops, *p) != NULL)
+	    break;
+    }
+    return p;
+}
+
+/* nimon line protocol: measurement,tag=value,... field=1i,field=2.5,field="string" time */
+void serve_prometheus_lp(char *p, struct serve_text *out)
+{
+    char section[256] = "";
+    char *measurement;
+    char *end;
+    char *equals;
+    char *value;
+    long measurement_len;
+    long value_len;
+    long labels;
+    long number;
+
+    while (*p != 0) {
+	measurement = p;
+	p = serve_lp_part(p, ", ");
+	measurement_len = p - measurement;
+	if (measurement_len == 0 || measurement_len >= sizeof(section) || *p == '\n' || *p == 0) {
+	    p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p);
+	    continue;
+	}
+	if (strlen(section) != measurement_len || strncmp(section, measurement, measurement_len)) {
+	    if (section[0] != 0)
+		serve_family(out, section, strlen(section));
+	    snprintf(section, sizeof(section), "%.*s", (int) measurement_len, measurement);
+	}
+	labels = serve_names.len;
+	while (*p == ',') {	/* tags */
+	    end = serve_lp_part(++p, ", ");
+	    if ((equals = memchr(p, '=', end - p)) != NULL)
+		serve_label(p, equals - p, equals + 1, end - equals - 1);
+	    p = end;
+	}
+	serve_add(&serve_names, "", 1);
+	while (*p == ' ' || *p == ',') {	/* fields */
+	    end = serve_lp_part(++p, ", ");
+	    if ((equals = memchr(p, '=', end - p)) != NULL && equals[1] != '"' && equals[1] != 't' && equals[1] != 'f') {
+		value = equals + 1;
+		value_len = end - value;
+		if (value_len > 0 && value[value_len - 1] == 'i')
+		    value_len--;
+		number = serve_names.len;
+		serve_add(&serve_names, value, value_len);
+		serve_add(&serve_names, "", 1);
+		serve_metric_add(labels, serve_name(p, equals - p), number);
+	    }
+	    p = end;
+	    if (*p == ' ')	/* the timestamp */
+		break;
+	}
+	p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p);
+    }
+    if (section[0] != 0)
+	serve_family(out, section, strlen(section));
+}
+
+/* build the whole HTTP response for a request */
+void serve_respond(struct serve_conn *c)
+{
+    static struct serve_text sample;
+    static struct serve_text body;
+    char header[256];
+    char path[256] = "";
+    char *type = "text/plain; charset=utf-8";
+    char *status = "200 OK";
+
+    serve_requests++;
+    body.len = 0;
+    if (body.buf == NULL)
+	serve_add(&body, "", 0);
+    if (sscanf(c->request, "GET %255s", path) != 1) {
+	status = "405 Method Not Allowed";
+	serve_adds(&body, "only GET\n");
+    } else if (strcmp(path, "/metrics") && strcmp(path, "/") && strcmp(path, "/json") && strcmp(path, "/lp")) {
+	status = "404 Not Found";
+	serve_adds(&body, "njmon serves /metrics and / (or /json) with njmon or /lp with nimon\n");
+    } else if (!serve_take(&sample)) {
+	status = "503 Service Unavailable";
+	serve_adds(&body, "no sample yet\n");
+    } else if (!strcmp(path, "/metrics")) {
+	type = "text/plain; version=0.0.4; charset=utf-8";
+	if (mode == NJMON)
+	    serve_prometheus_json(sample.buf, &body);
+	else
+	    serve_prometheus_lp(sample.buf, &body);
+    } else if (mode == NJMON && strcmp(path, "/lp")) {
+	type = "application/json";
+	serve_add(&body, sample.buf, sample.len);
+    } else if (mode == NIMON && !strcmp(path, "/lp")) {
+	serve_add(&body, sample.buf, sample.len);
+    } else {
+	status = "404 Not Found";
+	serve_adds(&body, mode == NJMON ? "njmon mode: /json not /lp\n" : "nimon mode: /lp not /json\n");
+    }
+    snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %ld\r\nConnection: close\r\n\r\n",
+	     status, type, body.len);
+    c->response.len = 0;
+    serve_adds(&c->response, header);
+    serve_add(&c->response, body.buf, body.len);
+    c->sent = 0;
+}
+
+time_t serve_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+void serve_close(int epfd, struct serve_conn *c)
+{
+    serve_conns[c->slot] = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->response.buf);
+    free(c);
+    serve_connections--;
+}
+
+/* read the request or write the response as far as the socket lets us */
+void serve_event(int epfd, struct serve_conn *c, unsigned int events)
+{
+    struct epoll_event ev;
+    long len;
+
+    c->active = serve_now();
+    if (c->response.buf == NULL) {
+	len = read(c->fd, &c->request[c->request_len], SERVE_REQUEST - 1 - c->request_len);
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+	    serve_close(epfd, c);
+	    return;
+	}
+	if (len < 0)
+	    return;
+	c->request_len += len;
+	c->request[c->request_len] = 0;
+	if (strstr(c->request, "\r\n\r\n") == NULL && strstr(c->request, "\n\n") == NULL
+	    && c->request_len < SERVE_REQUEST - 1)
+	    return;		/* more to come */
+	serve_respond(c);
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+	serve_close(epfd, c);
+	return;
+    }
+    while (c->sent < c->response.len) {
+	len = send(c->fd, &c->response.buf[c->sent], c->response.len - c->sent, MSG_NOSIGNAL);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+	    ev.events = EPOLLOUT;
+	    ev.data.ptr = c;
+	    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	    return;
+	}
+	if (len <= 0)
+	    break;
+	c->sent += len;
+    }
+    serve_close(epfd, c);
+}
+
+void *serve_loop(void *arg)
+{
+    struct epoll_event events[16];
+    struct epoll_event ev;
+    struct serve_conn *c;
+    time_t now;
+    int epfd;
+    int fd;
+    int count;
+    int i;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	return NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;		/* the listening socket */
+    epoll_ctl(epfd, EPOLL_CTL_ADD, serve_fd, &ev);
+    for (;;) {
+	count = epoll_wait(epfd, events, 16, serve_connections ? 1000 : -1);
+	now = serve_now();
+	for (i = 0; serve_connections && i < SERVE_CONNECTIONS; i++)
+	    if (serve_conns[i] != NULL && now - serve_conns[i]->active > SERVE_IDLE)
+		serve_close(epfd, serve_conns[i]);
+	for (i = 0; i < count; i++) {
+	    if (events[i].data.ptr != NULL) {
+		serve_event(epfd, events[i].data.ptr, events[i].events);
+		continue;
+	    }
+	    while ((fd = accept(serve_fd, NULL, NULL)) != -1) {
+		if (serve_connections >= SERVE_CONNECTIONS) {
+		    close(fd);	/* busy, the scraper will try again */
+		    continue;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		c = calloc(1, sizeof(struct serve_conn));
+		c->fd = fd;
+		c->active = now;
+		for (c->slot = 0; serve_conns[c->slot] != NULL; c->slot++)
+		    ;
+		serve_conns[c->slot] = c;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		serve_connections++;
+	    }
+	}
+    }
+    return NULL;
+}
+
+void serve_init()
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    FUNCTION_START;
+    if (serve_port == 0)
+	return;
+    if (mode == NBMON || delta_keyframe) {
+	nwarning("-u ignored with -C or -N as their samples are not complete on their own");
+	return;
+    }
+    if ((serve_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+	sprintf(errorbuf, "-u socket() failed errno=%d (%s)", errno, strerror(errno));
+	nwarning(errorbuf);
+	return;
+    }
+    setsockopt(serve_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, serve_address, &addr.sin_addr);	/* checked with the option */
+    addr.sin_port = htons(serve_port);
+    if (bind(serve_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(serve_fd, SERVE_CONNECTIONS) == -1
+	|| pthread_create(&serve_thread, NULL, serve_loop, NULL) != 0) {
+	sprintf(errorbuf, "-u %s:%d can not be served errno=%d (%s)", serve_address, serve_port, errno, strerror(errno));
+	nwarning(errorbuf);
+	close(serve_fd);
+	serve_fd = -1;
+    }
+}
+
+/* - - - - - fast formatting for the p functions - - - - */
+/*
+ * plong() and friends run for every stat, with -P that is 100,000s of times a sample and
+ * sprintf() was most of execute_time. Numbers are written straight in to output using a two
+ * digit table and doubles as integer thousandths, so no locale or varargs work per stat.
+ * For a string literal field name the "name": or name= text is built once per call site (and
+ * thread, as -j collectors share call sites) by the PKEY() macro and then copied, other names
+ * are built on each call.
+ * The output is byte for byte what the sprintf() versions made, njmon_bench checks this.
+ */
+#define PSPAN 64		/* bytes for a number, quotes and the comma */
+#define PKEY_MAX 96
+
+struct pkey {
+    char *name;			/* the literal this was built from */
+    int mode;
+    int len;
+    char text[PKEY_MAX];
+};
+
+#define PKEY(name) (__builtin_constant_p(name) ? ({ static __thread struct pkey pkey_site; &pkey_site; }) : (struct pkey *)0)
+
+static const char pdigits[] =
+    "00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859" "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+char *fmt_ulong(char *p, unsigned long long value)
+{
+    char buf[24];
+    char *b = &buf[24];
+    int i;
+
+    while (value >= 100) {
+	i = (value % 100) * 2;
+	value /= 100;
+	*--b = pdigits[i + 1];
+	*--b = pdigits[i];
+    }
+    if (value >= 10) {
+	*--b = pdigits[value * 2 + 1];
+	*--b = pdigits[value * 2];
+    } else {
+	*--b = '0' + value;
+    }
+    memcpy(p, b, &buf[24] - b);
+    return p + (&buf[24] - b);
+}
+
+char *fmt_long(char *p, long long value)
+{
+    if (value < 0) {
+	*p++ = '-';
+	return fmt_ulong(p, -(unsigned long long) value);
+    }
+    return fmt_ulong(p, value);
+}
+
+/* same as %.3f */
+char *fmt_double(char *p, double value)
+{
+    unsigned long long thousandths;
+    double scaled;
+    double part;
+    int frac;
+
+    scaled = fabs(value) * 1000.0;
+    if (scaled >= 1.0e18)	/* would not fit, rare so use libc */
+	return p + sprintf(p, "%.3f", value);
+    thousandths = (unsigned long long) scaled;
+    part = scaled - thousandths;
+    /* too close to half way to know which way printf would round the exact value */
+    if (fabs(part - 0.5) < scaled * 1.0e-15 + 1.0e-9)
+	return p + sprintf(p, "%.3f", value);
+    if (part > 0.5)
+	thousandths++;
+    if (signbit(value))
+	*p++ = '-';
+    p = fmt_ulong(p, thousandths / 1000);
+    frac = thousandths % 1000;
+    p[0] = '.';
+    p[1] = '0' + frac / 100;
+    p[2] = pdigits[(frac % 100) * 2];
+    p[3] = pdigits[(frac % 100) * 2 + 1];
+    return p + 4;
+}
+
+/* same as "0x%08llx" */
+char *fmt_hex(char *p, unsigned long long value)
+{
+    static const char hex[] = "0123456789abcdef";
+    char buf[16];
+    int n = 0;
+
+    do {
+	buf[n++] = hex[value & 0xf];
+	value >>= 4;
+    } while (value);
+    *p++ = '0';
+    *p++ = 'x';
+    for (; n < 8; n++)
+	buf[n] = '0';
+    while (n > 0)
+	*p++ = buf[--n];
+    return p;
+}
+
+/* add "name": or name= at the end of output */
+void pkey(struct pkey *k, char *name)
+{
+    char *p;
+    long len;
+
+    if (line_pending)
+	pline_start();
+    if (k != NULL && k->name == name && k->mode == mode) {
+	PRESERVE(k->len + PSPAN);
+	memcpy(&output[output_char], k->text, k->len);
+	output_char += k->len;
+	return;
+    }
+    len = strlen(name);
+    PRESERVE(len + PSPAN);
+    p = &output[output_char];
+    if (mode == NJMON) {
+	*p++ = '"';
+	memcpy(p, name, len);
+	p += len;
+	*p++ = '"';
+	*p++ = ':';
+	*p++ = ' ';
+    } else {
+	memcpy(p, name, len);
+	p += len;
+	*p++ = '=';
+    }
+    len = p - &output[output_char];
+    if (k != NULL && len <= PKEY_MAX) {
+	memcpy(k->text, &output[output_char], len);
+	k->len = len;
+	k->mode = mode;
+	k->name = name;
+    }
+    output_char += len;
+}
+
+void phex_key(struct pkey *k, char *name, long long value)
+{
+    char *p;
+
+    njmon_hex++;
+    if (delta_same(name, value))
+	return;
+    if(mode == NBMON) {
+	    nb_op(NB_HEX, name);
+	    nb_varint(value);
+    } else {
+	    pkey(k, name);
+	    p = &output[output_char];
+	    *p++ = '"';
+	    p = fmt_hex(p, value);
+	    *p++ = '"';
+	    *p++ = ',';
+	    output_char = p - output;
+    }
+    DEBUG fprintf(stderr, "phex(%s,0x%08llx) count=%ld\n", name, value, output_char);
+}
+
+void plong_key(struct pkey *k, char *name, long long value)
+{
+    char *p;
+
+    njmon_long++;
+    if (delta_same(name, value))
+	return;
+    if(mode == NBMON) {
+	    nb_op(NB_LONG, name);
+	    nb_zigzag(value);
+    } else {
+	    pkey(k, name);
+	    p = fmt_long(&output[output_char], value);
+	    if(mode != NJMON)
+		*p++ = 'i';
+	    *p++ = ',';
+	    output_char = p - output;
+    }
+    DEBUG fprintf(stderr, "plong(%s,%lld) count=%ld\n", name, value, output_char);
+}
+
+void pdouble_key(struct pkey *k, char *name, double value)
+{
+    unsigned long long bits;
+    char *p;
+
+    njmon_double++;
+    if (isnan(value) || isinf(value)) { /* Not-a-number or infinity */
+	DEBUG fprintf(stderr, "pdouble(%s,%.1f) - NaN error\n", name, value);
+	return;
+    }
+    if (delta_keyframe) {
+	memcpy(&bits, &value, sizeof(bits));
+	if (delta_same(name, bits))
+	    return;
+    }
+    if(mode == NBMON) {
+	nb_double(name, value);
+    } else {
+	pkey(k, name);
+	p = fmt_double(&output[output_char], value);
+	*p++ = ',';
+	output_char = p - output;
+    }
+    DEBUG fprintf(stderr, "pdouble(%s,%.1f) count=%ld\n", name, value, output_char);
+}
+
+void pstring_key(struct pkey *k, char *name, char *value)
+{
+    char *p;
+    int i;
+    int len;
+
+    njmon_string++;
+    if (value == (char *) 0)
+	value = "(null)";
+    len = strlen(value);
+    if(mode == NBMON) {
+	    for (i = 0; i < len; i++) {
+		if (value[i] == '\n' || iscntrl(value[i]))
+		    value[i] = '?';
+	    }
+	    nb_string(name, value);
+    } else {
+	    pkey(k, name);
+	    PRESERVE(len + PSPAN);
+	    p = &output[output_char];
+	    *p++ = '"';
+	    for (i = 0; i < len; i++) {
+		if (value[i] == '\n' || iscntrl(value[i]))
+		    value[i] = '?';
+		*p++ = value[i];
+	    }
+	    *p++ = '"';
+	    *p++ = ',';
+	    output_char = p - output;
+    }
+    DEBUG fprintf(stderr, "pstring(%s,%s) count=%ld\n", name, value, output_char);
+}
+
+#define phex(name, value)    phex_key(PKEY(name), name, value)
+#define plong(name, value)   plong_key(PKEY(name), name, value)
+#define pdouble(name, value) pdouble_key(PKEY(name), name, value)
+#define pstring(name, value) pstring_key(PKEY(name), name, value)
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#ifdef EXTRA
+
+#include "extra.c"
+
+#endif /* EXTRA */
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+/* - - - - - /proc file reading for the hot collectors - - - - */
+/*
+ * fgets() + sscanf() for every line of /proc/stat was most of njmon's own CPU use on large
+ * servers. These files stay open and each sample is one pread() in to a buffer kept between
+ * samples, which is then split in to lines in place and scanned by hand.
+ * The file names are variables so njmon_bench can use synthetic files.
+ */
+char *proc_stat_filename = "/proc/stat";
+char *proc_diskstats_filename = "/proc/diskstats";
+char *proc_net_dev_filename = "/proc/net/dev";
+char *proc_dirname = "/proc";	/* for read_data_number() */
+
+struct procfile {
+    char name[256];
+    int fd;
+    char *buf;
+    long size;
+    char *next;			/* next line for pf_line() */
+    struct procfile *chain;
+};
+struct procfile *procfiles = NULL;
+pthread_mutex_t procfiles_lock = PTHREAD_MUTEX_INITIALIZER;	/* -j collectors open files too */
+
+struct procfile *pf_open(char *name)
+{
+    struct procfile *pf;
+
+    pthread_mutex_lock(&procfiles_lock);
+    for (pf = procfiles; pf != NULL; pf = pf->chain)
+	if (!strcmp(pf->name, name)) {
+	    pthread_mutex_unlock(&procfiles_lock);
+	    return pf;
+	}
+    pf = calloc(1, sizeof(struct procfile));
+    strncpy(pf->name, name, sizeof(pf->name) - 1);
+    pf->fd = -1;
+    pf->size = 8192;
+    pf->buf = malloc(pf->size);
+    pf->chain = procfiles;
+    procfiles = pf;
+    pthread_mutex_unlock(&procfiles_lock);
+    return pf;
+}
+
+/* read the whole file from the start, returns 0 if it can't be opened or read */
+int pf_read(struct procfile *pf)
+{
+    long len;
+
+    if (pf->fd == -1 && (pf->fd = open(pf->name, O_RDONLY | O_CLOEXEC)) == -1)
+	return 0;
+    for (;;) {
+	len = pread(pf->fd, pf->buf, pf->size - 1, 0);
+	if (len < 0) {
+	    close(pf->fd);	/* try a fresh open next time */
+	    pf->fd = -1;
+	    return 0;
+	}
+	if (len < pf->size - 1)
+	    break;
+	pf->size = pf->size * 2;	/* might be more so grow and read it again */
+	pf->buf = realloc(pf->buf, pf->size);
+    }
+    pf->buf[len] = 0;
+    pf->next = pf->buf;
+    return 1;
+}
+
+/* the next line with the newline removed or NULL at the end */
+char *pf_line(struct procfile *pf)
+{
+    char *line = pf->next;
+    char *end;
+
+    if (line == NULL || *line == 0)
+	return NULL;
+    if ((end = strchr(line, '\n')) != NULL) {
+	*end = 0;
+	pf->next = end + 1;
+    } else {
+	pf->next = NULL;
+    }
+    return line;
+}
+
+/* scan a number skipping spaces and colons before it, returns 1 if there was one */
+int pf_number(char **s, long long *value)
+{
+    char *p = *s;
+    unsigned long long v = 0;
+    int negative = 0;
+
+    while (*p == ' ' || *p == '\t' || *p == ':')
+	p++;
+    if (*p == '-') {
+	negative = 1;
+	p++;
+    }
+    if (*p < '0' || *p > '9') {
+	*s = p;
+	return 0;
+    }
+    while (*p >= '0' && *p <= '9')
+	v = v * 10 + (*p++ - '0');
+    *value = negative ? -(long long) v : (long long) v;
+    *s = p;
+    return 1;
+}
+
+long long pf_ll(char **s)
+{
+    long long value = 0;
+
+    pf_number(s, &value);
+    return value;
+}
+
+/* copy the next space separated word */
+void pf_word(char **s, char *word, int size)
+{
+    char *p = *s;
+    int i = 0;
+
+    while (*p == ' ' || *p == '\t')
+	p++;
+    while (*p != 0 && *p != ' ' && *p != '\t' && i < size - 1)
+	word[i++] = *p++;
+    word[i] = 0;
+    *s = p;
+}
+
+/* - - - - - shared memory publication - - - - */
+/*
+ * -o name keeps the latest sample's numbers in /dev/shm/name in the fixed layout of
+ * njmon_shm.h: cpu_total and every CPU, the -E perf counters in total and per CPU, the host PSI
+ * and with -G and -g each pod's CPU, memory, io, pressure and counters. The collectors put them
+ * in shm_next as they go and at the end of the sample it is copied in to the segment inside a
+ * seqlock, so programs on the server (an MPI launcher, a scheduler agent) can read it in
+ * microseconds with njmon_shm_read() and no system calls. The text outputs do not change.
+ *    NJMON_SHM_PODS=pods   pod slots (default 256)
+ */
+char *shm_name = NULL;		/* -o */
+struct njmon_shm *shm_segment = NULL;
+struct njmon_shm *shm_next = NULL;	/* this sample so far */
+
+void shm_init()
+{
+    char path[256];
+    char *s;
+    long cpus;
+    long pods = 256;
+    long size;
+    int fd;
+
+    FUNCTION_START;
+    if (shm_name == NULL)
+	return;
+    if ((s = getenv("NJMON_SHM_PODS")) != 0 && atol(s) >= 0)
+	pods = atol(s);
+    if ((cpus = sysconf(_SC_NPROCESSORS_CONF)) < 1)
+	cpus = 1;
+    size = sizeof(struct njmon_shm) + cpus * sizeof(struct njmon_shm_cpu) + pods * sizeof(struct njmon_shm_pod);
+    snprintf(path, sizeof(path), "/%s", shm_name);
+    if ((fd = shm_open(path, O_RDWR | O_CREAT, 0644)) == -1 || ftruncate(fd, size) == -1
+	|| (shm_segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	sprintf(errorbuf, "-o /dev/shm%s can not be made errno=%d (%s)", path, errno, strerror(errno));
+	nwarning(errorbuf);
+	if (fd != -1)
+	    close(fd);
+	shm_segment = NULL;
+	return;
+    }
+    close(fd);
+    shm_next = calloc(1, size);
+    shm_next->size = size;
+    shm_next->cpus_max = cpus;
+    shm_next->pods_max = pods;
+    shm_next->cpus_offset = sizeof(struct njmon_shm);
+    shm_next->pods_offset = sizeof(struct njmon_shm) + cpus * sizeof(struct njmon_shm_cpu);
+    memset(shm_segment, 0, size);	/* readers see no samples until the first */
+    memcpy(shm_segment, shm_next, size);
+    memcpy(shm_segment->magic, NJMON_SHM_MAGIC, 8);	/* last, the layout is ready */
+    shm_segment->version = NJMON_SHM_VERSION;
+}
+
+/* the slot of pod number p, cleared if it was another pod's */
+struct njmon_shm_pod *shm_pod(int p, char *uid, char *qos)
+{
+    struct njmon_shm_pod *slot;
+
+    if (shm_next == NULL || p >= shm_next->pods_max)
+	return NULL;
+    slot = NJMON_SHM_POD(shm_next, p);
+    if (strncmp(slot->uid, uid, sizeof(slot->uid) - 1)) {
+	memset(slot, 0, sizeof(struct njmon_shm_pod));
+	strncpy(slot->uid, uid, sizeof(slot->uid) - 1);
+	strncpy(slot->qos, qos, sizeof(slot->qos) - 1);
+    }
+    if (p + 1 > shm_next->pods)
+	shm_next->pods = p + 1;
+    return slot;
+}
+
+/* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 and the full line if there is one */
+void shm_pressure(char *buf, struct njmon_shm_pressure *pressure)
+{
+    char *full;
+
+    if (pressure == NULL)
+	return;
+    sscanf(buf, "some avg10=%lf avg60=%lf avg300=%lf total=%" SCNu64,
+	   &pressure->some_avg10, &pressure->some_avg60, &pressure->some_avg300, &pressure->some_total_us);
+    if ((full = strstr(buf, "full ")) != NULL)
+	sscanf(full, "full avg10=%lf avg60=%lf avg300=%lf total=%" SCNu64,
+	       &pressure->full_avg10, &pressure->full_avg60, &pressure->full_avg300, &pressure->full_total_us);
+}
+
+/* copy the finished sample in to the segment, seq odd while it is going in */
+void shm_publish(double elapsed)
+{
+    struct timeval tv;
+    uint64_t seq;
+    long header = offsetof(struct njmon_shm, samples);
+    int i;
+
+    if (shm_segment == NULL)
+	return;
+    gettimeofday(&tv, 0);
+    shm_next->samples++;
+    shm_next->epoch_us = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    shm_next->elapsed = elapsed;
+    seq = shm_segment->seq;
+    __atomic_store_n(&shm_segment->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *) shm_segment + header, (char *) shm_next + header, shm_next->size - header);
+    __atomic_store_n(&shm_segment->seq, seq + 2, __ATOMIC_RELEASE);
+
+    for (i = 0; i < shm_next->cpus_max; i++)	/* ready for the next sample */
+	NJMON_SHM_CPU(shm_next, i)->online = 0;
+    shm_next->total.online = 0;
+    shm_next->pods = 0;
+}
+
+/* - - - - - hardware counters - - - - */
+/*
+ * -E event,event... counts perf events on every online CPU from /sys/devices/system/cpu/online.
+ * An event is one of
+ *    r17              a raw code in hex, as the perf command
+ *    cycles           the generic hardware and software events in counter_generic[]
+ *    pmu/name  name   a named event from /sys/bus/event_source/devices/pmu/events/name with
+ *                     the terms placed in the config fields by the pmu's format files
+ * and can have a field name in front like refill=r17. Each CPU's events on the same PMU are one
+ * group opened with PERF_FORMAT_GROUP and the enabled and running times so the whole group is a
+ * single read() and the counts are scaled up if the kernel had to multiplex them with other users.
+ * The kernel will not mix PMUs in a group so events of another PMU, and any that do not fit in
+ * the group as it has run out of hardware counters, lead groups of their own.
+ * The counts for the interval are sent in perf_counters (all CPUs), perf_sockets and perf_cpus.
+ * Events that will not open are warned about and left out, njmon carries on without them.
+ */
+#define COUNTERS_MAX 16
+
+struct counter {
+    char name[128];		/* field name, as long as any spec it came from */
+    char spec[128];		/* as given to -E */
+    unsigned int type;
+    unsigned long long config;
+    unsigned long long config1;
+    unsigned long long config2;
+    int ok;			/* opened on at least one CPU */
+    int error;			/* errno of the last failed open */
+    int alone;			/* did not fit in its PMU's group so it has one of its own */
+};
+
+struct counter_cpu {
+    int cpu;
+    int socket;
+    int fd[COUNTERS_MAX];	/* -1 if not open */
+    int leader;			/* the first group's fd, -1 if nothing opened */
+    int group[COUNTERS_MAX];	/* the event leading its group, -1 if not open */
+    int index[COUNTERS_MAX];	/* position in its group's read, -1 if not open */
+    int members[COUNTERS_MAX];	/* in the group this event leads */
+    unsigned long long value[COUNTERS_MAX];	/* at the previous sample */
+    unsigned long long enabled[COUNTERS_MAX];	/* of the event's group */
+    unsigned long long running[COUNTERS_MAX];
+};
+
+struct counter counters[COUNTERS_MAX];
+int counters_count = 0;
+struct counter_cpu *counter_cpus = NULL;
+int counter_cpus_count = 0;
+int counters_opened = 0;
+int counters_ok = 0;		/* events that opened */
+int counter_sockets = 0;
+
+struct {
+    char *name;
+    unsigned int type;
+    unsigned long long config;
+} counter_generic[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+    { "stalled-cycles-frontend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+    { "stalled-cycles-backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+    { "ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES },
+    { "cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+    { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+    { "minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+    { NULL, 0, 0 }
+};
+
+long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+                            int cpu, int group_fd, unsigned long flags) {
+    return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
+}
+
+/* read the first line of a small sysfs file, returns 0 if it is not there */
+int sysfs_read(char *filename, char *buf, int size)
+{
+    int fd;
+    int len;
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+	return 0;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0)
+	return 0;
+    buf[len] = 0;
+    if (buf[len - 1] == '\n')
+	buf[len - 1] = 0;
+    return 1;
+}
+
+/* calls add() for each CPU in a list like 0-3,8,10-11 */
+void cpu_list(char *list, void (*add)(int cpu))
+{
+    char *p = list;
+    long long first;
+    long long last;
+
+    while (pf_number(&p, &first)) {
+	last = first;
+	if (*p == '-') {
+	    p++;
+	    pf_number(&p, &last);
+	}
+	for (; first <= last; first++)
+	    add(first);
+	if (*p == ',')
+	    p++;
+    }
+}
+
+/* put value in to the config bits the pmu format file says, like config:0-7,21 or config1:0-15 */
+int counter_format(char *pmu, char *term, unsigned long long value, struct counter *c)
+{
+    char filename[512];
+    char buf[256];
+    unsigned long long *config = &c->config;
+    char *p;
+    long long first;
+    long long last;
+    int shift = 0;
+
+    snprintf(filename, sizeof(filename), "/sys/bus/event_source/devices/%s/format/%s", pmu, term);
+    if (!sysfs_read(filename, buf, sizeof(buf)))
+	return 0;
+    if (!strncmp(buf, "config1:", 8))
+	config = &c->config1;
+    else if (!strncmp(buf, "config2:", 8))
+	config = &c->config2;
+    if ((p = strchr(buf, ':')) == NULL)
+	return 0;
+    p++;
+    while (pf_number(&p, &first)) {
+	last = first;
+	if (*p == '-') {
+	    p++;
+	    pf_number(&p, &last);
+	}
+	for (; first <= last; first++, shift++)
+	    if (value & (1ULL << shift))
+		*config |= 1ULL << first;
+	if (*p == ',')
+	    p++;
+    }
+    return 1;
+}
+
+/* a named event from pmu/events/name, with pmu NULL search them all */
+int counter_sysfs(char *pmu, char *name, struct counter *c)
+{
+    char filename[512];
+    char buf[512];
+    char *term;
+    char *value;
+    char *next;
+    DIR *dir;
+    struct dirent *entry;
+    int found = 0;
+
+    if (pmu == NULL) {
+	if ((dir = opendir("/sys/bus/event_source/devices")) == NULL)
+	    return 0;
+	while (!found && (entry = readdir(dir)) != NULL)
+	    if (entry->d_name[0] != '.')
+		found = counter_sysfs(entry->d_name, name, c);
+	closedir(dir);
+	return found;
+    }
+    snprintf(filename, sizeof(filename), "/sys/bus/event_source/devices/%s/events/%s", pmu, name);
+    if (!sysfs_read(filename, buf, sizeof(buf)))
+	return 0;
+    snprintf(filename, sizeof(filename), "/sys/bus/event_source/devices/%s/type", pmu);
+    if (!sysfs_read(filename, filename, sizeof(filename)))
+	return 0;
+    c->type = atoi(filename);
+    for (term = buf; term != NULL && *term != 0; term = next) {	/* event=0x17,umask=0x1 */
+	if ((next = strchr(term, ',')) != NULL)
+	    *next++ = 0;
+	if ((value = strchr(term, '=')) != NULL)
+	    *value++ = 0;
+	else
+	    value = "1";	/* a flag like edge */
+	if (!counter_format(pmu, term, strtoull(value, NULL, 0), c)) {
+	    sprintf(errorbuf, "-E %s/%s term %s not understood", pmu, name, term);
+	    nwarning(errorbuf);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* work out the perf type and config of an event, returns 0 if it is not known */
+int counter_parse(char *spec, struct counter *c, int warn)
+{
+    char buf[128];
+    char *name;
+    char *slash;
+    int i;
+
+    memset(c, 0, sizeof(struct counter));
+    strncpy(c->spec, spec, sizeof(c->spec) - 1);
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    if ((name = strchr(buf, '=')) != NULL && strchr(buf, '/') == NULL) {	/* field=event */
+	*name++ = 0;
+	strcpy(c->name, buf);	/* both are sizeof(c->spec) */
+    } else {
+	name = buf;
+    }
+    for (i = 0; counter_generic[i].name != NULL; i++)
+	if (!strcmp(counter_generic[i].name, name))
+	    break;
+    if (counter_generic[i].name != NULL) {
+	c->type = counter_generic[i].type;
+	c->config = counter_generic[i].config;
+    } else if (name[0] == 'r' && isxdigit(name[1]) && strspn(&name[1], "0123456789abcdefABCDEF") == strlen(&name[1])) {
+	c->type = PERF_TYPE_RAW;
+	c->config = strtoull(&name[1], NULL, 16);
+    } else if ((slash = strchr(name, '/')) != NULL) {
+	*slash = 0;
+	if (!counter_sysfs(name, slash + 1, c)) {
+	    if (warn) {
+		sprintf(errorbuf, "-E %s/%s not found in /sys/bus/event_source/devices", name, slash + 1);
+		nwarning(errorbuf);
+	    }
+	    return 0;
+	}
+	*slash = '_';
+    } else if (!counter_sysfs(NULL, name, c)) {
+	if (warn) {
+	    sprintf(errorbuf, "-E %s is not a raw code, generic or /sys/bus/event_source event", name);
+	    nwarning(errorbuf);
+	}
+	return 0;
+    }
+    if (c->name[0] == 0) {	/* field names can not have - */
+	strcpy(c->name, name);	/* a part of buf so it fits */
+	for (i = 0; c->name[i] != 0; i++)
+	    if (!isalnum(c->name[i]))
+		c->name[i] = '_';
+    }
+    return 1;
+}
+
+/* add an event, returns its number or -1 */
+int counter_add(char *spec)
+{
+    int i;
+
+    for (i = 0; i < counters_count; i++)
+	if (!strcmp(counters[i].spec, spec))
+	    return i;
+    if (counters_count >= COUNTERS_MAX) {
+	sprintf(errorbuf, "-E more than %d events, %s ignored", COUNTERS_MAX, spec);
+	nwarning(errorbuf);
+	return -1;
+    }
+    if (!counter_parse(spec, &counters[counters_count], 1))
+	return -1;
+    return counters_count++;
+}
+
+/* the comma separated -E list */
+void counters_option(char *list)
+{
+    char buf[1024];
+    char *spec;
+    char *next;
+
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    for (spec = buf; spec != NULL && *spec != 0; spec = next) {
+	if ((next = strchr(spec, ',')) != NULL)
+	    *next++ = 0;
+	counter_add(spec);
+    }
+}
+
+void counter_cpu_add(int cpu)
+{
+    char filename[256];
+    char buf[64];
+    struct counter_cpu *cc;
+
+    counter_cpus = realloc(counter_cpus, sizeof(struct counter_cpu) * (counter_cpus_count + 1));
+    cc = &counter_cpus[counter_cpus_count++];
+    memset(cc, 0, sizeof(struct counter_cpu));
+    cc->cpu = cpu;
+    snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    if (sysfs_read(filename, buf, sizeof(buf)) && atoi(buf) > 0)
+	cc->socket = atoi(buf);
+    if (cc->socket + 1 > counter_sockets)
+	counter_sockets = cc->socket + 1;
+}
+
+/* events on the same PMU can share a group, the generic and raw ones are all on the CPU's */
+unsigned int counter_pmu(struct counter *c)
+{
+    if (c->type == PERF_TYPE_HARDWARE || c->type == PERF_TYPE_HW_CACHE)
+	return PERF_TYPE_RAW;
+    return c->type;
+}
+
+/* open event j in the group led by group_fd or as a leader if -1 */
+int counter_event_open(struct counter_cpu *cc, int j, int pid, int group_fd, unsigned long flags)
+{
+    struct perf_event_attr pe;
+    int fd;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = counters[j].type;
+    pe.config = counters[j].config;
+    pe.config1 = counters[j].config1;
+    pe.config2 = counters[j].config2;
+    pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    pe.exclude_kernel = 1;	/* allowed with perf_event_paranoid 2 */
+    pe.exclude_hv = 1;
+    fd = perf_event_open(&pe, pid, cc->cpu, group_fd, flags);
+    if (fd == -1 && errno == EINVAL) {	/* some PMUs like msr can not exclude */
+	pe.exclude_kernel = 0;
+	pe.exclude_hv = 0;
+	fd = perf_event_open(&pe, pid, cc->cpu, group_fd, flags);
+    }
+    return fd;
+}
+
+/* open the events as a group per PMU on a CPU, for pid -1 (all) or a cgroup fd with PERF_FLAG_PID_CGROUP,
+ * returns the number that opened */
+int counter_group_open(struct counter_cpu *cc, int pid, unsigned long flags)
+{
+    int opened = 0;
+    int error;
+    int lead;
+    int j;
+    int k;
+
+    cc->leader = -1;
+    for (j = 0; j < counters_count; j++) {
+	cc->group[j] = -1;
+	cc->index[j] = -1;
+	cc->members[j] = 0;
+	lead = -1;		/* the latest group on this PMU */
+	for (k = 0; k < j; k++)
+	    if (cc->group[k] == k && counter_pmu(&counters[k]) == counter_pmu(&counters[j]))
+		lead = k;
+	cc->fd[j] = counter_event_open(cc, j, pid, lead == -1 ? -1 : cc->fd[lead], flags);
+	if (cc->fd[j] == -1 && lead != -1) {	/* the group is full so start another */
+	    error = errno;
+	    if ((cc->fd[j] = counter_event_open(cc, j, pid, -1, flags)) != -1 && !counters[j].alone) {
+		counters[j].alone = 1;
+		sprintf(errorbuf, "-E %s does not fit in a group with %s errno=%d (%s) - counted in a group of its own",
+			counters[j].spec, counters[lead].spec, error, strerror(error));
+		nwarning(errorbuf);
+	    }
+	    lead = -1;
+	}
+	if (cc->fd[j] == -1) {
+	    counters[j].error = errno;
+	    continue;
+	}
+	if (lead == -1)
+	    lead = j;
+	if (cc->leader == -1)
+	    cc->leader = cc->fd[j];
+	cc->group[j] = lead;
+	cc->index[j] = cc->members[lead]++;
+	opened++;
+	if (!counters[j].ok)
+	    counters_ok++;
+	counters[j].ok = 1;
+    }
+    return opened;
+}
+
+/* open each CPU's group, once all the events are added */
+void counters_open()
+{
+    char buf[4096];
+    int i;
+    int j;
+
+    FUNCTION_START;
+    if (counters_opened || counters_count == 0)
+	return;
+    counters_opened = 1;
+    if (!sysfs_read("/sys/devices/system/cpu/online", buf, sizeof(buf)))
+	sprintf(buf, "0-%ld", sysconf(_SC_NPROCESSORS_ONLN) - 1);
+    cpu_list(buf, counter_cpu_add);
+
+    for (i = 0; i < counter_cpus_count; i++)
+	counter_group_open(&counter_cpus[i], -1, 0);
+    for (j = 0; j < counters_count; j++) {
+	if (!counters[j].ok) {
+	    sprintf(errorbuf, "-E %s did not open on any CPU errno=%d (%s)",
+		    counters[j].spec, counters[j].error, strerror(counters[j].error));
+	    nwarning(errorbuf);
+	}
+    }
+}
+
+/* one read() of each of a CPU's groups, returns 0 if they all failed */
+int counter_cpu_read(struct counter_cpu *cc, unsigned long long *value,
+		     unsigned long long *enabled, unsigned long long *running)
+{
+    unsigned long long data[3 + COUNTERS_MAX];	/* nr, time enabled, time running, values */
+    int ok = 0;
+    int j;
+    int k;
+
+    for (j = 0; j < counters_count; j++)
+	value[j] = enabled[j] = running[j] = 0;
+    if (cc->leader == -1)
+	return 0;
+    for (j = 0; j < counters_count; j++) {
+	if (cc->group[j] != j)
+	    continue;		/* not a leader */
+	if (read(cc->fd[j], data, sizeof(unsigned long long) * (3 + cc->members[j])) <= 0)
+	    continue;
+	for (k = j; k < counters_count; k++) {
+	    if (cc->group[k] != j)
+		continue;
+	    value[k] = data[3 + cc->index[k]];
+	    enabled[k] = data[1];
+	    running[k] = data[2];
+	}
+	ok = 1;
+    }
+    return ok;
+}
+
+/* all CPU total of each event since it was opened, scaled for multiplexing (thread safe) */
+void counters_sum(double *total)
+{
+    unsigned long long value[COUNTERS_MAX];
+    unsigned long long enabled[COUNTERS_MAX];
+    unsigned long long running[COUNTERS_MAX];
+    int i;
+    int j;
+
+    for (j = 0; j < counters_count; j++)
+	total[j] = 0.0;
+    for (i = 0; i < counter_cpus_count; i++) {
+	if (!counter_cpu_read(&counter_cpus[i], value, enabled, running))
+	    continue;
+	for (j = 0; j < counters_count; j++)
+	    if (running[j] > 0)
+		total[j] += (double) value[j] * (double) enabled[j] / (double) running[j];
+    }
+}
+
+/* the scaled counts of a CPU's groups since the last call, returns the smallest
+ * fraction of the time a group was counting or -1 if they could not be read */
+double counter_cpu_delta(struct counter_cpu *cc, double *delta)
+{
+    unsigned long long value[COUNTERS_MAX];
+    unsigned long long enabled[COUNTERS_MAX];
+    unsigned long long running[COUNTERS_MAX];
+    double scale;
+    double ran = 1.0;
+    int j;
+
+    if (!counter_cpu_read(cc, value, enabled, running))
+	return -1.0;
+    for (j = 0; j < counters_count; j++) {
+	scale = 0.0;
+	if (running[j] > cc->running[j]) {
+	    scale = (double) (enabled[j] - cc->enabled[j]) / (double) (running[j] - cc->running[j]);
+	    if (1.0 / scale < ran)
+		ran = 1.0 / scale;
+	}
+	delta[j] = (double) (value[j] - cc->value[j]) * scale;
+	cc->value[j] = value[j];
+	cc->enabled[j] = enabled[j];
+	cc->running[j] = running[j];
+    }
+    return ran;
+}
+
+/* the counts in this interval, kept for derived_sample() */
+double counter_total[COUNTERS_MAX];
+double *counter_socket = NULL;
+double *counter_delta = NULL;
+
+void counters_sample()
+{
+    struct counter_cpu *cc;
+    double ran;
+    double running_percent = 100.0;
+    char label[64];
+    int i;
+    int j;
+
+    FUNCTION_START;
+    if (counters_ok == 0)
+	return;
+    if (counter_socket == NULL) {
+	counter_socket = malloc(counter_sockets * COUNTERS_MAX * sizeof(double));
+	counter_delta = malloc(counter_cpus_count * COUNTERS_MAX * sizeof(double));
+    }
+    memset(counter_total, 0, sizeof(counter_total));
+    memset(counter_socket, 0, counter_sockets * COUNTERS_MAX * sizeof(double));
+    memset(counter_delta, 0, counter_cpus_count * COUNTERS_MAX * sizeof(double));
+    for (i = 0; i < counter_cpus_count; i++) {
+	cc = &counter_cpus[i];
+	if ((ran = counter_cpu_delta(cc, &counter_delta[i * COUNTERS_MAX])) < 0.0)
+	    continue;
+	if (ran * 100.0 < running_percent)
+	    running_percent = ran * 100.0;
+	for (j = 0; j < counters_count; j++) {
+	    counter_total[j] += counter_delta[i * COUNTERS_MAX + j];
+	    counter_socket[cc->socket * COUNTERS_MAX + j] += counter_delta[i * COUNTERS_MAX + j];
+	}
+    }
+
+    if (shm_next != NULL) {
+	shm_next->counters = counters_count;
+	for (j = 0; j < counters_count; j++) {
+	    snprintf(shm_next->counter_names[j], sizeof(shm_next->counter_names[j]), "%.*s",
+		     (int) sizeof(shm_next->counter_names[j]) - 1, counters[j].name);	/* cut to fit */
+	    shm_next->total.counters[j] = counter_total[j];
+	    for (i = 0; i < counter_cpus_count; i++)
+		if (counter_cpus[i].cpu < shm_next->cpus_max)
+		    NJMON_SHM_CPU(shm_next, counter_cpus[i].cpu)->counters[j] = counter_delta[i * COUNTERS_MAX + j];
+	}
+    }
+    psection("perf_counters");
+    for (j = 0; j < counters_count; j++)
+	if (counters[j].ok)
+	    plong(counters[j].name, counter_total[j]);
+    pdouble("running_percent", running_percent);	/* lowest, under 100 means multiplexed */
+    psectionend();
+    if (counter_sockets > 1) {
+	psection("perf_sockets");
+	for (i = 0; i < counter_sockets; i++) {
+	    sprintf(label, "socket%d", i);
+	    psub(label);
+	    for (j = 0; j < counters_count; j++)
+		if (counters[j].ok)
+		    plong(counters[j].name, counter_socket[i * COUNTERS_MAX + j]);
+	    psubend();
+	}
+	psectionend();
+    }
+    psection("perf_cpus");
+    for (i = 0; i < counter_cpus_count; i++) {
+	if (counter_cpus[i].leader == -1)
+	    continue;
+	sprintf(label, "cpu%d", counter_cpus[i].cpu);
+	psub(label);
+	for (j = 0; j < counters_count; j++)
+	    if (counter_cpus[i].index[j] != -1)
+		plong(counters[j].name, counter_delta[i * COUNTERS_MAX + j]);
+	psubend();
+    }
+    psectionend();
+}
+
+void counter_group_close(struct counter_cpu *cc)
+{
+    int j;
+
+    for (j = 0; j < counters_count; j++)
+	if (cc->fd[j] != -1)
+	    close(cc->fd[j]);
+}
+
+void counters_close()
+{
+    int i;
+
+    for (i = 0; i < counter_cpus_count; i++)
+	counter_group_close(&counter_cpus[i]);
+}
+
+/* - - - - - uncore memory bandwidth - - - - */
+/*
+ * The refill estimate in perf_derived misses the prefetchers and DMA, so the memory controller
+ * and interconnect PMUs in /sys/bus/event_source/devices are looked for at start up:
+ *    uncore_imc_free_running_N   data_read, data_write     Intel server memory controllers
+ *    uncore_imc_N                cas_count_read, write     Intel memory channels
+ *    arm_cmn_N                   hnf_mc_reqs               Arm CMN requests to memory (reads + writes)
+ *    arm_dsu_N                   bus_access                Arm DSU cluster bus accesses (reads + writes)
+ * Each is opened on the CPUs in its cpumask (one per socket or cluster) and perf_uncore has a
+ * sub per PMU and CPU with the bytes this interval and the MB/s, perf_uncore_sockets adds them
+ * up per socket and perf_derived mem_mbps is then this measured number (mem_source "uncore")
+ * instead of the refill estimate (mem_source "refills"). Counts are turned in to bytes with the
+ * event's .scale and .unit files or taken as 64 byte lines. Opening uncore PMUs needs root,
+ * CAP_PERFMON or perf_event_paranoid 0, without that there are no uncore sections and no
+ * warnings. NJMON_UNCORE=0 switches it off.
+ */
+#define UNCORE_READ 0		/* or all traffic if there is no write event */
+#define UNCORE_WRITE 1
+
+struct {
+    char *prefix;
+    char *event[2];		/* read (or both) and write */
+} uncore_kinds[] = {
+    { "uncore_imc_free_running", { "data_read", "data_write" } },
+    { "uncore_imc", { "cas_count_read", "cas_count_write" } },
+    { "arm_cmn", { "hnf_mc_reqs", NULL } },
+    { "arm_dsu", { "bus_access", NULL } },
+    { NULL, { NULL, NULL } }
+};
+
+struct uncore {
+    char name[64];		/* socket0_uncore_imc_0 */
+    char pmu[64];
+    int cpu;
+    int socket;
+    int fd[2];			/* -1 if not open */
+    double bytes_per_count[2];
+    unsigned long long value[2];	/* at the previous sample */
+    unsigned long long enabled[2];
+    unsigned long long running[2];
+    int seeded[2];		/* value is from a read */
+    double bytes[2];		/* this interval */
+};
+
+struct uncore *uncores = NULL;
+int uncores_count = 0;
+int uncore_sockets = 0;
+double *uncore_socket_bytes = NULL;	/* per socket read and write */
+double uncore_total_bytes;
+int uncore_split = 0;		/* some have read and write events */
+int uncore_kind;		/* for uncore_cpu() */
+char *uncore_pmu;
+
+/* bytes per count from the event's .scale and .unit, like 6.103515625e-5 and MiB */
+double uncore_scale(char *pmu, char *event)
+{
+    char filename[512];
+    char buf[64];
+    double scale;
+
+    snprintf(filename, sizeof(filename), "/sys/bus/event_source/devices/%s/events/%s.scale", pmu, event);
+    if (!sysfs_read(filename, buf, sizeof(buf)) || (scale = atof(buf)) <= 0.0)
+	return 64.0;
+    snprintf(filename, sizeof(filename), "/sys/bus/event_source/devices/%s/events/%s.unit", pmu, event);
+    if (!sysfs_read(filename, buf, sizeof(buf)))
+	return scale;
+    if (!strcmp(buf, "MiB"))
+	return scale * 1024.0 * 1024.0;
+    if (!strcmp(buf, "KiB"))
+	return scale * 1024.0;
+    return scale;
+}
+
+/* the events of uncore_kind on one CPU of the PMU's cpumask */
+void uncore_cpu(int cpu)
+{
+    struct perf_event_attr pe;
+    struct counter c;
+    struct uncore *u;
+    char filename[256];
+    char buf[64];
+    int k;
+
+    uncores = realloc(uncores, sizeof(struct uncore) * (uncores_count + 1));
+    u = &uncores[uncores_count];
+    memset(u, 0, sizeof(struct uncore));
+    u->cpu = cpu;
+    snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    if (sysfs_read(filename, buf, sizeof(buf)) && atoi(buf) > 0)
+	u->socket = atoi(buf);
+    strncpy(u->pmu, uncore_pmu, sizeof(u->pmu) - 1);
+    snprintf(u->name, sizeof(u->name), "socket%d_%s", u->socket, uncore_pmu);
+    for (k = 0; k < 2; k++) {
+	u->fd[k] = -1;
+	if (uncore_kinds[uncore_kind].event[k] == NULL)
+	    continue;
+	memset(&c, 0, sizeof(c));
+	if (!counter_sysfs(uncore_pmu, uncore_kinds[uncore_kind].event[k], &c))
+	    continue;
+	memset(&pe, 0, sizeof(pe));
+	pe.size = sizeof(pe);
+	pe.type = c.type;
+	pe.config = c.config;
+	pe.config1 = c.config1;
+	pe.config2 = c.config2;
+	pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	if ((u->fd[k] = perf_event_open(&pe, -1, cpu, -1, 0)) == -1) {
+	    DEBUG fprintf(stderr, "uncore %s/%s cpu %d errno=%d\n", uncore_pmu, uncore_kinds[uncore_kind].event[k], cpu, errno);
+	    continue;
+	}
+	u->bytes_per_count[k] = uncore_scale(uncore_pmu, uncore_kinds[uncore_kind].event[k]);
+    }
+    if (u->fd[UNCORE_READ] == -1 && u->fd[UNCORE_WRITE] == -1)
+	return;		/* not kept */
+    if (u->fd[UNCORE_WRITE] != -1)
+	uncore_split = 1;
+    if (u->socket + 1 > uncore_sockets)
+	uncore_sockets = u->socket + 1;
+    uncores_count++;
+}
+
+/* the bytes of one event since the last read in to u->bytes[k], 0 the first time */
+void uncore_read(struct uncore *u, int k)
+{
+    unsigned long long data[3];	/* value, time enabled, time running */
+    double scale;
+
+    u->bytes[k] = 0.0;
+    if (u->fd[k] == -1 || read(u->fd[k], data, sizeof(data)) != sizeof(data))
+	return;
+    scale = 1.0;		/* shared with other perf users */
+    if (data[2] > u->running[k])
+	scale = (double) (data[1] - u->enabled[k]) / (double) (data[2] - u->running[k]);
+    if (u->seeded[k])
+	u->bytes[k] = (double) (data[0] - u->value[k]) * scale * u->bytes_per_count[k];
+    u->value[k] = data[0];
+    u->enabled[k] = data[1];
+    u->running[k] = data[2];
+    u->seeded[k] = 1;
+}
+
+void uncore_open()
+{
+    struct dirent *entry;
+    DIR *dir;
+    char filename[512];
+    char buf[4096];
+    char *s;
+    int len;
+    int i;
+    int k;
+
+    FUNCTION_START;
+    if ((s = getenv("NJMON_UNCORE")) != NULL && atoi(s) == 0)
+	return;
+    if ((dir = opendir("/sys/bus/event_source/devices")) == NULL)
+	return;
+    while ((entry = readdir(dir)) != NULL) {
+	for (i = 0; uncore_kinds[i].prefix != NULL; i++) {	/* uncore_imc_3 but not uncore_imc_free_running_0 */
+	    len = strlen(uncore_kinds[i].prefix);
+	    if (!strncmp(entry->d_name, uncore_kinds[i].prefix, len)
+		&& (entry->d_name[len] == 0 || (entry->d_name[len] == '_' && isdigit(entry->d_name[len + 1]))))
+		break;
+	}
+	if (uncore_kinds[i].prefix == NULL)
+	    continue;
+	snprintf(filename, sizeof(filename), "/sys/bus/event_source/devices/%s/cpumask", entry->d_name);
+	if (!sysfs_read(filename, buf, sizeof(buf)))
+	    strcpy(buf, "0");
+	uncore_kind = i;
+	uncore_pmu = entry->d_name;
+	cpu_list(buf, uncore_cpu);
+    }
+    closedir(dir);
+    if (uncores_count == 0)
+	return;
+    uncore_socket_bytes = malloc(sizeof(double) * 2 * uncore_sockets);
+    for (i = 0; i < uncores_count; i++)	/* seed so the first sample has a real interval */
+	for (k = 0; k < 2; k++)
+	    uncore_read(&uncores[i], k);
+}
+
+/* measured MB/s of a socket, or all of them with -1, or -1.0 if there are no uncore PMUs */
+double uncore_mbps(int socket, double elapsed)
+{
+    if (uncores_count == 0 || socket >= uncore_sockets)
+	return -1.0;
+    if (socket == -1)
+	return uncore_total_bytes / elapsed / 1024.0 / 1024.0;
+    return (uncore_socket_bytes[socket * 2 + UNCORE_READ] + uncore_socket_bytes[socket * 2 + UNCORE_WRITE]) / elapsed / 1024.0 / 1024.0;
+}
+
+void uncore_sample(double elapsed)
+{
+    struct uncore *u;
+    char label[64];
+    int i;
+    int k;
+
+    FUNCTION_START;
+    if (uncores_count == 0)
+	return;
+    memset(uncore_socket_bytes, 0, sizeof(double) * 2 * uncore_sockets);
+    uncore_total_bytes = 0.0;
+    psection("perf_uncore");
+    for (i = 0; i < uncores_count; i++) {
+	u = &uncores[i];
+	for (k = 0; k < 2; k++) {
+	    uncore_read(u, k);
+	    uncore_socket_bytes[u->socket * 2 + k] += u->bytes[k];
+	    uncore_total_bytes += u->bytes[k];
+	}
+	psub(u->name);
+	plong("cpu", u->cpu);
+	plong("socket", u->socket);
+	if (u->fd[UNCORE_WRITE] != -1) {
+	    plong("read_bytes", u->bytes[UNCORE_READ]);
+	    plong("write_bytes", u->bytes[UNCORE_WRITE]);
+	    pdouble("read_mbps", u->bytes[UNCORE_READ] / elapsed / 1024.0 / 1024.0);
+	    pdouble("write_mbps", u->bytes[UNCORE_WRITE] / elapsed / 1024.0 / 1024.0);
+	}
+	plong("bytes", u->bytes[UNCORE_READ] + u->bytes[UNCORE_WRITE]);
+	pdouble("mbps", (u->bytes[UNCORE_READ] + u->bytes[UNCORE_WRITE]) / elapsed / 1024.0 / 1024.0);
+	psubend();
+    }
+    psectionend();
+
+    psection("perf_uncore_sockets");
+    for (i = 0; i < uncore_sockets; i++) {
+	sprintf(label, "socket%d", i);
+	psub(label);
+	if (uncore_split) {
+	    pdouble("read_mbps", uncore_socket_bytes[i * 2 + UNCORE_READ] / elapsed / 1024.0 / 1024.0);
+	    pdouble("write_mbps", uncore_socket_bytes[i * 2 + UNCORE_WRITE] / elapsed / 1024.0 / 1024.0);
+	}
+	pdouble("mbps", uncore_mbps(i, elapsed));
+	psubend();
+    }
+    psectionend();
+}
+
+void uncore_close()
+{
+    int i;
+    int k;
+
+    for (i = 0; i < uncores_count; i++)
+	for (k = 0; k < 2; k++)
+	    if (uncores[i].fd[k] != -1)
+		close(uncores[i].fd[k]);
+}
+
+/* - - - - - derived memory bandwidth and interference - - - - */
+/*
+ * Turns the interval's counts in to rates so the scheduler reading njmon does not need to
+ * know the cache line size or the interval. The counters are picked out by their event or
+ * by giving them one of these field names with -E:
+ *    cycles        cycles, r11 on aarch64
+ *    instructions  instructions, r8 on aarch64
+ *    refills       cache-misses, r17 (L2D_CACHE_REFILL) on aarch64 - refill=r17 is the default
+ *    stalls        stalled-cycles-backend, r24 (STALL_BACKEND) on aarch64
+ * mem_mbps = refills x line size / elapsed, an estimate as not every refill is from memory and
+ * prefetches are not all counted, for all CPUs and sockets it is the measured uncore number
+ * when there are uncore PMUs. ipc, stall_percent and mpki (refills per 1000 instructions)
+ * need the events they are made from.
+ * The interference_score compares a socket's CPI and MPKI with a baseline: 1.0 is the same as
+ * the baseline and 1.5 means 50% worse. The baseline is only learned from quiet samples, when
+ * cpu_total is under NJMON_BASELINE_BUSY (default 10) percent busy, so a restart on a loaded
+ * node does not learn the load. It is the mean of the first NJMON_BASELINE_SAMPLES (default 10)
+ * quiet samples and then moved slowly by later quiet ones. Until then baseline_ready is 0 and
+ * there is no interference_score.
+ */
+#define DERIVED_CYCLES 0
+#define DERIVED_INSTRUCTIONS 1
+#define DERIVED_REFILLS 2
+#define DERIVED_STALLS 3
+#define DERIVED_ROLES 4
+
+struct derived_baseline {
+    long samples;
+    double cpi;
+    double mpki;
+};
+
+int derived_index[DERIVED_ROLES] = { -1, -1, -1, -1 };
+long derived_line_size = 64;
+long derived_baseline_samples = 10;
+double derived_baseline_busy = 10.0;	/* NJMON_BASELINE_BUSY */
+double derived_busy = -1.0;	/* cpu_total busy percent from proc_stat(), -1 until known */
+struct derived_baseline *derived_baselines = NULL;	/* per socket then one for the total */
+int derived_found = 0;
+
+int derived_role(struct counter *c)
+{
+    if (!strcmp(c->name, "cycles"))
+	return DERIVED_CYCLES;
+    if (!strcmp(c->name, "instructions"))
+	return DERIVED_INSTRUCTIONS;
+    if (!strcmp(c->name, "refills") || !strcmp(c->name, "refill"))
+	return DERIVED_REFILLS;
+    if (!strcmp(c->name, "stalls"))
+	return DERIVED_STALLS;
+    if (c->type == PERF_TYPE_HARDWARE) {
+	switch (c->config) {
+	case PERF_COUNT_HW_CPU_CYCLES:
+	    return DERIVED_CYCLES;
+	case PERF_COUNT_HW_INSTRUCTIONS:
+	    return DERIVED_INSTRUCTIONS;
+	case PERF_COUNT_HW_CACHE_MISSES:
+	    return DERIVED_REFILLS;
+	case PERF_COUNT_HW_STALLED_CYCLES_BACKEND:
+	    return DERIVED_STALLS;
+	}
+    }
+#if defined(__aarch64__)
+    if (c->type == PERF_TYPE_RAW) {
+	switch (c->config) {
+	case 0x11:
+	    return DERIVED_CYCLES;
+	case 0x08:
+	    return DERIVED_INSTRUCTIONS;
+	case 0x17:
+	    return DERIVED_REFILLS;
+	case 0x24:
+	    return DERIVED_STALLS;
+	}
+    }
+#endif
+    return -1;
+}
+
+void derived_init()
+{
+    char buf[64];
+    char *s;
+    int role;
+    int j;
+
+    derived_found = 1;
+    for (j = 0; j < counters_count; j++)
+	if (counters[j].ok && (role = derived_role(&counters[j])) != -1 && derived_index[role] == -1)
+	    derived_index[role] = j;
+    if (sysfs_read("/sys/devices/system/cpu/cpu0/cache/index0/coherency_line_size", buf, sizeof(buf)) && atol(buf) > 0)
+	derived_line_size = atol(buf);
+    if ((s = getenv("NJMON_BASELINE_SAMPLES")) != 0 && atol(s) > 0)
+	derived_baseline_samples = atol(s);
+    if ((s = getenv("NJMON_BASELINE_BUSY")) != 0 && atof(s) > 0.0)
+	derived_baseline_busy = atof(s);
+    derived_baselines = calloc(counter_sockets + 1, sizeof(struct derived_baseline));
+}
+
+/* the rates from one set of counts, per CPU, per socket or all of them, measured_mbps is from
+ * the uncore PMUs or -1.0 */
+void derived_rates(double *delta, double elapsed, double measured_mbps)
+{
+    double cycles = derived_index[DERIVED_CYCLES] == -1 ? 0.0 : delta[derived_index[DERIVED_CYCLES]];
+    double instructions = derived_index[DERIVED_INSTRUCTIONS] == -1 ? 0.0 : delta[derived_index[DERIVED_INSTRUCTIONS]];
+
+    if (measured_mbps >= 0.0)
+	pdouble("mem_mbps", measured_mbps);
+    if (derived_index[DERIVED_REFILLS] != -1) {
+	if (measured_mbps < 0.0)
+	    pdouble("mem_mbps", delta[derived_index[DERIVED_REFILLS]] * derived_line_size / elapsed / 1024.0 / 1024.0);
+	if (instructions > 0.0)
+	    pdouble("mpki", delta[derived_index[DERIVED_REFILLS]] * 1000.0 / instructions);
+    }
+    if (cycles > 0.0) {
+	if (derived_index[DERIVED_INSTRUCTIONS] != -1)
+	    pdouble("ipc", instructions / cycles);
+	if (derived_index[DERIVED_STALLS] != -1)
+	    pdouble("stall_percent", delta[derived_index[DERIVED_STALLS]] * 100.0 / cycles);
+    }
+}
+
+/* interference_score against the baseline and learn the baseline when it is quiet */
+void derived_interference(double *delta, struct derived_baseline *b)
+{
+    double cpi = 0.0;
+    double mpki = 0.0;
+    double score = 0.0;
+    int quiet = derived_busy >= 0.0 && derived_busy < derived_baseline_busy;
+    int parts = 0;
+
+    if (derived_index[DERIVED_INSTRUCTIONS] == -1 || delta[derived_index[DERIVED_INSTRUCTIONS]] <= 0.0)
+	return;
+    if (derived_index[DERIVED_CYCLES] != -1)
+	cpi = delta[derived_index[DERIVED_CYCLES]] / delta[derived_index[DERIVED_INSTRUCTIONS]];
+    if (derived_index[DERIVED_REFILLS] != -1)
+	mpki = delta[derived_index[DERIVED_REFILLS]] * 1000.0 / delta[derived_index[DERIVED_INSTRUCTIONS]];
+    if (cpi == 0.0 && mpki == 0.0)
+	return;
+    if (b->samples < derived_baseline_samples) {	/* still learning */
+	if (quiet) {
+	    b->cpi = (b->cpi * b->samples + cpi) / (b->samples + 1);
+	    b->mpki = (b->mpki * b->samples + mpki) / (b->samples + 1);
+	    b->samples++;
+	}
+	plong("baseline_ready", 0);
+    } else {
+	if (b->cpi > 0.0) {
+	    score += cpi / b->cpi;
+	    parts++;
+	}
+	if (b->mpki > 0.0) {
+	    score += mpki / b->mpki;
+	    parts++;
+	}
+	if (quiet) {		/* nothing else much running so follow it */
+	    b->cpi = b->cpi * 0.95 + cpi * 0.05;
+	    b->mpki = b->mpki * 0.95 + mpki * 0.05;
+	}
+	plong("baseline_ready", 1);
+	if (parts)
+	    pdouble("interference_score", score / parts);
+    }
+    pdouble("baseline_cpi", b->cpi);
+    pdouble("baseline_mpki", b->mpki);
+    plong("baseline_samples", b->samples);
+}
+
+void derived_sample(double elapsed)
+{
+    char label[64];
+    int i;
+
+    FUNCTION_START;
+    if (!derived_found)
+	derived_init();
+    if (derived_index[DERIVED_CYCLES] == -1 && derived_index[DERIVED_REFILLS] == -1)
+	return;
+    psection("perf_derived");
+    plong("line_size", derived_line_size);
+    pstring("mem_source", uncores_count ? "uncore" : "refills");
+    derived_rates(counter_total, elapsed, uncore_mbps(-1, elapsed));
+    derived_interference(counter_total, &derived_baselines[counter_sockets]);
+    psectionend();
+
+    psection("perf_derived_sockets");
+    for (i = 0; i < counter_sockets; i++) {
+	sprintf(label, "socket%d", i);
+	psub(label);
+	derived_rates(&counter_socket[i * COUNTERS_MAX], elapsed, uncore_mbps(i, elapsed));
+	derived_interference(&counter_socket[i * COUNTERS_MAX], &derived_baselines[i]);
+	psubend();
+    }
+    psectionend();
+
+    psection("perf_derived_cpus");
+    for (i = 0; i < counter_cpus_count; i++) {
+	if (counter_cpus[i].leader == -1)
+	    continue;
+	sprintf(label, "cpu%d", counter_cpus[i].cpu);
+	psub(label);
+	derived_rates(&counter_delta[i * COUNTERS_MAX], elapsed, -1.0);
+	psubend();
+    }
+    psectionend();
+}
+
+/* - - - - - kubernetes pods - - - - */
+/*
+ * Pods are found from the cgroup v2 directories kubelet makes, with either cgroup driver:
+ *    kubepods.slice/kubepods-burstable.slice/kubepods-burstable-pod<uid>.slice   systemd
+ *    kubepods/burstable/pod<uid>                                                 cgroupfs
+ * Guaranteed pods are straight under kubepods. After one scan the kubepods, QoS and pod
+ * directories are watched with inotify so new pods and containers are picked up and deleted
+ * ones dropped without scanning again. If the kernel drops events every pod's containers are
+ * scanned again along with the pods, as any of them may have changed. NJMON_CGROUP_ROOT
+ * overrides the cgroup2 mount point found in /proc/mounts.
+ * -G sends each pod's and container's cpu.stat, memory.current, memory.stat, io.stat (added up
+ * over the devices) and cpu, memory and io pressure, read with openat() from the directory
+ * fds kept open, in pods and pod_containers.
+ * -g counts the perf events per pod: a group per pod per CPU opened on the cgroup with
+ * PERF_FLAG_PID_CGROUP so the counts are only while that pod's tasks are on the CPU.
+ * That is pods x CPUs x events fds so the open file limit is raised to its hard maximum.
+ */
+struct cgroup_previous {
+    long long usage_usec;
+    long long nr_periods;
+    long long nr_throttled;
+    int valid;
+};
+
+#define PSI_TRIGGERS_MAX 8	/* -Y, see pressure stall information */
+
+struct pod_container {
+    char id[80];
+    int seen;			/* found in this scan */
+    int dirfd;
+    struct cgroup_previous previous;
+};
+
+struct pod {
+    char uid[128];
+    char qos[16];
+    char path[1024];
+    int seen;			/* found in this scan */
+    int dirfd;			/* kept open for the -G stats files */
+    int wd;			/* inotify watch for its containers */
+    struct pod_container *containers;
+    int containers_count;
+    struct cgroup_previous previous;
+    struct counter_cpu *cpus;	/* -g per CPU groups */
+    int psi_fds[PSI_TRIGGERS_MAX];	/* -Y triggers, -1 if not accepted */
+    int psi_opened;
+};
+
+/* the kubepods and QoS directories watched for pods coming and going */
+struct pod_watch {
+    int wd;
+    char path[1024];
+    char qos[16];
+};
+
+struct pod *pods = NULL;
+int pods_count = 0;
+char cgroup_root[512] = "";
+int pod_counters = 0;		/* -g */
+int pod_stats = 0;		/* -G */
+int pods_inotify = -1;
+struct pod_watch *pod_watches = NULL;
+int pod_watches_count = 0;
+
+void cgroup_root_find()
+{
+    FILE *fp;
+    char buf[1024];
+    char dev[256];
+    char dir[512];
+    char type[64];
+    char *s;
+
+    if ((s = getenv("NJMON_CGROUP_ROOT")) != 0) {
+	strncpy(cgroup_root, s, sizeof(cgroup_root) - 1);
+	return;
+    }
+    strcpy(cgroup_root, "/sys/fs/cgroup");
+    if ((fp = fopen("/proc/mounts", "r")) == NULL)
+	return;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	if (sscanf(buf, "%255s %511s %63s", dev, dir, type) == 3 && !strcmp(type, "cgroup2")) {
+	    strcpy(cgroup_root, dir);
+	    break;
+	}
+    }
+    fclose(fp);
+}
+
+/* the uid from kubepods-burstable-pod<uid>.slice or pod<uid>, returns 0 if not a pod.
+ * systemd slice names have _ for the - of the kubernetes uid so both drivers give the same uid */
+int pod_uid(char *name, char *uid, int size)
+{
+    char *p;
+    int i;
+
+    if (!strncmp(name, "pod", 3))
+	p = name + 3;
+    else if ((p = strstr(name, "-pod")) != NULL)
+	p += 4;
+    else
+	return 0;
+    for (i = 0; *p != 0 && *p != '.' && i < size - 1; i++, p++)
+	uid[i] = *p == '_' ? '-' : *p;
+    uid[i] = 0;
+    return i > 0;
+}
+
+void pod_watch_add(char *path, char *qos)
+{
+    int wd;
+    int i;
+
+    if (pods_inotify == -1 || (wd = inotify_add_watch(pods_inotify, path, IN_CREATE | IN_DELETE | IN_ONLYDIR)) == -1)
+	return;
+    for (i = 0; i < pod_watches_count; i++)
+	if (pod_watches[i].wd == wd)
+	    return;
+    pod_watches = realloc(pod_watches, sizeof(struct pod_watch) * (pod_watches_count + 1));
+    pod_watches[pod_watches_count].wd = wd;
+    strncpy(pod_watches[pod_watches_count].path, path, sizeof(pod_watches[0].path) - 1);
+    pod_watches[pod_watches_count].path[sizeof(pod_watches[0].path) - 1] = 0;
+    strncpy(pod_watches[pod_watches_count].qos, qos, sizeof(pod_watches[0].qos) - 1);
+    pod_watches[pod_watches_count].qos[sizeof(pod_watches[0].qos) - 1] = 0;
+    pod_watches_count++;
+}
+
+/* the container id from cri-containerd-<id>.scope, crio-<id>.scope, docker-<id>.scope or <id> */
+void container_id(char *name, char *id, int size)
+{
+    char *p;
+    int i;
+
+    if ((p = strrchr(name, '-')) != NULL)
+	name = p + 1;
+    for (i = 0; name[i] != 0 && name[i] != '.' && i < size - 1; i++)
+	id[i] = name[i];
+    id[i] = 0;
+}
+
+void container_found(struct pod *pod, char *name)
+{
+    struct pod_container *c;
+    char id[80];
+    int fd;
+    int i;
+
+    container_id(name, id, sizeof(id));
+    for (i = 0; i < pod->containers_count; i++) {
+	if (!strcmp(pod->containers[i].id, id)) {
+	    pod->containers[i].seen = 1;
+	    return;
+	}
+    }
+    if ((fd = openat(pod->dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	return;
+    pod->containers = realloc(pod->containers, sizeof(struct pod_container) * (pod->containers_count + 1));
+    c = &pod->containers[pod->containers_count++];
+    memset(c, 0, sizeof(struct pod_container));
+    strcpy(c->id, id);
+    c->seen = 1;
+    c->dirfd = fd;
+    DEBUG fprintf(stderr, "container_found(%s,%s)\n", pod->uid, id);
+}
+
+void container_gone(struct pod *pod, char *name)
+{
+    char id[80];
+    int i;
+
+    container_id(name, id, sizeof(id));
+    for (i = 0; i < pod->containers_count; i++) {
+	if (!strcmp(pod->containers[i].id, id)) {
+	    DEBUG fprintf(stderr, "container_gone(%s,%s)\n", pod->uid, id);
+	    close(pod->containers[i].dirfd);
+	    memmove(&pod->containers[i], &pod->containers[i + 1],
+		    sizeof(struct pod_container) * (pod->containers_count - i - 1));
+	    pod->containers_count--;
+	    return;
+	}
+    }
+}
+
+void pod_gone(struct pod *pod)
+{
+    int i;
+
+    DEBUG fprintf(stderr, "pod_gone(%s)\n", pod->uid);
+    if (pod->cpus != NULL) {
+	for (i = 0; i < counter_cpus_count; i++)
+	    counter_group_close(&pod->cpus[i]);
+	free(pod->cpus);
+    }
+    for (i = 0; i < pod->containers_count; i++)
+	close(pod->containers[i].dirfd);
+    free(pod->containers);
+    for (i = 0; pod->psi_opened && i < PSI_TRIGGERS_MAX; i++)
+	if (pod->psi_fds[i] != -1)
+	    close(pod->psi_fds[i]);
+    close(pod->dirfd);		/* the watch went with the directory */
+}
+
+void pod_remove(char *uid)
+{
+    int i;
+
+    for (i = 0; i < pods_count; i++) {
+	if (!strcmp(pods[i].uid, uid)) {
+	    pod_gone(&pods[i]);
+	    memmove(&pods[i], &pods[i + 1], sizeof(struct pod) * (pods_count - i - 1));
+	    pods_count--;
+	    return;
+	}
+    }
+}
+
+/* find the pod's containers, dropping the ones that have gone */
+void pod_containers_scan(struct pod *pod)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int i;
+
+    for (i = 0; i < pod->containers_count; i++)
+	pod->containers[i].seen = 0;
+    if ((dir = fdopendir(dup(pod->dirfd))) != NULL) {
+	rewinddir(dir);		/* the dup shares the offset of the last scan */
+	while ((entry = readdir(dir)) != NULL)
+	    if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+		container_found(pod, entry->d_name);
+	closedir(dir);
+    }
+    for (i = 0; i < pod->containers_count; i++) {
+	if (!pod->containers[i].seen) {
+	    DEBUG fprintf(stderr, "container_gone(%s,%s)\n", pod->uid, pod->containers[i].id);
+	    close(pod->containers[i].dirfd);
+	    memmove(&pod->containers[i], &pod->containers[i + 1],
+		    sizeof(struct pod_container) * (pod->containers_count - i - 1));
+	    pod->containers_count--;
+	    i--;
+	}
+    }
+}
+
+void pod_found(char *path, char *uid, char *qos)
+{
+    struct pod *pod;
+    struct stat now;
+    struct stat was;
+    int fd;
+    int i;
+
+    for (i = 0; i < pods_count; i++) {
+	if (strcmp(pods[i].uid, uid))
+	    continue;
+	if (stat(path, &now) == 0 && fstat(pods[i].dirfd, &was) == 0 && now.st_ino == was.st_ino) {
+	    pods[i].seen = 1;	/* a rescan after lost events so its containers may have changed */
+	    pod_containers_scan(&pods[i]);
+	    return;
+	}
+	pod_remove(uid);	/* made again under the same name */
+	break;
+    }
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	return;
+    pods = realloc(pods, sizeof(struct pod) * (pods_count + 1));
+    pod = &pods[pods_count++];
+    memset(pod, 0, sizeof(struct pod));
+    strncpy(pod->uid, uid, sizeof(pod->uid) - 1);
+    strncpy(pod->qos, qos, sizeof(pod->qos) - 1);
+    strncpy(pod->path, path, sizeof(pod->path) - 1);
+    pod->seen = 1;
+    pod->dirfd = fd;
+    pod->wd = -1;
+    if (pods_inotify != -1)	/* watch before looking so no container is missed */
+	pod->wd = inotify_add_watch(pods_inotify, path, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+    pod_containers_scan(pod);
+    DEBUG fprintf(stderr, "pod_found(%s,%s,%s)\n", path, uid, qos);
+}
+
+void pods_dir(char *path, char *qos)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char full[1024];
+    char uid[128];
+
+    pod_watch_add(path, qos);
+    if ((dir = opendir(path)) == NULL)
+	return;
+    while ((entry = readdir(dir)) != NULL) {
+	if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+	    continue;
+	snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+	if (pod_uid(entry->d_name, uid, sizeof(uid)))
+	    pod_found(full, uid, qos);
+	else if (!strcmp(qos, "guaranteed") && strstr(entry->d_name, "burstable"))
+	    pods_dir(full, "burstable");
+	else if (!strcmp(qos, "guaranteed") && strstr(entry->d_name, "besteffort"))
+	    pods_dir(full, "besteffort");
+    }
+    closedir(dir);
+}
+
+void pods_scan()
+{
+    char path[1024];
+    int i;
+
+    FUNCTION_START;
+    if (cgroup_root[0] == 0)
+	cgroup_root_find();
+    for (i = 0; i < pods_count; i++)
+	pods[i].seen = 0;
+    snprintf(path, sizeof(path), "%s/kubepods.slice", cgroup_root);
+    if (access(path, R_OK) != 0)
+	snprintf(path, sizeof(path), "%s/kubepods", cgroup_root);
+    pods_dir(path, "guaranteed");
+    for (i = 0; i < pods_count; i++) {
+	if (!pods[i].seen) {
+	    pod_gone(&pods[i]);
+	    memmove(&pods[i], &pods[i + 1], sizeof(struct pod) * (pods_count - i - 1));
+	    pods_count--;
+	    i--;
+	}
+    }
+}
+
+/* pods that came or went since the last sample from the inotify events, with a full scan
+ * the first time or if the kernel dropped events */
+void pods_event(struct inotify_event *event)
+{
+    char full[1024 + 256];
+    char uid[128];
+    int i;
+
+    for (i = 0; i < pod_watches_count; i++) {
+	if (pod_watches[i].wd != event->wd)
+	    continue;
+	snprintf(full, sizeof(full), "%s/%s", pod_watches[i].path, event->name);
+	if (pod_uid(event->name, uid, sizeof(uid))) {
+	    if (event->mask & IN_CREATE)
+		pod_found(full, uid, pod_watches[i].qos);
+	    else
+		pod_remove(uid);
+	} else if ((event->mask & IN_CREATE) && !strcmp(pod_watches[i].qos, "guaranteed")) {
+	    if (strstr(event->name, "burstable"))
+		pods_dir(full, "burstable");
+	    else if (strstr(event->name, "besteffort"))
+		pods_dir(full, "besteffort");
+	}
+	return;
+    }
+    for (i = 0; i < pods_count; i++) {
+	if (pods[i].wd != event->wd)
+	    continue;
+	if (event->mask & IN_CREATE)
+	    container_found(&pods[i], event->name);
+	else
+	    container_gone(&pods[i], event->name);
+	return;
+    }
+}
+
+void pods_update()
+{
+    char buf[1024 * 16] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    char *p;
+    int len;
+    int rescan = 0;
+
+    FUNCTION_START;
+    if (cgroup_root[0] == 0) {	/* first time */
+	cgroup_root_find();
+	pods_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	pods_scan();
+	return;
+    }
+    if (pods_inotify == -1) {
+	pods_scan();
+	return;
+    }
+    while ((len = read(pods_inotify, buf, sizeof(buf))) > 0) {
+	for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+	    event = (struct inotify_event *) p;
+	    if (event->mask & IN_Q_OVERFLOW)
+		rescan = 1;
+	    else if ((event->mask & IN_ISDIR) && event->len > 0)
+		pods_event(event);
+	}
+    }
+    if (rescan)
+	pods_scan();
+}
+
+/* the events counted per pod, -E or these */
+void pod_counters_events(int events_set)
+{
+    struct rlimit limit;
+
+    if (!events_set) {
+	counter_add("cycles");
+	counter_add("instructions");
+	counter_add("llc_misses=cache-misses");
+#if defined(__aarch64__)
+	counter_add("l2_refill=r17");	/* L2D_CACHE_REFILL */
+	counter_add("mem_access=r13");	/* MEM_ACCESS */
+#endif
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void pod_counters_open(struct pod *pod)
+{
+    int fd;
+    int i;
+    int ok = 0;
+
+    if ((fd = open(pod->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	return;
+    pod->cpus = calloc(counter_cpus_count, sizeof(struct counter_cpu));
+    for (i = 0; i < counter_cpus_count; i++) {
+	pod->cpus[i].cpu = counter_cpus[i].cpu;
+	pod->cpus[i].socket = counter_cpus[i].socket;
+	ok += counter_group_open(&pod->cpus[i], fd, PERF_FLAG_PID_CGROUP);
+    }
+    close(fd);			/* the events hold on to the cgroup */
+    if (ok == 0) {
+	sprintf(errorbuf, "-g no counters for pod %s errno=%d (%s)", pod->uid, errno, strerror(errno));
+	nwarning(errorbuf);
+    }
+}
+
+/* -g the counts per pod in this interval */
+void pods_counters()
+{
+    double delta[COUNTERS_MAX];
+    double total[COUNTERS_MAX];
+    struct njmon_shm_pod *slot;
+    struct pod *pod;
+    int p;
+    int i;
+    int j;
+
+    FUNCTION_START;
+    pods_update();
+    if (counters_ok == 0 || pods_count == 0)
+	return;
+    psection("pod_counters");
+    for (p = 0; p < pods_count; p++) {
+	pod = &pods[p];
+	if (pod->cpus == NULL) {
+	    pod_counters_open(pod);	/* counts from the next sample */
+	    continue;
+	}
+	for (j = 0; j < counters_count; j++)
+	    total[j] = 0.0;
+	for (i = 0; i < counter_cpus_count; i++) {
+	    if (counter_cpu_delta(&pod->cpus[i], delta) < 0.0)
+		continue;
+	    for (j = 0; j < counters_count; j++)
+		total[j] += delta[j];
+	}
+	psub(pod->uid);
+	pstring("qos", pod->qos);
+	for (j = 0; j < counters_count; j++)
+	    if (counters[j].ok)
+		plong(counters[j].name, total[j]);
+	if ((slot = shm_pod(p, pod->uid, pod->qos)) != NULL)
+	    memcpy(slot->counters, total, sizeof(double) * counters_count);
+	psubend();
+    }
+    psectionend();
+}
+
+/* -G the cgroup v2 files of a pod or container */
+int cgroup_read(int dirfd, char *name, char *buf, int size)
+{
+    int fd;
+    int len;
+
+    if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) == -1)
+	return -1;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0)
+	return -1;
+    buf[len] = 0;
+    return len;
+}
+
+/* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 as cpu_some_avg10 and so on */
+void pressure_fields(char *buf, char *resource)
+{
+    char kind[16];
+    char label[128];
+    char *line;
+    char *next;
+    char *s;
+    char *value;
+
+    for (line = buf; line != NULL && *line != 0; line = next) {
+	if ((next = strchr(line, '\n')) != NULL)
+	    *next++ = 0;
+	s = line;
+	pf_word(&s, kind, sizeof(kind));
+	while ((s = strchr(s, ' ')) != NULL) {
+	    s++;
+	    if ((value = strchr(s, '=')) == NULL)
+		break;
+	    snprintf(label, sizeof(label), "%s_%s_%.*s", resource, kind, (int) (value - s), s);
+	    if (!strncmp(s, "total", 5))
+		plong(label, atoll(value + 1));
+	    else
+		pdouble(label, atof(value + 1));
+	}
+    }
+}
+
+void cgroup_pressure(int dirfd, char *resource, struct njmon_shm_pressure *shm)
+{
+    char filename[64];
+    char buf[1024];
+
+    snprintf(filename, sizeof(filename), "%s.pressure", resource);
+    if (cgroup_read(dirfd, filename, buf, sizeof(buf)) > 0) {
+	shm_pressure(buf, shm);
+	pressure_fields(buf, resource);
+    }
+}
+
+/* shm is the -o pod slot or NULL */
+void cgroup_stats(int dirfd, struct cgroup_previous *previous, double elapsed, struct njmon_shm_pod *shm)
+{
+    static char *io_names[] = { "rbytes", "wbytes", "rios", "wios", "dbytes", "dios" };
+    char buf[1024 * 16];
+    char key[128];
+    char label[160];
+    char *line;
+    char *next;
+    char *s;
+    long long value;
+    long long usage = -1;
+    long long periods = -1;
+    long long throttled = 0;
+    long long io[6] = { 0 };
+    int i;
+
+    if (cgroup_read(dirfd, "cpu.stat", buf, sizeof(buf)) > 0) {
+	for (line = buf; line != NULL && *line != 0; line = next) {
+	    if ((next = strchr(line, '\n')) != NULL)
+		*next++ = 0;
+	    s = line;
+	    pf_word(&s, key, sizeof(key));
+	    value = pf_ll(&s);
+	    plong(key, value);
+	    if (!strcmp(key, "usage_usec"))
+		usage = value;
+	    else if (!strcmp(key, "nr_periods"))
+		periods = value;
+	    else if (!strcmp(key, "nr_throttled"))
+		throttled = value;
+	}
+	if (previous->valid && usage >= previous->usage_usec) {
+	    pdouble("cpu_percent", (usage - previous->usage_usec) / elapsed / 10000.0);
+	    if (shm != NULL)
+		shm->cpu_percent = (usage - previous->usage_usec) / elapsed / 10000.0;
+	}
+	if (previous->valid && periods > previous->nr_periods) {
+	    pdouble("throttled_percent", (throttled - previous->nr_throttled) * 100.0 / (periods - previous->nr_periods));
+	    if (shm != NULL)
+		shm->throttled_percent = (throttled - previous->nr_throttled) * 100.0 / (periods - previous->nr_periods);
+	}
+	previous->usage_usec = usage;
+	previous->nr_periods = periods;
+	previous->nr_throttled = throttled;
+	previous->valid = 1;
+    }
+    if (cgroup_read(dirfd, "memory.current", buf, sizeof(buf)) > 0) {
+	plong("memory_current", atoll(buf));
+	if (shm != NULL)
+	    shm->memory_current = atoll(buf);
+    }
+    if (cgroup_read(dirfd, "memory.stat", buf, sizeof(buf)) > 0) {
+	for (line = buf; line != NULL && *line != 0; line = next) {
+	    if ((next = strchr(line, '\n')) != NULL)
+		*next++ = 0;
+	    s = line;
+	    pf_word(&s, key, sizeof(key));
+	    snprintf(label, sizeof(label), "memory_%s", key);
+	    plong(label, pf_ll(&s));
+	}
+    }
+    if (cgroup_read(dirfd, "io.stat", buf, sizeof(buf)) > 0) {
+	/* 8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0 added up over the devices */
+	for (s = buf; (s = strchr(s, ' ')) != NULL;) {
+	    s++;
+	    for (i = 0; i < 6; i++) {
+		if (!strncmp(s, io_names[i], strlen(io_names[i])) && s[strlen(io_names[i])] == '=') {
+		    io[i] += atoll(s + strlen(io_names[i]) + 1);
+		    break;
+		}
+	    }
+	}
+	for (i = 0; i < 6; i++) {
+	    snprintf(label, sizeof(label), "io_%s", io_names[i]);
+	    plong(label, io[i]);
+	}
+	if (shm != NULL) {
+	    shm->io_rbytes = io[0];
+	    shm->io_wbytes = io[1];
+	}
+    }
+    cgroup_pressure(dirfd, "cpu", shm == NULL ? NULL : &shm->pressure[NJMON_SHM_CPU_PSI]);
+    cgroup_pressure(dirfd, "memory", shm == NULL ? NULL : &shm->pressure[NJMON_SHM_MEMORY_PSI]);
+    cgroup_pressure(dirfd, "io", shm == NULL ? NULL : &shm->pressure[NJMON_SHM_IO_PSI]);
+}
+
+/* -G resource use per pod and per container */
+void pods_stats(double elapsed)
+{
+    struct pod *pod;
+    char label[256];
+    int containers = 0;
+    int p;
+    int i;
+
+    FUNCTION_START;
+    pods_update();
+    if (pods_count == 0)
+	return;
+    psection("pods");
+    for (p = 0; p < pods_count; p++) {
+	pod = &pods[p];
+	psub(pod->uid);
+	pstring("qos", pod->qos);
+	plong("containers", pod->containers_count);
+	cgroup_stats(pod->dirfd, &pod->previous, elapsed, shm_pod(p, pod->uid, pod->qos));
+	psubend();
+	containers += pod->containers_count;
+    }
+    psectionend();
+    if (containers == 0)
+	return;
+    psection("pod_containers");
+    for (p = 0; p < pods_count; p++) {
+	pod = &pods[p];
+	for (i = 0; i < pod->containers_count; i++) {
+	    snprintf(label, sizeof(label), "%s_%.12s", pod->uid, pod->containers[i].id);
+	    psub(label);
+	    pstring("pod_uid", pod->uid);
+	    pstring("container_id", pod->containers[i].id);
+	    cgroup_stats(pod->containers[i].dirfd, &pod->containers[i].previous, elapsed, NULL);
+	    psubend();
+	}
+    }
+    psectionend();
+}
+
+/* - - - - - pressure stall information - - - - */
+/*
+ * The psi section has the /proc/pressure cpu, memory and io averages every sample.
+ * -Y resource:some|full:stall_us:window_us,... also writes PSI triggers, like
+ * -Y memory:some:150000:2000000 for 150ms of memory stall in any 2 seconds, in to /proc/pressure
+ * and with -G in to every pod's <resource>.pressure file. Between samples njmon then sleeps in
+ * poll() on the triggers (so no extra thread or cost while nothing happens) and the moment the
+ * kernel says one fired a psi_event record is sent on its own, with the microsecond time, the
+ * trigger, the host or pod uid and the averages then, before going back to sleep.
+ */
+struct psi_trigger {
+    char resource[16];		/* cpu, memory or io */
+    char kind[8];		/* some or full */
+    long stall_us;
+    long window_us;
+    int fd;			/* the system wide trigger */
+};
+
+struct psi_trigger psi_triggers[PSI_TRIGGERS_MAX];
+int psi_triggers_count = 0;
+long psi_events = 0;		/* since the last sample */
+int psi_host = 0;		/* /proc/pressure exists */
+
+/* -Y cpu:some:50000:1000000,io:full:100000:2000000 */
+void psi_option(char *list)
+{
+    struct psi_trigger *t;
+    char *item;
+    char *next;
+
+    for (item = list; item != NULL && *item != 0; item = next) {
+	if ((next = strchr(item, ',')) != NULL)
+	    *next++ = 0;
+	if (psi_triggers_count == PSI_TRIGGERS_MAX) {
+	    printf("-Y at most %d triggers\n", PSI_TRIGGERS_MAX);
+	    exit(105);
+	}
+	t = &psi_triggers[psi_triggers_count];
+	if (sscanf(item, "%15[a-z]:%7[a-z]:%ld:%ld", t->resource, t->kind, &t->stall_us, &t->window_us) != 4
+	    || (strcmp(t->resource, "cpu") && strcmp(t->resource, "memory") && strcmp(t->resource, "io"))
+	    || (strcmp(t->kind, "some") && strcmp(t->kind, "full"))) {
+	    printf("Invalid -Y trigger \"%s\" - resource:some|full:stall_us:window_us like memory:some:150000:1000000\n", item);
+	    exit(105);
+	}
+	t->fd = -1;
+	psi_triggers_count++;
+    }
+}
+
+/* write a trigger in to a pressure file, returns the fd to poll or -1 */
+int psi_trigger_open(int dirfd, char *filename, struct psi_trigger *t)
+{
+    char trigger[128];
+    int fd;
+    int len;
+
+    if ((fd = openat(dirfd, filename, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1)
+	return -1;
+    len = snprintf(trigger, sizeof(trigger), "%s %ld %ld", t->kind, t->stall_us, t->window_us);
+    if (write(fd, trigger, len + 1) == -1) {
+	sprintf(errorbuf, "-Y trigger \"%s\" not accepted for %s errno=%d (%s)", trigger, filename, errno, strerror(errno));
+	nwarning(errorbuf);
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+void psi_init()
+{
+    int i;
+
+    FUNCTION_START;
+    psi_host = (access("/proc/pressure/cpu", R_OK) == 0);
+    for (i = 0; i < psi_triggers_count; i++)
+	psi_triggers[i].fd = psi_trigger_open(AT_FDCWD, psi_triggers[i].resource[0] == 'c' ? "/proc/pressure/cpu" :
+				    psi_triggers[i].resource[0] == 'm' ? "/proc/pressure/memory" : "/proc/pressure/io",
+				    &psi_triggers[i]);
+}
+
+/* the triggers for pods found since the last look */
+void psi_pods()
+{
+    char filename[64];
+    int p;
+    int i;
+
+    for (p = 0; p < pods_count; p++) {
+	if (pods[p].psi_opened)
+	    continue;
+	for (i = 0; i < psi_triggers_count; i++) {
+	    snprintf(filename, sizeof(filename), "%s.pressure", psi_triggers[i].resource);
+	    pods[p].psi_fds[i] = psi_trigger_open(pods[p].dirfd, filename, &psi_triggers[i]);
+	}
+	pods[p].psi_opened = 1;
+    }
+}
+
+/* a record of its own the moment a trigger fires */
+void psi_event(struct psi_trigger *t, char *scope, int dirfd)
+{
+    struct timeval tv;
+    struct tm *tm;
+    char buffer[128];
+    char filename[64];
+    char buf[1024];
+
+    FUNCTION_START;
+    gettimeofday(&tv, 0);
+    psi_events++;
+    precord();
+    psection("psi_event");
+    tm = gmtime(&tv.tv_sec);
+    snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%06ld",
+	     tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, (long) tv.tv_usec);
+    pstring("UTC", buffer);
+    plong("epoch_us", (long long) tv.tv_sec * 1000000 + tv.tv_usec);
+    pstring("scope", scope);
+    pstring("resource", t->resource);
+    pstring("kind", t->kind);
+    plong("stall_us", t->stall_us);
+    plong("window_us", t->window_us);
+    if (dirfd == AT_FDCWD)
+	snprintf(filename, sizeof(filename), "/proc/pressure/%s", t->resource);
+    else
+	snprintf(filename, sizeof(filename), "%s.pressure", t->resource);
+    if (cgroup_read(dirfd, filename, buf, sizeof(buf)) > 0)
+	pressure_fields(buf, t->resource);
+    psectionend();
+    psampleend();
+    push();
+}
+
+/* sleep but wake for any trigger firing */
+void psi_sleep(double seconds)
+{
+    struct pollfd *fds;
+    struct timeval tv;
+    int *pod;
+    int *trigger;
+    int count = 0;
+    int i;
+    int p;
+    double end;
+    double now;
+
+    psi_pods();
+    fds = malloc(sizeof(struct pollfd) * psi_triggers_count * (pods_count + 1));
+    pod = malloc(sizeof(int) * psi_triggers_count * (pods_count + 1));
+    trigger = malloc(sizeof(int) * psi_triggers_count * (pods_count + 1));
+    for (i = 0; i < psi_triggers_count; i++) {
+	for (p = -1; p < pods_count; p++) {
+	    fds[count].fd = (p == -1) ? psi_triggers[i].fd : pods[p].psi_fds[i];
+	    fds[count].events = POLLPRI;
+	    pod[count] = p;
+	    trigger[count] = i;
+	    count++;
+	}
+    }
+    gettimeofday(&tv, 0);
+    end = (double) tv.tv_sec + (double) tv.tv_usec * 1.0e-6 + seconds;
+    for (;;) {
+	gettimeofday(&tv, 0);
+	now = (double) tv.tv_sec + (double) tv.tv_usec * 1.0e-6;
+	if (now >= end)
+	    break;
+	if (poll(fds, count, (int) ((end - now) * 1000.0) + 1) <= 0)
+	    continue;
+	for (i = 0; i < count; i++) {
+	    if (fds[i].revents & (POLLERR | POLLNVAL)) {	/* the pod's cgroup has gone */
+		fds[i].fd = -1;
+	    } else if (fds[i].revents & POLLPRI) {
+		if (pod[i] == -1)
+		    psi_event(&psi_triggers[trigger[i]], "host", AT_FDCWD);
+		else
+		    psi_event(&psi_triggers[trigger[i]], pods[pod[i]].uid, pods[pod[i]].dirfd);
+	    }
+	}
+    }
+    free(fds);
+    free(pod);
+    free(trigger);
+}
+
+/* the averages every sample */
+void psi_sample()
+{
+    static char *resources[] = { "cpu", "memory", "io" };
+    struct procfile *pf;
+    char filename[64];
+    int i;
+
+    FUNCTION_START;
+    if (!psi_host)
+	return;
+    psection("psi");
+    for (i = 0; i < 3; i++) {
+	snprintf(filename, sizeof(filename), "/proc/pressure/%s", resources[i]);
+	pf = pf_open(filename);
+	if (pf_read(pf)) {
+	    if (shm_next != NULL)
+		shm_pressure(pf->buf, &shm_next->psi[i]);
+	    pressure_fields(pf->buf, resources[i]);
+	}
+    }
+    if (psi_triggers_count)
+	plong("trigger_events", psi_events);
+    psi_events = 0;
+    psectionend();
+}
+
+/* - - - - - sampled memory access profiling - - - - */
+/*
+ * -S period samples one event in every period on each online CPU in to a perf ring buffer
+ * with PERF_SAMPLE_IP|TID|ADDR, so the misses can be put down to the processes and pods
+ * causing them. The first event that opens of
+ *    NJMON_SAMPLE_EVENT  any -E style event
+ *    mem-loads           Intel precise loads (PEBS, data address in ADDR)
+ *    r17                 aarch64 L2D_CACHE_REFILL
+ *    cycles              then cpu-clock for machines (or VMs) with no PMU
+ * is used. ARM SPE needs its AUX buffer decoded and is not done here.
+ * A thread poll()s the ring buffers and drains them as the perf mmap protocol's single
+ * consumer (acquire load of data_head, release store of data_tail) with no locks, counting
+ * samples per PID in an open addressing table. At each sample the table is swapped out
+ * under a short mutex and the top NJMON_SAMPLE_TOP (default 10) PIDs and cgroups are sent.
+ * The overhead is set by the period: interrupts per second = event rate / period.
+ */
+#define SAMPLER_PAGES 16	/* data pages per CPU ring, a power of 2 */
+#define SAMPLER_PIDS 8192	/* a power of 2 */
+
+struct sampler_cpu {
+    int cpu;
+    int fd;
+    struct perf_event_mmap_page *meta;
+    char *data;
+    unsigned long long size;
+};
+
+struct sampler_pid {
+    int pid;			/* 0 = empty */
+    long samples;
+};
+
+#define SAMPLER_CGROUPS 4096	/* a power of 2 */
+
+struct sampler_cgroup_cache {
+    int pid;			/* 0 = empty, a collision replaces the entry */
+    unsigned long long start_time;
+    char cgroup[256];
+};
+
+struct sampler_cpu *sampler_cpus = NULL;
+int sampler_cpus_count = 0;
+struct sampler_cgroup_cache *sampler_cgroups = NULL;
+long sampler_period = 0;	/* -S */
+char sampler_event[128] = "";
+struct sampler_pid *sampler_table;	/* filled by the thread */
+struct sampler_pid *sampler_spare;	/* swapped in at each sample */
+long sampler_other = 0;		/* samples when the table is full */
+long sampler_used = 0;
+long sampler_samples = 0;
+long sampler_lost = 0;
+long sampler_top = 10;
+pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t sampler_thread;
+int sampler_running = 0;
+int sampler_stopping = 0;
+
+void sampler_cpu_add(int cpu)
+{
+    sampler_cpus = realloc(sampler_cpus, sizeof(struct sampler_cpu) * (sampler_cpus_count + 1));
+    memset(&sampler_cpus[sampler_cpus_count], 0, sizeof(struct sampler_cpu));
+    sampler_cpus[sampler_cpus_count].cpu = cpu;
+    sampler_cpus[sampler_cpus_count].fd = -1;
+    sampler_cpus_count++;
+}
+
+/* open the event on every CPU, returns the CPUs that worked */
+int sampler_try(char *spec)
+{
+    struct perf_event_attr pe;
+    struct counter c;
+    struct sampler_cpu *sc;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int precise;
+    int ok = 0;
+    int i;
+
+    if (!counter_parse(spec, &c, 0))
+	return 0;
+    for (i = 0; i < sampler_cpus_count; i++) {
+	sc = &sampler_cpus[i];
+	memset(&pe, 0, sizeof(pe));
+	pe.size = sizeof(pe);
+	pe.type = c.type;
+	pe.config = c.config;
+	pe.config1 = c.config1;
+	pe.config2 = c.config2;
+	pe.sample_period = sampler_period;
+	pe.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_ADDR;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	pe.watermark = 1;
+	pe.wakeup_watermark = SAMPLER_PAGES * pagesize / 2;
+	for (precise = 3; precise >= 0; precise--) {	/* as precise as this event allows */
+	    pe.precise_ip = precise;
+	    if ((sc->fd = perf_event_open(&pe, -1, sc->cpu, -1, PERF_FLAG_FD_CLOEXEC)) != -1)
+		break;
+	}
+	if (sc->fd == -1)
+	    continue;
+	sc->meta = mmap(NULL, (SAMPLER_PAGES + 1) * pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, sc->fd, 0);
+	if (sc->meta == MAP_FAILED) {
+	    close(sc->fd);
+	    sc->fd = -1;
+	    continue;
+	}
+	sc->data = (char *) sc->meta + pagesize;
+	sc->size = SAMPLER_PAGES * pagesize;
+	ok++;
+    }
+    if (ok)
+	strncpy(sampler_event, spec, sizeof(sampler_event) - 1);
+    return ok;
+}
+
+void sampler_count(int pid)
+{
+    long i;
+
+    for (i = (pid * 2654435761UL) & (SAMPLER_PIDS - 1); ; i = (i + 1) & (SAMPLER_PIDS - 1)) {
+	if (sampler_table[i].pid == pid) {
+	    sampler_table[i].samples++;
+	    return;
+	}
+	if (sampler_table[i].pid == 0) {
+	    if (sampler_used >= SAMPLER_PIDS / 2) {	/* keep the probes short */
+		sampler_other++;
+		return;
+	    }
+	    sampler_table[i].pid = pid;
+	    sampler_table[i].samples = 1;
+	    sampler_used++;
+	    return;
+	}
+    }
+}
+
+/* the consumer end of one ring buffer */
+void sampler_drain(struct sampler_cpu *sc)
+{
+    struct perf_event_header *header;
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long offset;
+    char record[1024];
+    char *p;
+    struct {
+	struct perf_event_header header;
+	unsigned long long ip;
+	unsigned int pid;
+	unsigned int tid;
+	unsigned long long addr;
+    } *sample;
+    struct {
+	struct perf_event_header header;
+	unsigned long long id;
+	unsigned long long lost;
+    } *lost;
+
+    head = __atomic_load_n(&sc->meta->data_head, __ATOMIC_ACQUIRE);
+    tail = sc->meta->data_tail;
+    pthread_mutex_lock(&sampler_lock);
+    while (tail < head) {
+	offset = tail % sc->size;
+	header = (struct perf_event_header *) &sc->data[offset];
+	if (header->size == 0) {	/* can not step over it, so start again at the head */
+	    tail = head;
+	    break;
+	}
+	p = &sc->data[offset];
+	if (offset + header->size > sc->size) {	/* wraps round the end so copy it out */
+	    if (header->size > sizeof(record)) {	/* not a sample we asked for, step over it */
+		tail += header->size;
+		continue;
+	    }
+	    memcpy(record, p, sc->size - offset);
+	    memcpy(&record[sc->size - offset], sc->data, header->size - (sc->size - offset));
+	    p = record;
+	}
+	if (header->type == PERF_RECORD_SAMPLE) {
+	    sample = (void *) p;
+	    sampler_samples++;
+	    sampler_count(sample->pid);
+	} else if (header->type == PERF_RECORD_LOST) {
+	    lost = (void *) p;
+	    sampler_lost += lost->lost;
+	}
+	tail += header->size;
+    }
+    pthread_mutex_unlock(&sampler_lock);
+    __atomic_store_n(&sc->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+void *sampler_consumer(void *arg)
+{
+    struct pollfd *fds;
+    int i;
+
+    fds = calloc(sampler_cpus_count, sizeof(struct pollfd));
+    for (i = 0; i < sampler_cpus_count; i++) {
+	fds[i].fd = sampler_cpus[i].fd;	/* poll() skips the -1s */
+	fds[i].events = POLLIN;
+    }
+    while (!sampler_stopping) {
+	poll(fds, sampler_cpus_count, 250);
+	for (i = 0; i < sampler_cpus_count; i++)
+	    if (sampler_cpus[i].fd != -1)
+		sampler_drain(&sampler_cpus[i]);
+    }
+    free(fds);
+    return NULL;
+}
+
+void sampler_init()
+{
+    char buf[4096];
+    char *s;
+    int ok = 0;
+    int i;
+
+    FUNCTION_START;
+    if ((s = getenv("NJMON_SAMPLE_TOP")) != 0 && atol(s) > 0)
+	sampler_top = atol(s);
+    if (!sysfs_read("/sys/devices/system/cpu/online", buf, sizeof(buf)))
+	sprintf(buf, "0-%ld", sysconf(_SC_NPROCESSORS_ONLN) - 1);
+    cpu_list(buf, sampler_cpu_add);
+
+    if ((s = getenv("NJMON_SAMPLE_EVENT")) != 0)
+	ok = sampler_try(s);
+    else {
+	ok = sampler_try("cpu/mem-loads");
+#if defined(__aarch64__)
+	if (!ok)
+	    ok = sampler_try("r17");
+#endif
+	if (!ok)
+	    ok = sampler_try("cycles");
+	if (!ok)
+	    ok = sampler_try("cpu-clock");
+    }
+    if (!ok) {
+	sprintf(errorbuf, "-S no event could be sampled errno=%d (%s)", errno, strerror(errno));
+	nwarning(errorbuf);
+	return;
+    }
+    sampler_table = calloc(SAMPLER_PIDS, sizeof(struct sampler_pid));
+    sampler_spare = calloc(SAMPLER_PIDS, sizeof(struct sampler_pid));
+    sampler_cgroups = calloc(SAMPLER_CGROUPS, sizeof(struct sampler_cgroup_cache));
+    if (pthread_create(&sampler_thread, NULL, sampler_consumer, NULL) != 0) {
+	nwarning("sampler_init() pthread_create failed - no memory access sampling");
+	for (i = 0; i < sampler_cpus_count; i++)
+	    if (sampler_cpus[i].fd != -1)
+		close(sampler_cpus[i].fd);
+	return;
+    }
+    sampler_running = 1;
+}
+
+void sampler_finish()
+{
+    if (!sampler_running)
+	return;
+    sampler_stopping = 1;
+    pthread_join(sampler_thread, NULL);
+    sampler_running = 0;
+}
+
+/* most samples first */
+int sampler_compare(const void *a, const void *b)
+{
+    long as = ((struct sampler_pid *) a)->samples;
+    long bs = ((struct sampler_pid *) b)->samples;
+
+    return as < bs ? 1 : as > bs ? -1 : 0;
+}
+
+/* the start time of a process from /proc/<pid>/stat, 0 if it has gone */
+unsigned long long sampler_start_time(int pid)
+{
+    char filename[64];
+    char buf[1024];
+    char *p;
+    int fd;
+    int len;
+    int i;
+
+    snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+    if ((fd = open(filename, O_RDONLY)) == -1)
+	return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+	return 0;
+    buf[len] = 0;
+    p = strrchr(buf, ')');	/* the comm can have spaces */
+    for (i = 0; i < 20 && p != NULL; i++)	/* to the space before starttime, the 22nd field */
+	p = strchr(p + 1, ' ');
+    return p == NULL ? 0 : strtoull(p + 1, NULL, 10);
+}
+
+/* the cgroup of a process as pod_<uid> for kubernetes or its cgroup v2 path */
+void sampler_cgroup_read(int pid, char *cgroup, int size)
+{
+    char filename[64];
+    char buf[1024];
+    char uid[128];
+    char *name;
+    char *next;
+    FILE *fp;
+
+    strcpy(cgroup, "unknown");
+    snprintf(filename, sizeof(filename), "/proc/%d/cgroup", pid);
+    if ((fp = fopen(filename, "r")) == NULL)
+	return;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	if (strncmp(buf, "0::", 3))	/* only the cgroup v2 line */
+	    continue;
+	buf[strcspn(buf, "\n")] = 0;
+	strncpy(cgroup, &buf[3], size - 1);
+	cgroup[size - 1] = 0;
+	for (name = &buf[3]; name != NULL; name = next) {
+	    if ((next = strchr(name + 1, '/')) != NULL)
+		*next = 0;
+	    if (pod_uid(name + 1, uid, sizeof(uid))) {
+		snprintf(cgroup, size, "pod_%s", uid);
+		break;
+	    }
+	    if (next != NULL)
+		*next = '/';
+	}
+    }
+    fclose(fp);
+}
+
+/* sampler_cgroup_read() once per process, a reused pid has a different start time */
+void sampler_cgroup(int pid, char *cgroup, int size)
+{
+    struct sampler_cgroup_cache *c;
+    unsigned long long start_time;
+
+    start_time = sampler_start_time(pid);
+    c = &sampler_cgroups[(pid * 2654435761UL) & (SAMPLER_CGROUPS - 1)];
+    if (start_time == 0 || c->pid != pid || c->start_time != start_time) {
+	sampler_cgroup_read(pid, c->cgroup, sizeof(c->cgroup));
+	c->pid = start_time == 0 ? 0 : pid;	/* gone so look again if the pid returns */
+	c->start_time = start_time;
+    }
+    strncpy(cgroup, c->cgroup, size - 1);
+    cgroup[size - 1] = 0;
+}
+
+/* the top PIDs and cgroups by samples in this interval */
+void sampler_sample()
+{
+    struct sampler_pid *table;
+    struct sampler_pid *groups;
+    char cgroups[256][256];
+    char cgroup[256];
+    char filename[64];
+    char comm[64];
+    char label[128];
+    long samples;
+    long lost;
+    long other;
+    long n = 0;
+    long ngroups = 0;
+    long i;
+    long j;
+    int fd;
+    int len;
+
+    FUNCTION_START;
+    if (!sampler_running)
+	return;
+    pthread_mutex_lock(&sampler_lock);
+    table = sampler_table;
+    sampler_table = sampler_spare;
+    sampler_spare = table;
+    samples = sampler_samples;
+    lost = sampler_lost;
+    other = sampler_other;
+    sampler_samples = sampler_lost = sampler_other = sampler_used = 0;
+    pthread_mutex_unlock(&sampler_lock);
+
+    for (i = 0; i < SAMPLER_PIDS; i++)	/* pack the used entries to the front */
+	if (table[i].pid != 0)
+	    table[n++] = table[i];
+    qsort(table, n, sizeof(struct sampler_pid), sampler_compare);
+
+    psection("mem_sampling");
+    pstring("event", sampler_event);
+    plong("period", sampler_period);
+    plong("samples", samples);
+    plong("lost", lost);
+    plong("pids", n);
+    plong("other", other);
+    psectionend();
+
+    groups = calloc(256, sizeof(struct sampler_pid));
+    psection("mem_sample_pids");
+    for (i = 0; i < n; i++) {
+	sampler_cgroup(table[i].pid, cgroup, sizeof(cgroup));
+	for (j = 0; j < ngroups; j++)
+	    if (!strcmp(cgroups[j], cgroup))
+		break;
+	if (j == ngroups && ngroups < 256)
+	    strcpy(cgroups[ngroups++], cgroup);
+	if (j < ngroups)
+	    groups[j].samples += table[i].samples;
+	if (i >= sampler_top)
+	    continue;
+	strcpy(comm, "exited");
+	snprintf(filename, sizeof(filename), "/proc/%d/comm", table[i].pid);
+	if ((fd = open(filename, O_RDONLY)) != -1) {
+	    if ((len = read(fd, comm, sizeof(comm) - 1)) > 0) {
+		comm[len] = 0;
+		comm[strcspn(comm, "\n")] = 0;
+	    }
+	    close(fd);
+	}
+	snprintf(label, sizeof(label), "%s_%d", comm, table[i].pid);
+	psub(label);
+	plong("pid", table[i].pid);
+	pstring("comm", comm);
+	pstring("cgroup", cgroup);
+	plong("samples", table[i].samples);
+	plong("events", table[i].samples * sampler_period);
+	pdouble("percent", samples ? 100.0 * table[i].samples / samples : 0.0);
+	psubend();
+    }
+    psectionend();
+
+    for (j = 0; j < ngroups; j++)
+	groups[j].pid = j;
+    qsort(groups, ngroups, sizeof(struct sampler_pid), sampler_compare);
+    psection("mem_sample_cgroups");
+    for (j = 0; j < ngroups && j < sampler_top; j++) {
+	psub(cgroups[groups[j].pid]);
+	plong("samples", groups[j].samples);
+	plong("events", groups[j].samples * sampler_period);
+	pdouble("percent", samples ? 100.0 * groups[j].samples / samples : 0.0);
+	psubend();
+    }
+    psectionend();
+    free(groups);
+
+    memset(table, 0, sizeof(struct sampler_pid) * SAMPLER_PIDS);
+}
+
+/* - - - - - high frequency sampling - - - - */
+/*
+ * -U ms samples a few cheap collectors every 10 to 1000 milliseconds in their own thread so
+ * short bursts of interference are not averaged away over the -s interval.
+ * Each tick goes in to a ring buffer which hf_flush() empties at every normal sample as an
+ * "hf" measure per tick (NIMON lines get a millisecond timestamp of their own).
+ *    NJMON_HF_COLLECTORS=cpu,perf,psi,net  the collectors to use (default all that work)
+ *    NJMON_HF_DOWNSAMPLE=n                 average each n ticks in to one record (default 1)
+ * The files are opened once and re-read with pread() to keep each tick to a few syscalls.
+ */
+#define HF_FIELDS 22
+
+struct hf_tick {
+    long long time_ms;
+    double value[HF_FIELDS];
+};
+
+char *hf_names[HF_FIELDS] = {
+    "cpu_user", "cpu_nice", "cpu_sys", "cpu_idle", "cpu_iowait", "cpu_hardirq", "cpu_softirq", "cpu_steal",
+    "perf_cycles", "perf_instructions", "perf_ipc",
+    "psi_cpu_some", "psi_cpu_full", "psi_memory_some", "psi_memory_full", "psi_io_some", "psi_io_full",
+    "net_rx_bytes", "net_tx_bytes", "net_rx_packets", "net_tx_packets",
+    "elapsed_ms"
+};
+
+#define HF_CPU   0
+#define HF_PERF  8
+#define HF_PSI  11
+#define HF_NET  17
+#define HF_ELAPSED 21
+
+struct hf_tick *hf_ring = NULL;
+long hf_ring_size = 0;
+long hf_head = 0;		/* next tick to write */
+long hf_count = 0;		/* ticks waiting for hf_flush() */
+pthread_mutex_t hf_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t hf_thread;
+int hf_stopping = 0;
+int hf_running = 0;
+long hf_downsample = 1;
+
+int hf_cpu_on = 1;
+int hf_perf_on = 1;
+int hf_psi_on = 1;
+int hf_net_on = 1;
+
+long hf_ticks = 0;
+long hf_overruns = 0;		/* ticks missed as the previous one took too long */
+long hf_dropped = 0;		/* ticks lost as the ring was full */
+
+int hf_stat_fd = -1;
+struct procfile hf_net_pf;	/* not pf_open()'s as the main loop reads /proc/net/dev too */
+int hf_psi_fd[3] = { -1, -1, -1 };
+int hf_cycles = -1;		/* counters[] numbers */
+int hf_instructions = -1;
+
+/* read a whole small /proc file in to buf, returns the bytes */
+long hf_read(int fd, char *buf, long size)
+{
+    long len;
+
+    len = pread(fd, buf, size - 1, 0);
+    if (len < 0)
+	len = 0;
+    buf[len] = 0;
+    return len;
+}
+
+void hf_cpu(double *raw)
+{
+    char buf[1024];
+    long long v[8] = { 0 };
+    int i;
+
+    hf_read(hf_stat_fd, buf, sizeof(buf));
+    sscanf(buf, "cpu %lld %lld %lld %lld %lld %lld %lld %lld",
+	   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    for (i = 0; i < 8; i++)
+	raw[HF_CPU + i] = v[i];
+}
+
+void hf_perf(double *raw)
+{
+    double total[COUNTERS_MAX];
+
+    counters_sum(total);
+    raw[HF_PERF] = total[hf_cycles];
+    raw[HF_PERF + 1] = total[hf_instructions];
+}
+
+void hf_psi(double *raw)
+{
+    char buf[512];
+    char *s;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	raw[HF_PSI + i * 2] = raw[HF_PSI + i * 2 + 1] = 0.0;
+	if (hf_psi_fd[i] == -1)
+	    continue;
+	hf_read(hf_psi_fd[i], buf, sizeof(buf));
+	if ((s = strstr(buf, "some ")) != NULL && (s = strstr(s, "total=")) != NULL)
+	    raw[HF_PSI + i * 2] = atoll(&s[6]);
+	if ((s = strstr(buf, "full ")) != NULL && (s = strstr(s, "total=")) != NULL)
+	    raw[HF_PSI + i * 2 + 1] = atoll(&s[6]);
+    }
+}
+
+void hf_net(double *raw)
+{
+    char *line;
+    char *colon;
+    long long v[16];
+
+    raw[HF_NET] = raw[HF_NET + 1] = raw[HF_NET + 2] = raw[HF_NET + 3] = 0.0;
+    if (!pf_read(&hf_net_pf))	/* grows to fit hundreds of veth interfaces */
+	return;
+    while ((line = pf_line(&hf_net_pf)) != NULL) {
+	if ((colon = strchr(line, ':')) == NULL)
+	    continue;		/* the two heading lines */
+	while (*line == ' ')
+	    line++;
+	if (!strncmp(line, "lo:", 3))
+	    continue;
+	if (sscanf(colon + 1, "%lld %lld %*d %*d %*d %*d %*d %*d %lld %lld",
+		   &v[0], &v[1], &v[8], &v[9]) == 4) {
+	    raw[HF_NET] += v[0];
+	    raw[HF_NET + 1] += v[8];
+	    raw[HF_NET + 2] += v[1];
+	    raw[HF_NET + 3] += v[9];
+	}
+    }
+}
+
+void hf_collect(double *raw)
+{
+    if (hf_cpu_on)
+	hf_cpu(raw);
+    if (hf_perf_on)
+	hf_perf(raw);
+    if (hf_psi_on)
+	hf_psi(raw);
+    if (hf_net_on)
+	hf_net(raw);
+}
+
+/* turn two raw readings in to the tick values */
+void hf_delta(double *now, double *then, double seconds, double *value)
+{
+    double total = 0.0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+	total += now[HF_CPU + i] - then[HF_CPU + i];
+    for (i = 0; i < 8; i++)
+	value[HF_CPU + i] = total > 0.0 ? (now[HF_CPU + i] - then[HF_CPU + i]) * 100.0 / total : 0.0;
+    value[HF_PERF] = (now[HF_PERF] - then[HF_PERF]) / seconds;
+    value[HF_PERF + 1] = (now[HF_PERF + 1] - then[HF_PERF + 1]) / seconds;
+    value[HF_PERF + 2] = value[HF_PERF] > 0.0 ? value[HF_PERF + 1] / value[HF_PERF] : 0.0;
+    for (i = HF_PSI; i < HF_PSI + 6; i++)	/* stall microseconds as percent of the tick */
+	value[i] = (now[i] - then[i]) / (seconds * 10000.0);
+    for (i = HF_NET; i < HF_NET + 4; i++)
+	value[i] = (now[i] - then[i]) / seconds;
+    value[HF_ELAPSED] = seconds * 1000.0;
+}
+
+void *hf_sampler(void *arg)
+{
+    struct timespec next;
+    struct timespec now;
+    struct timeval tv;
+    double raw[2][HF_FIELDS];
+    double then_secs;
+    double now_secs;
+    long long interval_ns = hf_ms * 1000000LL;
+    long long late_ns;
+    int cur = 0;
+
+    memset(raw, 0, sizeof(raw));
+    hf_collect(raw[cur]);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    then_secs = next.tv_sec + next.tv_nsec * 1.0e-9;
+    while (!hf_stopping) {
+	next.tv_nsec += interval_ns;
+	while (next.tv_nsec >= 1000000000) {
+	    next.tv_nsec -= 1000000000;
+	    next.tv_sec++;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+	    ;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late_ns = (now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec);
+	if (late_ns > interval_ns) {	/* skip the deadlines we missed rather than rush to catch up */
+	    hf_overruns += late_ns / interval_ns;
+	    next = now;
+	}
+	cur = !cur;
+	hf_collect(raw[cur]);
+	now_secs = now.tv_sec + now.tv_nsec * 1.0e-9;
+	gettimeofday(&tv, 0);
+
+	pthread_mutex_lock(&hf_lock);
+	hf_ring[hf_head].time_ms = (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	hf_delta(raw[cur], raw[!cur], now_secs - then_secs, hf_ring[hf_head].value);
+	hf_head = (hf_head + 1) % hf_ring_size;
+	if (hf_count == hf_ring_size)
+	    hf_dropped++;	/* overwrote the oldest */
+	else
+	    hf_count++;
+	hf_ticks++;
+	pthread_mutex_unlock(&hf_lock);
+	then_secs = now_secs;
+    }
+    return NULL;
+}
+
+void hf_init(long seconds)
+{
+    char *s;
+
+    FUNCTION_START;
+    if ((s = getenv("NJMON_HF_COLLECTORS")) != 0) {
+	hf_cpu_on = strstr(s, "cpu") != NULL;
+	hf_perf_on = strstr(s, "perf") != NULL;
+	hf_psi_on = strstr(s, "psi") != NULL;
+	hf_net_on = strstr(s, "net") != NULL;
+    }
+    if ((s = getenv("NJMON_HF_DOWNSAMPLE")) != 0 && atol(s) > 0)
+	hf_downsample = atol(s);
+
+    if (hf_cpu_on && (hf_stat_fd = open("/proc/stat", O_RDONLY)) == -1)
+	hf_cpu_on = 0;
+    if (hf_net_on) {
+	strncpy(hf_net_pf.name, proc_net_dev_filename, sizeof(hf_net_pf.name) - 1);
+	hf_net_pf.size = 1024 * 16;
+	hf_net_pf.buf = malloc(hf_net_pf.size);
+	if ((hf_net_pf.fd = open(hf_net_pf.name, O_RDONLY | O_CLOEXEC)) == -1)
+	    hf_net_on = 0;
+    }
+    if (hf_psi_on) {
+	hf_psi_fd[0] = open("/proc/pressure/cpu", O_RDONLY);
+	hf_psi_fd[1] = open("/proc/pressure/memory", O_RDONLY);
+	hf_psi_fd[2] = open("/proc/pressure/io", O_RDONLY);
+	if (hf_psi_fd[0] == -1 && hf_psi_fd[1] == -1 && hf_psi_fd[2] == -1)
+	    hf_psi_on = 0;
+    }
+    if (hf_perf_on) {	/* in the same per CPU groups as any -E events */
+	hf_cycles = counter_add("cycles");
+	hf_instructions = counter_add("instructions");
+	counters_open();
+	if (hf_cycles == -1 || hf_instructions == -1 || !counters[hf_cycles].ok || !counters[hf_instructions].ok) {
+	    nwarning("-U no perf counters (no PMU or perf_event_paranoid) so no perf_ fields");
+	    hf_perf_on = 0;
+	}
     }
-    DEBUG fprintf(stderr, "phex(%s,0x%08llx) count=%ld\n", name, value, output_char);
-}
 
-void plong(char *name, long long value)
-{
-    njmon_long++;
-    if(mode == NJMON) {
-	    output_char += sprintf(&output[output_char], "\"%s\": %lld,", name, value);
-    } else {
-	    output_char += sprintf(&output[output_char], "%s=%lldi,", name, value);
+    hf_ring_size = (seconds * 1000 / hf_ms) * 2 + 16;	/* room for a slow push */
+    hf_ring = calloc(hf_ring_size, sizeof(struct hf_tick));
+    if (pthread_create(&hf_thread, NULL, hf_sampler, NULL) != 0) {
+	nwarning("hf_init() pthread_create failed - no high frequency samples");
+	return;
     }
-    DEBUG fprintf(stderr, "plong(%s,%lld) count=%ld\n", name, value, output_char);
+    hf_running = 1;
 }
 
-void pdouble(char *name, double value)
+void hf_finish()
 {
-    njmon_double++;
-    if (isnan(value) || isinf(value)) { /* Not-a-number or infinity */
-	DEBUG fprintf(stderr, "pdouble(%s,%.1f) - NaN error\n", name, value);
+    if (!hf_running)
 	return;
-    } 
-    if(mode == NJMON) {
-	output_char += sprintf(&output[output_char], "\"%s\": %.3f,", name, value);
-	DEBUG fprintf(stderr, "pdouble(%s,%.1f) count=%ld\n", name, value, output_char);
-    } else {
-	output_char += sprintf(&output[output_char], "%s=%.3f,", name, value);
-	DEBUG fprintf(stderr, "pdouble(%s,%.1f) count=%ld\n", name, value, output_char);
-    }
+    hf_stopping = 1;
+    pthread_join(hf_thread, NULL);
+    hf_running = 0;
 }
 
-void pstring(char *name, char *value)
+void hf_fields(double *value)
 {
     int i;
-    int len;
 
-    buffer_check();
-    njmon_string++;
-    if (value == (char *) 0)
-	value = "(null)";
-    len = strlen(value);
-    for (i = 0; i < len; i++) {
-	if (value[i] == '\n' || iscntrl(value[i]))
-	    value[i] = '?';
-    }
-    if(mode == NJMON) {
-	    output_char += sprintf(&output[output_char], "\"%s\": \"%s\",", name, value);
-    } else {
-	    output_char += sprintf(&output[output_char], "%s=\"%s\",", name, value);
+    for (i = 0; i < HF_FIELDS; i++) {
+	if ((i >= HF_CPU && i < HF_PERF && !hf_cpu_on) ||
+	    (i >= HF_PERF && i < HF_PSI && !hf_perf_on) ||
+	    (i >= HF_PSI && i < HF_NET && !hf_psi_on) ||
+	    (i >= HF_NET && i < HF_ELAPSED && !hf_net_on))
+	    continue;
+	pdouble(hf_names[i], value[i]);
     }
-    DEBUG fprintf(stderr, "pstring(%s,%s) count=%ld\n", name, value, output_char);
 }
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-
-#ifdef EXTRA
 
-#include "extra.c"
+/* empty the ring in to this sample, averaging hf_downsample ticks at a time */
+void hf_flush()
+{
+    struct hf_tick *ticks;
+    double sum[HF_FIELDS];
+    char label[32];
+    long count;
+    long tail;
+    long i;
+    long j;
+    long n;
+    int f;
 
-#endif /* EXTRA */
+    if (!hf_running)
+	return;
+    pthread_mutex_lock(&hf_lock);
+    count = hf_count;
+    ticks = malloc(sizeof(struct hf_tick) * (count + 1));
+    tail = (hf_head - hf_count + hf_ring_size) % hf_ring_size;
+    for (i = 0; i < count; i++)
+	ticks[i] = hf_ring[(tail + i) % hf_ring_size];
+    hf_count = 0;
+    pthread_mutex_unlock(&hf_lock);
+
+    if (count > 0 && mode != NIMON)
+	psection("hf");
+    for (i = 0, n = 0; i < count; i += hf_downsample, n++) {
+	memset(sum, 0, sizeof(sum));
+	for (j = i; j < i + hf_downsample && j < count; j++)
+	    for (f = 0; f < HF_FIELDS; f++)
+		sum[f] += ticks[j].value[f];
+	for (f = 0; f < HF_FIELDS; f++)
+	    sum[f] = f == HF_ELAPSED ? sum[f] : sum[f] / (j - i);
+	if (mode == NIMON) {	/* a line per tick with its own time */
+	    hf_line_ms = ticks[i].time_ms;
+	    psection("hf");
+	    hf_fields(sum);
+	    psectionend();
+	    hf_line_ms = 0;
+	} else {
+	    sprintf(label, "%ld", n);
+	    psub(label);
+	    plong("time_ms", ticks[i].time_ms);
+	    hf_fields(sum);
+	    psubend();
+	}
+    }
+    if (count > 0 && mode != NIMON)
+	psectionend();
+    free(ticks);
+}
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+long collector_threads = 0;	/* -j, see parallel collectors */
+long collectors_late = 0;	/* times a collector missed the deadline */
 
 void pstats()
 {
@@ -879,9 +5823,286 @@ void pstats()
     plong("long", njmon_long);
     plong("double", njmon_double);
     plong("hex", njmon_hex);
+    if (target_port) {
+	plong("push_queued", push_head - __atomic_load_n(&push_tail, __ATOMIC_ACQUIRE));
+	plong("push_dropped", push_dropped);
+	plong("push_reconnects", push_reconnects);
+	plong("push_rejected", push_rejected);
+	plong("push_requests", push_requests);
+	plong("push_samples", push_samples);
+	plong("push_bytes", push_bytes);
+	if (spool != NULL) {
+	    plong("spool_samples", spool->records);
+	    plong("spool_bytes", spool->head - spool->tail);
+	    plong("spool_dropped", spool_dropped);
+	    plong("spool_replayed", spool_replayed);
+	}
+    }
+    if (serve_fd != -1) {
+	plong("serve_requests", serve_requests);
+	plong("serve_skipped", serve_skipped);
+    }
+    if (delta_keyframe) {
+	plong("delta_suppressed", delta_suppressed);
+	plong("delta_keys", delta_used);
+    }
+    if (collector_threads)
+	plong("collectors_late", collectors_late);
+    if (hf_ms) {
+	plong("hf_ticks", hf_ticks);
+	plong("hf_overruns", hf_overruns);
+	plong("hf_dropped", hf_dropped);
+    }
     psectionend("njmon_internal_stats");
 }
 
+/* - - - - - collector self timing - - - - */
+/*
+ * NJMON_SELF=1 times every collector with CLOCK_MONOTONIC and CLOCK_THREAD_CPUTIME_ID (so -j
+ * collectors are charged for their own thread only) and counts the bytes each one adds to the
+ * record and its system calls. The kernel only counts read and write class calls per thread
+ * (syscr and syscw in /proc/thread-self/io) so that is what syscalls is, for the /proc reading
+ * collectors it is nearly all of them. Each collector keeps log2 histograms of the microseconds
+ * per call and the njmon_self section has this sample's numbers, the totals and the p50 and
+ * p99 from the histograms, to budget njmon's overhead on production nodes. A late -j collector
+ * can finish while the main thread is in self_sample() so the stats are updated under self_lock.
+ */
+#define SELF_DATE_TIME		0
+#define SELF_INVENTORY		1
+#define SELF_TAGS		2
+#define SELF_PROC_STAT		3
+#define SELF_COUNTERS		4
+#define SELF_UNCORE		5
+#define SELF_DERIVED		6
+#define SELF_POD_COUNTERS	7
+#define SELF_PODS		8
+#define SELF_SAMPLER		9
+#define SELF_LOADAVG		10
+#define SELF_PSI		11
+#define SELF_MEMINFO		12
+#define SELF_VMSTAT		13
+#define SELF_NUMA		14
+#define SELF_DISKSTATS		15
+#define SELF_SWAPS		16
+#define SELF_NET		17
+#define SELF_UPTIME		18
+#define SELF_FILESYSTEMS	19
+#define SELF_NFS		20
+#define SELF_LPARCFG		21
+#define SELF_SYS_CPU		22
+#define SELF_GPFS		23
+#define SELF_GPU		24
+#define SELF_PROCESSES		25
+#define SELF_EXTRA		26
+#define SELF_HF			27
+#define SELF_PUSH		28
+#define SELF_MAX		29
+
+#define SELF_BUCKETS 24		/* 0 = under 1 microsecond, n = under 2^n up to 8 seconds and over */
+
+char *self_names[SELF_MAX] = {
+    "date_time", "inventory", "tags", "proc_stat", "counters", "uncore", "derived", "pod_counters",
+    "pods", "sampler", "loadavg", "psi", "meminfo", "vmstat", "numa", "diskstats", "swaps",
+    "networks", "uptime", "filesystems", "nfs", "lparcfg", "sys_cpu", "gpfs", "gpu", "processes",
+    "extra", "hf", "push"
+};
+
+struct self_stat {
+    long calls;			/* this sample */
+    double wall;
+    double cpu;
+    long bytes;
+    long syscalls;
+    long calls_total;
+    double wall_total;
+    double cpu_total;
+    long bytes_total;
+    double wall_max;
+    long wall_hist[SELF_BUCKETS];
+    long cpu_hist[SELF_BUCKETS];
+};
+
+struct self_clock {
+    struct timespec wall;
+    struct timespec cpu;
+    long output_char;
+    long syscalls;
+};
+
+int self_on = 0;		/* NJMON_SELF */
+struct self_stat self_stats[SELF_MAX];
+pthread_mutex_t self_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread int self_io_fd = -2;	/* this thread's /proc/thread-self/io, -1 if there is none */
+
+/* read plus write system calls by this thread so far, the pread here is counted next time */
+long self_syscalls()
+{
+    char buf[512];
+    char *s;
+    long len;
+    long count = 0;
+
+    if (self_io_fd == -2)
+	self_io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+    if (self_io_fd == -1)
+	return 0;
+    if ((len = pread(self_io_fd, buf, sizeof(buf) - 1, 0)) <= 0)
+	return 0;
+    buf[len] = 0;
+    if ((s = strstr(buf, "syscr:")) != NULL)
+	count += atol(s + 6);
+    if ((s = strstr(buf, "syscw:")) != NULL)
+	count += atol(s + 6);
+    return count;
+}
+
+void self_start(struct self_clock *sc)
+{
+    if (!self_on)
+	return;
+    sc->output_char = output_char;
+    sc->syscalls = self_syscalls();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &sc->cpu);
+    clock_gettime(CLOCK_MONOTONIC, &sc->wall);
+}
+
+int self_bucket(double seconds)
+{
+    long us = seconds * 1.0e6;
+    int bucket = 0;
+
+    while (us > 0 && bucket < SELF_BUCKETS - 1) {
+	us = us >> 1;
+	bucket++;
+    }
+    return bucket;
+}
+
+void self_stop(int id, struct self_clock *sc)
+{
+    struct self_stat *st = &self_stats[id];
+    struct timespec wall;
+    struct timespec cpu;
+    double wall_secs;
+    double cpu_secs;
+    long syscalls;
+
+    if (!self_on)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    wall_secs = (wall.tv_sec - sc->wall.tv_sec) + (wall.tv_nsec - sc->wall.tv_nsec) * 1.0e-9;
+    cpu_secs = (cpu.tv_sec - sc->cpu.tv_sec) + (cpu.tv_nsec - sc->cpu.tv_nsec) * 1.0e-9;
+    syscalls = self_syscalls() - sc->syscalls - 1;	/* less the pread() in self_start() */
+    pthread_mutex_lock(&self_lock);
+    st->calls++;
+    st->wall += wall_secs;
+    st->cpu += cpu_secs;
+    if (output_char >= sc->output_char)
+	st->bytes += output_char - sc->output_char;
+    else
+	st->bytes += sc->output_char;	/* push() sent the record and emptied output */
+    st->syscalls += syscalls;
+    st->wall_hist[self_bucket(wall_secs)]++;
+    st->cpu_hist[self_bucket(cpu_secs)]++;
+    if (wall_secs > st->wall_max)
+	st->wall_max = wall_secs;
+    pthread_mutex_unlock(&self_lock);
+}
+
+#define SELF(id, call) do { struct self_clock self_clock; self_start(&self_clock); call; self_stop(id, &self_clock); } while (0)
+
+/* the top of the bucket the percent of calls are in, microseconds */
+long self_percentile(long *hist, long calls, double percent)
+{
+    long want = calls * percent / 100.0;
+    long count = 0;
+    int i;
+
+    for (i = 0; i < SELF_BUCKETS - 1; i++) {
+	count += hist[i];
+	if (count > want)
+	    break;
+    }
+    return 1L << i;
+}
+
+/* -Z in the sender thread, this sample and the totals */
+void self_compress()
+{
+    static long last_in = 0;
+    static long last_out = 0;
+    static long last_cpu_ns = 0;
+    long in = __atomic_load_n(&push_zin, __ATOMIC_RELAXED);
+    long out = __atomic_load_n(&push_zout, __ATOMIC_RELAXED);
+    long cpu_ns = __atomic_load_n(&push_zcpu_ns, __ATOMIC_RELAXED);
+
+    psub("compress");
+    plong("level", push_level);
+    plong("bytes", in - last_in);
+    plong("compressed_bytes", out - last_out);
+    if (out > last_out)
+	pdouble("ratio", (double) (in - last_in) / (double) (out - last_out));
+    pdouble("cpu_ms", (cpu_ns - last_cpu_ns) / 1.0e6);
+    plong("bytes_total", in);
+    plong("compressed_bytes_total", out);
+    if (out > 0)
+	pdouble("ratio_total", (double) in / (double) out);
+    pdouble("cpu_total_ms", cpu_ns / 1.0e6);
+    if (in > 0)
+	pdouble("cpu_us_per_kb", cpu_ns / 1.0e3 / (in / 1024.0));
+    psubend();
+    last_in = in;
+    last_out = out;
+    last_cpu_ns = cpu_ns;
+}
+
+/* from the main loop when every collector has finished */
+void self_sample()
+{
+    struct self_stat *st;
+    int id;
+
+    if (!self_on)
+	return;
+    psection("njmon_self");
+    pthread_mutex_lock(&self_lock);
+    for (id = 0; id < SELF_MAX; id++) {
+	st = &self_stats[id];
+	st->calls_total += st->calls;
+	st->wall_total += st->wall;
+	st->cpu_total += st->cpu;
+	st->bytes_total += st->bytes;
+	if (st->calls_total == 0)
+	    continue;		/* not in use */
+	psub(self_names[id]);
+	plong("calls", st->calls);
+	pdouble("wall_ms", st->wall * 1000.0);
+	pdouble("cpu_ms", st->cpu * 1000.0);
+	plong("bytes", st->bytes);
+	plong("syscalls", st->syscalls);
+	plong("calls_total", st->calls_total);
+	pdouble("wall_total_ms", st->wall_total * 1000.0);
+	pdouble("cpu_total_ms", st->cpu_total * 1000.0);
+	plong("bytes_total", st->bytes_total);
+	pdouble("wall_max_ms", st->wall_max * 1000.0);
+	plong("wall_p50_us", self_percentile(st->wall_hist, st->calls_total, 50.0));
+	plong("wall_p99_us", self_percentile(st->wall_hist, st->calls_total, 99.0));
+	plong("cpu_p50_us", self_percentile(st->cpu_hist, st->calls_total, 50.0));
+	plong("cpu_p99_us", self_percentile(st->cpu_hist, st->calls_total, 99.0));
+	psubend();
+	st->calls = 0;
+	st->wall = 0.0;
+	st->cpu = 0.0;
+	st->bytes = 0;
+	st->syscalls = 0;
+    }
+    pthread_mutex_unlock(&self_lock);
+    if (push_level)
+	self_compress();
+    psectionend();
+}
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 int has_dots(char *name)
@@ -1021,6 +6242,8 @@ void date_time(long seconds, long loop, long maxloops,double sleeping, double sl
     pdouble("execute_time",  execute_time);
     pdouble("sleep_overrun", sleep_overrun);
     pdouble("elapsed", elapsed);
+    if (delta_keyframe)
+	plong("keyframe", delta_full);	/* 0 = unchanged values were left out */
 
     psectionend();
 }
@@ -1981,115 +7204,551 @@ void read_lparcfg(double elapsed)
     psectionend();
 }
 
-#define ADD_LABEL(ch) label[labelch++]   = ch
-#define ADD_NUM(ch)   numstr[numstrch++] = ch
+#define ADD_LABEL(ch) label[labelch++]   = ch
+#define ADD_NUM(ch)   numstr[numstrch++] = ch
+/*
+read files in format
+name number
+name: number
+name: numer kB
+*/
+
+/* increamenting counters */
+struct rate {
+	char label_orig[32];
+	char label_rate[32];
+	long long saved;
+} rates[] = {
+	/* swap */
+	{"pswpin",   "pswpon_rate",  0 },
+	{"pswpout",  "pswpout_rate", 0 },
+
+	/* paging */
+	{"pgpgin", "pgpgin_rate", 0},
+	{"pgpgout", "pgpgout_rate", 0},
+	{"pgalloc_dma", "pgalloc_dma_rate", 0},
+	{"pgalloc_dma32", "pgalloc_dma32_rate", 0},
+	{"pgalloc_normal", "pgalloc_normal_rate", 0},
+	{"pgalloc_movable", "pgalloc_movable_rate", 0},
+	{"pgskip_dma", "pgskip_dma_rate", 0},
+	{"pgskip_dma32", "pgskip_dma32_rate", 0},
+	{"pgskip_normal", "pgskip_normal_rate", 0},
+	{"pgskip_movable", "pgskip_movable_rate", 0},
+	{"pgfree", "pgfree_rate", 0},
+	{"pgactivate", "pgactivate_rate", 0},
+	{"pgdeactivate", "pgdeactivate_rate", 0},
+	{"pglazyfree", "pglazyfree_rate", 0},
+	{"pgfault", "pgfault_rate", 0},
+	{"pgmajfault", "pgmajfault_rate", 0},
+	{"pglazyfreed", "pglazyfreed_rate", 0},
+	{"pgrefill", "pgrefill_rate", 0},
+	{"pgsteal_kswapd", "pgsteal_kswapd_rate", 0},
+	{"pgsteal_direct", "pgsteal_direct_rate", 0},
+	{"pgscan_kswapd", "pgscan_kswapd_rate", 0},
+	{"pgscan_direct", "pgscan_direct_rate", 0},
+	{"pgscan_direct_throttle", "pgscan_direct_throttle_rate", 0},
+	{"pgscan_anon", "pgscan_anon_rate", 0},
+	{"pgscan_file", "pgscan_file_rate", 0},
+	{"pgsteal_anon", "pgsteal_anon_rate", 0},
+	{"pgsteal_file", "pgsteal_file_rate", 0},
+	{"pginodesteal", "pginodesteal_rate", 0},
+	{"pgrotated", "pgrotated_rate", 0},
+	{"pgmigrate_success", "pgmigrate_success_rate", 0},
+	{"pgmigrate_fail", "pgmigrate_fail_rate", 0},
+	{"unevictable_pgs_culled", "unevictable_pgs_culled_rate", 0},
+	{"unevictable_pgs_scanned", "unevictable_pgs_scanned_rate", 0},
+	{"unevictable_pgs_rescued", "unevictable_pgs_rescued_rate", 0},
+	{"unevictable_pgs_mlocked", "unevictable_pgs_mlocked_rate", 0},
+	{"unevictable_pgs_munlocked", "unevictable_pgs_munlocked_rate", 0},
+	{"unevictable_pgs_cleared", "unevictable_pgs_cleared_rate", 0},
+	{"unevictable_pgs_stranded", "unevictable_pgs_stranded_rate", 0}
+	};
+
+
+
+void read_data_number(char *statname, double elapsed)
+{
+    struct procfile *pf;
+    char *line;
+    char filename[1024];
+    char label[1024 + 64];	/* room for the warning with the whole filename */
+    long long number;
+    int i;
+
+    FUNCTION_START;
+    snprintf(filename, sizeof(filename), "%s/%s", proc_dirname, statname);
+    pf = pf_open(filename);
+    if (!pf_read(pf)) {
+	snprintf(label, sizeof(label), "read_data_number: failed to open file %s", filename);
+	nwarning(label);
+	return;
+    }
+    sprintf(label, "proc_%s", statname);
+    psection(label);
+    while ((line = pf_line(pf)) != NULL) {
+	/* "Active(anon):  123 kB" becomes Active_anon */
+	for (i = 0; *line != 0 && *line != ' ' && *line != ':' && *line != ')' && i < sizeof(label) - 1; line++)
+	    label[i++] = (*line == '(') ? '_' : *line;
+	label[i] = 0;
+	if (i == 0)
+	    continue;
+	if (*line == ')')
+	    line++;
+	number = pf_ll(&line);
+
+	plong(label, number);
+
+	for(i = 0;i < (sizeof(rates)/sizeof(struct rate));i++) {
+	    if( !strcmp(label, rates[i].label_orig) ) {
+		if(rates[i].saved != 0)
+		    plong(rates[i].label_rate, (number - rates[i].saved) / elapsed);
+		rates[i].saved = number;
+		break;
+	    }
+	}
+    }
+    psectionend();
+}
+
+/* - - - - - NUMA nodes - - - - */
+/*
+ * The numa_nodes section has a sub per node from /sys/devices/system/node/nodeN with its CPU
+ * count and memory (meminfo), the numastat allocation rates (hit, miss, foreign, interleave,
+ * local and other) and the tiering pgpromote and pgdemote rates from its vmstat. The
+ * numa_balancing section has the host wide automatic NUMA balancing faults and page migration
+ * rates from /proc/vmstat, which are not kept per node. Which node each CPU is on is read once
+ * from the node cpulist files at start up. NJMON_NUMA=0 switches both sections off.
+ */
+#define NUMA_MEMINFO	12
+#define NUMA_STATS	16
+
+char *numa_meminfo_names[NUMA_MEMINFO] = {
+    "MemTotal", "MemFree", "MemUsed", "Active", "Inactive", "FilePages",
+    "AnonPages", "Shmem", "Dirty", "Slab", "HugePages_Total", "HugePages_Free"
+};
+
+struct numa_node {
+    int node;
+    char name[16];		/* node0 */
+    int cpus;
+    int stats;			/* numastat and vmstat counters so far */
+    char stat_names[NUMA_STATS][48];
+    long long stat_saved[NUMA_STATS];
+};
+
+struct numa_node *numa_nodes = NULL;
+int numa_nodes_count = 0;
+int *numa_cpu_node = NULL;	/* CPU number to node number */
+int numa_cpu_node_size = 0;
+int numa_on = 1;
+
+/* the counters worth a rate */
+char *numa_balancing_names[] = {
+    "numa_pte_updates", "numa_huge_pte_updates", "numa_hint_faults", "numa_hint_faults_local",
+    "numa_pages_migrated", "pgmigrate_success", "pgmigrate_fail", NULL
+};
+long long numa_balancing_saved[8];
+
+void numa_cpu(int cpu)
+{
+    if (cpu >= numa_cpu_node_size) {
+	numa_cpu_node = realloc(numa_cpu_node, sizeof(int) * (cpu + 1));
+	for (; numa_cpu_node_size <= cpu; numa_cpu_node_size++)
+	    numa_cpu_node[numa_cpu_node_size] = -1;
+    }
+    numa_cpu_node[cpu] = numa_nodes[numa_nodes_count - 1].node;
+    numa_nodes[numa_nodes_count - 1].cpus++;
+}
+
+void numa_node_add(int node)
+{
+    char filename[256];
+    char buf[4096];
+    struct numa_node *n;
+
+    numa_nodes = realloc(numa_nodes, sizeof(struct numa_node) * (numa_nodes_count + 1));
+    n = &numa_nodes[numa_nodes_count++];
+    memset(n, 0, sizeof(struct numa_node));
+    n->node = node;
+    snprintf(n->name, sizeof(n->name), "node%d", node);
+    snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", node);
+    if (sysfs_read(filename, buf, sizeof(buf)))
+	cpu_list(buf, numa_cpu);	/* memory only nodes have an empty list */
+}
+
+void numa_init()
+{
+    char buf[4096];
+    char *s;
+
+    FUNCTION_START;
+    if ((s = getenv("NJMON_NUMA")) != NULL && atoi(s) == 0)
+	numa_on = 0;
+    if (!numa_on || !sysfs_read("/sys/devices/system/node/online", buf, sizeof(buf))) {
+	numa_on = 0;
+	return;
+    }
+    cpu_list(buf, numa_node_add);
+}
+
+/* the node of a CPU or -1 if it was not online at start up */
+int numa_node_of(int cpu)
+{
+    if (cpu < 0 || cpu >= numa_cpu_node_size)
+	return -1;
+    return numa_cpu_node[cpu];
+}
+
+/* counter as a rate from the second sample on, name is the counter name so the slots line up */
+void numa_rate(struct numa_node *n, char *name, long long value, double elapsed)
+{
+    char label[64];
+    int i;
+
+    for (i = 0; i < n->stats; i++)
+	if (!strcmp(n->stat_names[i], name))
+	    break;
+    if (i == n->stats) {
+	if (n->stats == NUMA_STATS)
+	    return;
+	strncpy(n->stat_names[i], name, sizeof(n->stat_names[i]) - 1);
+	n->stats++;
+    } else {
+	snprintf(label, sizeof(label), "%s_rate", name);
+	pdouble(label, (double) (value - n->stat_saved[i]) / elapsed);
+    }
+    n->stat_saved[i] = value;
+}
+
+void numa_node_sample(struct numa_node *n, double elapsed)
+{
+    struct procfile *pf;
+    char filename[256];
+    char label[64];
+    char *line;
+    char *p;
+    int i;
+
+    snprintf(filename, sizeof(filename), "/sys/devices/system/node/%s/meminfo", n->name);
+    pf = pf_open(filename);
+    if (pf_read(pf)) {
+	while ((line = pf_line(pf)) != NULL) {	/* Node 0 MemTotal:  5996280 kB */
+	    if ((p = strchr(line, ':')) == NULL)
+		continue;
+	    *p++ = 0;
+	    if ((line = strrchr(line, ' ')) == NULL)
+		continue;
+	    line++;
+	    for (i = 0; i < NUMA_MEMINFO; i++)
+		if (!strcmp(line, numa_meminfo_names[i])) {
+		    plong(numa_meminfo_names[i], pf_ll(&p));
+		    break;
+		}
+	}
+    }
+    snprintf(filename, sizeof(filename), "/sys/devices/system/node/%s/numastat", n->name);
+    pf = pf_open(filename);
+    if (pf_read(pf)) {
+	while ((line = pf_line(pf)) != NULL) {	/* numa_hit 10341474 */
+	    pf_word(&line, label, sizeof(label));
+	    numa_rate(n, label, pf_ll(&line), elapsed);
+	}
+    }
+    snprintf(filename, sizeof(filename), "/sys/devices/system/node/%s/vmstat", n->name);
+    pf = pf_open(filename);
+    if (pf_read(pf)) {
+	while ((line = pf_line(pf)) != NULL) {	/* memory tiering, from Linux 5.18 */
+	    if (strncmp(line, "pgpromote_success", 17) && strncmp(line, "pgdemote_", 9))
+		continue;
+	    pf_word(&line, label, sizeof(label));
+	    numa_rate(n, label, pf_ll(&line), elapsed);
+	}
+    }
+}
+
+void numa_sample(double elapsed)
+{
+    struct procfile *pf;
+    char filename[1024];
+    char label[64];
+    char buf[64];
+    char *line;
+    long long value;
+    static int seeded = 0;
+    int i;
+
+    FUNCTION_START;
+    if (!numa_on)
+	return;
+    psection("numa_nodes");
+    for (i = 0; i < numa_nodes_count; i++) {
+	psub(numa_nodes[i].name);
+	plong("cpus", numa_nodes[i].cpus);
+	numa_node_sample(&numa_nodes[i], elapsed);
+	psubend();
+    }
+    psectionend();
+
+    snprintf(filename, sizeof(filename), "%s/vmstat", proc_dirname);
+    pf = pf_open(filename);
+    if (!pf_read(pf))
+	return;
+    psection("numa_balancing");
+    if (sysfs_read("/proc/sys/kernel/numa_balancing", buf, sizeof(buf)))
+	plong("numa_balancing", atoi(buf));	/* 0 off, 1 normal, 2 memory tiering */
+    while ((line = pf_line(pf)) != NULL) {
+	if (line[0] != 'n' && line[0] != 'p')
+	    continue;
+	pf_word(&line, label, sizeof(label));
+	for (i = 0; numa_balancing_names[i] != NULL; i++)
+	    if (!strcmp(label, numa_balancing_names[i]))
+		break;
+	if (numa_balancing_names[i] == NULL)
+	    continue;
+	value = pf_ll(&line);
+	if (seeded) {
+	    strcat(label, "_rate");
+	    pdouble(label, (double) (value - numa_balancing_saved[i]) / elapsed);
+	}
+	numa_balancing_saved[i] = value;
+    }
+    seeded = 1;
+    psectionend();
+}
+
+/* - - - - - logical CPUs and their groups - - - - */
 /*
-read files in format
-name number
-name: number
-name: numer kB
-*/
+ * The per CPU state is sized from /sys/devices/system/cpu/possible and grows if a higher
+ * cpuNNN line turns up. A CPU only gets a delta when it was in /proc/stat last time too, so a
+ * CPU that was offline or is new (hotplug) is just remembered for next time, nothing else is
+ * reset. On a 384 thread node the cpus section is most of the record, so -l says which of
+ * cpu (cpus, the default), core (cpu_cores), cluster (cpu_clusters) and node (cpu_nodes) to
+ * send, the groups being the average of their online CPUs from sysfs topology, like -l node,core
+ */
+#define CPU_UTIL_FIELDS 10	/* user nice sys idle iowait hardirq softirq steal guest guestnice */
 
-/* increamenting counters */
-struct rate {
-	char label_orig[32];
-	char label_rate[32];
-	long long saved;
-} rates[] = {
-	/* swap */
-	{"pswpin",   "pswpon_rate",  0 },
-	{"pswpout",  "pswpout_rate", 0 },
+#define CPU_CORE	0
+#define CPU_CLUSTER	1
+#define CPU_NODE	2
+#define CPU_LEVELS	3
 
-	/* paging */
-	{"pgpgin", "pgpgin_rate", 0},
-	{"pgpgout", "pgpgout_rate", 0},
-	{"pgalloc_dma", "pgalloc_dma_rate", 0},
-	{"pgalloc_dma32", "pgalloc_dma32_rate", 0},
-	{"pgalloc_normal", "pgalloc_normal_rate", 0},
-	{"pgalloc_movable", "pgalloc_movable_rate", 0},
-	{"pgskip_dma", "pgskip_dma_rate", 0},
-	{"pgskip_dma32", "pgskip_dma32_rate", 0},
-	{"pgskip_normal", "pgskip_normal_rate", 0},
-	{"pgskip_movable", "pgskip_movable_rate", 0},
-	{"pgfree", "pgfree_rate", 0},
-	{"pgactivate", "pgactivate_rate", 0},
-	{"pgdeactivate", "pgdeactivate_rate", 0},
-	{"pglazyfree", "pglazyfree_rate", 0},
-	{"pgfault", "pgfault_rate", 0},
-	{"pgmajfault", "pgmajfault_rate", 0},
-	{"pglazyfreed", "pglazyfreed_rate", 0},
-	{"pgrefill", "pgrefill_rate", 0},
-	{"pgsteal_kswapd", "pgsteal_kswapd_rate", 0},
-	{"pgsteal_direct", "pgsteal_direct_rate", 0},
-	{"pgscan_kswapd", "pgscan_kswapd_rate", 0},
-	{"pgscan_direct", "pgscan_direct_rate", 0},
-	{"pgscan_direct_throttle", "pgscan_direct_throttle_rate", 0},
-	{"pgscan_anon", "pgscan_anon_rate", 0},
-	{"pgscan_file", "pgscan_file_rate", 0},
-	{"pgsteal_anon", "pgsteal_anon_rate", 0},
-	{"pgsteal_file", "pgsteal_file_rate", 0},
-	{"pginodesteal", "pginodesteal_rate", 0},
-	{"pgrotated", "pgrotated_rate", 0},
-	{"pgmigrate_success", "pgmigrate_success_rate", 0},
-	{"pgmigrate_fail", "pgmigrate_fail_rate", 0},
-	{"unevictable_pgs_culled", "unevictable_pgs_culled_rate", 0},
-	{"unevictable_pgs_scanned", "unevictable_pgs_scanned_rate", 0},
-	{"unevictable_pgs_rescued", "unevictable_pgs_rescued_rate", 0},
-	{"unevictable_pgs_mlocked", "unevictable_pgs_mlocked_rate", 0},
-	{"unevictable_pgs_munlocked", "unevictable_pgs_munlocked_rate", 0},
-	{"unevictable_pgs_cleared", "unevictable_pgs_cleared_rate", 0},
-	{"unevictable_pgs_stranded", "unevictable_pgs_stranded_rate", 0}
-	};
+struct cpu_state {
+    long long util[CPU_UTIL_FIELDS];
+    long seen;			/* proc_stat() call it was last in /proc/stat */
+    int group[CPU_LEVELS];
+};
+
+struct cpu_group {
+    char name[64];
+    int cpus;			/* with a delta this sample */
+    double util[CPU_UTIL_FIELDS];
+};
 
+struct cpu_level {
+    char *option;
+    char *section;
+    int on;
+    struct cpu_group *groups;
+    int count;
+};
 
+struct cpu_state *cpu_states = NULL;
+int cpu_states_size = 0;
+long cpu_generation = 1;		/* so no CPU looks seen at the first sample */
+int cpu_logical_on = 1;		/* the cpus section */
+struct cpu_level cpu_levels[CPU_LEVELS] = {
+    { "core", "cpu_cores", 0, NULL, 0 },
+    { "cluster", "cpu_clusters", 0, NULL, 0 },
+    { "node", "cpu_nodes", 0, NULL, 0 }
+};
 
-void read_data_number(char *statname, double elapsed)
+/* -l cpu,core,cluster,node */
+void cpu_levels_option(char *list)
 {
-    FILE *fp = 0;
-    char line[2048];
-    char filename[1024];
-    char label[2048];
-    char number[512];
+    char copy[256];
+    char *item;
     int i;
-    int len;
 
-    FUNCTION_START;
-    sprintf(filename, "/proc/%s", statname);
-    if ((fp = fopen(filename, "r")) == NULL) {
-	sprintf(line, "read_data_number: failed to open file %s", filename);
-	nwarning(line);
-	return;
+    strncpy(copy, list, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = 0;
+    cpu_logical_on = 0;
+    for (item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+	if (!strcmp(item, "cpu")) {
+	    cpu_logical_on = 1;
+	    continue;
+	}
+	for (i = 0; i < CPU_LEVELS; i++)
+	    if (!strcmp(item, cpu_levels[i].option))
+		break;
+	if (i == CPU_LEVELS) {
+	    printf("njmon: -l option \"%s\" is not one of cpu, core, cluster or node\n", item);
+	    exit(108);
+	}
+	cpu_levels[i].on = 1;
     }
-    sprintf(label, "proc_%s", statname);
-    psection(label);
-    while (fgets(line, 1000, fp) != NULL) {
-	len = strlen(line);
-	for (i = 0; i < len; i++) {
-	    if (line[i] == '(')
-		line[i] = '_';
-	    if (line[i] == ')')
-		line[i] = ' ';
-	    if (line[i] == ':')
-		line[i] = ' ';
-	    if (line[i] == '\n')
-		line[i] = 0;
+}
+
+void cpu_states_grow(int cpuno)
+{
+    char buf[4096];
+    char *last;
+    int size = cpu_states_size * 2;
+
+    if (cpu_states_size == 0) {	/* possible is like 0-383 or 0,2-5 */
+	size = 1;
+	if (sysfs_read("/sys/devices/system/cpu/possible", buf, sizeof(buf))) {
+	    if ((last = strrchr(buf, ',')) == NULL || (strrchr(buf, '-') != NULL && strrchr(buf, '-') > last))
+		last = strrchr(buf, '-');
+	    size = atoi(last != NULL ? last + 1 : buf) + 1;
 	}
-	sscanf(line, "%s %s", label, number);
+    }
+    if (size < cpuno + 1)
+	size = cpuno + 1;
+    cpu_states = realloc(cpu_states, sizeof(struct cpu_state) * size);
+    memset(&cpu_states[cpu_states_size], 0, sizeof(struct cpu_state) * (size - cpu_states_size));
+    cpu_states_size = size;
+}
 
-	/*printf("read_data_numer(%s) |%s| |%s|=%lld\n", statname,label,numstr,atoll(numstr)); */
-	plong(label, atoll(number));
+int cpu_group_find(struct cpu_level *level, char *name)
+{
+    int i;
 
-	for(i = 0;i < (sizeof(rates)/sizeof(struct rate));i++) {
-	    if( !strcmp(label, rates[i].label_orig) ) {
-		if(rates[i].saved != 0)
-		    plong(rates[i].label_rate, (atoll(number) - rates[i].saved) / elapsed);
-		rates[i].saved = atoll(number);
+    for (i = 0; i < level->count; i++)
+	if (!strcmp(level->groups[i].name, name))
+	    return i;
+    level->groups = realloc(level->groups, sizeof(struct cpu_group) * (level->count + 1));
+    memset(&level->groups[i], 0, sizeof(struct cpu_group));
+    strncpy(level->groups[i].name, name, sizeof(level->groups[i].name) - 1);
+    level->count++;
+    return i;
+}
+
+int cpu_topology_value(int cpuno, char *name)
+{
+    char filename[256];
+    char buf[64];
+
+    snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/topology/%s", cpuno, name);
+    if (!sysfs_read(filename, buf, sizeof(buf)))
+	return -1;
+    return atoi(buf);
+}
+
+/* the groups of a CPU seen for the first time or back online */
+void cpu_topology(int cpuno)
+{
+    struct cpu_state *cs = &cpu_states[cpuno];
+    struct dirent *dent;
+    DIR *dir;
+    char name[256];
+    int package;
+    int core;
+    int cluster;
+    int node = 0;
+
+    if (cpu_levels[CPU_CORE].on == 0 && cpu_levels[CPU_CLUSTER].on == 0 && cpu_levels[CPU_NODE].on == 0)
+	return;
+    if ((package = cpu_topology_value(cpuno, "physical_package_id")) < 0)
+	package = 0;
+    if ((core = cpu_topology_value(cpuno, "core_id")) < 0)
+	core = cpuno;
+    snprintf(name, sizeof(name), "package%d_core%d", package, core);
+    cs->group[CPU_CORE] = cpu_group_find(&cpu_levels[CPU_CORE], name);
+
+    if ((cluster = cpu_topology_value(cpuno, "cluster_id")) < 0)	/* from Linux 5.16 */
+	snprintf(name, sizeof(name), "package%d", package);
+    else
+	snprintf(name, sizeof(name), "package%d_cluster%d", package, cluster);
+    cs->group[CPU_CLUSTER] = cpu_group_find(&cpu_levels[CPU_CLUSTER], name);
+
+    snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%d", cpuno);
+    if ((node = numa_node_of(cpuno)) == -1 && (dir = opendir(name)) != NULL) {	/* a nodeN link on NUMA kernels */
+	node = 0;
+	while ((dent = readdir(dir)) != NULL)
+	    if (!strncmp(dent->d_name, "node", 4) && isdigit(dent->d_name[4])) {
+		node = atoi(&dent->d_name[4]);
 		break;
 	    }
+	closedir(dir);
+    }
+    if (node == -1)
+	node = 0;
+    snprintf(name, sizeof(name), "node%d", node);
+    cs->group[CPU_NODE] = cpu_group_find(&cpu_levels[CPU_NODE], name);
+}
+
+void cpu_util_print(double *util)
+{
+    pdouble("user", util[0]);
+    pdouble("nice", util[1]);
+    pdouble("sys", util[2]);
+    pdouble("idle", util[3]);
+    pdouble("iowait", util[4]);
+    pdouble("hardirq", util[5]);
+    pdouble("softirq", util[6]);
+    pdouble("steal", util[7]);
+    pdouble("guest", util[8]);
+    pdouble("guestnice", util[9]);
+}
+
+void shm_cpu(struct njmon_shm_cpu *shm, double *util)
+{
+    shm->user = util[0];
+    shm->nice = util[1];
+    shm->sys = util[2];
+    shm->idle = util[3];
+    shm->iowait = util[4];
+    shm->hardirq = util[5];
+    shm->softirq = util[6];
+    shm->steal = util[7];
+    shm->guest = util[8];
+    shm->guestnice = util[9];
+    shm->online = 1;
+}
+
+void cpu_groups_add(struct cpu_state *cs, double *util)
+{
+    struct cpu_group *g;
+    int level;
+    int i;
+
+    for (level = 0; level < CPU_LEVELS; level++) {
+	if (!cpu_levels[level].on)
+	    continue;
+	g = &cpu_levels[level].groups[cs->group[level]];
+	g->cpus++;
+	for (i = 0; i < CPU_UTIL_FIELDS; i++)
+	    g->util[i] += util[i];
+    }
+}
+
+void cpu_groups_print()
+{
+    struct cpu_group *g;
+    double util[CPU_UTIL_FIELDS];
+    int level;
+    int j;
+    int i;
+
+    for (level = 0; level < CPU_LEVELS; level++) {
+	if (!cpu_levels[level].on || cpu_levels[level].count == 0)
+	    continue;
+	psection(cpu_levels[level].section);
+	for (j = 0; j < cpu_levels[level].count; j++) {
+	    g = &cpu_levels[level].groups[j];
+	    if (g->cpus == 0)
+		continue;	/* all offline */
+	    for (i = 0; i < CPU_UTIL_FIELDS; i++)
+		util[i] = g->util[i] / g->cpus;
+	    psub(g->name);
+	    plong("cpus", g->cpus);
+	    cpu_util_print(util);
+	    psubend();
+	    memset(g->util, 0, sizeof(g->util));
+	    g->cpus = 0;
 	}
+	psectionend();
     }
-    psectionend();
-    (void) fclose(fp);
 }
 
 void proc_stat(double elapsed, int print, int reduced_stats)
@@ -2104,13 +7763,17 @@ void proc_stat(double elapsed, int print, int reduced_stats)
     long long steal;
     long long guest;
     long long guestnice;
-    int cpu_total = 0;
-    int count;
+    int cpus_open = 0;
+    int online = 0;
     int cpuno;
+    int i;
     long long value;
-    static FILE *fp = 0;
-    static char line[8192];
-    static int max_cpuno;
+    long long now[CPU_UTIL_FIELDS];
+    double util[CPU_UTIL_FIELDS];
+    struct cpu_state *cs;
+    static struct procfile *pf = NULL;
+    char *line;
+    char *p;
 
     struct utilisation {
 	long long user;
@@ -2124,37 +7787,44 @@ void proc_stat(double elapsed, int print, int reduced_stats)
 	long long guest;
 	long long guestnice;
     };
-#define MAX_LOGICAL_CPU 256
     static long long old_ctxt;
     static long long old_processes;
     static struct utilisation total_cpu;
-    static struct utilisation logical_cpu[MAX_LOGICAL_CPU];
     char label[512];
 
     FUNCTION_START;
-    /* printf("DEBUG\t--> proc_stat(%.4f, %d) max_cpuno=%d\n",elapsed, print,max_cpuno); */
-    if (fp == 0) {
-	if ((fp = fopen("/proc/stat", "r")) == NULL) {
-	    sprintf(errorbuf, "failed to open file /proc/stat errno=%d", errno);
-	    nwarning(errorbuf);
-	    fp = 0;
-	    return;
-	}
-    } else
-	rewind(fp);
+    /* printf("DEBUG\t--> proc_stat(%.4f, %d)\n",elapsed, print); */
+    if (pf == NULL)
+	pf = pf_open(proc_stat_filename);
+    if (!pf_read(pf)) {
+	sprintf(errorbuf, "failed to open file %s errno=%d", proc_stat_filename, errno);
+	nwarning(errorbuf);
+	return;
+    }
+    cpu_generation++;
+    for (p = pf->buf; (p = strstr(p, "\ncpu")) != NULL; p += 4)	/* the total is for the online CPUs */
+	if (isdigit(p[4]))
+	    online++;
+    if (online == 0)
+	online = 1;
 
-    while (fgets(line, 1000, fp) != NULL) {
+    while ((line = pf_line(pf)) != NULL) {
 
 	if (!strncmp(line, "cpu", 3)) {
 	    if (!strncmp(line, "cpu ", 4)) {	/* this is the first line and is the average total CPU stats */
-		cpu_total = 1;
-		count = sscanf(&line[4],	/* cpu USER */
-			       "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-			       &user, &nice, &sys, &idle,
-			       &iowait, &hardirq, &softirq,
-			       &steal, &guest, &guestnice);
+		p = &line[4];	/* cpu USER */
+		user = pf_ll(&p);
+		nice = pf_ll(&p);
+		sys = pf_ll(&p);
+		idle = pf_ll(&p);
+		iowait = pf_ll(&p);
+		hardirq = pf_ll(&p);
+		softirq = pf_ll(&p);
+		steal = pf_ll(&p);
+		guest = pf_ll(&p);
+		guestnice = pf_ll(&p);
 		if (print) {
-#define DELTA_TOTAL(stat) ((double)((double)stat - (double)total_cpu.stat)/(double)elapsed/((double)(max_cpuno + 1.0)))
+#define DELTA_TOTAL(stat) ((double)((double)stat - (double)total_cpu.stat)/(double)elapsed/((double)online))
 		    psection("cpu_total");
 		    pdouble("user", DELTA_TOTAL(user));	/* incrementing counter */
 		    pdouble("nice", DELTA_TOTAL(nice));	/* incrementing counter */
@@ -2168,6 +7838,20 @@ void proc_stat(double elapsed, int print, int reduced_stats)
 		    pdouble("guest", DELTA_TOTAL(guest));	/* incrementing counter */
 		    pdouble("guestnice", DELTA_TOTAL(guestnice));	/* incrementing counter */
 		    psectionend();
+		    derived_busy = 100.0 - DELTA_TOTAL(idle) - DELTA_TOTAL(iowait);	/* for the interference baseline */
+		    if (shm_next != NULL) {
+			shm_next->total.user = DELTA_TOTAL(user);
+			shm_next->total.nice = DELTA_TOTAL(nice);
+			shm_next->total.sys = DELTA_TOTAL(sys);
+			shm_next->total.idle = DELTA_TOTAL(idle);
+			shm_next->total.iowait = DELTA_TOTAL(iowait);
+			shm_next->total.hardirq = DELTA_TOTAL(hardirq);
+			shm_next->total.softirq = DELTA_TOTAL(softirq);
+			shm_next->total.steal = DELTA_TOTAL(steal);
+			shm_next->total.guest = DELTA_TOTAL(guest);
+			shm_next->total.guestnice = DELTA_TOTAL(guestnice);
+			shm_next->total.online = online;
+		    }
 		}
 		total_cpu.user = user;
 		total_cpu.nice = nice;
@@ -2183,55 +7867,43 @@ void proc_stat(double elapsed, int print, int reduced_stats)
 	    } else {
 		if(reduced_stats)
 		    continue;
-		if (cpu_total == 1)	/* first cpuNNN line */
-		    if (print)
-			psection("cpus");
-		cpu_total++;
-		count = sscanf(&line[3],	/* cpuNNNN USER */
-			       "%d %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-			       &cpuno, &user, &nice, &sys, &idle,
-			       &iowait, &hardirq, &softirq,
-			       &steal, &guest, &guestnice);
-		if (cpuno > max_cpuno)
-		    max_cpuno = cpuno;
-		if (cpuno >= MAX_LOGICAL_CPU)
-		    continue;
-		if (print) {
-		    sprintf(label, "cpu%d", cpuno);
-		    psub(label);
-#define DELTA_LOGICAL(stat) ((double)((double)stat - (double)logical_cpu[cpuno].stat)/(double)elapsed)
-		    pdouble("user", DELTA_LOGICAL(user));	/* counter */
-		    pdouble("nice", DELTA_LOGICAL(nice));	/* counter */
-		    pdouble("sys", DELTA_LOGICAL(sys));	/* counter */
-		    pdouble("idle", DELTA_LOGICAL(idle));	/* counter */
-/*			pdouble("DEBUG IDLE idle: %lld %lld %lld\n", logical_cpu[cpuno].idle, idle, idle-logical_cpu[cpuno].idle); */
-		    pdouble("iowait", DELTA_LOGICAL(iowait));	/* counter */
-		    pdouble("hardirq", DELTA_LOGICAL(hardirq));	/* counter */
-		    pdouble("softirq", DELTA_LOGICAL(softirq));	/* counter */
-		    pdouble("steal", DELTA_LOGICAL(steal));	/* counter */
-		    pdouble("guest", DELTA_LOGICAL(guest));	/* counter */
-		    pdouble("guestnice", DELTA_LOGICAL(guestnice));	/* counter */
-		    psubend();
+		p = &line[3];	/* cpuNNNN USER */
+		cpuno = pf_ll(&p);
+		for (i = 0; i < CPU_UTIL_FIELDS; i++)
+		    now[i] = pf_ll(&p);
+		if (cpuno >= cpu_states_size)
+		    cpu_states_grow(cpuno);
+		cs = &cpu_states[cpuno];
+		if (cs->seen != cpu_generation - 1) {	/* new or back online so no delta yet */
+		    cpu_topology(cpuno);
+		} else if (print) {
+		    for (i = 0; i < CPU_UTIL_FIELDS; i++)
+			util[i] = (double) (now[i] - cs->util[i]) / elapsed;
+		    if (cpu_logical_on) {
+			if (!cpus_open)
+			    psection("cpus");
+			cpus_open = 1;
+			sprintf(label, "cpu%d", cpuno);
+			psub(label);
+			cpu_util_print(util);
+			psubend();
+		    }
+		    cpu_groups_add(cs, util);
+		    if (shm_next != NULL && cpuno < shm_next->cpus_max)
+			shm_cpu(NJMON_SHM_CPU(shm_next, cpuno), util);
 		}
-		logical_cpu[cpuno].user = user;
-		logical_cpu[cpuno].nice = nice;
-		logical_cpu[cpuno].sys = sys;
-		logical_cpu[cpuno].idle = idle;
-		logical_cpu[cpuno].iowait = iowait;
-		logical_cpu[cpuno].hardirq = hardirq;
-		logical_cpu[cpuno].softirq = softirq;
-		logical_cpu[cpuno].steal = steal;
-		logical_cpu[cpuno].guest = guest;
-		logical_cpu[cpuno].guestnice = guestnice;
+		memcpy(cs->util, now, sizeof(now));
+		cs->seen = cpu_generation;
 		continue;
 	    }
 	}
 	if (!strncmp(line, "ctxt", 4)) {
-	    if (print)
+	    if (cpus_open)
 		psectionend();	/* rather aassumes ctxt is the first non "cpu" line */
-	    value = 0;
-	    count = sscanf(&line[5], "%lld", &value);	/* counter */
-	    if (count == 1) {
+	    if (print)
+		cpu_groups_print();
+	    p = &line[5];
+	    if (pf_number(&p, &value)) {	/* counter */
 		if (print) {
 		    psection("stat_counters");
 		    pdouble("ctxt",
@@ -2242,30 +7914,30 @@ void proc_stat(double elapsed, int print, int reduced_stats)
 	    continue;
 	}
 	if (!strncmp(line, "btime", 5)) {
-	    value = 0;
-	    count = sscanf(&line[6], "%lld", &value);	/* seconds since boot */
+	    p = &line[6];
+	    value = pf_ll(&p);	/* seconds since boot */
 	    if (print)
 		plong("btime", value);
 	    continue;
 	}
 	if (!strncmp(line, "processes", 9)) {
-	    value = 0;
-	    count = sscanf(&line[10], "%lld", &value);	/* counter  actually forks */
+	    p = &line[10];
+	    value = pf_ll(&p);	/* counter  actually forks */
 	    if (print)
 		pdouble("processes_forks", ((double) (value - old_processes) / elapsed));
 	    old_processes = value;
 	    continue;
 	}
 	if (!strncmp(line, "procs_running", 13)) {
-	    value = 0;
-	    count = sscanf(&line[14], "%lld", &value);
+	    p = &line[14];
+	    value = pf_ll(&p);
 	    if (print)
 		plong("procs_running", value);
 	    continue;
 	}
 	if (!strncmp(line, "procs_blocked", 13)) {
-	    value = 0;
-	    count = sscanf(&line[14], "%lld", &value);
+	    p = &line[14];
+	    value = pf_ll(&p);
 	    if (print) {
 		plong("procs_blocked", value);
 		psectionend();	/* rather assumes "blocked" is the last line */
@@ -2308,7 +7980,7 @@ struct diskinfo {
 struct diskinfo *diskstat_current;
 struct diskinfo *diskstat_previous;
 long disks_all = 0;
-FILE *diskstat_fp = 0;
+struct procfile *diskstat_pf = NULL;
 
 /* actual disk drives and not all the other nosense in the diskstats file */
 char **real_disks_list = 0;
@@ -2339,6 +8011,40 @@ void diskstat_cleanup(struct diskinfo *disk)
 		  disk->dk_wkb) / disk->dk_xfers) * 1024;
 }
 
+/* one /proc/diskstats line, dk_count is the number of fields found as sscanf() would return */
+void diskstat_parse(char *line, struct diskinfo *disk)
+{
+    long long *fields[] = {
+	&disk->dk_reads, &disk->dk_rmerge, &disk->dk_rkb, &disk->dk_rmsec,
+	&disk->dk_writes, &disk->dk_wmerge, &disk->dk_wkb, &disk->dk_wmsec,
+	&disk->dk_inflight, &disk->dk_time, &disk->dk_backlog,
+	/* new additions */
+	&disk->dk_discards, &disk->dk_discard_merges, &disk->dk_discard_sectors, &disk->dk_discard_time,
+	&disk->dk_flushes, &disk->dk_flush_time
+    };
+    long long value;
+    int i;
+
+    bzero(disk, sizeof(struct diskinfo));
+    if (!pf_number(&line, &value))
+	return;
+    disk->dk_major = value;
+    disk->dk_count++;
+    if (!pf_number(&line, &value))
+	return;
+    disk->dk_minor = value;
+    disk->dk_count++;
+    pf_word(&line, disk->dk_name, sizeof(disk->dk_name));
+    if (disk->dk_name[0] == 0)
+	return;
+    disk->dk_count++;
+    for (i = 0; i < sizeof(fields) / sizeof(long long *); i++) {
+	if (!pf_number(&line, fields[i]))
+	    break;
+	disk->dk_count++;
+    }
+}
+
 void add_real_disk(int num,char *name)
 {
     FUNCTION_START;
@@ -2353,7 +8059,7 @@ void add_real_disk(int num,char *name)
 
 void proc_diskstats_init()
 {
-    char buf[1024];
+    char *line;
     /* popen variables */
     FILE *pop;
     char tmpstr[1024 + 1];
@@ -2385,34 +8091,16 @@ void proc_diskstats_init()
 	} else
 	    real_disks_count = 0;
 
-	if ((diskstat_fp = fopen("/proc/diskstats", "r")) == NULL) {
+	if (diskstat_pf == NULL)
+	    diskstat_pf = pf_open(proc_diskstats_filename);
+	if (!pf_read(diskstat_pf)) {
 	    nwarning("failed to open - /proc/diskstats");
 	    return;
 	}
 
     disks_all = 0;
-    while (fgets(buf, 1024, diskstat_fp) != NULL) {
-	buf[strlen(buf) - 1] = 0;	/* remove newline */
-	/*printf("DISKSTATS: \"%s\"", buf); */
-	/* zero the data ready for reading */
-	bzero(&dstat, sizeof(struct diskinfo));
-
-	dstat.dk_count = sscanf(&buf[0],
-		   "%ld %ld %s %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-		   &dstat.dk_major, &dstat.dk_minor,
-		   &dstat.dk_name[0], &dstat.dk_reads,
-		   &dstat.dk_rmerge, &dstat.dk_rkb,    &dstat.dk_rmsec,
-		   &dstat.dk_writes, &dstat.dk_wmerge, &dstat.dk_wkb,
-		   &dstat.dk_wmsec, &dstat.dk_inflight,
-		   &dstat.dk_time, &dstat.dk_backlog,
-		   /* new additions */
-		   &dstat.dk_discards,
-		   &dstat.dk_discard_merges,
-		   &dstat.dk_discard_sectors,
-		   &dstat.dk_discard_time,
-		   &dstat.dk_flushes,
-		   &dstat.dk_flush_time);
-
+    while ((line = pf_line(diskstat_pf)) != NULL) {
+	diskstat_parse(line, &dstat);
 	diskstat_cleanup(&dstat);
 	/* TEST TEST
 	if(strcmp("sr0", dstat.dk_name) )
@@ -2442,54 +8130,25 @@ int miss_count = 0;
 
 void proc_diskstats_collect(double elapsed)
 {
-    char buf[1024];
+    char *line;
     long i;
     long j;
 
     FUNCTION_START;
-    if(diskstat_fp == NULL)
+    if(diskstat_pf == NULL || disks_all == 0)
    	return;
    
-    rewind(diskstat_fp);
+    if (!pf_read(diskstat_pf))
+	return;
 
     memcpy(&diskstat_previous[0], &diskstat_current[0], sizeof(struct diskinfo) * disks_all);
 
     j = 0;
-    while (fgets(buf, 1024, diskstat_fp) != NULL) {
-	buf[strlen(buf) - 1] = 0;	/* remove newline */
-	/*printf("DISKSTATS: \"%s\"", buf); */
-	/* zero the data ready for reading */
-	bzero(&diskstat_current[j], sizeof(struct diskinfo));
-	diskstat_current[j].dk_count =
-	    sscanf(&buf[0],
-		   "%ld %ld %s %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-		   &diskstat_current[j].dk_major, 
-		   &diskstat_current[j].dk_minor,
-		   &diskstat_current[j].dk_name[0], 
-		   &diskstat_current[j].dk_reads,
-		   &diskstat_current[j].dk_rmerge, 
-		   &diskstat_current[j].dk_rkb, 
-		   &diskstat_current[j].dk_rmsec,
-		   &diskstat_current[j].dk_writes, 
-		   &diskstat_current[j].dk_wmerge, 
-		   &diskstat_current[j].dk_wkb,
-		   &diskstat_current[j].dk_wmsec, 
-		   &diskstat_current[j].dk_inflight,
-		   &diskstat_current[j].dk_time, 
-		   &diskstat_current[j].dk_backlog,
-		   /* new additions */
-		   &diskstat_current[j].dk_discards,
-		   &diskstat_current[j].dk_discard_merges,
-		   &diskstat_current[j].dk_discard_sectors,
-		   &diskstat_current[j].dk_discard_time,
-		   &diskstat_current[j].dk_flushes,
-		   &diskstat_current[j].dk_flush_time);
-/*
-	if(strcmp("sr0", &diskstat_current[j].dk_name[0]) == 0 && miss_count++ < 3)
-		continue;
-*/
-
-	diskstat_cleanup(&diskstat_current[j]);
+    while ((line = pf_line(diskstat_pf)) != NULL) {
+	if (j < disks_all) {	/* more lines than at the start is caught by the resync below */
+	    diskstat_parse(line, &diskstat_current[j]);
+	    diskstat_cleanup(&diskstat_current[j]);
+	}
 	j++;
     }
     /* Check if the number of lines in /proc/diskstats is the same as when we started - ek! */
@@ -2701,15 +8360,14 @@ int i;
     /* current/previous all the stats from /proc/disksstats */
 	if(diskstat_current != 0)
 	    free(diskstat_current);
+	diskstat_current = 0;
 
 	if(diskstat_previous != 0)
 	    free(diskstat_previous);
+	diskstat_previous = 0;
 
 	disks_all = 0;
 
-	if(diskstat_fp != 0)
-	    fclose(diskstat_fp);
-
     /* btrfs only devices */
 	for(i=0;i<btrfs_disks_count;i++) {
 	    if(btrfs_disks_list[i] != 0)
@@ -2789,31 +8447,6 @@ void proc_swaps()
 }
 
 
-void strip_spaces(char *s)
-{
-    char *p;
-    int spaced = 1;
-
-    p = s;
-    for (p = s; *p != 0; p++) {
-	if (*p == ':')
-	    *p = ' ';
-	if (*p != ' ') {
-	    *s = *p;
-	    s++;
-	    spaced = 0;
-	} else if (spaced) {
-	    /* do no thing as this is second space */
-	} else {
-	    *s = *p;
-	    s++;
-	    spaced = 1;
-	}
-
-    }
-    *s = 0;
-}
-
 void proc_net_dev(double elapsed, int print)
 {
     struct netinfo {
@@ -2835,49 +8468,48 @@ void proc_net_dev(double elapsed, int print)
     static struct netinfo current;
     static struct netinfo *previous = NULL;
     long long junk;
+    long long *fields[] = {
+	&current.if_ibytes, &current.if_ipackets, &current.if_ierrs, &current.if_idrop,
+	&current.if_ififo, &current.if_iframe, &junk, &junk,
+	&current.if_obytes, &current.if_opackets, &current.if_oerrs, &current.if_odrop,
+	&current.if_ofifo, &current.if_ocolls, &current.if_ocarrier
+    };
 
-    static FILE *fp = 0;
-    char buf[1024];
+    static struct procfile *pf = NULL;
+    char *line;
     static long interfaces = 0;
     int ret;
     long i;
+    int n;
 
     FUNCTION_START;
-    if (fp == (FILE *) 0) {
-	if ((fp = fopen("/proc/net/dev", "r")) == NULL) {
-	    nwarning("failed to open - /proc/net/dev");
-	    return;
-	}
-    } else
-	rewind(fp);
+    if (pf == NULL)
+	pf = pf_open(proc_net_dev_filename);
+    if (!pf_read(pf)) {
+	nwarning("failed to open - /proc/net/dev");
+	return;
+    }
 
-    if (fgets(buf, 1024, fp) == NULL)
+    if (pf_line(pf) == NULL)
 	return;			/* throw away the header line */
-    if (fgets(buf, 1024, fp) == NULL)
+    if (pf_line(pf) == NULL)
 	return;			/* throw away the header line */
 
     if (print)
 	psection("networks");
-    while (fgets(buf, 1024, fp) != NULL) {
-	strip_spaces(buf);
+    while ((line = pf_line(pf)) != NULL) {
 	bzero(&current, sizeof(struct netinfo));
-	ret = sscanf(&buf[0],
-		     "%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-		     (char *) current.if_name,
-		     &current.if_ibytes,
-		     &current.if_ipackets,
-		     &current.if_ierrs,
-		     &current.if_idrop,
-		     &current.if_ififo,
-		     &current.if_iframe,
-		     &junk,
-		     &junk,
-		     &current.if_obytes,
-		     &current.if_opackets,
-		     &current.if_oerrs,
-		     &current.if_odrop,
-		     &current.if_ofifo,
-		     &current.if_ocolls, &current.if_ocarrier);
+	while (*line == ' ')
+	    line++;
+	for (n = 0; *line != ':' && *line != 0 && n < sizeof(current.if_name) - 1; n++)
+	    current.if_name[n] = *line++;
+	current.if_name[n] = 0;
+	ret = (n > 0);
+	for (i = 0; ret && i < sizeof(fields) / sizeof(long long *); i++) {
+	    if (!pf_number(&line, fields[i]))
+		break;
+	    ret++;
+	}
 	if (ret == 16) {
 	    for (i = 0; i < interfaces; i++) {
 		if (!strcmp(current.if_name, previous[i].if_name)) {
@@ -2941,7 +8573,7 @@ void proc_net_dev(double elapsed, int print)
 		}
 	    }
 	} else {
-	    DEBUG fprintf(stderr, "net sscanf wanted 16 returned = %d line=%s\n", ret, (char *) buf);
+	    DEBUG fprintf(stderr, "net sscanf wanted 16 returned = %d name=%s\n", ret, current.if_name);
 	}
     }
     if (print)
@@ -2965,20 +8597,6 @@ char *clean_string(char *s)
     return s;
 }
 
-void etc_hw_mem(long long int l2refill_long[8]) {
-	psection("hw_mem_refill");
-	plong("refill_cpu0", l2refill_long[0]);
-	plong("refill_cpu1", l2refill_long[1]);
-	plong("refill_cpu2", l2refill_long[2]);
-	plong("refill_cpu3", l2refill_long[3]);
-	plong("refill_cpu4", l2refill_long[4]);
-	plong("refill_cpu5", l2refill_long[5]);
-	plong("refill_cpu6", l2refill_long[6]);
-	plong("refill_cpu7", l2refill_long[7]);
-	psectionend();
-
-}
-
 void etc_os_release()
 {
     static FILE *fp = 0;
@@ -3717,7 +9335,7 @@ void identity(char *command, char *version)
     switch(mode) {
         case NJMON: str = "njmon-JSON"; break;
         case NIMON: str = "nimon-InfluxDB"; break;
-        case NSMON: str = "nsmon-Splunk"; break;
+        case NBMON: str = "nbmon-binary"; break;
         default: str = "none";
     }
     pstring("njmon_mode", str);
@@ -3826,6 +9444,98 @@ void identity(char *command, char *version)
     psectionend();
 }
 
+/* - - - - - static inventory - - - - */
+/*
+ * identity, os_release, proc_version, lscpu and cpuinfo hardly ever change but lscpu() is a
+ * fork and exec of /usr/bin/lscpu and together they are several KB of every sample.
+ * They are now sent on the first sample, every inventory_every samples and on the sample
+ * after a change. Changes are looked for every inventory_check seconds, or at the next
+ * sample after a SIGHUP, with a checksum of the files behind them, the online CPUs, the
+ * hostname and the IP addresses. The cpuinfo MHz is only as fresh as the last send.
+ *    NJMON_INVENTORY=samples   send every n samples (default 60, 1 = every sample as before)
+ */
+long inventory_every = 60;
+long inventory_check = 300;	/* seconds */
+long inventory_samples = 0;	/* since the last send */
+long inventory_checked = 0;	/* sample_epoch of the last checksum */
+unsigned long long inventory_sum = 0;
+volatile sig_atomic_t inventory_hangup = 0;
+
+void inventory_hup(int signum)
+{
+    inventory_hangup = 1;
+}
+
+unsigned long long inventory_signature()
+{
+    char *files[] = { "/etc/os-release", "/etc/redhat-release", "/proc/version",
+	"/sys/devices/system/cpu/online", "/sys/devices/system/cpu/present" };
+    unsigned long long hash = HASH_START;
+    struct procfile *pf;
+    struct ifaddrs *interfaces = NULL;
+    struct ifaddrs *p;
+    char host[256];
+    int i;
+
+    FUNCTION_START;
+    for (i = 0; i < sizeof(files) / sizeof(char *); i++) {
+	pf = pf_open(files[i]);
+	if (pf_read(pf))
+	    hash = hash_bytes(hash, pf->buf, strlen(pf->buf));
+    }
+    if (gethostname(host, sizeof(host)) == 0)
+	hash = hash_bytes(hash, host, strlen(host));
+    if (getifaddrs(&interfaces) == 0) {
+	for (p = interfaces; p != NULL; p = p->ifa_next) {
+	    if (p->ifa_addr == NULL)
+		continue;
+	    if (p->ifa_addr->sa_family == AF_INET) {
+		hash = hash_bytes(hash, p->ifa_name, strlen(p->ifa_name));
+		hash = hash_bytes(hash, &((struct sockaddr_in *) p->ifa_addr)->sin_addr,
+				      sizeof(struct in_addr));
+	    } else if (p->ifa_addr->sa_family == AF_INET6) {
+		hash = hash_bytes(hash, p->ifa_name, strlen(p->ifa_name));
+		hash = hash_bytes(hash, &((struct sockaddr_in6 *) p->ifa_addr)->sin6_addr,
+				      sizeof(struct in6_addr));
+	    }
+	}
+	freeifaddrs(interfaces);
+    }
+    return hash;
+}
+
+/* the static sections, when they are due */
+void inventory(char *command, char *version, int reduced_stats)
+{
+    unsigned long long sum;
+    int due = 0;
+
+    FUNCTION_START;
+    if (inventory_checked == 0 || inventory_hangup || sample_epoch - inventory_checked >= inventory_check) {
+	sum = inventory_signature();
+	if (sum != inventory_sum) {
+	    DEBUG fprintf(stderr, "inventory changed 0x%llx to 0x%llx\n", inventory_sum, sum);
+	    due = 1;
+	}
+	inventory_sum = sum;
+	inventory_checked = sample_epoch;
+    }
+    if (inventory_hangup) {
+	inventory_hangup = 0;
+	due = 1;
+    }
+    if (++inventory_samples >= inventory_every)
+	due = 1;
+    if (!due)
+	return;
+    inventory_samples = 0;
+    identity(command, version);
+    etc_os_release();
+    proc_version();
+    lscpu();
+    proc_cpuinfo(reduced_stats);
+}
+
 /* check_pid_file() and make_pid_file()
  *    If you start njmon and it finds there is a copy running already then it will quitely stop.
  *       You can hourly start njmon via crontab and not end up with dozens of copies runnings.
@@ -4012,363 +9722,537 @@ struct procsinfo {
     unsigned long statm_drs;	/* data/stack */
     unsigned long statm_lrs;	/* library */
     unsigned long statm_dt;	/* dirty pages */
+};
+
+/* One pass over /proc each sample. The processes stay in a table found by pid through an
+ * open addressing index, so the previous sample is there without matching lists, and their
+ * schedstat and stat files are kept open and pread() while the process lives (up to half the
+ * open file limit, after that they are opened for each read). schedstat only has the run
+ * time of the main thread, so for a single threaded process (which has to run to start a
+ * thread) stat is only read again once schedstat shows it has run, or every PROC_STAT_EVERY
+ * samples so the memory sizes of sleeping processes move too. Threaded processes have their
+ * stat read every time. Each slot keeps when its two stats were read and the rates are over
+ * that time, not the sample's elapsed. statm is only read for those sent. A slot whose stat
+ * has a new start time is a reused pid, so it starts again without a previous.
+ * Files are opened with openat() on the /proc directory fd, user names are cached by uid
+ * and the top NJMON_PROCESSES_TOP (default all over the -t threshold) are picked with a
+ * bounded heap rather than a sort.
+ */
+#define PROC_STAT_EVERY 10
+
+struct proc_slot {
+    int pid;
+    int generation;		/* the sample it was last seen */
+    int schedstat_fd;		/* -1 if not kept open */
+    int stat_fd;
+    int statm_fd;
+    long long runtime;		/* from schedstat, -1 if there is none */
+    int now;			/* info[now] is current, the other previous */
+    int samples;		/* reads so far, 2 or more has a previous */
+    int skipped;		/* samples since stat was read */
+    double read[2];		/* when info[] was read */
+    uid_t uid;
+    char username[64];
+    struct procsinfo info[2];
+};
 
-    /* Process stats for disks */
-    unsigned long long read_io;	/* storage read bytes */
-    unsigned long long write_io;/* storage write bytes */
+struct proc_slot *proc_slots = NULL;
+double proc_read_time;		/* of this pass over /proc */
+long proc_slots_count = 0;
+long proc_slots_size = 0;
+int *proc_index = NULL;		/* slot number or -1 */
+long proc_index_size = 0;	/* a power of 2 */
+DIR *proc_dir = NULL;
+int proc_generation = 0;
+long proc_fds_kept = 0;
+long proc_fds_max = 0;
+long processes_top = 0;		/* 0 = all over the threshold */
+int proc_schedstat = 0;		/* the kernel has /proc/<pid>/schedstat */
+
+struct proc_user {
+    uid_t uid;
+    int used;
+    char name[64];
 };
+#define PROC_USERS 1024		/* a power of 2 */
+struct proc_user proc_users[PROC_USERS];
+long proc_users_count = 0;
+
+struct proc_top {
+    long slot;
+    long time;
+} *proc_heap = NULL;
+long proc_heap_count = 0;
+long proc_heap_size = 0;
+
+void proc_username(uid_t userid, char *name)
+{
+    struct passwd pw;
+    struct passwd *pwpointer;
+    char pwbuf[1024 * 4];
+    long i;
+
+    name[0] = 0;
+    if (userid == (uid_t) 0) {
+	strcpy(name, "root");
+	return;
+    }
+    for (i = (userid * 2654435761UL) & (PROC_USERS - 1); proc_users[i].used; i = (i + 1) & (PROC_USERS - 1)) {
+	if (proc_users[i].uid == userid) {
+	    strcpy(name, proc_users[i].name);
+	    return;
+	}
+    }
+    if (getpwuid_r(userid, &pw, pwbuf, sizeof(pwbuf), &pwpointer) == 0 && pwpointer != 0) {
+	strncpy(name, pw.pw_name, 63);
+	name[63] = 0;
+    }
+    if (proc_users_count < PROC_USERS / 2) {	/* unknown uids are cached as "" too */
+	proc_users[i].uid = userid;
+	proc_users[i].used = 1;
+	strcpy(proc_users[i].name, name);
+	proc_users_count++;
+    }
+}
+
+/* index position of the pid or the empty one where it would go */
+long proc_index_find(int pid)
+{
+    long i;
+
+    for (i = (pid * 2654435761UL) & (proc_index_size - 1); proc_index[i] != -1; i = (i + 1) & (proc_index_size - 1))
+	if (proc_slots[proc_index[i]].pid == pid)
+	    break;
+    return i;
+}
 
-struct data {
-    struct procsinfo *procs;
-    long proc_records;
-    long processes;
-} database[2], *p = &database[0], *q = &database[1], *r;
+void proc_index_grow()
+{
+    long i;
 
+    free(proc_index);
+    proc_index_size = proc_index_size ? proc_index_size * 2 : 4096;
+    proc_index = malloc(proc_index_size * sizeof(int));
+    for (i = 0; i < proc_index_size; i++)
+	proc_index[i] = -1;
+    for (i = 0; i < proc_slots_count; i++)
+	proc_index[proc_index_find(proc_slots[i].pid)] = i;
+}
 
-/* We order this array rather than the actual process tables
- * the index is the position in the process table and
- * the time is the CPU used in the last period in seconds
- */
-struct topper {
-    int pindex;
-    int qindex;
-    long time;
-} *topper = NULL;
-int topper_size = 0;
+/* take out one entry shifting back the ones after it that probed past it */
+void proc_index_remove(long i)
+{
+    long j = i;
+    long home;
+
+    for (;;) {
+	proc_index[i] = -1;
+	for (;;) {
+	    j = (j + 1) & (proc_index_size - 1);
+	    if (proc_index[j] == -1)
+		return;
+	    home = (proc_slots[proc_index[j]].pid * 2654435761UL) & (proc_index_size - 1);
+	    if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
+		break;
+	}
+	proc_index[i] = proc_index[j];
+	i = j;
+    }
+}
 
-/* Routine used by qsort to order the processes by CPU usage */
-int cpu_compare(const void *a, const void *b)
+void proc_slot_close(struct proc_slot *s)
 {
-    return (int) (((struct topper *) b)->time -
-		  ((struct topper *) a)->time);
+    if (s->schedstat_fd != -1) {
+	close(s->schedstat_fd);
+	proc_fds_kept--;
+    }
+    if (s->stat_fd != -1) {
+	close(s->stat_fd);
+	proc_fds_kept--;
+    }
+    if (s->statm_fd != -1) {
+	close(s->statm_fd);
+	proc_fds_kept--;
+    }
+    s->schedstat_fd = s->stat_fd = s->statm_fd = -1;
 }
 
-int proc_procsinfo(int pid, int index)
+/* read a /proc/<pid>/ file in to buf, keeping it open if there is room, returns the size or -1 */
+int proc_slot_file(struct proc_slot *s, char *name, int *keep, char *buf, int size)
 {
-    FILE *fp;
-    int fd;
     char filename[64];
-    char buf[1024 * 4];
-    int size = 0;
-    int ret = 0;
-    int count = 0;
-    int i;
     struct stat statbuf;
-    uid_t userid;
-    static struct passwd pw;
-    static struct passwd *pwpointer;
-    static char pwbuf[1024 * 4];
-
-    FUNCTION_START;
-    /* the statistic file for the process */
-    snprintf(filename, 64, "/proc/%d/stat", pid);
+    int fd = *keep;
+    int len;
 
-    if ((fd = open(filename, O_RDONLY)) == -1) {
-	DEBUG fprintf(stderr, "ERROR: failed to open file %s", filename);
-	return 0;
+    if (fd != -1) {
+	if ((len = pread(fd, buf, size - 1, 0)) > 0) {
+	    buf[len] = 0;
+	    return len;
+	}
+	close(fd);		/* gone or the pid used again, so try a fresh open */
+	proc_fds_kept--;
+	*keep = -1;
     }
-    size = read(fd, buf, 1024);
-
-    if (fstat(fd, &statbuf) != 0) {
-	DEBUG fprintf(stderr, "ERROR: failed to stat file %s", filename);
-	return 0;
+    snprintf(filename, sizeof(filename), "%d/%s", s->pid, name);
+    if ((fd = openat(dirfd(proc_dir), filename, O_RDONLY | O_CLOEXEC)) == -1) {
+	DEBUG fprintf(stderr, "ERROR: failed to open file %s/%s\n", proc_dirname, filename);
+	return -1;
     }
-
-    /* get the user id and user name  using the open file descriptor */
-    userid = statbuf.st_uid;
-    p->procs[index].uid = userid;
-    if (userid == (uid_t) 0) {
-	strcpy(p->procs[index].username, "root");
+    if (keep == &s->stat_fd && fstat(fd, &statbuf) == 0 && (s->samples == 0 || statbuf.st_uid != s->uid)) {
+	s->uid = statbuf.st_uid;	/* the owner from the open file */
+	proc_username(s->uid, s->username);
+    }
+    len = pread(fd, buf, size - 1, 0);
+    if (proc_fds_kept < proc_fds_max) {
+	*keep = fd;
+	proc_fds_kept++;
     } else {
-	pwpointer = &pw;
-	ret = getpwuid_r(userid, &pw, pwbuf, sizeof(pwbuf), &pwpointer);
-	if (ret == 0 && pwpointer != 0) {
-	    strncpy(p->procs[index].username, pw.pw_name, 63);
-	    p->procs[index].username[63] = 0;
-	}
+	close(fd);
     }
-    close(fd);
+    if (len <= 0)
+	return -1;
+    buf[len] = 0;
+    return len;
+}
 
-    if (size == -1) {
-	DEBUG fprintf(stderr, "ERROR: procsinfo read returned = %d assuming process stopped pid=%d errno=%d\n", ret, pid, errno);
-	return 0;
-    }
-    ret =
-	sscanf(buf, "%d (%s)", &p->procs[index].pi_pid,
-	       &p->procs[index].pi_comm[0]);
-    if (ret != 2) {
-	DEBUG fprintf(stderr, "procsinfo sscanf returned = %d line=%s\n", ret, buf);
-	return 0;
-    }
-    p->procs[index].pi_comm[strlen(p->procs[index].pi_comm) - 1] = 0;
+/* get the process stats in to the slot's other info,
+ * returns 0 if it has gone, 1 if read or 2 if it has not run since the last read */
+int proc_slot_read(struct proc_slot *s)
+{
+    struct procsinfo *pi = &s->info[!s->now];
+    char buf[1024 * 4];
+    char *c;
+    char *end;
+    long long v[39];
+    long long runtime = -1;
+    int len;
+    int i;
 
-    /* now look for ") " as dumb Infiniband driver includes "()" */
-    for (count = 0; count < size; count++) {
-	if (buf[count] == ')' && buf[count + 1] == ' ')
-	    break;
-    }
-    if (count == size) {
-	DEBUG fprintf(stderr, "procsinfo failed to find end of command buf=%s\n", buf);
-	return 0;
-    }
-    count++;
-    count++;
-
-    ret = sscanf(&buf[count],
-/*		 1  2  3  4  5  6  7   8   9   10  11  12  13  14  15  16  17  18  19  20  21  22  23  24  25  26  27  28  29  30  31  32  33  34  35 36 37  38  39  40 */
-		 "%c %d %d %d %d %d %lu %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d %lu %lu %llu",
-		 /* column 1 and 2 handled above */
-		 &p->procs[index].pi_state,	/*3 numbers taken from "man proc" */
-		 &p->procs[index].pi_ppid,	/*4 */
-		 &p->procs[index].pi_pgrp,	/*5 */
-		 &p->procs[index].pi_session,	/*6 */
-		 &p->procs[index].pi_tty_nr,	/*7 */
-		 &p->procs[index].pi_tty_pgrp,	/*8 */
-		 &p->procs[index].pi_flags,	/*9 */
-		 &p->procs[index].pi_minflt,	/*10 */
-		 &p->procs[index].pi_child_min_flt,	/*11 */
-		 &p->procs[index].pi_majflt,	/*12 */
-		 &p->procs[index].pi_child_maj_flt,	/*13 */
-		 &p->procs[index].pi_utime,	/*14 */
-		 &p->procs[index].pi_stime,	/*15 */
-		 &p->procs[index].pi_child_utime,	/*16 */
-		 &p->procs[index].pi_child_stime,	/*18 */
-		 &p->procs[index].pi_priority,	/*19 */
-		 &p->procs[index].pi_nice,	/*20 */
-		 &p->procs[index].pi_num_threads,	/*21 */
-		 &p->procs[index].pi_it_real_value,	/*22 */
-		 &p->procs[index].pi_start_time,	/*23 */
-		 &p->procs[index].pi_vsize,	/*24 */
-		 &p->procs[index].pi_rss,	/*25 */
-		 &p->procs[index].pi_rsslimit,	/*26 */
-		 &p->procs[index].pi_start_code,	/*27 */
-		 &p->procs[index].pi_end_code,	/*28 */
-		 &p->procs[index].pi_start_stack,	/*29 */
-		 &p->procs[index].pi_esp,	/*29 */
-		 &p->procs[index].pi_eip,	/*30 */
-		 &p->procs[index].pi_signal_pending,	/*31 */
-		 &p->procs[index].pi_signal_blocked,	/*32 */
-		 &p->procs[index].pi_signal_ignore,	/*33 */
-		 &p->procs[index].pi_signal_catch,	/*34 */
-		 &p->procs[index].pi_wchan,	/*35 */
-		 &p->procs[index].pi_swap_pages,	/*36 */
-		 &p->procs[index].pi_child_swap_pages,	/*37 */
-		 &p->procs[index].pi_signal_exit,	/*38 */
-		 &p->procs[index].pi_last_cpu	/*39 */
-		 , &p->procs[index].pi_realtime_priority,	/*40 */
-		 &p->procs[index].pi_sched_policy,	/*41 */
-		 &p->procs[index].pi_delayacct_blkio_ticks	/*42 */
-	);
-    if (ret != 40) {
-	DEBUG fprintf(stderr, "procsinfo2 sscanf wanted 40 returned = %d pid=%d line=%s\n", ret, pid, buf);
+    /* schedstat is much cheaper for the kernel to make than stat and if the run time of a single
+     * threaded process has not moved nor have utime and stime, so the last stat read still stands */
+    if (s->schedstat_fd != -1 && (len = pread(s->schedstat_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+	buf[len] = 0;
+	c = buf;
+	runtime = pf_ll(&c);
+	if (runtime == s->runtime && s->samples > 0 && s->info[s->now].pi_num_threads == 1 && ++s->skipped < PROC_STAT_EVERY)
+	    return 2;
+    } else if (proc_schedstat && proc_slot_file(s, "schedstat", &s->schedstat_fd, buf, sizeof(buf)) > 0) {
+	c = buf;
+	runtime = pf_ll(&c);
+    }
+    s->runtime = runtime;
+    s->skipped = 0;
+    if (proc_slot_file(s, "stat", &s->stat_fd, buf, sizeof(buf)) == -1)
 	return 0;
-    }
-    snprintf(filename, 64, "/proc/%d/statm", pid);
-    if ((fd = open(filename, O_RDONLY)) == -1) {
-	DEBUG fprintf(stderr, "failed to open file %s", filename);
+    /* the command can have spaces and brackets in it so it ends at the last ") " */
+    if ((c = strchr(buf, '(')) == NULL || (end = strrchr(c, ')')) == NULL || end[1] != ' ') {
+	DEBUG fprintf(stderr, "procsinfo failed to find end of command buf=%s\n", buf);
 	return 0;
     }
-    size = read(fd, buf, 1024 * 4);
-    close(fd);			/* close it even if the read failed, the file could have been removed 
-				   between open & read i.e. the device driver does not behave like a file */
-    if (size == -1) {
-	DEBUG fprintf(stderr, "failed to read file %s", filename);
-	return 0;
+    pi->pi_pid = s->pid;
+    len = end - c - 1;
+    if (len > sizeof(pi->pi_comm) - 1)
+	len = sizeof(pi->pi_comm) - 1;
+    memcpy(pi->pi_comm, c + 1, len);
+    pi->pi_comm[len] = 0;
+    for (i = 0; i < len; i++)
+	if (pi->pi_comm[i] == ' ')	/* it is used as a name */
+	    pi->pi_comm[i] = '_';
+    c = end + 2;
+    pi->pi_state = *c++;
+    for (i = 0; i < 39; i++) {	/* fields 4 to 42 of "man proc" */
+	if (!pf_number(&c, &v[i])) {
+	    DEBUG fprintf(stderr, "procsinfo wanted 39 numbers after the state got %d pid=%d\n", i, s->pid);
+	    return 0;
+	}
     }
+    pi->pi_ppid = v[0];
+    pi->pi_pgrp = v[1];
+    pi->pi_session = v[2];
+    pi->pi_tty_nr = v[3];
+    pi->pi_tty_pgrp = v[4];
+    pi->pi_flags = v[5];
+    pi->pi_minflt = v[6];
+    pi->pi_child_min_flt = v[7];
+    pi->pi_majflt = v[8];
+    pi->pi_child_maj_flt = v[9];
+    pi->pi_utime = v[10];
+    pi->pi_stime = v[11];
+    pi->pi_child_utime = v[12];
+    pi->pi_child_stime = v[13];
+    pi->pi_priority = v[14];
+    pi->pi_nice = v[15];
+    pi->pi_num_threads = v[16];
+    pi->pi_it_real_value = v[17];
+    pi->pi_start_time = v[18];
+    pi->pi_vsize = v[19];
+    pi->pi_rss = v[20];
+    pi->pi_rsslimit = v[21];
+    pi->pi_start_code = v[22];
+    pi->pi_end_code = v[23];
+    pi->pi_start_stack = v[24];
+    pi->pi_esp = v[25];
+    pi->pi_eip = v[26];
+    pi->pi_signal_pending = v[27];
+    pi->pi_signal_blocked = v[28];
+    pi->pi_signal_ignore = v[29];
+    pi->pi_signal_catch = v[30];
+    pi->pi_wchan = v[31];
+    pi->pi_swap_pages = v[32];
+    pi->pi_child_swap_pages = v[33];
+    pi->pi_signal_exit = v[34];
+    pi->pi_last_cpu = v[35];
+    pi->pi_realtime_priority = v[36];
+    pi->pi_sched_policy = v[37];
+    pi->pi_delayacct_blkio_ticks = v[38];
+    pi->uid = s->uid;
+    strcpy(pi->username, s->username);
+
+    if (s->samples > 0 && pi->pi_start_time != s->info[s->now].pi_start_time)
+	s->samples = 0;		/* the pid was used again, the previous was another process */
+    s->read[!s->now] = proc_read_time;
+    s->now = !s->now;
+    s->samples++;
+    return 1;
+}
 
-    ret = sscanf(&buf[0], "%lu %lu %lu %lu %lu %lu %lu",
-		 &p->procs[index].statm_size,
-		 &p->procs[index].statm_resident,
-		 &p->procs[index].statm_share,
-		 &p->procs[index].statm_trs,
-		 &p->procs[index].statm_lrs,
-		 &p->procs[index].statm_drs, &p->procs[index].statm_dt);
-    if (ret != 7) {
-	DEBUG fprintf(stderr, "sscanf wanted 7 returned = %d line=%s\n", ret,
-		    buf);
-	return 0;
-    }
-    if (uid == (uid_t) 0) {
-	p->procs[index].read_io = 0;
-	p->procs[index].write_io = 0;
-	sprintf(filename, "/proc/%d/io", pid);
-	if ((fp = fopen(filename, "r")) != NULL) {
-	    for (i = 0; i < 6; i++) {
-		if (fgets(buf, 1024, fp) == NULL) {
-		    break;
-		}
-		if (strncmp("read_bytes:", buf, 11) == 0)
-		    sscanf(&buf[12], "%lld", &p->procs[index].read_io);
-		if (strncmp("write_bytes:", buf, 12) == 0)
-		    sscanf(&buf[13], "%lld", &p->procs[index].write_io);
-	    }
+/* the memory sizes are only read for the processes that are sent */
+void proc_slot_statm(struct proc_slot *s)
+{
+    struct procsinfo *pi = &s->info[s->now];
+    char buf[1024];
+    char *c = buf;
+    long long v[7] = { 0 };
+    int i;
+
+    if (proc_slot_file(s, "statm", &s->statm_fd, buf, sizeof(buf)) == -1)
+	buf[0] = 0;
+    for (i = 0; i < 7; i++) {
+	if (!pf_number(&c, &v[i])) {
+	    DEBUG fprintf(stderr, "statm wanted 7 numbers got %d line=%s\n", i, buf);
+	    break;
 	}
+    }
+    pi->statm_size = v[0];
+    pi->statm_resident = v[1];
+    pi->statm_share = v[2];
+    pi->statm_trs = v[3];
+    pi->statm_lrs = v[4];
+    pi->statm_drs = v[5];
+    pi->statm_dt = v[6];
+}
 
-	if (fp != NULL)
-	    fclose(fp);
+/* a min heap of the busiest processes, bounded if there is a top */
+void proc_heap_add(long slot, long time)
+{
+    struct proc_top t = { slot, time };
+    long i;
+    long child;
+
+    if (processes_top > 0 && proc_heap_count == processes_top) {
+	if (time <= proc_heap[0].time)
+	    return;
+	i = 0;			/* replace the smallest and sift it down */
+	for (;;) {
+	    child = i * 2 + 1;
+	    if (child >= proc_heap_count)
+		break;
+	    if (child + 1 < proc_heap_count && proc_heap[child + 1].time < proc_heap[child].time)
+		child++;
+	    if (proc_heap[child].time >= time)
+		break;
+	    proc_heap[i] = proc_heap[child];
+	    i = child;
+	}
+	proc_heap[i] = t;
+	return;
     }
-    return 1;
+    if (proc_heap_count == proc_heap_size) {
+	proc_heap_size = proc_heap_size ? proc_heap_size * 2 : 256;
+	proc_heap = realloc(proc_heap, proc_heap_size * sizeof(struct proc_top));
+    }
+    for (i = proc_heap_count++; i > 0 && proc_heap[(i - 1) / 2].time > time; i = (i - 1) / 2)
+	proc_heap[i] = proc_heap[(i - 1) / 2];
+    proc_heap[i] = t;
 }
 
-int isnumbers(char *s)
+/* take the heap apart putting the smallest at the end so it is busiest first */
+void proc_heap_sort()
 {
-    while (*s != 0) {
-	if (*s < '0' || *s > '9')
-	    return 0;
-	s++;
+    struct proc_top t;
+    long n;
+    long i;
+    long child;
+
+    for (n = proc_heap_count - 1; n > 0; n--) {
+	t = proc_heap[n];
+	proc_heap[n] = proc_heap[0];
+	for (i = 0;;) {
+	    child = i * 2 + 1;
+	    if (child >= n)
+		break;
+	    if (child + 1 < n && proc_heap[child + 1].time < proc_heap[child].time)
+		child++;
+	    if (proc_heap[child].time >= t.time)
+		break;
+	    proc_heap[i] = proc_heap[child];
+	    i = child;
+	}
+	proc_heap[i] = t;
     }
-    return 1;
 }
 
-#define JUST_RETURN_THE_COUNT 0
+/* seconds between the slot's last two stat reads */
+#define PROC_ELAPSED(s) ((s)->read[(s)->now] - (s)->read[!(s)->now])
 
-/* Read directory /proc/<PID> for process information
- *
- * If just counting them the number of directory = processes then return the count.
- *
- * Otherwise for each process call proc_procsinfo() to get the process details
- *  up to the max_records.
- */
-int getprocs(int max_records)
+/* walk /proc once reading every process and put the busy ones in the heap */
+void processes_collect()
 {
+    struct timespec ts;
     struct dirent *dent;
-    DIR *procdir;
-    int count = 0;
+    struct proc_slot *s;
+    struct procsinfo *now;
+    struct procsinfo *before;
+    long slot;
+    long i;
+    long cputime;
+    int pid;
+    int read;
+    char *c;
 
     FUNCTION_START;
-    if ((char *) (procdir = opendir("/proc")) == NULL) {
-	printf("opendir(/proc) failed");
-	return 0;
-    }
-    while ((char *) (dent = readdir(procdir)) != NULL) {
-	if (dent->d_type == 4) {	/* is this a directlory */
-	    /* mainframes report 0 = unknown every time !  */
-	    if (isnumbers(dent->d_name)) {
-		if (max_records != JUST_RETURN_THE_COUNT) {	/* getting the details mode */
-		    count += proc_procsinfo(atoi(dent->d_name), count);
-		    if (count == max_records) {
-			break;
-		    }
-		} else {	/* just counting the processes mode */
-		    count++;
-		}
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    proc_read_time = ts.tv_sec + ts.tv_nsec / 1.0e9;
+    proc_generation++;
+    proc_heap_count = 0;
+    rewinddir(proc_dir);
+    while ((dent = readdir(proc_dir)) != NULL) {
+	if (dent->d_type != DT_DIR && dent->d_type != DT_UNKNOWN)	/* mainframes report unknown */
+	    continue;
+	for (pid = 0, c = dent->d_name; *c >= '0' && *c <= '9'; c++)
+	    pid = pid * 10 + (*c - '0');
+	if (*c != 0 || pid == 0)
+	    continue;
+	i = proc_index_find(pid);
+	if (proc_index[i] == -1) {	/* new process */
+	    if (proc_slots_count == proc_slots_size) {
+		proc_slots_size = proc_slots_size ? proc_slots_size * 2 : 1024;
+		proc_slots = realloc(proc_slots, proc_slots_size * sizeof(struct proc_slot));
 	    }
+	    s = &proc_slots[proc_slots_count];
+	    s->pid = pid;
+	    s->schedstat_fd = s->stat_fd = s->statm_fd = -1;
+	    s->runtime = -1;
+	    s->now = 0;
+	    s->samples = 0;
+	    s->skipped = 0;
+	    s->generation = 0;
+	    s->uid = 0;
+	    s->username[0] = 0;
+	    proc_index[i] = proc_slots_count++;
+	    if (proc_slots_count * 2 > proc_index_size)
+		proc_index_grow();
 	}
-    }
-    closedir(procdir);
-    DEBUG printf("GETPROCS returning %d\n", count);
-    return count;
+	slot = proc_index[proc_index_find(pid)];
+	s = &proc_slots[slot];
+	if ((read = proc_slot_read(s)) == 0)
+	    continue;		/* went away, dropped below as it is not in this generation */
+	s->generation = proc_generation;
+	if (read == 2 || s->samples < 2)
+	    continue;		/* no CPU time or no previous */
+	now = &s->info[s->now];
+	before = &s->info[!s->now];
+	cputime = (now->pi_utime - before->pi_utime) + (now->pi_stime - before->pi_stime);
+	if ((cputime / PROC_ELAPSED(s)) > ignore_threshold)	/* only interesting processes */
+	    proc_heap_add(slot, cputime);
+    }
+    proc_heap_sort();
 }
 
-/* Workout how many prcesses we have and make sure we have enough structures */
-void processes_space_manage()
+/* drop the processes that were not found this time */
+void processes_tidy()
 {
-    int count;
-    int rounded_up;
-
-    FUNCTION_START;
-    /* how many processes ? */
-    count = getprocs(JUST_RETURN_THE_COUNT);
+    long i;
 
-    DEBUG fprintf(stderr, "++++ processes_space_manage() BEFORE proc_records p=%ld q=%ld processes p=%ld q=%ld count=%d\n",
-	     p->proc_records, q->proc_records, p->processes, q->processes, count);
-    /* allocate enough data structures plus a few in case  processes start */
-    rounded_up = count + 64;
-    if (count >= p->proc_records) {
-	p->procs =
-	    realloc(p->procs, sizeof(struct procsinfo) * rounded_up);
-	p->proc_records = rounded_up;
-    }
-    if (count >= q->proc_records) {
-	q->procs =
-	    realloc(q->procs, sizeof(struct procsinfo) * rounded_up);
-	q->proc_records = rounded_up;
-    }
-    if (count >= topper_size) {
-	topper = realloc(topper, sizeof(struct topper) * rounded_up);
-	topper_size = rounded_up;
+    for (i = proc_slots_count - 1; i >= 0; i--) {
+	if (proc_slots[i].generation == proc_generation)
+	    continue;
+	proc_slot_close(&proc_slots[i]);
+	proc_index_remove(proc_index_find(proc_slots[i].pid));
+	if (i != --proc_slots_count) {	/* move the last one in to the gap */
+	    proc_slots[i] = proc_slots[proc_slots_count];
+	    proc_index[proc_index_find(proc_slots[i].pid)] = i;
+	}
     }
-    DEBUG fprintf(stderr, "++++ processes_space_manage() AFTER proc_records p=%ld q=%ld processes p=%ld q=%ld round_up=%d\n",
-	     p->proc_records, q->proc_records, p->processes, q->processes,
-	     rounded_up);
 }
 
 /* initialise processor data structures */
 void processes_init()
 {
+    struct rlimit limit;
+    char *s;
+
     FUNCTION_START;
     DEBUG fprintf(stderr, "processes_init\n");
-
-    /* allocate space for process records */
-    processes_space_manage();
+    if ((proc_dir = opendir(proc_dirname)) == NULL) {
+	sprintf(errorbuf, "opendir(%s) failed errno=%d (%s) - no processes", proc_dirname, errno, strerror(errno));
+	nwarning(errorbuf);
+	return;
+    }
+    if ((s = getenv("NJMON_PROCESSES_TOP")) != 0)
+	processes_top = atol(s);
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+	if (limit.rlim_cur < limit.rlim_max) {
+	    limit.rlim_cur = limit.rlim_max;
+	    setrlimit(RLIMIT_NOFILE, &limit);
+	    getrlimit(RLIMIT_NOFILE, &limit);
+	}
+	proc_fds_max = limit.rlim_cur / 2;	/* leave room for everything else */
+    }
+    proc_schedstat = (faccessat(dirfd(proc_dir), "self/schedstat", R_OK, 0) == 0);
+    proc_index_grow();
 
     /* fill the first set */
-    p->processes = getprocs(p->proc_records);
+    processes_collect();
+    processes_tidy();
 }
 
-#define CURRENT(member) (p->procs[pindex].member)
-#define PREVIOUS(member) (q->procs[qindex].member)
+#define CURRENT(member) (s->info[s->now].member)
+#define PREVIOUS(member) (s->info[!s->now].member)
 #define TIMEDELTA(member) (CURRENT(member) - PREVIOUS(member))
 #define COUNTDELTA(member) ( (PREVIOUS(member) > CURRENT(member)) ? 0 : (CURRENT(member) - PREVIOUS(member)) )
 
 /* processes() does the bulk work
- * 1 get the latest process stats
- * 2 build the topper structures of matching previous & current processes matched by pid
- * 3 save data for processes using over the threshold CPU percentage
+ * 1 get the latest process stats and the busiest in the heap
+ * 2 save data for processes using over the threshold CPU percentage
+ * 3 forget the processes that have gone
  */
 void processes(double elapsed,int proc_pid)
 {
-    int pindex = 0;
-    int qindex = 0;
+    struct proc_slot *s;
+    double interval;		/* the slot's own, as it may not have been read last sample */
     int entry = 0;
-    int max_sorted = 0;
     char str[256];
-    long cputime;
 #define pagesize  (1024 * 4)
 
     FUNCTION_START;
-    /* swap databases note: q is previous and p is current */
-    r = q;
-    q = p;
-    p = r;
-
-    /* recaculate the number of processes */
-    processes_space_manage();
-
-    /* get fresh top processes data */
-    p->processes = getprocs(p->proc_records);
-
-    /* Sort the processes by CPU utilisation */
-    /* 1st find matching pids in both lists */
-    for (pindex = 0, max_sorted = 0; pindex < p->processes; pindex++) {
-	/* move forward in the previous array to find a match */
-	for (qindex = 0; qindex < q->processes; qindex++) {
-	    if (p->procs[pindex].pi_pid == q->procs[qindex].pi_pid) {	/* found a match */
-		cputime = TIMEDELTA(pi_utime) + TIMEDELTA(pi_stime);
-		if ((cputime / elapsed) > ignore_threshold) {
-		    /* save only interesting processes (i.e. not near zero cputime) */
-		    topper[max_sorted].pindex = pindex;
-		    topper[max_sorted].qindex = qindex;
-		    topper[max_sorted].time = cputime;
-		    max_sorted++;
-		}
-		break;
-	    }
-	}
-    }
-    if (max_sorted <= 0) /* empty list */
+    if (proc_dir == NULL)
 	return;
-
-    qsort((void *) &topper[0], max_sorted, sizeof(struct topper),
-	      &cpu_compare);
+    processes_collect();
+    if (proc_heap_count <= 0) { /* empty list */
+	processes_tidy();
+	return;
+    }
 
     /* Even if we have no processes create a processors section + end
      * No proceses over the threadold is still valid JSON  - I hope.
      * */
     psection("processes");
-    for (entry = 0; entry < max_sorted; entry++) {
-	pindex = topper[entry].pindex;
-	qindex = topper[entry].qindex;
+    for (entry = 0; entry < proc_heap_count; entry++) {
+	s = &proc_slots[proc_heap[entry].slot];
+	proc_slot_statm(s);
+	interval = PROC_ELAPSED(s);
 
 	if(proc_pid)
 	    sprintf(str, "%s_%ld", CURRENT(pi_comm), (long) CURRENT(pi_pid));
@@ -4388,9 +10272,9 @@ void processes(double elapsed,int proc_pid)
 	phex("flags", CURRENT(pi_flags));
 	pstring("state", get_state(CURRENT(pi_state)));
 	plong("threads", CURRENT(pi_num_threads));
-	pdouble("cpu_percent", topper[entry].time / elapsed);
-	pdouble("cpu_usr", TIMEDELTA(pi_utime) / elapsed);
-	pdouble("cpu_sys", TIMEDELTA(pi_stime) / elapsed);
+	pdouble("cpu_percent", proc_heap[entry].time / interval);
+	pdouble("cpu_usr", TIMEDELTA(pi_utime) / interval);
+	pdouble("cpu_sys", TIMEDELTA(pi_stime) / interval);
 	pdouble("cpu_usr_total_secs",
 		CURRENT(pi_utime) / (double) sysconf(_SC_CLK_TCK));
 	pdouble("cpu_sys_total_secs",
@@ -4401,8 +10285,8 @@ void processes(double elapsed,int proc_pid)
 	plong("statm_restext_kb", CURRENT(statm_trs) * pagesize / 1024);
 	plong("statm_resdata_kb", CURRENT(statm_drs) * pagesize / 1024);
 	plong("statm_share_kb", CURRENT(statm_share) * pagesize / 1024);
-	pdouble("minorfault", COUNTDELTA(pi_minflt) / elapsed);
-	pdouble("majorfault", COUNTDELTA(pi_majflt) / elapsed);
+	pdouble("minorfault", COUNTDELTA(pi_minflt) / interval);
+	pdouble("majorfault", COUNTDELTA(pi_majflt) / interval);
 
 	plong("it_real_value", CURRENT(pi_it_real_value));
 	pdouble("starttime_secs",
@@ -4441,8 +10325,290 @@ void processes(double elapsed,int proc_pid)
 	psubend();
     }
     psectionend();
+    processes_tidy();
+}
+
+/* - - - - - parallel collectors - - - - */
+/*
+ * With -j n the slow collectors (disks, networks, filesystems, NFS, GPFS and processes) run on
+ * n worker threads while the main thread does the rest. Each collector writes in to its own
+ * buffer (the output, saved_section and first_sub p function state is per thread) and the main
+ * thread appends the buffers at the place the collector used to run, so the record is byte for
+ * byte the same as without -j. The main thread waits for a collector until half of -s
+ * (NJMON_COLLECTOR_TIMEOUT=seconds) after the sample started. A collector still running then,
+ * like a statfs() on a hung NFS mount, is late: its sections are left out of the record rather
+ * than sent with old numbers under the new time, and it is not started again until it finishes
+ * (what that run made is thrown away too), so it only holds up its own sections. Each worker
+ * run divides by the time since that collector's own last run, as after a late one that is
+ * more than one -s.
+ * NBMON's name dictionary and the -N change table are shared by every section, so with -C or
+ * -N the collectors run in the main thread as before.
+ */
+#define COLLECT_DISKSTATS	0
+#define COLLECT_NET		1
+#define COLLECT_FILESYSTEMS	2
+#define COLLECT_NFS		3
+#define COLLECT_GPFS		4
+#define COLLECT_PROCESSES	5
+#define COLLECTORS_MAX		6
+
+#define COLLECTOR_IDLE		0
+#define COLLECTOR_QUEUED	1
+#define COLLECTOR_RUNNING	2
+#define COLLECTOR_DONE		3
+
+struct collector_output {
+    char *output;
+    long output_size;
+    long output_char;
+    int sections;		/* njmon_internal_stats counts from the worker */
+    int subsections;
+    int strings;
+    int longs;
+    int doubles;
+    int hexs;
+};
+
+struct collector {
+    int on;
+    int state;
+    int late;			/* missed the deadline and not finished since */
+    double read_time;		/* CLOCK_MONOTONIC seconds its last run started, only the worker's */
+    struct collector_output now;	/* the worker's buffer */
+};
 
+struct collector collectors[COLLECTORS_MAX];
+pthread_t *collector_workers;
+pthread_mutex_t collector_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t collector_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t collector_done = PTHREAD_COND_INITIALIZER;
+double collector_timeout = 0.0;	/* seconds after collectors_start() to wait, 0 = -s / 2 */
+struct timespec collector_deadline;
+
+/* the collector settings from the command line */
+double collector_elapsed;
+int collector_storage;
+int collector_btrfs;
+int collector_mountpoint;
+int collector_proc_pid;
+
+char *collector_names[COLLECTORS_MAX] = {
+    "diskstats", "net", "filesystems", "nfs", "gpfs", "processes"
+};
+
+int collector_self[COLLECTORS_MAX] = {
+    SELF_DISKSTATS, SELF_NET, SELF_FILESYSTEMS, SELF_NFS, SELF_GPFS, SELF_PROCESSES
+};
+
+void collector_run(int id)
+{
+    struct self_clock self_clock;
+    struct timespec ts;
+    double elapsed = collector_elapsed;
+    double now;
+
+    if (collector_threads) {	/* since its own last read, a late run makes that longer than -s */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec + ts.tv_nsec / 1.0e9;
+	if (collectors[id].read_time > 0.0)
+	    elapsed = now - collectors[id].read_time;
+	collectors[id].read_time = now;
+    }
+    self_start(&self_clock);
+    switch (id) {
+    case COLLECT_DISKSTATS:
+	proc_diskstats_collect(elapsed);
+	proc_diskstats_real(elapsed);
+	if (collector_storage)
+	    proc_diskstats_all(elapsed);
+	if (collector_btrfs)
+	    proc_diskstats_btrfs(elapsed);
+	if (diskstats_resync) {
+	    proc_diskstats_resync();
+	    proc_diskstats_init(elapsed);
+	    if (collector_btrfs)
+		proc_diskstats_btrfs_init(elapsed);
+	}
+	break;
+    case COLLECT_NET:
+	proc_net_dev(elapsed, PRINT_TRUE);
+	break;
+    case COLLECT_FILESYSTEMS:
+	filesystems(collector_mountpoint);
+	break;
+    case COLLECT_NFS:
+	nfs(elapsed);
+	break;
+#ifndef NOGPFS
+    case COLLECT_GPFS:
+	gpfs_data(elapsed);
+	break;
+#endif				/* NOGPFS */
+    case COLLECT_PROCESSES:
+	processes(elapsed, collector_proc_pid);
+	break;
+    }
+    self_stop(collector_self[id], &self_clock);
+}
+
+void *collector_worker(void *arg)
+{
+    struct collector *c;
+    int id;
+
+    pthread_mutex_lock(&collector_lock);
+    for (;;) {
+	for (id = 0; id < COLLECTORS_MAX; id++)
+	    if (collectors[id].state == COLLECTOR_QUEUED)
+		break;
+	if (id == COLLECTORS_MAX) {
+	    pthread_cond_wait(&collector_queued, &collector_lock);
+	    continue;
+	}
+	c = &collectors[id];
+	c->state = COLLECTOR_RUNNING;
+	pthread_mutex_unlock(&collector_lock);
+
+	output = c->now.output;	/* the p functions now write to the collector's buffer */
+	output_size = c->now.output_size;
+	output_char = 0;
+	output[0] = 0;
+	njmon_sections = njmon_subsections = 0;
+	njmon_string = njmon_long = njmon_double = njmon_hex = 0;
+	collector_run(id);
+
+	pthread_mutex_lock(&collector_lock);
+	c->now.output = output;	/* it may have been realloc()ed */
+	c->now.output_size = output_size;
+	c->now.output_char = output_char;
+	c->now.sections = njmon_sections;
+	c->now.subsections = njmon_subsections;
+	c->now.strings = njmon_string;
+	c->now.longs = njmon_long;
+	c->now.doubles = njmon_double;
+	c->now.hexs = njmon_hex;
+	c->state = COLLECTOR_DONE;
+	pthread_cond_broadcast(&collector_done);
+    }
+    return NULL;
+}
+
+void collectors_init(int storage, int btrfs, int mountpoint, int filesystems_on, int proc_mode, int proc_pid, long seconds)
+{
+    char *s;
+    long i;
+
+    FUNCTION_START;
+    collector_storage = storage;
+    collector_btrfs = btrfs;
+    collector_mountpoint = mountpoint;
+    collector_proc_pid = proc_pid;
+    collectors[COLLECT_DISKSTATS].on = 1;
+    collectors[COLLECT_NET].on = 1;
+    collectors[COLLECT_FILESYSTEMS].on = filesystems_on;
+    collectors[COLLECT_NFS].on = 1;
+#ifndef NOGPFS
+    collectors[COLLECT_GPFS].on = !gpfs_na;
+#endif				/* NOGPFS */
+    collectors[COLLECT_PROCESSES].on = proc_mode;
+    if (collector_threads == 0)
+	return;
+    if (mode == NBMON || delta_keyframe) {
+	nwarning("-j ignored with -C or -N as they share state between sections - collecting serially");
+	collector_threads = 0;
+	return;
+    }
+    if (collector_threads > COLLECTORS_MAX)
+	collector_threads = COLLECTORS_MAX;
+    collector_timeout = seconds / 2.0;
+    if ((s = getenv("NJMON_COLLECTOR_TIMEOUT")) != 0 && atof(s) > 0.0)
+	collector_timeout = atof(s);
+    for (i = 0; i < COLLECTORS_MAX; i++) {
+	collectors[i].now.output_size = INITIAL_BUFFER_SIZE;
+	collectors[i].now.output = malloc(collectors[i].now.output_size);
+    }
+    collector_workers = calloc(collector_threads, sizeof(pthread_t));
+    for (i = 0; i < collector_threads; i++) {
+	if (pthread_create(&collector_workers[i], NULL, collector_worker, NULL) != 0) {
+	    nwarning("collectors_init() pthread_create failed - collecting serially");
+	    collector_threads = i;
+	    break;
+	}
+    }
+}
+
+/* from the main loop once elapsed is known, the workers start on every collector but the late ones */
+void collectors_start(double elapsed)
+{
+    long ns;
+    int id;
+
+    collector_elapsed = elapsed;
+    if (collector_threads == 0)
+	return;
+    clock_gettime(CLOCK_REALTIME, &collector_deadline);	/* pthread_cond_timedwait()'s clock */
+    ns = collector_deadline.tv_nsec + (long) (collector_timeout * 1.0e9);
+    collector_deadline.tv_sec += ns / 1000000000L;
+    collector_deadline.tv_nsec = ns % 1000000000L;
+    pthread_mutex_lock(&collector_lock);
+    for (id = 0; id < COLLECTORS_MAX; id++) {
+	if (!collectors[id].on)
+	    continue;
+	if (collectors[id].late && collectors[id].state == COLLECTOR_DONE) {
+	    collectors[id].state = COLLECTOR_IDLE;	/* finished since, its sections are for an old time */
+	    collectors[id].late = 0;
+	}
+	if (collectors[id].state == COLLECTOR_IDLE)
+	    collectors[id].state = COLLECTOR_QUEUED;
+    }
+    pthread_cond_broadcast(&collector_queued);
+    pthread_mutex_unlock(&collector_lock);
+}
+
+/* add the collector's sections to the record at this point, collecting now if there are no workers */
+void collector_join(int id)
+{
+    struct collector *c = &collectors[id];
+
+    if (!c->on)
+	return;
+    if (collector_threads == 0) {
+	collector_run(id);
+	return;
+    }
+    pthread_mutex_lock(&collector_lock);
+    if (c->late) {		/* a run from an earlier sample, even if it has just finished */
+	pthread_mutex_unlock(&collector_lock);
+	return;
+    }
+    while (c->state != COLLECTOR_DONE)
+	if (pthread_cond_timedwait(&collector_done, &collector_lock, &collector_deadline) == ETIMEDOUT)
+	    break;
+    if (c->state != COLLECTOR_DONE) {
+	c->late = 1;
+	collectors_late++;
+	sprintf(errorbuf, "-j %s collector still running after %.1f seconds - its sections are left out until it finishes",
+		collector_names[id], collector_timeout);
+	nwarning(errorbuf);
+	pthread_mutex_unlock(&collector_lock);
+	return;
+    }
+    c->state = COLLECTOR_IDLE;
+    pthread_mutex_unlock(&collector_lock);
+
+    /* the worker does not touch its buffer again until collectors_start() queues it */
+    PRESERVE(c->now.output_char + 1);
+    memcpy(&output[output_char], c->now.output, c->now.output_char);
+    output_char += c->now.output_char;
+    output[output_char] = 0;
+    njmon_sections += c->now.sections;
+    njmon_subsections += c->now.subsections;
+    njmon_string += c->now.strings;
+    njmon_long += c->now.longs;
+    njmon_double += c->now.doubles;
+    njmon_hex += c->now.hexs;
 }
+
 void tokenise(char *s)
 {
 int i;
@@ -4505,6 +10671,7 @@ void hint(char *program, char *version)
     printf("- Performance stats collector outputting JSON or Influx Line Protocol format.\n");
     printf("- If the commend starts with njmon it runs in NJMON mode\n");
     printf("- If the commend starts with nimon it runs in NIJMON mode\n");
+    printf("- If the commend starts with nbmon it runs in NBMON compact binary mode\n");
     printf("- -J forces NJMON mode regardless of the command name\n");
     printf("- -I forces NIMON mode regardless of the command name\n");
     printf("- Note:njmon & nimondata is exactly the same, so use one database.\n");
@@ -4529,6 +10696,7 @@ void hint(char *program, char *version)
     printf("\t-M           : Filesystems listed by mount point (like AIX njmon) and not filesystem name\n");
     printf("\t-f           : Output to file (not stdout) to two files below\n");
     printf("\t             : NIMON mode - Data:  hostname_<year><month><day>_<hour><minutes>.influxlp\n");
+    printf("\t             : NBMON mode - Data:  hostname_<year><month><day>_<hour><minutes>.nbmon\n");
     printf("\t             : NJMON mode - Data:  hostname_<year><month><day>_<hour><minutes>.json\n");
     printf("\t             : Error: hostname_<year><month><day>_<hour><minutes>.err\n");
     printf("\t-ff          : NIMON mode - Note: a second -f adds a timestamp so this data can be added to InfluxDB later\n");
@@ -4544,8 +10712,11 @@ void hint(char *program, char *version)
     printf("\t               multiple concurrent data captures\n");
     printf("\t-I           : Force to NIMON mode. Saving InfluxDB Line Protocol data or njmond.py or other Timeseries database\n");
     printf("\t-J           : Force to NJMON mode. Set njmon mode for JSON format for njmond.py or other Timeseries database\n");
+    printf("\t-C           : Force to NBMON mode. Compact binary frames, names are sent once then as numbers\n");
+    printf("\t               nbmon_decode turns it back in to Line Protocol: nbmon -s 10 | nbmon_decode\n");
     printf("\t-P           : Add process stats (take CPU cycles and large stats volume)\n");
     printf("\t-t percent   : Set ignore process CPU use percent threshold (default 0.01%%)\n");
+    printf("\t               NJMON_PROCESSES_TOP=n only sends the n busiest processes (default all)\n");
     printf("\t-b           : Switch of adding pid to the process names: \"ksh_76927\" -> \"ksh\"\n");
     printf("\t-? or -h     : This output and stop\n");
     printf("\t-d           : Switch on debug tracing (output no longer JSON/line protocol format)\n");
@@ -4553,7 +10724,41 @@ void hint(char *program, char *version)
     printf("\t-r           : Random start pause. Stops cron making every program send data in sync\n");
     printf("\t-n           : No PID printed out at start up.\n");
     printf("\t-R           : Reduced stats - skip logical CPU stats for SMT threads.\n");
+    printf("\t-U ms        : Also sample CPU, perf counters, PSI and network every ms (10 to 1000) milliseconds\n");
+    printf("\t               and send them as an \"hf\" measure per tick at each -s sample. Environment:\n");
+    printf("\t               NJMON_HF_COLLECTORS=cpu,perf,psi,net  NJMON_HF_DOWNSAMPLE=ticks to average\n");
+    printf("\t-E events    : Count perf events on all online CPUs: r17 (raw hex), cycles, instructions,\n");
+    printf("\t               cache-misses, ... or pmu/name from /sys/bus/event_source/devices/pmu/events\n");
+    printf("\t               Comma separated, field=event to name it: -E refill=r17,ipc_c=cycles\n");
+    printf("\t               With cycles, instructions, refills (cache-misses) or stalls the perf_derived\n");
+    printf("\t               sections have mem_mbps, ipc, mpki, stall_percent and an interference_score\n");
+    printf("\t               against a baseline of the first NJMON_BASELINE_SAMPLES (default 10) samples that\n");
+    printf("\t               are under NJMON_BASELINE_BUSY (default 10) percent busy, baseline_ready=1 once learned\n");
+    printf("\t               Memory controller PMUs (uncore_imc, arm_cmn, arm_dsu) are found and measured in\n");
+    printf("\t               perf_uncore and used for mem_mbps, NJMON_UNCORE=0 switches them off\n");
+    printf("\t-g           : Count the perf events per kubernetes pod (cgroup v2 kubepods) in pod_counters\n");
+    printf("\t               Default events: cycles, instructions, llc_misses (+ l2_refill, mem_access on aarch64)\n");
+    printf("\t-G           : Kubernetes pod and container cgroup v2 cpu, memory, io and pressure stats\n");
+    printf("\t               in pods and pod_containers\n");
+    printf("\t-Y triggers  : PSI triggers resource:some|full:stall_us:window_us,... on the host and with -G\n");
+    printf("\t               each pod, a psi_event record is sent as soon as one fires: -Y memory:some:150000:2000000\n");
+    printf("\t               Without CAP_SYS_RESOURCE the kernel wants windows that are a multiple of 2 seconds\n");
+    printf("\t-S period    : Sample one memory event in every period on each CPU and send the top PIDs\n");
+    printf("\t               and cgroups/pods in mem_sample_pids and mem_sample_cgroups. Environment:\n");
+    printf("\t               NJMON_SAMPLE_EVENT=event (default mem-loads, r17 on aarch64, cycles, cpu-clock)\n");
+    printf("\t               NJMON_SAMPLE_TOP=n (default 10)\n");
+    printf("\t-N n         : Change-only: numbers the same as the last sample are left out except\n");
+    printf("\t               every n samples which are sent in full (timestamp keyframe=1)\n");
     printf("\t-F           : Switch off filesystem stats (autofs and tmpfs can cause issues)\n");
+    printf("\t-j threads   : Run the disks, networks, filesystems, NFS, GPFS and processes collectors on\n");
+    printf("\t               threads (at most 6) so a slow one does not hold up the rest, ignored with -C or -N\n");
+    printf("\t-l list      : CPU stats per cpu (cpus, the default), core (cpu_cores), cluster (cpu_clusters)\n");
+    printf("\t               and node (cpu_nodes) as a comma list, like -l core,node on large servers\n");
+    printf("\t-u port      : Serve the latest sample over HTTP: /metrics (Prometheus) and / (njmon JSON)\n");
+    printf("\t               or /lp (nimon line protocol), not with -C or -N. Only on 127.0.0.1 unless\n");
+    printf("\t               given as address:port, like -u 0.0.0.0:8080 for every interface\n");
+    printf("\t-o name      : Keep the latest CPU, perf counter, PSI and pod numbers in /dev/shm/name for\n");
+    printf("\t               programs on this server to read with njmon_shm.h, NJMON_SHM_PODS=slots (256)\n");
 
     printf("--- NIMON mode options ---\n");
     printf("- Sent data to InfluxDB (all of these are inportant for InfluxDB):\n");
@@ -4593,6 +10798,26 @@ void hint(char *program, char *version)
     printf("\t-i ip/host   : IP address or Hostname of the njmond central daemon\n");
     printf("\t-p port      : Port number on njmond.py host\n");
     printf("\n");
+    printf("Network sends are done by a separate thread over a connection kept open between samples.\n");
+    printf("If the remote end is slow or down samples queue up and are sent together later:\n");
+    printf("\tNJMON_PUSH_QUEUE=samples : samples held before dropping the newest (default 64)\n");
+    printf("\tNJMON_PUSH_BATCH=samples : max samples in one send (default 16)\n");
+    printf("\t-L file                  : keep samples that could not be sent in this spool file, they are\n");
+    printf("\t                           sent oldest first when the remote end is back (also with NIMON -i)\n");
+    printf("\tNJMON_SPOOL_MB=MB        : spool file size, the oldest samples are dropped when full (default 64)\n");
+    printf("\tNJMON_REPLAY_RATE=samples: spooled samples sent per second once connected again (default 10)\n");
+    printf("\t-Z level                 : zlib compress what is sent, level 1 (fastest) to 9 (smallest)\n");
+    printf("\t                           InfluxDB gets gzip POSTs, njmond NJZ1 then length + zlib frames\n");
+    printf("\n");
+    printf("NJMON_SELF=1 adds njmon_self with the wall and CPU time, bytes and read/write system calls\n");
+    printf("of each collector this sample, totals and p50/p99 times, to see what njmon itself costs\n");
+    printf("\n");
+    printf("numa_nodes has each NUMA node's memory and numastat rates and numa_balancing the page\n");
+    printf("migration rates, NJMON_NUMA=0 switches them off\n");
+    printf("\n");
+    printf("identity, os_release, proc_version, lscpu and cpuinfo are only sent on the first sample,\n");
+    printf("when they change, after a SIGHUP (kill -HUP pid) and every NJMON_INVENTORY=samples (default 60)\n");
+    printf("\n");
 
     printf("NJMON Examples:\n");
     printf("    1 Every 5 mins all day\n");
@@ -4625,41 +10850,15 @@ int i;
 	}
 }
 
-static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
-                            int cpu, int group_fd, unsigned long flags) {
-    return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
-}
-
 /* MAIN */
 
 int main(int argc, char **argv)
 {
-	// This is for hardware counters
-    struct perf_event_attr pe[8];
-    int fdmem[8];
-    long long l2_refill_count[8];
-    memset(&pe, 0, sizeof(struct perf_event_attr));
-
-    for(int i = 0; i <= 7; i++) {
-    pe[i].type = PERF_TYPE_RAW;
-    pe[i].size = sizeof(struct perf_event_attr);
-    pe[i].config = 0x17; // L2D_CACHE_REFILL_LD event code
-    pe[i].disabled = 1; // start in disabled state
-    pe[i].exclude_kernel = 1; // exclude kernel space
-    pe[i].exclude_hv = 1; // exclude hypervisor space
-
-    fdmem[i] = perf_event_open(&pe[i], -1, i, -1, 0);
-    if (fdmem[i] == -1) {
-        perror("Error opening perf event");
-        exit(EXIT_FAILURE);
-    	}
-	}
-
-
     long maxloops = -1;
     long seconds = 60;
     int target_mode = 0;
     int no_pid = 0;
+    int events_set = 0;
     int ch;
     double elapsed = 0.1;
     double previous_time;
@@ -4675,6 +10874,7 @@ int main(int argc, char **argv)
     long sleep_secs;
     long sleep_usecs;
     struct timeval tv;
+    struct in_addr serve_in;
     int commlen;
     int i;
     int j;
@@ -4716,6 +10916,12 @@ int main(int argc, char **argv)
     s = getenv("NJMON_STATS");
     if (s != 0)
 	njmon_internal_stats = atoi(s);
+    s = getenv("NJMON_SELF");
+    if (s != 0)
+	self_on = atoi(s);
+    s = getenv("NJMON_INVENTORY");
+    if (s != 0 && atol(s) > 0)
+	inventory_every = atol(s);
 
     /* if no slash that use the whole command name */
     cmd = argv[0];
@@ -4733,13 +10939,17 @@ int main(int argc, char **argv)
     else if (!strncmp(cmd, "nimon",5)) {
         mode = NIMON;
     }
+    else if (!strncmp(cmd, "nbmon",5)) {
+        mode = NBMON;
+    }
     else {
-        printf("Invalid command name: must start with njmon or nimon and not \"%s\"\n", cmd);
+        printf("Invalid command name: must start with njmon, nimon or nbmon and not \"%s\"\n", cmd);
         exit(76);
     }
 
     signal(SIGUSR1, interrupt);
     signal(SIGUSR2, interrupt);
+    signal(SIGHUP, inventory_hup);	/* send the inventory on the next sample */
 
     uid = getuid();
 
@@ -4750,10 +10960,9 @@ int main(int argc, char **argv)
     for (i = 0; i < argc; i++) {
 	sprintf(&commandline[strlen(commandline)], "%s ", argv[i]);
     }
-    if(mode == NJMON)
-	cli_njmon = "a:A:bBc:dDefFh?i:IJkK:m:MnO:p:PrRs:t:T:WX:!";
-    else
-	cli_nimon = "a:A:bBc:dDfFhH?i:IJkK:m:MnO:p:Pq:rRs:t:T:vwW!x:y:z:"; /* less X and extra vwxyz */
+    /* both set as -I -J and -C can switch mode part way through the options */
+    cli_njmon = "a:A:bBc:CdDeE:fFgGh?i:Ij:JkK:l:L:m:MN:no:O:p:PrRs:S:t:T:u:U:WX:Y:Z:!";
+    cli_nimon = "a:A:bBc:CdDE:fFgGhH?i:Ij:JkK:l:L:m:MN:no:O:p:Pq:rRs:S:t:T:u:U:vwW!x:y:Y:z:Z:"; /* less X and extra vwxyz */
 
     while (-1 != (ch = getopt(argumentc, argumentv, mode==NJMON?cli_njmon:cli_nimon))) 
 	{
@@ -4895,6 +11104,105 @@ int main(int argc, char **argv)
                 DEBUG printf("option -J: JSON njmon stats\n");
                 mode = NJMON;
                 break;
+	    case 'U': /* high frequency sampling milliseconds */
+		DEBUG fprintf(stderr, "option -U: ms=\"%s\"\n",optarg);
+		hf_ms = atol(optarg);
+		if (hf_ms < 10 || hf_ms > 1000) {
+		    printf("njmon: -U option requires milliseconds between 10 and 1000\n");
+		    exit(102);
+		}
+		break;
+	    case 'E': /* perf events */
+		DEBUG fprintf(stderr, "option -E: events=\"%s\"\n",optarg);
+		counters_option(optarg);
+		events_set = 1;
+		break;
+	    case 'g': /* perf events per kubernetes pod */
+		DEBUG fprintf(stderr, "option -g: pod counters\n");
+		pod_counters = 1;
+		break;
+	    case 'G': /* cgroup v2 stats per kubernetes pod */
+		DEBUG fprintf(stderr, "option -G: pod stats\n");
+		pod_stats = 1;
+		break;
+	    case 'Y': /* PSI triggers */
+		DEBUG fprintf(stderr, "option -Y: triggers=\"%s\"\n",optarg);
+		psi_option(optarg);
+		break;
+	    case 'S': /* sampled memory access profiling */
+		DEBUG fprintf(stderr, "option -S: period=\"%s\"\n",optarg);
+		sampler_period = atol(optarg);
+		if (sampler_period < 1) {
+		    printf("Invalid -S period \"%s\" - it must be a positive number of events\n", optarg);
+		    exit(104);
+		}
+		break;
+	    case 'Z': /* compress what is sent */
+		DEBUG fprintf(stderr, "option -Z: level=\"%s\"\n",optarg);
+		push_level = atoi(optarg);
+		if (push_level < 1 || push_level > 9) {
+		    printf("njmon: -Z option requires a compression level 1 (fastest) to 9 (smallest)\n");
+		    exit(107);
+		}
+		break;
+	    case 'L': /* spool file for samples the remote end could not take */
+		DEBUG fprintf(stderr, "option -L: spool=\"%s\"\n",optarg);
+		spool_filename = optarg;
+		break;
+	    case 'j': /* worker threads for the slow collectors */
+		DEBUG fprintf(stderr, "option -j: threads=\"%s\"\n",optarg);
+		collector_threads = atol(optarg);
+		if (collector_threads < 0) {
+		    printf("njmon: -j option requires the number of collector threads (0 or more)\n");
+		    exit(106);
+		}
+		break;
+	    case 'l': /* per CPU, core, cluster and node CPU sections */
+		DEBUG fprintf(stderr, "option -l: levels=\"%s\"\n",optarg);
+		cpu_levels_option(optarg);
+		break;
+	    case 'o': /* shared memory segment for the latest sample */
+		DEBUG fprintf(stderr, "option -o: shm=\"%s\"\n",optarg);
+		shm_name = optarg;
+		if (strchr(shm_name, '/') != NULL || shm_name[0] == 0) {
+		    printf("njmon: -o option requires a name for /dev/shm (no /)\n");
+		    exit(110);
+		}
+		break;
+	    case 'u': /* HTTP [address:]port for pulling the latest sample */
+		DEBUG fprintf(stderr, "option -u: port=\"%s\"\n",optarg);
+		if ((s = strrchr(optarg, ':')) != NULL) {
+		    if (s - optarg >= (long) sizeof(serve_address) || s == optarg) {
+			printf("njmon: -u option address is not an IPv4 address\n");
+			exit(109);
+		    }
+		    memcpy(serve_address, optarg, s - optarg);
+		    serve_address[s - optarg] = 0;
+		    serve_port = atoi(s + 1);
+		} else {
+		    serve_port = atoi(optarg);
+		}
+		if (inet_pton(AF_INET, serve_address, &serve_in) != 1) {
+		    printf("njmon: -u option address is not an IPv4 address\n");
+		    exit(109);
+		}
+		if (serve_port <= 0 || serve_port > 65535) {
+		    printf("njmon: -u option requires a port number for the HTTP endpoint\n");
+		    exit(109);
+		}
+		break;
+	    case 'N': /* change-only emission with a full sample every n */
+		DEBUG fprintf(stderr, "option -N: keyframe=\"%s\"\n",optarg);
+		delta_keyframe = atol(optarg);
+		if (delta_keyframe < 1) {
+		    printf("njmon: -N option requires the samples between full samples (1 or more)\n");
+		    exit(103);
+		}
+		break;
+            case 'C':
+                DEBUG printf("option -C: compact binary nbmon mode\n");
+                mode = NBMON;
+                break;
 	    case 'n': /* Don't print the PID at start up */
 		DEBUG fprintf(stderr, "option -n: no PID\n");
 		no_pid = 1;
@@ -4993,6 +11301,12 @@ int main(int argc, char **argv)
 		break;
 	    }
 	}
+#if defined(__aarch64__)
+    if (!events_set && !pod_counters)
+	counter_add("refill=r17");	/* L2D_CACHE_REFILL, counted on aarch64 before -E */
+#endif
+    if (pod_counters)
+	pod_counters_events(events_set);
     if (alias_hostname[0] == 0) {
 	    ptr = getenv("NJMON_HOSTNAME");
 	    if(ptr != 0)
@@ -5081,8 +11395,7 @@ int main(int argc, char **argv)
 	   close(1);
 	   close(2);
 	 */
-	setpgrp();		/* become process group leader */
-	signal(SIGHUP, SIG_IGN);	/* ignore hangups */
+	setpgrp();		/* become process group leader, hangups only resend the inventory */
     }
     if (file_output) {
 	get_time();
@@ -5101,8 +11414,9 @@ int main(int argc, char **argv)
                 }
 	    }
 	} else {
-		sprintf(filename, "%s_%02d%02d%02d_%02d%02d.influxlp", 
-			hostname, tim->tm_year, tim->tm_mon, tim->tm_mday, tim->tm_hour, tim->tm_min);
+		sprintf(filename, "%s_%02d%02d%02d_%02d%02d.%s", 
+			hostname, tim->tm_year, tim->tm_mon, tim->tm_mday, tim->tm_hour, tim->tm_min,
+			mode == NBMON ? "nbmon" : "influxlp");
 		if ((fp = freopen(filename, "w", stdout)) == 0 ) {
                     nwarning2("opening file for stdout filename=%s\n", filename);
                     exit(13);
@@ -5149,6 +11463,25 @@ int main(int argc, char **argv)
 	    strcat(njmon_command, " ");
     }
 
+    if (target_port)
+	push_init();		/* after the fork() as threads do not survive it */
+    serve_init();
+    shm_init();
+    if (!target_port && spool_filename != NULL)
+	nwarning("-L spool ignored as it is only for sending to a remote host with -i and -p");
+    if (!target_port && push_level) {
+	nwarning("-Z ignored as it is only for sending to a remote host with -i and -p");
+	push_level = 0;
+    }
+    if (hf_ms)
+	hf_init(seconds);
+    counters_open();	/* after hf_init() which can add events */
+    uncore_open();
+    if (sampler_period)
+	sampler_init();
+    psi_init();
+    numa_init();
+
     save_tags();
     /* seed incrementing counters */
     proc_stat(elapsed, PRINT_FALSE, reduced_stats);
@@ -5173,6 +11506,7 @@ int main(int argc, char **argv)
 
     if (proc_mode)
 	processes_init();
+    collectors_init(storage, btrfs, mountpoint, filesystems_on, proc_mode, proc_pid, seconds);
 
 #ifdef EXTRA
     extra_init();
@@ -5198,12 +11532,6 @@ int main(int argc, char **argv)
     /* have to initialise just this one */
     execute_start = (double) tv.tv_sec + ((double) tv.tv_usec * 1.0e-6);
     for (loop = 0; maxloops == -1 || loop < maxloops; loop++) {
-		// L2D_REFILL: START READING WHILE SLEEPING
-		for(int i = 0; i <= 7; i++) {
-		ioctl(fdmem[i], PERF_EVENT_IOC_RESET, 0);
-		ioctl(fdmem[i], PERF_EVENT_IOC_ENABLE, 0);
-		}
-
         /* sanity check */
         if(execute_time < 0.0)
             execute_time = 0.0;
@@ -5220,11 +11548,6 @@ int main(int argc, char **argv)
             sleep_secs = seconds;
             sleep_usecs= 0;
         }
-		// L2D_REFILL: FINISH READING 
-		for(int i = 0; i <= 7; i++) {
-		ioctl(fdmem[i], PERF_EVENT_IOC_DISABLE, 0);
-		read(fdmem[i], &l2_refill_count[i], sizeof(long long int));
-		}
        if (loop != 0) {  /* don't sleep on the first loop */
             DEBUG printf("calling usleep(%6.4f) . . .\n", sleep_target);
 /* testing 
@@ -5242,10 +11565,14 @@ int main(int argc, char **argv)
             gettimeofday(&tv, 0);
             sleep_start = (double)tv.tv_sec + ((double)tv.tv_usec * 1.0e-6);
 
-            if(sleep_secs > 0 && sleep_secs < (seconds + 1) )
-                sleep (sleep_secs);  /* WHOLE SECOND SLEEP */
-            if(sleep_usecs > 0.0 && sleep_usecs < 1000001 )
-                usleep(sleep_usecs); /* MICRO SECOND SLEEP */
+            if (psi_triggers_count) {
+		psi_sleep(sleep_secs + sleep_usecs * 1.0e-6);	/* wakes to send psi_event records */
+	    } else {
+		if(sleep_secs > 0 && sleep_secs < (seconds + 1) )
+		    sleep (sleep_secs);  /* WHOLE SECOND SLEEP */
+		if(sleep_usecs > 0.0 && sleep_usecs < 1000001 )
+		    usleep(sleep_usecs); /* MICRO SECOND SLEEP */
+	    }
 
             gettimeofday(&tv, 0);
             sleep_end = (double)tv.tv_sec + ((double)tv.tv_usec * 1.0e-6);
@@ -5282,54 +11609,51 @@ int main(int argc, char **argv)
 	current_time = (double) tv.tv_sec + ((double) tv.tv_usec * 1.0e-6);
 	elapsed = current_time - previous_time;
 
-	date_time(seconds, loop, maxloops, sleep_target, sleep_overrun, execute_time, elapsed);
-	identity(commandline, VERSION);
-	tags();
-	etc_os_release();
-	proc_version();
-	lscpu();
-	proc_stat(elapsed, PRINT_TRUE,reduced_stats);
-	etc_hw_mem(l2_refill_count);
-	proc_cpuinfo(reduced_stats);
-        proc_loadavg();
-	read_data_number("meminfo", elapsed);
-	read_data_number("vmstat",  elapsed);
-	proc_diskstats_collect(elapsed);
-	proc_diskstats_real(elapsed);
-	if(storage)
-	    proc_diskstats_all(elapsed);
-	if(btrfs)
-	    proc_diskstats_btrfs(elapsed);
-	
-        if(diskstats_resync) {
-	    proc_diskstats_resync();
-    	    proc_diskstats_init(elapsed);
-    	    if(btrfs)
-        	    proc_diskstats_btrfs_init(elapsed);
-	}
-	proc_swaps();
-	proc_net_dev(elapsed, PRINT_TRUE);
-	uptime();
-	if(filesystems_on)
-	    filesystems(mountpoint);
-	nfs(elapsed);
-	read_lparcfg(elapsed);
-	sys_device_system_cpu(elapsed, PRINT_TRUE);
+	collectors_start(elapsed);
+	SELF(SELF_DATE_TIME, date_time(seconds, loop, maxloops, sleep_target, sleep_overrun, execute_time, elapsed));
+	SELF(SELF_INVENTORY, inventory(commandline, VERSION, reduced_stats));
+	SELF(SELF_TAGS, tags());
+	SELF(SELF_PROC_STAT, proc_stat(elapsed, PRINT_TRUE,reduced_stats));
+	SELF(SELF_COUNTERS, counters_sample());
+	SELF(SELF_UNCORE, uncore_sample(elapsed));
+	if (counters_ok)
+	    SELF(SELF_DERIVED, derived_sample(elapsed));
+	if (pod_counters)
+	    SELF(SELF_POD_COUNTERS, pods_counters());
+	if (pod_stats)
+	    SELF(SELF_PODS, pods_stats(elapsed));
+	SELF(SELF_SAMPLER, sampler_sample());
+        SELF(SELF_LOADAVG, proc_loadavg());
+	SELF(SELF_PSI, psi_sample());
+	SELF(SELF_MEMINFO, read_data_number("meminfo", elapsed));
+	SELF(SELF_VMSTAT, read_data_number("vmstat",  elapsed));
+	SELF(SELF_NUMA, numa_sample(elapsed));
+	collector_join(COLLECT_DISKSTATS);	/* -j collectors time themselves */
+	SELF(SELF_SWAPS, proc_swaps());
+	collector_join(COLLECT_NET);
+	SELF(SELF_UPTIME, uptime());
+	collector_join(COLLECT_FILESYSTEMS);
+	collector_join(COLLECT_NFS);
+	SELF(SELF_LPARCFG, read_lparcfg(elapsed));
+	SELF(SELF_SYS_CPU, sys_device_system_cpu(elapsed, PRINT_TRUE));
 #ifndef NOGPFS
-	gpfs_data(elapsed);
+	collector_join(COLLECT_GPFS);
 #endif				/* NOGPFS */
 #ifdef NVIDIA_GPU
-	gpu_stats();
+	SELF(SELF_GPU, gpu_stats());
 #endif				/* NVIDIA_GPU */
-	if (proc_mode)
-	    processes(elapsed,proc_pid);
+	collector_join(COLLECT_PROCESSES);
 
 #ifdef EXTRA
-	extra_data(elapsed);
+	SELF(SELF_EXTRA, extra_data(elapsed));
 #endif /* EXTRA */
+	SELF(SELF_HF, hf_flush());
+	self_sample();
 
 	psampleend();
-	push();
+	serve_publish();
+	shm_publish(elapsed);
+	SELF(SELF_PUSH, push());
 	/* debbuging - uncomment to crash here!
 	  {
           int *crashptr = NULL;
@@ -5342,13 +11666,16 @@ int main(int argc, char **argv)
         execute_time = execute_end - execute_start;
     }
     /* finish-of */
-    remove_ending_comma_if_any();
+    if (mode != NBMON)
+	remove_ending_comma_if_any();
     if (njmon_internal_stats)
 	pstats();
+    hf_finish();
+    sampler_finish();
     push();
-	for (int i = 0; i <= 7; i++) {
-		close(fdmem[i]);
-	}
+    push_finish();
+    counters_close();
+    uncore_close();
     close(sockfd);		/* if a socket, let it close cleanly */
     remove_pid_file();
     sleep(1);
@@ -0,0 +1,1865 @@
+/*
+ * njmon_relay.c -- takes the samples pushed by the njmon and nimon of a whole cluster over
+ *                  kept open connections, turns them in to InfluxDB Line Protocol and sends
+ *                  them on to InfluxDB in large batches over one connection.
+ * (C) Copyright 2018 Nigel Griffiths
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    Find the GNU General Public License here <http://www.gnu.org/licenses/>.
+ */
+
+/* Compile example: cc -O4 -g -o njmon_relay njmon_relay.c -lz -lpthread
+ * Usage: njmon_relay -l 8181 -i influxbox -p 8086 -x njmon
+ *        and on every node  nimon -s 1 -i relaybox -p 8181 -x njmon  or  njmon -s 1 -i relaybox -p 8181
+ *
+ * One thread looks after all the client connections with epoll. What a connection sends is
+ * worked out from its first bytes:
+ *    POST           nimon writing to InfluxDB (v1 /write or v2 /api/v2/write, gzip with -Z),
+ *                   answered with a 204 like InfluxDB and the precision= of each is honoured,
+ *                   a 413 over 64 MB and a 400 for gzip that stops short. Replies the socket
+ *                   does not take straight away are queued and finished on EPOLLOUT
+ *    {              njmon JSON, made in to the same lines nimon would have sent
+ *    a letter       raw Line Protocol (nimon in Telegraf mode), timestamped when it arrives
+ *    NJZ1           the -Z frames of njmon or nimon, inflated and then one of the above
+ * The bytes are parsed as they arrive and only a part sample or line is kept between reads.
+ * Lines go in to the current batch which is handed to the sender thread once it has -b lines
+ * or is -t ms old. The sender POSTs each batch (gzip with -Z) on one kept open connection and
+ * reconnects with a backoff. While more than -m MB is waiting the clients are not read, so TCP
+ * pushes back on the njmon sender threads and their -L spools rather than the relay losing data.
+ *
+ * -r label adds rollups every -s seconds. For the lines of the -R measurements that have the
+ * label as a tag (like job from nimon -q job=hpl or njmon's job_tag) the latest values of each
+ * series (a host or a host's disk) seen in the period are added up for each label value:
+ *    <measurement>_rollup,<label>=<value>[,<sub>_name=] series=N,<field>_sum=,<field>_avg=,<field>_min=,<field>_max=
+ * The subsection name is kept so the psi cpu, memory and io lines are rolled up on their own.
+ * Every minute the relay adds a njmon_relay line with its own counts. A client that sends
+ * nothing for -k seconds is closed so nodes that vanished without a FIN do not pile up.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <zlib.h>
+
+long listen_port = 0;		/* -l */
+char *influx_host = NULL;	/* -i */
+long influx_port = 8086;	/* -p */
+char influx_database[64] = "njmon";	/* -x */
+char influx_username[64] = "";	/* -y */
+char influx_password[64] = "";	/* -z */
+char influx_org[64 + 1] = "default";	/* -O */
+char influx_token[256 + 1] = "";	/* -T */
+int influx_version = 1;
+char *output_filename = NULL;	/* -f */
+long batch_lines = 5000;	/* -b */
+long batch_ms = 1000;		/* -t */
+long pending_max = 256 * 1024 * 1024;	/* -m */
+int zlevel = 0;			/* -Z */
+char *rollup_label = NULL;	/* -r */
+char rollup_measurements[1024] = ",cpu_total,";	/* -R */
+long rollup_seconds = 10;	/* -s */
+long idle_seconds = 300;	/* -k */
+int verbose = 0;		/* -v */
+long stats_seconds = 60;
+char hostname[256];
+
+volatile sig_atomic_t stopping = 0;
+
+/* counters for the njmon_relay line */
+long stat_connections = 0;
+long stat_clients = 0;
+long stat_samples = 0;		/* JSON samples and HTTP requests */
+long stat_lines = 0;
+long stat_bytes_in = 0;
+long stat_rollups = 0;
+long stat_bad = 0;		/* lines or samples that could not be parsed */
+long stat_batches = 0;		/* sent */
+long stat_bytes_out = 0;
+long stat_send_errors = 0;
+long stat_reconnects = 0;
+
+void nwarning(char *message)
+{
+    fprintf(stderr, "njmon_relay: %s\n", message);
+}
+
+long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* - - - - - buffers - - - - */
+struct buf {
+    char *data;
+    long len;
+    long size;			/* only ever grows so steady state does not malloc */
+};
+
+char *buf_room(struct buf *b, long needed)
+{
+    if (b->size - b->len < needed + 1) {
+	b->size = b->len + needed + (64 * 1024);
+	if ((b->data = realloc(b->data, b->size)) == NULL) {
+	    nwarning("out of memory");
+	    exit(2);
+	}
+    }
+    return &b->data[b->len];
+}
+
+void buf_append(struct buf *b, char *data, long len)
+{
+    memcpy(buf_room(b, len), data, len);
+    b->len += len;
+}
+
+/* throw away the first len bytes */
+void buf_consume(struct buf *b, long len)
+{
+    if (len >= b->len) {
+	b->len = 0;
+	return;
+    }
+    memmove(b->data, &b->data[len], b->len - len);
+    b->len -= len;
+}
+
+/* - - - - - batches and the sender thread - - - - */
+/*
+ * The main thread fills current and puts it on the end of the pending list. The sender takes
+ * the head, sends it and puts it on the free list for reuse. pending_bytes is what the -m
+ * back pressure looks at.
+ */
+struct batch {
+    struct buf b;
+    long lines;
+    struct batch *next;
+};
+
+struct batch *current = NULL;
+long long current_started = 0;
+struct batch *pending_head = NULL;
+struct batch *pending_tail = NULL;
+struct batch *free_batches = NULL;
+long pending_bytes = 0;
+int sender_stopping = 0;
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batch_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t batch_space = PTHREAD_COND_INITIALIZER;
+pthread_t sender_thread;
+
+void rollup_line(char *line, long len);
+
+struct batch *batch_get()
+{
+    struct batch *b;
+
+    pthread_mutex_lock(&batch_lock);
+    if ((b = free_batches) != NULL)
+	free_batches = b->next;
+    pthread_mutex_unlock(&batch_lock);
+    if (b == NULL)
+	b = calloc(1, sizeof(struct batch));
+    b->b.len = 0;
+    b->lines = 0;
+    b->next = NULL;
+    return b;
+}
+
+void batch_flush()
+{
+    if (current->lines == 0)
+	return;
+    pthread_mutex_lock(&batch_lock);
+    if (pending_tail != NULL)
+	pending_tail->next = current;
+    else
+	pending_head = current;
+    pending_tail = current;
+    pending_bytes += current->b.len;
+    pthread_cond_signal(&batch_ready);
+    pthread_mutex_unlock(&batch_lock);
+    current = batch_get();
+}
+
+/* add a line (no newline) then suffix, which is the timestamp or the zeros to make it ns */
+void batch_line(char *line, long len, char *suffix, long suffix_len)
+{
+    char *p;
+
+    if (current->lines == 0)
+	current_started = now_ms();
+    p = buf_room(&current->b, len + suffix_len + 1);
+    memcpy(p, line, len);
+    memcpy(&p[len], suffix, suffix_len);
+    p[len + suffix_len] = '\n';
+    current->b.len += len + suffix_len + 1;
+    current->lines++;
+    stat_lines++;
+    if (rollup_label != NULL)
+	rollup_line(p, len + suffix_len);
+    if (current->lines >= batch_lines)
+	batch_flush();
+}
+
+/* the InfluxDB connection of the sender thread */
+int influx_fd = -1;
+z_stream send_z;
+struct buf send_zbuf;
+
+int influx_connect()
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *r;
+    char port[16];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%ld", influx_port);
+    if (getaddrinfo(influx_host, port, &hints, &res) != 0)
+	return -1;
+    for (r = res; r != NULL; r = r->ai_next) {
+	if ((fd = socket(r->ai_family, r->ai_socktype | SOCK_CLOEXEC, r->ai_protocol)) == -1)
+	    continue;
+	if (connect(fd, r->ai_addr, r->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* writev() until everything is gone, returns 1 for OK and 0 for a broken connection */
+int write_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+	ret = writev(fd, iov, count);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	while (count > 0 && ret >= (ssize_t) iov->iov_len) {
+	    ret -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if (count > 0) {
+	    iov->iov_base = (char *) iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
+    }
+    return 1;
+}
+
+/* the rest of an InfluxDB response read through the buffer that had the header */
+struct reader {
+    int fd;
+    char *buf;
+    long size;
+    long pos;
+    long got;
+};
+
+/* the next byte or -1 for a broken connection */
+int reader_getc(struct reader *r)
+{
+    int ret;
+
+    if (r->pos == r->got) {
+	if ((ret = read(r->fd, r->buf, r->size)) <= 0)
+	    return -1;
+	r->pos = 0;
+	r->got = ret;
+    }
+    return (unsigned char) r->buf[r->pos++];
+}
+
+/* throw away length bytes, returns 0 for a broken connection */
+int reader_skip(struct reader *r, long length)
+{
+    long n;
+    int ret;
+
+    while (length > 0) {
+	if (r->pos == r->got) {
+	    if ((ret = read(r->fd, r->buf, r->size)) <= 0)
+		return 0;
+	    r->pos = 0;
+	    r->got = ret;
+	}
+	n = r->got - r->pos < length ? r->got - r->pos : length;
+	r->pos += n;
+	length -= n;
+    }
+    return 1;
+}
+
+/* one CRLF ended line in to line (cut to size), returns its length or -1 for a broken connection */
+long reader_line(struct reader *r, char *line, long size)
+{
+    long len = 0;
+    int c;
+
+    while ((c = reader_getc(r)) != '\n') {
+	if (c == -1)
+	    return -1;
+	if (c != '\r' && len < size - 1)
+	    line[len++] = c;
+    }
+    line[len] = 0;
+    return len;
+}
+
+/* throw away a Transfer-Encoding: chunked body, returns 0 for a broken connection */
+int reader_chunked(struct reader *r)
+{
+    char line[256];
+    long length;
+
+    for (;;) {
+	if (reader_line(r, line, sizeof(line)) == -1)
+	    return 0;
+	length = strtol(line, NULL, 16);	/* any ;extension is ignored */
+	if (length <= 0)
+	    break;
+	if (reader_skip(r, length + 2) == 0)	/* the chunk and its CRLF */
+	    return 0;
+    }
+    do {			/* trailers until the empty line */
+	if ((length = reader_line(r, line, sizeof(line))) == -1)
+	    return 0;
+    } while (length > 0);
+    return 1;
+}
+
+/* Read one HTTP response including its body so the next request lines up on the kept open
+ * connection. returns the HTTP code or -1 for a broken connection and clears *keep if the
+ * server is closing */
+int influx_response(int fd, int *keep)
+{
+    char result[1024 * 8];
+    char *end;
+    char *s;
+    long got = 0;
+    long length = 0;
+    int chunked;
+    int code = -1;
+    int ret;
+    struct reader r;
+
+    for (;;) {
+	ret = read(fd, &result[got], sizeof(result) - 1 - got);
+	if (ret <= 0)
+	    return -1;
+	got += ret;
+	result[got] = 0;
+	if ((end = strstr(result, "\r\n\r\n")) != NULL)
+	    break;
+	if (got == sizeof(result) - 1)
+	    return -1;		/* silly sized header */
+    }
+    sscanf(result, "HTTP/1.%*d %d", &code);
+    *end = 0;
+    if ((s = strcasestr(result, "Content-Length:")) != NULL)
+	length = atol(&s[strlen("Content-Length:")]);
+    chunked = strcasestr(result, "Transfer-Encoding: chunked") != NULL;	/* InfluxDB 2 errors */
+    if (strcasestr(result, "Connection: close") != NULL)
+	*keep = 0;
+    if (code != 204)
+	fprintf(stderr, "njmon_relay: InfluxDB code %d -->%s<--\n", code, result);
+    r.fd = fd;
+    r.buf = result;
+    r.size = sizeof(result);
+    r.pos = end + 4 - result;
+    r.got = got;
+    if (chunked) {
+	if (reader_chunked(&r) == 0)
+	    return -1;
+    } else if (reader_skip(&r, length) == 0) {
+	return -1;
+    }
+    return code;
+}
+
+/* returns 1 when the batch is done with (sent or rejected by InfluxDB) and 0 to try again */
+int batch_send(struct batch *b)
+{
+    struct iovec iov[2];
+    char header[1024 * 2];
+    char *body = b->b.data;
+    long length = b->b.len;
+    int keep = 1;
+    int code;
+
+    if (output_filename != NULL) {
+	iov[0].iov_base = b->b.data;
+	iov[0].iov_len = b->b.len;
+	if (write_all(influx_fd, iov, 1) == 0)
+	    nwarning("write to the -f file failed");
+	return 1;
+    }
+    if (influx_fd == -1) {
+	if ((influx_fd = influx_connect()) == -1)
+	    return 0;
+	__atomic_add_fetch(&stat_reconnects, 1, __ATOMIC_RELAXED);
+    }
+    if (zlevel) {		/* a gzip body per POST */
+	deflateReset(&send_z);
+	send_z.next_in = (Bytef *) b->b.data;
+	send_z.avail_in = b->b.len;
+	send_zbuf.len = 0;
+	do {
+	    buf_room(&send_zbuf, deflateBound(&send_z, b->b.len));
+	    send_z.next_out = (Bytef *) & send_zbuf.data[send_zbuf.len];
+	    send_z.avail_out = send_zbuf.size - send_zbuf.len;
+	    deflate(&send_z, Z_FINISH);
+	    send_zbuf.len = send_zbuf.size - send_z.avail_out;
+	} while (send_z.avail_out == 0);
+	body = send_zbuf.data;
+	length = send_zbuf.len;
+    }
+    if (influx_version == 1) {
+	snprintf(header, sizeof(header), "POST /write?db=%s&u=%s&p=%s HTTP/1.1\r\nHost: %s:%ld\r\n%sContent-Length: %ld\r\n\r\n",
+		 influx_database, influx_username, influx_password, influx_host, influx_port,
+		 zlevel ? "Content-Encoding: gzip\r\n" : "", length);
+    } else {			/* InfluxDB 2 */
+	snprintf(header, sizeof(header), "POST /api/v2/write?bucket=%s&org=%s HTTP/1.1\r\nHost: %s:%ld\r\nAuthorization: Token %s\r\nContent-Type: text/plain; charset=utf-8\r\n%sAccept: application/json\r\nContent-Length: %ld\r\n\r\n",
+		 influx_database, influx_org, influx_host, influx_port, influx_token,
+		 zlevel ? "Content-Encoding: gzip\r\n" : "", length);
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = body;
+    iov[1].iov_len = length;
+    if (write_all(influx_fd, iov, 2) == 0 || (code = influx_response(influx_fd, &keep)) == -1) {
+	__atomic_add_fetch(&stat_send_errors, 1, __ATOMIC_RELAXED);
+	close(influx_fd);
+	influx_fd = -1;
+	return 0;
+    }
+    if (!keep) {
+	close(influx_fd);
+	influx_fd = -1;
+    }
+    if (code >= 500) {		/* InfluxDB is struggling, give it the batch again later */
+	__atomic_add_fetch(&stat_send_errors, 1, __ATOMIC_RELAXED);
+	return 0;
+    }
+    __atomic_add_fetch(&stat_batches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat_bytes_out, length, __ATOMIC_RELAXED);
+    return 1;			/* 4xx means the lines are bad and sending them again will not help */
+}
+
+void *sender(void *arg)
+{
+    struct batch *b;
+    struct timespec retry;
+    long backoff = 1;
+    int stop;
+
+    for (;;) {
+	pthread_mutex_lock(&batch_lock);
+	while (pending_head == NULL && !sender_stopping)
+	    pthread_cond_wait(&batch_ready, &batch_lock);
+	b = pending_head;	/* left on the list while it is sent so pending_bytes includes it */
+	stop = sender_stopping;
+	pthread_mutex_unlock(&batch_lock);
+	if (b == NULL)
+	    return NULL;
+
+	if (batch_send(b) == 0) {
+	    if (stop) {
+		nwarning("InfluxDB unreachable at exit - rest of the lines dropped");
+		return NULL;
+	    }
+	    if (verbose)
+		fprintf(stderr, "njmon_relay: send to %s:%ld failed - retry in %ld seconds\n", influx_host, influx_port, backoff);
+	    clock_gettime(CLOCK_REALTIME, &retry);
+	    retry.tv_sec += backoff;
+	    pthread_mutex_lock(&batch_lock);
+	    if (!sender_stopping)
+		pthread_cond_timedwait(&batch_ready, &batch_lock, &retry);
+	    pthread_mutex_unlock(&batch_lock);
+	    if (backoff < 64)
+		backoff = backoff * 2;
+	    continue;
+	}
+	backoff = 1;
+	pthread_mutex_lock(&batch_lock);
+	pending_head = b->next;
+	if (pending_head == NULL)
+	    pending_tail = NULL;
+	pending_bytes -= b->b.len;
+	b->next = free_batches;
+	free_batches = b;
+	pthread_cond_signal(&batch_space);
+	pthread_mutex_unlock(&batch_lock);
+    }
+}
+
+/* - - - - - rollups - - - - */
+/*
+ * A series is the part of a line before the fields (measurement and tags) so it is one host or
+ * one disk of a host. Each keeps its latest values, found through an open addressing hash of
+ * the series, and belongs to the group of its measurement and label value. Fields come in the
+ * same order every sample so the field number is guessed from the position first. A series
+ * not seen for ROLLUP_KEEP periods, like a node that has gone or a process disk, is forgotten
+ * and a group with no series left goes too, so churn does not grow the table for ever.
+ */
+#define ROLLUP_FIELDS 256
+#define ROLLUP_KEEP 6
+
+struct rollup_group {
+    char measurement[128];
+    char value[128];
+    char sub[256];		/* the <sub>_name= tag so psi cpu and io are not added together */
+    char *names[ROLLUP_FIELDS];
+    int fields;
+    struct rollup_series *series;
+    struct rollup_group *next;
+};
+
+struct rollup_series {
+    char *key;
+    unsigned long long hash;
+    struct rollup_group *group;	/* NULL if the line does not have the label */
+    double values[ROLLUP_FIELDS];
+    long seen;			/* rollup period it was last updated in */
+    struct rollup_series *next;	/* in the group */
+};
+
+struct rollup_group *rollup_groups = NULL;
+struct rollup_series **rollup_table = NULL;
+long rollup_size = 0;
+long rollup_used = 0;
+long rollup_period = 1;
+char rollup_tag[128];		/* ,label= */
+long rollup_tag_len;
+
+unsigned long long hash_bytes(char *s, long len)
+{
+    unsigned long long h = 14695981039346656037ULL;	/* FNV-1a */
+
+    while (len-- > 0)
+	h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+    return h;
+}
+
+/* the end of the tag value or measurement starting at s, up to an unescaped , or space */
+char *lp_token_end(char *s, char *end)
+{
+    for (; s < end && *s != ',' && *s != ' '; s++)
+	if (*s == '\\' && s + 1 < end)
+	    s++;
+    return s;
+}
+
+void rollup_grow()
+{
+    struct rollup_series **old = rollup_table;
+    long old_size = rollup_size;
+    long i;
+    long j;
+
+    rollup_size = rollup_size ? rollup_size * 2 : 1024;
+    rollup_table = calloc(rollup_size, sizeof(struct rollup_series *));
+    for (i = 0; i < old_size; i++) {
+	if (old[i] == NULL)
+	    continue;
+	for (j = old[i]->hash & (rollup_size - 1); rollup_table[j] != NULL; j = (j + 1) & (rollup_size - 1));
+	rollup_table[j] = old[i];
+    }
+    free(old);
+}
+
+struct rollup_series *rollup_series_new(char *key, long key_len, unsigned long long hash, char *measurement, long measurement_len)
+{
+    struct rollup_series *series = calloc(1, sizeof(struct rollup_series));
+    struct rollup_group *group;
+    char *tag;
+    char *value;
+    char *sub;
+    long value_len;
+    long sub_len = 0;
+    long i;
+
+    series->key = malloc(key_len + 1);
+    memcpy(series->key, key, key_len);
+    series->key[key_len] = 0;
+    series->hash = hash;
+    for (i = 0; i < ROLLUP_FIELDS; i++)
+	series->values[i] = NAN;
+    if ((tag = strstr(series->key, rollup_tag)) == NULL)
+	return series;
+    value = tag + rollup_tag_len;
+    value_len = lp_token_end(value, &series->key[key_len]) - value;
+    if ((sub = strstr(series->key, "_name=")) != NULL) {
+	while (sub > series->key && sub[-1] != ',')
+	    sub--;
+	sub_len = lp_token_end(strchr(sub, '=') + 1, &series->key[key_len]) - sub;
+    }
+    if (measurement_len >= sizeof(group->measurement) || value_len >= sizeof(group->value) || sub_len >= sizeof(group->sub))
+	return series;
+    for (group = rollup_groups; group != NULL; group = group->next)
+	if (!strncmp(group->measurement, measurement, measurement_len) && group->measurement[measurement_len] == 0
+	    && !strncmp(group->value, value, value_len) && group->value[value_len] == 0
+	    && (sub_len == 0 || !strncmp(group->sub, sub, sub_len)) && group->sub[sub_len] == 0)
+	    break;
+    if (group == NULL) {
+	group = calloc(1, sizeof(struct rollup_group));
+	memcpy(group->measurement, measurement, measurement_len);
+	memcpy(group->value, value, value_len);
+	if (sub_len > 0)
+	    memcpy(group->sub, sub, sub_len);
+	group->next = rollup_groups;
+	rollup_groups = group;
+    }
+    series->group = group;
+    series->next = group->series;
+    group->series = series;
+    return series;
+}
+
+/* a line going in to the batch, remember its numbers if it is a -R measurement */
+void rollup_line(char *line, long len)
+{
+    struct rollup_series *series;
+    struct rollup_group *group;
+    unsigned long long hash;
+    char *end = &line[len];
+    char *key_end;
+    char *measurement_end;
+    char *name;
+    char *value;
+    char *s;
+    char wanted[130];
+    long name_len;
+    long i;
+    int field;
+    int k;
+
+    measurement_end = lp_token_end(line, end);
+    if (measurement_end - line + 2 >= (long) sizeof(wanted))
+	return;
+    wanted[0] = ',';
+    memcpy(&wanted[1], line, measurement_end - line);
+    wanted[measurement_end - line + 1] = ',';
+    wanted[measurement_end - line + 2] = 0;
+    if (strstr(rollup_measurements, wanted) == NULL)
+	return;
+    for (key_end = measurement_end; key_end < end && *key_end != ' '; key_end++)
+	if (*key_end == '\\' && key_end + 1 < end)
+	    key_end++;
+    if (key_end >= end)
+	return;
+
+    if (rollup_used * 10 >= rollup_size * 7)
+	rollup_grow();
+    hash = hash_bytes(line, key_end - line);
+    for (i = hash & (rollup_size - 1); (series = rollup_table[i]) != NULL; i = (i + 1) & (rollup_size - 1))
+	if (series->hash == hash && !strncmp(series->key, line, key_end - line) && series->key[key_end - line] == 0)
+	    break;
+    if (series == NULL) {
+	series = rollup_table[i] = rollup_series_new(line, key_end - line, hash, line, measurement_end - line);
+	rollup_used++;
+    }
+    series->seen = rollup_period;
+    if ((group = series->group) == NULL)
+	return;
+
+    /* name=value,name=value up to the space before the timestamp, string values are skipped */
+    for (s = key_end + 1, k = 0; s < end && *s != ' '; k++) {
+	name = s;
+	while (s < end && *s != '=')
+	    s++;
+	name_len = s - name;
+	value = ++s;
+	if (*value == '"') {
+	    for (s++; s < end && *s != '"'; s++)
+		if (*s == '\\')
+		    s++;
+	    s++;
+	} else {
+	    while (s < end && *s != ',' && *s != ' ')
+		s++;
+	}
+	if (s < end && *s == ',')
+	    s++;
+	if (*value == '"' || *value == 't' || *value == 'f' || *value == 'T' || *value == 'F')
+	    continue;
+	if (k < group->fields && !strncmp(group->names[k], name, name_len) && group->names[k][name_len] == 0) {
+	    field = k;
+	} else {
+	    for (field = 0; field < group->fields; field++)
+		if (!strncmp(group->names[field], name, name_len) && group->names[field][name_len] == 0)
+		    break;
+	    if (field == group->fields) {
+		if (field == ROLLUP_FIELDS)
+		    continue;
+		group->names[field] = strndup(name, name_len);
+		group->fields++;
+	    }
+	}
+	series->values[field] = strtod(value, NULL);	/* stops at the i of an integer */
+    }
+}
+
+/* drop the series not seen for ROLLUP_KEEP periods, the table is rebuilt as open addressing
+ * can not just empty a slot */
+void rollup_evict()
+{
+    struct rollup_series **old = rollup_table;
+    struct rollup_series **s;
+    struct rollup_group **g;
+    struct rollup_group *group;
+    long i;
+    long j;
+
+    for (i = 0; i < rollup_size; i++)
+	if (old[i] != NULL && rollup_period - old[i]->seen >= ROLLUP_KEEP)
+	    break;
+    if (i == rollup_size)
+	return;
+    for (group = rollup_groups; group != NULL; group = group->next)
+	for (s = &group->series; *s != NULL;)
+	    if (rollup_period - (*s)->seen >= ROLLUP_KEEP)
+		*s = (*s)->next;
+	    else
+		s = &(*s)->next;
+    rollup_table = calloc(rollup_size, sizeof(struct rollup_series *));
+    rollup_used = 0;
+    for (i = 0; i < rollup_size; i++) {
+	if (old[i] == NULL)
+	    continue;
+	if (rollup_period - old[i]->seen >= ROLLUP_KEEP) {
+	    free(old[i]->key);
+	    free(old[i]);
+	    continue;
+	}
+	for (j = old[i]->hash & (rollup_size - 1); rollup_table[j] != NULL; j = (j + 1) & (rollup_size - 1));
+	rollup_table[j] = old[i];
+	rollup_used++;
+    }
+    free(old);
+    for (g = &rollup_groups; *g != NULL;) {
+	group = *g;
+	if (group->series != NULL) {
+	    g = &group->next;
+	    continue;
+	}
+	*g = group->next;
+	for (i = 0; i < group->fields; i++)
+	    free(group->names[i]);
+	free(group);
+    }
+}
+
+/* add up each group's series seen this period */
+void rollup_send(long long epoch)
+{
+    struct rollup_group *group;
+    struct rollup_series *series;
+    struct buf line = { 0 };
+    char suffix[64];
+    double sum;
+    double min;
+    double max;
+    long count;
+    long series_count;
+    int field;
+
+    snprintf(suffix, sizeof(suffix), " %lld000000000", epoch);
+    for (group = rollup_groups; group != NULL; group = group->next) {
+	series_count = 0;
+	for (series = group->series; series != NULL; series = series->next)
+	    if (series->seen == rollup_period)
+		series_count++;
+	if (series_count == 0)
+	    continue;
+	line.len = 0;
+	line.len += snprintf(buf_room(&line, 1024), 1024, "%s_rollup,%s=%s%s%s series=%ldi",
+			     group->measurement, rollup_label, group->value, group->sub[0] ? "," : "", group->sub, series_count);
+	for (field = 0; field < group->fields; field++) {
+	    sum = 0.0;
+	    min = INFINITY;
+	    max = -INFINITY;
+	    count = 0;
+	    for (series = group->series; series != NULL; series = series->next) {
+		if (series->seen != rollup_period || isnan(series->values[field]))
+		    continue;
+		sum += series->values[field];
+		if (series->values[field] < min)
+		    min = series->values[field];
+		if (series->values[field] > max)
+		    max = series->values[field];
+		count++;
+	    }
+	    if (count == 0)
+		continue;
+	    line.len += snprintf(buf_room(&line, 1024), 1024, ",%s_sum=%.3f,%s_avg=%.3f,%s_min=%.3f,%s_max=%.3f",
+				 group->names[field], sum, group->names[field], sum / count,
+				 group->names[field], min, group->names[field], max);
+	}
+	batch_line(line.data, line.len, suffix, strlen(suffix));
+	stat_rollups++;
+    }
+    free(line.data);
+    rollup_evict();
+    rollup_period++;
+}
+
+/* - - - - - client connections - - - - */
+#define KIND_UNKNOWN 0
+#define KIND_HTTP    1
+#define KIND_JSON    2
+#define KIND_LP      3
+
+#define FRAMED_MAGIC "NJZ1"	/* what njmon -Z sends first on a raw socket */
+
+struct conn {
+    int fd;
+    int kind;
+    int framed;			/* -Z frames, raw has the bytes as they came */
+    z_stream z;
+    struct buf raw;
+    struct buf in;		/* the JSON, lines or HTTP */
+    char peer[64];
+    /* JSON */
+    long scan;			/* looked at up to here */
+    long start;			/* of the sample being read or -1 */
+    int depth;
+    int quote;
+    int escape;
+    char tags[1024];		/* ,host=...,mtm=... from the tags section */
+    char extra[512];		/* the other _tag fields, like the -q additional tags */
+    /* HTTP */
+    int gzip_ok;
+    z_stream gz;		/* for Content-Encoding: gzip bodies */
+    struct buf body;
+    struct buf out;		/* replies the socket has not taken yet */
+    int events;			/* what epoll is waiting for */
+    int closing;		/* closed once out has gone */
+    long long active;		/* ms of the last read or write */
+    struct conn *prev;
+    struct conn *next;
+};
+
+struct conn *conns = NULL;	/* to find the idle ones */
+
+char now_suffix[32];		/* " ns" for lines that did not come with a timestamp */
+long now_suffix_len;
+int epfd;
+
+void conn_close(int epfd, struct conn *c)
+{
+    if (c->prev != NULL)
+	c->prev->next = c->next;
+    else
+	conns = c->next;
+    if (c->next != NULL)
+	c->next->prev = c->prev;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->framed)
+	inflateEnd(&c->z);
+    if (c->gzip_ok)
+	inflateEnd(&c->gz);
+    free(c->raw.data);
+    free(c->in.data);
+    free(c->body.data);
+    free(c->out.data);
+    free(c);
+    stat_clients--;
+}
+
+/* a Line Protocol line, suffix makes its timestamp ns */
+void lp_line(char *line, long len, char *suffix, long suffix_len)
+{
+    long spaces = 0;
+    long i;
+    int quote = 0;
+
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' '))
+	len--;
+    if (len == 0 || line[0] == '#')
+	return;
+    for (i = 0; i < len; i++) {	/* two spaces outside strings means it has a timestamp */
+	if (line[i] == '\\')
+	    i++;
+	else if (line[i] == '"')
+	    quote = !quote;
+	else if (line[i] == ' ' && !quote)
+	    spaces++;
+    }
+    if (spaces >= 2)
+	batch_line(line, len, suffix, suffix_len);
+    else
+	batch_line(line, len, now_suffix, now_suffix_len);
+}
+
+/* split lines, returns the bytes used (the part line at the end is left) */
+long lp_lines(char *data, long len, char *suffix, long suffix_len, int last)
+{
+    char *s = data;
+    char *end = data + len;
+    char *nl;
+
+    while (s < end && (nl = memchr(s, '\n', end - s)) != NULL) {
+	lp_line(s, nl - s, suffix, suffix_len);
+	s = nl + 1;
+    }
+    if (last && s < end) {	/* a POST body does not need a final newline */
+	lp_line(s, end - s, suffix, suffix_len);
+	s = end;
+    }
+    return s - data;
+}
+
+/* - - - - - njmon JSON to Line Protocol - - - - */
+/*
+ * Only what njmon writes: an object of sections which are objects of numbers and strings or
+ * of subsections which are. A section with subsections is a line per subsection with the
+ * <section less the s>_name tag, and its own fields are dropped, just as nimon does it.
+ * Integers get the i nimon puts on plong() values. Arrays (-e) are skipped.
+ */
+void json_space(char **p, char *end)
+{
+    while (*p < end && (**p == ' ' || **p == '\n' || **p == '\r' || **p == '\t'))
+	(*p)++;
+}
+
+/* the string at p without the quotes (escapes left as they are), returns its length */
+long json_string(char **p, char *end, char **s)
+{
+    char *q = *p;
+
+    if (q >= end || *q != '"')
+	return -1;
+    *s = ++q;
+    for (; q < end && *q != '"'; q++)
+	if (*q == '\\')
+	    q++;
+    if (q >= end)
+	return -1;
+    *p = q + 1;
+    return q - *s;
+}
+
+/* step over any value */
+void json_skip(char **p, char *end)
+{
+    char *s;
+    int depth = 0;
+
+    json_space(p, end);
+    do {
+	if (*p >= end)
+	    return;
+	if (**p == '"') {
+	    json_string(p, end, &s);
+	    continue;
+	}
+	if (**p == '{' || **p == '[')
+	    depth++;
+	else if (**p == '}' || **p == ']')
+	    depth--;
+	else if (depth == 0 && **p == ',')
+	    return;
+	(*p)++;
+    } while (depth > 0 || (*p < end && **p != ',' && **p != '}' && **p != ']'));
+}
+
+/* a tag value with the Line Protocol specials escaped */
+long lp_escape(char *target, long size, char *s, long len)
+{
+    long n = 0;
+
+    for (; len > 0 && n < size - 2; len--, s++) {
+	if (*s == ' ' || *s == ',' || *s == '=')
+	    target[n++] = '\\';
+	target[n++] = *s;
+    }
+    target[n] = 0;
+    return n;
+}
+
+/* the fields of one object in to fields, subsection objects are passed to sub() */
+int json_fields(char **p, char *end, struct buf *fields, void (*sub) (char *, long, char **, char *))
+{
+    char *name;
+    char *s;
+    long name_len;
+    long len;
+    int subs = 0;
+
+    json_space(p, end);
+    if (*p >= end || **p != '{')
+	return -1;
+    (*p)++;
+    for (;;) {
+	json_space(p, end);
+	if (*p < end && **p == '}') {
+	    (*p)++;
+	    return subs;
+	}
+	if ((name_len = json_string(p, end, &name)) < 0)
+	    return -1;
+	json_space(p, end);
+	if (*p >= end || **p != ':')
+	    return -1;
+	(*p)++;
+	json_space(p, end);
+	if (*p >= end)
+	    return -1;
+	if (**p == '"') {
+	    if ((len = json_string(p, end, &s)) < 0)
+		return -1;
+	    buf_append(fields, name, name_len);
+	    buf_append(fields, "=\"", 2);
+	    buf_append(fields, s, len);
+	    buf_append(fields, "\",", 2);
+	} else if (**p == '-' || (**p >= '0' && **p <= '9')) {
+	    for (s = *p; *p < end && strchr("-+.eE0123456789", **p) != NULL; (*p)++);
+	    if (*p < end && ((**p >= 'a' && **p <= 'z') || (**p >= 'A' && **p <= 'Z'))) {
+		json_skip(p, end);	/* -nan and -inf */
+		if (*p < end && **p == ',')
+		    (*p)++;
+		continue;
+	    }
+	    buf_append(fields, name, name_len);
+	    buf_append(fields, "=", 1);
+	    buf_append(fields, s, *p - s);
+	    if (memchr(s, '.', *p - s) == NULL && memchr(s, 'e', *p - s) == NULL)
+		buf_append(fields, "i,", 2);
+	    else
+		buf_append(fields, ",", 1);
+	} else if (**p == '{' && sub != NULL) {
+	    sub(name, name_len, p, end);
+	    subs++;
+	} else {
+	    json_skip(p, end);	/* arrays, true, false, null and nan */
+	}
+	json_space(p, end);
+	if (*p < end && **p == ',')
+	    (*p)++;
+    }
+}
+
+/* the state of the sample being converted, for the sub() callback */
+struct conn *json_conn;
+char json_section[256];
+char json_sub[256];
+char json_suffix[64];
+long json_suffix_len;
+struct buf json_line;
+struct buf json_fields_buf;
+
+void json_sub_line(char *name, long name_len, char **p, char *end)
+{
+    struct buf *line = &json_line;
+    long len;
+
+    json_fields_buf.len = 0;
+    if (json_fields(p, end, &json_fields_buf, NULL) < 0 || json_fields_buf.len == 0)
+	return;
+    line->len = 0;
+    len = snprintf(buf_room(line, 2048), 2048, "%s%s,%s_name=", json_section, json_conn->tags, json_sub);
+    line->len += len < 2048 ? len : 2047;
+    line->len += lp_escape(buf_room(line, name_len * 2 + 2), name_len * 2 + 2, name, name_len);
+    buf_append(line, json_conn->extra, strlen(json_conn->extra));
+    buf_append(line, " ", 1);
+    buf_append(line, json_fields_buf.data, json_fields_buf.len - 1);	/* less the last comma */
+    batch_line(line->data, line->len, json_suffix, json_suffix_len);
+}
+
+/* pick the host tags out of the tags section */
+void json_tags(struct conn *c, char *p, char *end)
+{
+    char *names[5] = { "host", "os", "architecture", "serial_no", "mtm" };
+    char *values[5] = { "", "", "", "", "" };
+    long lens[5] = { 0, 0, 0, 0, 0 };
+    char *name;
+    char *value;
+    long name_len;
+    long value_len;
+    long n = 0;
+    long extra = 0;
+    int i;
+
+    json_space(&p, end);
+    if (p >= end || *p != '{')
+	return;
+    for (p++;;) {
+	json_space(&p, end);
+	if ((name_len = json_string(&p, end, &name)) < 0)
+	    break;
+	json_space(&p, end);
+	if (p >= end || *p != ':')
+	    break;
+	p++;
+	json_space(&p, end);
+	if ((value_len = json_string(&p, end, &value)) < 0)
+	    break;
+	json_space(&p, end);
+	if (p < end && *p == ',')
+	    p++;
+	if (name_len < 5 || strncmp(&name[name_len - 4], "_tag", 4))
+	    continue;
+	name_len -= 4;
+	for (i = 0; i < 5; i++)
+	    if (!strncmp(names[i], name, name_len) && names[i][name_len] == 0)
+		break;
+	if (i < 5) {
+	    values[i] = value;
+	    lens[i] = value_len;
+	} else if (extra + name_len + value_len * 2 + 3 < (long) sizeof(c->extra)) {
+	    c->extra[extra++] = ',';
+	    memcpy(&c->extra[extra], name, name_len);
+	    extra += name_len;
+	    c->extra[extra++] = '=';
+	    extra += lp_escape(&c->extra[extra], sizeof(c->extra) - extra, value, value_len);
+	}
+    }
+    c->extra[extra] = 0;
+    for (i = 0; i < 5; i++) {
+	if (n + strlen(names[i]) + lens[i] * 2 + 3 >= sizeof(c->tags))
+	    break;
+	n += sprintf(&c->tags[n], ",%s=", names[i]);
+	n += lp_escape(&c->tags[n], sizeof(c->tags) - n, values[i], lens[i]);
+    }
+    c->tags[n] = 0;
+}
+
+void json_sample(struct conn *c, char *data, long len)
+{
+    struct tm tm;
+    char *end = data + len;
+    char *p = data;
+    char *name;
+    char *s;
+    long name_len;
+    long long epoch;
+    int subs;
+
+    stat_samples++;
+    /* the tags and time first as the sections before them need them */
+    for (s = data; (s = memmem(s, end - s, "\"tags\": {", 9)) != NULL; s += 9)
+	if (s == data || s[-1] != '\\') {
+	    json_tags(c, s + 8, end);
+	    break;
+	}
+    epoch = time(0);
+    if ((s = memmem(data, len, "\"UTC\": \"", 8)) != NULL) {
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s + 8, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+	    tm.tm_year -= 1900;
+	    tm.tm_mon -= 1;
+	    epoch = timegm(&tm);
+	}
+    }
+    json_suffix_len = snprintf(json_suffix, sizeof(json_suffix), " %lld000000000", epoch);
+    json_conn = c;
+
+    json_space(&p, end);
+    if (p >= end || *p++ != '{') {
+	stat_bad++;
+	return;
+    }
+    for (;;) {
+	json_space(&p, end);
+	if (p >= end || *p == '}')
+	    return;
+	if ((name_len = json_string(&p, end, &name)) < 0 || name_len >= (long) sizeof(json_section)) {
+	    stat_bad++;
+	    return;
+	}
+	json_space(&p, end);
+	if (p >= end || *p++ != ':') {
+	    stat_bad++;
+	    return;
+	}
+	json_space(&p, end);
+	if (p < end && *p == '{') {
+	    memcpy(json_section, name, name_len);
+	    json_section[name_len] = 0;
+	    strcpy(json_sub, json_section);	/* remove the trailing s for the sub tag name */
+	    if (!strcmp("processes", json_sub))
+		strcpy(json_sub, "process");
+	    else if (json_sub[0] != 0 && json_sub[strlen(json_sub) - 1] == 's')
+		json_sub[strlen(json_sub) - 1] = 0;
+	    json_fields_buf.len = 0;
+	    if ((subs = json_fields(&p, end, &json_fields_buf, json_sub_line)) < 0) {
+		stat_bad++;
+		return;
+	    }
+	    if (subs == 0 && json_fields_buf.len > 0) {
+		json_line.len = 0;
+		buf_append(&json_line, json_section, name_len);
+		buf_append(&json_line, c->tags, strlen(c->tags));
+		buf_append(&json_line, c->extra, strlen(c->extra));
+		buf_append(&json_line, " ", 1);
+		buf_append(&json_line, json_fields_buf.data, json_fields_buf.len - 1);
+		batch_line(json_line.data, json_line.len, json_suffix, json_suffix_len);
+	    }
+	} else {
+	    json_skip(&p, end);
+	}
+	json_space(&p, end);
+	if (p < end && *p == ',')
+	    p++;
+    }
+}
+
+/* find whole samples as the bytes come in, only the new bytes are looked at */
+void json_input(struct conn *c)
+{
+    char *data = c->in.data;
+    long i;
+
+    for (i = c->scan; i < c->in.len; i++) {
+	if (c->quote) {
+	    if (c->escape)
+		c->escape = 0;
+	    else if (data[i] == '\\')
+		c->escape = 1;
+	    else if (data[i] == '"')
+		c->quote = 0;
+	    continue;
+	}
+	switch (data[i]) {
+	case '"':
+	    c->quote = 1;
+	    break;
+	case '{':
+	    if (c->depth++ == 0)
+		c->start = i;
+	    break;
+	case '}':
+	    if (c->depth > 0 && --c->depth == 0) {
+		json_sample(c, &data[c->start], i + 1 - c->start);
+		c->start = -1;
+	    }
+	    break;
+	}
+    }
+    if (c->start == -1) {	/* between samples */
+	c->in.len = 0;
+	c->scan = 0;
+    } else {
+	buf_consume(&c->in, c->start);
+	c->scan = c->in.len;
+	c->start = 0;
+    }
+}
+
+/* - - - - - HTTP from nimon - - - - */
+#define HTTP_BODY_MAX (64 * 1024 * 1024)	/* 413 for a bigger POST, nimon sends a few MB at most */
+#define HTTP_OUT_MAX (64 * 1024)	/* stop reading a client that is not reading its replies */
+
+/* queued as the socket is non-blocking and may not take it all, conn_output() sends it */
+void http_reply(struct conn *c, char *status)
+{
+    char reply[256];
+    long len;
+
+    len = snprintf(reply, sizeof(reply), "HTTP/1.1 %s\r\nContent-Length: 0\r\nX-Influxdb-Version: njmon_relay\r\n\r\n", status);
+    buf_append(&c->out, reply, len);
+}
+
+/* returns 0 when the connection should be closed */
+int http_input(struct conn *c)
+{
+    char *header_end;
+    char *body;
+    char *s;
+    char *path;
+    char suffix[16] = "";
+    long header_len;
+    long length = 0;
+    int gzip;
+    int keep;
+    int write_path;
+    int ret;
+
+    for (;;) {
+	buf_room(&c->in, 0);
+	c->in.data[c->in.len] = 0;
+	if ((header_end = strstr(c->in.data, "\r\n\r\n")) == NULL)
+	    return c->in.len < 64 * 1024;	/* silly sized header */
+	*header_end = 0;
+	header_len = header_end + 4 - c->in.data;
+	if ((s = strcasestr(c->in.data, "Content-Length:")) != NULL)
+	    length = atol(&s[strlen("Content-Length:")]);
+	else
+	    length = 0;
+	if (strcasestr(c->in.data, "Transfer-Encoding: chunked") != NULL) {
+	    http_reply(c, "411 Length Required");
+	    return 0;
+	}
+	if (length < 0) {
+	    stat_bad++;
+	    http_reply(c, "400 Bad Request");
+	    return 0;
+	}
+	if (length > HTTP_BODY_MAX) {	/* rather than buffer whatever a client claims */
+	    stat_bad++;
+	    http_reply(c, "413 Payload Too Large");
+	    return 0;
+	}
+	if (c->in.len < header_len + length) {
+	    *header_end = '\r';
+	    return 1;		/* the rest of the body is still to come */
+	}
+	gzip = strcasestr(c->in.data, "Content-Encoding: gzip") != NULL;
+	keep = strcasestr(c->in.data, "Connection: close") == NULL;
+	path = strchr(c->in.data, ' ');
+	write_path = path != NULL && (!strncmp(path, " /write", 7) || !strncmp(path, " /api/v2/write", 14));
+	if ((s = strstr(c->in.data, "precision=")) != NULL) {
+	    s += strlen("precision=");
+	    if (s[0] == 's')
+		strcpy(suffix, "000000000");
+	    else if (s[0] == 'm' && s[1] == 's')
+		strcpy(suffix, "000000");
+	    else if (s[0] == 'u')
+		strcpy(suffix, "000");
+	}
+	body = &c->in.data[header_len];
+
+	if (!strncmp(c->in.data, "GET /ping", 9) || !strncmp(c->in.data, "HEAD /ping", 10)) {
+	    http_reply(c, "204 No Content");
+	} else if (strncmp(c->in.data, "POST ", 5) || !write_path) {
+	    http_reply(c, "404 Not Found");
+	} else {
+	    stat_samples++;
+	    if (gzip) {
+		if (!c->gzip_ok) {
+		    if (inflateInit2(&c->gz, 15 + 16) != Z_OK) {
+			http_reply(c, "500 Internal Server Error");
+			return 0;
+		    }
+		    c->gzip_ok = 1;
+		}
+		inflateReset(&c->gz);
+		c->gz.next_in = (Bytef *) body;
+		c->gz.avail_in = length;
+		c->body.len = 0;
+		do {
+		    buf_room(&c->body, length * 4 + 64 * 1024);
+		    c->gz.next_out = (Bytef *) & c->body.data[c->body.len];
+		    c->gz.avail_out = c->body.size - c->body.len - 1;
+		    ret = inflate(&c->gz, Z_NO_FLUSH);
+		    c->body.len = c->body.size - 1 - c->gz.avail_out;
+		    if (c->body.len > HTTP_BODY_MAX * 8) {	/* a zip bomb */
+			stat_bad++;
+			http_reply(c, "413 Payload Too Large");
+			return 0;
+		    }
+		} while (ret == Z_OK && c->gz.avail_out == 0);
+		if (ret != Z_STREAM_END) {	/* bad or cut short, the lines may be part ones */
+		    stat_bad++;
+		    http_reply(c, "400 Bad Request");
+		    return 0;
+		}
+		lp_lines(c->body.data, c->body.len, suffix, strlen(suffix), 1);
+	    } else {
+		lp_lines(body, length, suffix, strlen(suffix), 1);
+	    }
+	    http_reply(c, "204 No Content");
+	}
+	buf_consume(&c->in, header_len + length);
+	if (!keep)
+	    return 0;
+    }
+}
+
+/* - - - - - reading the clients - - - - */
+/* work out what the connection is sending, returns 0 to close it */
+int conn_kind(struct conn *c)
+{
+    unsigned char *d = (unsigned char *) c->in.data;
+
+    if (c->in.len == 0)
+	return 1;
+    if (!c->framed && !memcmp(d, FRAMED_MAGIC, c->in.len < 4 ? c->in.len : 4)) {
+	if (c->in.len < 4)
+	    return 1;		/* the rest of the magic is still to come */
+	if (inflateInit(&c->z) != Z_OK)
+	    return 0;
+	c->framed = 1;
+	buf_append(&c->raw, &c->in.data[4], c->in.len - 4);
+	c->in.len = 0;
+	return 1;
+    }
+    if (d[0] == '{') {
+	c->kind = KIND_JSON;
+	c->start = -1;
+    } else if (d[0] == 'P' || d[0] == 'G' || d[0] == 'H') {
+	if (c->in.len < 5)
+	    return 1;
+	c->kind = (!strncmp(c->in.data, "POST ", 5) || !strncmp(c->in.data, "GET ", 4) || !strncmp(c->in.data, "HEAD ", 5)) ? KIND_HTTP : KIND_LP;
+    } else if ((d[0] >= 'a' && d[0] <= 'z') || (d[0] >= 'A' && d[0] <= 'Z') || d[0] == '_') {
+	c->kind = KIND_LP;
+    } else if (c->framed) {
+	fprintf(stderr, "njmon_relay: %s -Z stream is not JSON or Line Protocol - closed\n", c->peer);
+	return 0;
+    } else if (c->in.len < 5) {
+	return 1;
+    } else if (d[4] == 'T') {
+	fprintf(stderr, "njmon_relay: %s is sending NBMON, use nbmon_decode for that - closed\n", c->peer);
+	return 0;
+    } else {
+	fprintf(stderr, "njmon_relay: %s is sending something unknown - closed\n", c->peer);
+	return 0;
+    }
+    return 1;
+}
+
+/* inflate the whole frames, returns 0 for a broken stream */
+int conn_frames(struct conn *c)
+{
+    unsigned char *d;
+    long len;
+    long at = 0;
+
+    while (c->raw.len - at >= 4) {
+	d = (unsigned char *) &c->raw.data[at];
+	len = d[0] | (d[1] << 8) | (d[2] << 16) | ((long) d[3] << 24);
+	if (len > 256 * 1024 * 1024)
+	    return 0;
+	if (c->raw.len - at - 4 < len)
+	    break;
+	c->z.next_in = (Bytef *) & d[4];
+	c->z.avail_in = len;
+	do {
+	    buf_room(&c->in, len * 4 + 64 * 1024);
+	    c->z.next_out = (Bytef *) & c->in.data[c->in.len];
+	    c->z.avail_out = c->in.size - c->in.len - 1;
+	    if (inflate(&c->z, Z_SYNC_FLUSH) < 0 && c->z.avail_in > 0)
+		return 0;
+	    c->in.len = c->in.size - 1 - c->z.avail_out;
+	} while (c->z.avail_out == 0);
+	at += 4 + len;
+    }
+    buf_consume(&c->raw, at);
+    return 1;
+}
+
+/* returns 0 when the connection should be closed */
+int conn_input(struct conn *c)
+{
+    struct buf *target = c->framed ? &c->raw : &c->in;
+    long used;
+    ssize_t got;
+
+    got = read(c->fd, buf_room(target, 256 * 1024), 256 * 1024);
+    if (got == 0)
+	return 0;
+    if (got < 0)
+	return errno == EAGAIN || errno == EINTR;
+    target->len += got;
+    stat_bytes_in += got;
+    c->active = now_ms();
+    if (c->framed && conn_frames(c) == 0) {
+	fprintf(stderr, "njmon_relay: %s broken -Z stream - closed\n", c->peer);
+	return 0;
+    }
+    if (c->kind == KIND_UNKNOWN) {
+	if (conn_kind(c) == 0)
+	    return 0;
+	if (c->framed && c->kind == KIND_UNKNOWN) {	/* just switched to frames */
+	    if (conn_frames(c) == 0 || conn_kind(c) == 0)
+		return 0;
+	}
+	if (c->kind == KIND_UNKNOWN)
+	    return 1;
+    }
+    switch (c->kind) {
+    case KIND_HTTP:
+	return http_input(c);
+    case KIND_JSON:
+	json_input(c);
+	break;
+    case KIND_LP:
+	used = lp_lines(c->in.data, c->in.len, "", 0, 0);
+	if (used == 0 && c->in.len > 16 * 1024 * 1024) {
+	    stat_bad++;
+	    return 0;		/* no newline in 16 MB */
+	}
+	buf_consume(&c->in, used);
+	break;
+    }
+    return 1;
+}
+
+/* send what is queued and wait for EPOLLOUT if the socket is full, returns 0 when the
+ * connection should be closed */
+int conn_output(struct conn *c)
+{
+    struct epoll_event ev;
+    ssize_t done;
+    int events;
+
+    while (c->out.len > 0) {
+	if ((done = write(c->fd, c->out.data, c->out.len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN) {
+		if (verbose)
+		    fprintf(stderr, "njmon_relay: reply to %s did not go\n", c->peer);
+		return 0;
+	    }
+	    break;
+	}
+	buf_consume(&c->out, done);
+	c->active = now_ms();
+    }
+    if (c->closing && c->out.len == 0)
+	return 0;
+    events = (c->out.len > 0 ? EPOLLOUT : 0) | (!c->closing && c->out.len < HTTP_OUT_MAX ? EPOLLIN : 0);
+    if (events != c->events) {
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+    }
+    return 1;
+}
+
+/* close the clients that have sent nothing (or not taken their replies) for -k seconds, like
+ * a node that went away without a FIN */
+void conn_idle(long long now)
+{
+    struct conn *c;
+    struct conn *next;
+
+    for (c = conns; c != NULL; c = next) {
+	next = c->next;
+	if (now - c->active < idle_seconds * 1000)
+	    continue;
+	if (verbose)
+	    fprintf(stderr, "njmon_relay: %s idle for %ld seconds - closed\n", c->peer, idle_seconds);
+	conn_close(epfd, c);
+    }
+}
+
+void relay_stats(long long epoch)
+{
+    char line[1024];
+    char suffix[64];
+    long pending;
+    long len;
+
+    pthread_mutex_lock(&batch_lock);
+    pending = pending_bytes;
+    pthread_mutex_unlock(&batch_lock);
+    len = snprintf(line, sizeof(line),
+		   "njmon_relay,host=%s clients=%ldi,connections=%ldi,samples=%ldi,lines=%ldi,bytes_in=%ldi,bad=%ldi,rollups=%ldi,"
+		   "batches=%ldi,bytes_out=%ldi,send_errors=%ldi,reconnects=%ldi,pending_bytes=%ldi,rollup_series=%ldi",
+		   hostname, stat_clients, stat_connections, stat_samples, stat_lines, stat_bytes_in, stat_bad, stat_rollups,
+		   __atomic_load_n(&stat_batches, __ATOMIC_RELAXED), __atomic_load_n(&stat_bytes_out, __ATOMIC_RELAXED),
+		   __atomic_load_n(&stat_send_errors, __ATOMIC_RELAXED), __atomic_load_n(&stat_reconnects, __ATOMIC_RELAXED), pending, rollup_used);
+    if (verbose)
+	fprintf(stderr, "%s\n", line);
+    snprintf(suffix, sizeof(suffix), " %lld000000000", epoch);
+    batch_line(line, len, suffix, strlen(suffix));
+}
+
+void stop_handler(int sig)
+{
+    stopping = 1;
+}
+
+void hint(char *program)
+{
+    printf("%s: relays njmon JSON and nimon Line Protocol from many servers to InfluxDB in batches\n\n", program);
+    printf("\t%s -l port -i influx_host [-p 8086] [-x njmon [-y user -z password] | -x bucket -O org -T token]\n", program);
+    printf("\t-l port      : Port the njmon (-i relay -p port) and nimon connect to\n");
+    printf("\t-i hostname  : InfluxDB server, -p its port (default 8086)\n");
+    printf("\t-x njmon     : InfluxDB database (default njmon), -y username -z password\n");
+    printf("\t-O org -T token : InfluxDB 2 organisation and token, -x is then the bucket\n");
+    printf("\t-f file      : Append the lines to a file instead of sending them to InfluxDB\n");
+    printf("\t-b lines     : Lines per InfluxDB write (default 5000)\n");
+    printf("\t-t ms        : Send a part batch when it is this old (default 1000)\n");
+    printf("\t-m MB        : Stop reading the clients while this much is waiting for InfluxDB (default 256)\n");
+    printf("\t-Z level     : gzip the InfluxDB writes with this zlib level 1 to 9\n");
+    printf("\t-r label     : Rollups for each value of this tag, like job from nimon -q job=name\n");
+    printf("\t-R m1,m2     : Measurements to roll up (default cpu_total)\n");
+    printf("\t-s seconds   : Rollup period (default 10)\n");
+    printf("\t-k seconds   : Close clients that send nothing for this long (default 300), more than their -s\n");
+    printf("\t-v           : Verbose, the njmon_relay counts and retries on stderr\n");
+    printf("\tExample: %s -l 8181 -i influxbox -p 8086 -x njmon -r job -R cpu_total,proc_meminfo,psi\n", program);
+    printf("\t         nimon -s 1 -i relaybox -p 8181 -x njmon -q job=hpl   on every node\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev;
+    struct epoll_event events[256];
+    struct sockaddr_in addr;
+    struct sockaddr_storage peer;
+    struct rlimit rl;
+    struct timespec wait;
+    struct conn listener;
+    struct conn *c;
+    socklen_t peer_len;
+    long long next_rollup;
+    long long next_stats;
+    long long next_idle;
+    long long now;
+    long long epoch;
+    int listen_fd;
+    int timeout;
+    int fd;
+    int one = 1;
+    int ch;
+    int i;
+    int n;
+
+    while ((ch = getopt(argc, argv, "b:f:h?i:k:l:m:O:p:r:R:s:t:T:vx:y:z:Z:")) != -1) {
+	switch (ch) {
+	case 'b':
+	    batch_lines = atol(optarg);
+	    break;
+	case 'f':
+	    output_filename = optarg;
+	    break;
+	case 'i':
+	    influx_host = optarg;
+	    break;
+	case 'k':
+	    idle_seconds = atol(optarg);
+	    break;
+	case 'l':
+	    listen_port = atol(optarg);
+	    break;
+	case 'm':
+	    pending_max = atol(optarg) * 1024 * 1024;
+	    break;
+	case 'O':
+	    strncpy(influx_org, optarg, 64);
+	    break;
+	case 'p':
+	    influx_port = atol(optarg);
+	    break;
+	case 'r':
+	    rollup_label = optarg;
+	    break;
+	case 'R':
+	    snprintf(rollup_measurements, sizeof(rollup_measurements), ",%s,", optarg);
+	    break;
+	case 's':
+	    rollup_seconds = atol(optarg);
+	    break;
+	case 't':
+	    batch_ms = atol(optarg);
+	    break;
+	case 'T':
+	    strncpy(influx_token, optarg, 256);
+	    influx_version = 2;
+	    break;
+	case 'v':
+	    verbose++;
+	    break;
+	case 'x':
+	    strncpy(influx_database, optarg, 63);
+	    break;
+	case 'y':
+	    strncpy(influx_username, optarg, 63);
+	    break;
+	case 'z':
+	    strncpy(influx_password, optarg, 63);
+	    break;
+	case 'Z':
+	    zlevel = atoi(optarg);
+	    break;
+	default:
+	    hint(argv[0]);
+	    exit(0);
+	}
+    }
+    if (listen_port <= 0 || (influx_host == NULL && output_filename == NULL)) {
+	hint(argv[0]);
+	exit(1);
+    }
+    if (batch_lines < 1 || batch_ms < 1 || pending_max < 1 || rollup_seconds < 1 || idle_seconds < 1 || zlevel < 0 || zlevel > 9) {
+	printf("njmon_relay: -b -t -m -s and -k must be more than zero and -Z 1 to 9\n");
+	exit(1);
+    }
+    if (rollup_label != NULL)
+	rollup_tag_len = snprintf(rollup_tag, sizeof(rollup_tag), ",%s=", rollup_label);
+    gethostname(hostname, sizeof(hostname) - 1);
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {	/* a connection per node */
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    if (output_filename != NULL && (influx_fd = open(output_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+	perror(output_filename);
+	exit(2);
+    }
+    if (zlevel && deflateInit2(&send_z, zlevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	nwarning("deflateInit2() failed - sending uncompressed");
+	zlevel = 0;
+    }
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+	perror("socket");
+	exit(2);
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(listen_port);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listen_fd, 1024) == -1) {
+	perror("bind/listen");
+	exit(2);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    memset(&listener, 0, sizeof(listener));
+    listener.fd = listen_fd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    current = batch_get();
+    if (pthread_create(&sender_thread, NULL, sender, NULL) != 0) {
+	perror("pthread_create");
+	exit(2);
+    }
+    next_rollup = now_ms() + rollup_seconds * 1000;
+    next_stats = now_ms() + stats_seconds * 1000;
+    next_idle = now_ms() + 1000;
+
+    while (!stopping) {
+	now = now_ms();
+	epoch = time(0);
+	if (current->lines > 0 && now - current_started >= batch_ms)
+	    batch_flush();
+	if (rollup_label != NULL && now >= next_rollup) {
+	    rollup_send(epoch);
+	    next_rollup += rollup_seconds * 1000;
+	}
+	if (now >= next_stats) {
+	    relay_stats(epoch);
+	    next_stats += stats_seconds * 1000;
+	}
+	if (now >= next_idle) {
+	    conn_idle(now);
+	    next_idle = now + 1000;
+	}
+
+	pthread_mutex_lock(&batch_lock);
+	if (pending_bytes > pending_max) {	/* leave the clients waiting until InfluxDB catches up */
+	    clock_gettime(CLOCK_REALTIME, &wait);
+	    wait.tv_nsec += 100 * 1000000L;
+	    wait.tv_sec += wait.tv_nsec / 1000000000L;
+	    wait.tv_nsec = wait.tv_nsec % 1000000000L;
+	    pthread_cond_timedwait(&batch_space, &batch_lock, &wait);
+	    pthread_mutex_unlock(&batch_lock);
+	    continue;
+	}
+	pthread_mutex_unlock(&batch_lock);
+
+	timeout = stats_seconds * 1000;
+	if (current->lines > 0)
+	    timeout = current_started + batch_ms - now;
+	if (rollup_label != NULL && next_rollup - now < timeout)
+	    timeout = next_rollup - now;
+	if (next_stats - now < timeout)
+	    timeout = next_stats - now;
+	if (conns != NULL && next_idle - now < timeout)
+	    timeout = next_idle - now;
+	if (timeout < 0)
+	    timeout = 0;
+	if ((n = epoll_wait(epfd, events, 256, timeout)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    break;
+	}
+	now_suffix_len = snprintf(now_suffix, sizeof(now_suffix), " %lld000000000", (long long) time(0));
+	for (i = 0; i < n; i++) {
+	    c = events[i].data.ptr;
+	    if (c == &listener) {
+		for (;;) {
+		    peer_len = sizeof(peer);
+		    if ((fd = accept4(listen_fd, (struct sockaddr *) &peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+			break;
+		    c = calloc(1, sizeof(struct conn));
+		    c->fd = fd;
+		    c->start = -1;
+		    c->active = now_ms();
+		    if ((c->next = conns) != NULL)
+			conns->prev = c;
+		    conns = c;
+		    getnameinfo((struct sockaddr *) &peer, peer_len, c->peer, sizeof(c->peer), NULL, 0, NI_NUMERICHOST);
+		    c->events = EPOLLIN;
+		    ev.events = EPOLLIN;
+		    ev.data.ptr = c;
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		    stat_connections++;
+		    stat_clients++;
+		    if (verbose)
+			fprintf(stderr, "njmon_relay: connection from %s\n", c->peer);
+		}
+		continue;
+	    }
+	    if (!c->closing && (events[i].events & ~EPOLLOUT) && conn_input(c) == 0)
+		c->closing = 1;	/* after any reply has gone, like the 413 */
+	    if (conn_output(c) == 0) {
+		if (verbose)
+		    fprintf(stderr, "njmon_relay: %s closed\n", c->peer);
+		conn_close(epfd, c);
+	    }
+	}
+    }
+
+    /* send what is left and let the sender finish */
+    if (rollup_label != NULL)
+	rollup_send(time(0));
+    batch_flush();
+    pthread_mutex_lock(&batch_lock);
+    sender_stopping = 1;
+    pthread_cond_signal(&batch_ready);
+    pthread_mutex_unlock(&batch_lock);
+    pthread_join(sender_thread, NULL);
+    return 0;
+}
@@ -0,0 +1,432 @@
+/*
+ * njmon_relay_load.c -- load generator for njmon_relay: replays captured njmon or nimon samples
+ *                       from many fake nodes, each with its own kept open connection.
+ * (C) Copyright 2018 Nigel Griffiths
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    Find the GNU General Public License here <http://www.gnu.org/licenses/>.
+ */
+
+/* Compile example: cc -O4 -g -o njmon_relay_load njmon_relay_load.c
+ * Usage: njmon -s 1 -c 30 -f     or   nimon -s 1 -c 30 -f     to capture some samples, then
+ *        njmon_relay_load -i relaybox -p 8181 -n 500 -s 1 -c 60 -j 8 host_20261017_1200.json
+ *
+ * A .json capture is sent like njmon -i -p does, a sample per line on a raw socket. Anything
+ * else is taken as Line Protocol and POSTed like nimon does, a sample per request, waiting for
+ * each 204. Samples start at the timestamp lines. Each fake node sends the samples in turn with
+ * its host tag changed to fakeNNNNN, a job tag of one of -j jobs added and the time changed to
+ * now. The nodes are spread evenly over each -s interval. At the end (and every 10 seconds with
+ * -v) the rate achieved, sends that were late and the HTTP reply times are printed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+char *host = "localhost";	/* -i */
+long port = 8181;		/* -p */
+long nodes = 10;		/* -n */
+double interval = 1.0;		/* -s */
+long count = 60;		/* -c */
+long jobs = 1;			/* -j */
+char database[64] = "njmon";	/* -x */
+int verbose = 0;		/* -v */
+
+int json;			/* the capture is njmon JSON */
+char **samples = NULL;
+long *sample_lens = NULL;
+long samples_count = 0;
+
+int *fds;
+char *out = NULL;
+long out_len = 0;
+long out_size = 0;
+
+long sent_samples = 0;
+long sent_bytes = 0;
+long late = 0;
+long replies = 0;
+double reply_total_ms = 0.0;
+double reply_max_ms = 0.0;
+
+double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void out_add(char *data, long len)
+{
+    if (out_len + len + 1024 > out_size) {	/* room for the HTTP header */
+	out_size = out_len + len + (1024 * 1024);
+	out = realloc(out, out_size);
+    }
+    memcpy(&out[out_len], data, len);
+    out_len += len;
+}
+
+/* split the capture in to samples, at each {...} line or each timestamp line */
+void load(char *filename)
+{
+    FILE *fp;
+    char *data;
+    char *s;
+    char *nl;
+    long size;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+	perror(filename);
+	exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    data = malloc(size + 1);
+    if (fread(data, 1, size, fp) != (size_t) size) {
+	perror(filename);
+	exit(1);
+    }
+    data[size] = 0;
+    fclose(fp);
+    json = data[0] == '{';
+    for (s = data; s < data + size; s = nl + 1) {
+	if ((nl = strchr(s, '\n')) == NULL)
+	    nl = data + size;
+	if (json || samples_count == 0 || !strncmp(s, "timestamp,", 10)) {
+	    samples = realloc(samples, (samples_count + 1) * sizeof(char *));
+	    sample_lens = realloc(sample_lens, (samples_count + 1) * sizeof(long));
+	    samples[samples_count] = s;
+	    sample_lens[samples_count++] = 0;
+	}
+	sample_lens[samples_count - 1] = nl + 1 - samples[samples_count - 1];
+	if (nl == data + size)
+	    sample_lens[samples_count - 1]--;
+    }
+    if (samples_count == 0) {
+	fprintf(stderr, "njmon_relay_load: no samples in %s\n", filename);
+	exit(1);
+    }
+}
+
+/* copy from s to the value after key, replaced by value and returns where the old one ends */
+char *json_replace(char *s, char *end, char *key, char *value)
+{
+    char *found;
+    char *close;
+
+    if ((found = memmem(s, end - s, key, strlen(key))) == NULL)
+	return s;
+    found += strlen(key);
+    if ((close = memchr(found, '"', end - found)) == NULL)
+	return s;
+    out_add(s, found - s);
+    out_add(value, strlen(value));
+    return close;
+}
+
+/* the sample as node would send it */
+void render(char *sample, long len, long node, time_t now)
+{
+    char name[64];
+    char job[64];
+    char utc[64];
+    char ts[64];
+    char *end = sample + len;
+    char *s = sample;
+    char *line_end;
+    char *tags_end;
+    char *tags;
+    char *p;
+    struct tm tm;
+    int quote;
+
+    snprintf(name, sizeof(name), "fake%05ld", node);
+    snprintf(job, sizeof(job), "job%ld", node % jobs);
+    out_len = 0;
+    if (json) {			/* the timestamp section is before the tags */
+	gmtime_r(&now, &tm);
+	strftime(utc, sizeof(utc), "%Y-%m-%dT%H:%M:%S", &tm);
+	s = json_replace(s, end, "\"UTC\": \"", utc);
+	if (memmem(s, end - s, "\"job_tag\": \"", 12) != NULL) {	/* captured with -q job= */
+	    s = json_replace(s, end, "\"job_tag\": \"", job);
+	} else if ((p = memmem(s, end - s, "\"tags\": {", 9)) != NULL) {
+	    out_add(s, p + 9 - s);
+	    out_add("\"job_tag\": \"", 12);
+	    out_add(job, strlen(job));
+	    out_add("\",", 2);
+	    s = p + 9;
+	}
+	s = json_replace(s, end, "\"host_tag\": \"", name);
+	out_add(s, end - s);
+	if (out_len == 0 || out[out_len - 1] != '\n')
+	    out_add("\n", 1);
+	return;
+    }
+    snprintf(ts, sizeof(ts), " %ld\n", (long) now);
+    for (; s < end; s = line_end + 1) {
+	if ((line_end = memchr(s, '\n', end - s)) == NULL)
+	    line_end = end;
+	for (tags_end = s; tags_end < line_end && *tags_end != ' '; tags_end++)
+	    if (*tags_end == '\\')
+		tags_end++;
+	if (tags_end >= line_end) {
+	    if (line_end == end)
+		break;
+	    continue;
+	}
+	if ((p = memmem(s, tags_end - s, ",host=", 6)) != NULL) {
+	    out_add(s, p + 6 - s);
+	    out_add(name, strlen(name));
+	    for (p += 6; p < tags_end && *p != ','; p++)
+		if (*p == '\\')
+		    p++;
+	} else {
+	    p = s;
+	}
+	if ((tags = memmem(p, tags_end - p, ",job=", 5)) != NULL) {	/* captured with -q job= */
+	    out_add(p, tags - p);
+	    for (p = tags + 5; p < tags_end && *p != ','; p++)
+		if (*p == '\\')
+		    p++;
+	}
+	out_add(p, tags_end - p);
+	out_add(",job=", 5);
+	out_add(job, strlen(job));
+	for (p = tags_end + 1, quote = 0; p < line_end; p++) {	/* the fields without any timestamp */
+	    if (*p == '\\')
+		p++;
+	    else if (*p == '"')
+		quote = !quote;
+	    else if (*p == ' ' && !quote)
+		break;
+	}
+	while (p > tags_end + 1 && (p[-1] == ' ' || p[-1] == '\r'))
+	    p--;
+	out_add(tags_end, p - tags_end);
+	out_add(ts, strlen(ts));
+	if (line_end == end)
+	    break;
+    }
+}
+
+int node_connect()
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *r;
+    char service[16];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%ld", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+	fprintf(stderr, "njmon_relay_load: can not find %s\n", host);
+	exit(1);
+    }
+    for (r = res; r != NULL; r = r->ai_next) {
+	if ((fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1)
+	    continue;
+	if (connect(fd, r->ai_addr, r->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+	perror("connect");
+	exit(1);
+    }
+    return fd;
+}
+
+int write_all(int fd, char *data, long len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+	if ((ret = write(fd, data, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	data += ret;
+	len -= ret;
+    }
+    return 1;
+}
+
+/* read the reply to a POST, returns 0 if it was not a 204 */
+int reply(int fd)
+{
+    char result[4096];
+    long got = 0;
+    int code = -1;
+    int ret;
+
+    for (;;) {
+	if ((ret = read(fd, &result[got], sizeof(result) - 1 - got)) <= 0)
+	    return 0;
+	got += ret;
+	result[got] = 0;
+	if (strstr(result, "\r\n\r\n") != NULL || got == sizeof(result) - 1)
+	    break;
+    }
+    sscanf(result, "HTTP/1.%*d %d", &code);
+    return code == 204;
+}
+
+void report(double elapsed)
+{
+    printf("nodes %ld samples %ld bytes %ld in %.1f s = %.1f samples/s %.2f MB/s late %ld",
+	   nodes, sent_samples, sent_bytes, elapsed, sent_samples / elapsed, sent_bytes / elapsed / 1024.0 / 1024.0, late);
+    if (replies > 0)
+	printf(" replies %ld avg %.3f ms max %.3f ms", replies, reply_total_ms / replies, reply_max_ms);
+    printf("\n");
+    fflush(stdout);
+}
+
+void hint(char *program)
+{
+    printf("%s: replays captured njmon JSON or nimon Line Protocol samples from fake nodes\n\n", program);
+    printf("\t%s [-i relay_host] [-p port] [-n nodes] [-s seconds] [-c count] [-j jobs] [-x db] [-v] capture_file\n", program);
+    printf("\t-i host -p port : the njmon_relay (default localhost 8181)\n");
+    printf("\t-n nodes     : fake nodes, one connection each (default 10)\n");
+    printf("\t-s seconds   : interval between a node's samples, 0.1 is fine (default 1)\n");
+    printf("\t-c count     : samples each node sends (default 60)\n");
+    printf("\t-j jobs      : the nodes are spread over job0 to job<jobs-1> (default 1)\n");
+    printf("\t-x db        : database in the nimon POSTs (default njmon)\n");
+    printf("\t-v           : report every 10 seconds\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit rl;
+    struct timespec ts;
+    char header[512];
+    double start;
+    double target;
+    double now;
+    double sent;
+    double next_report;
+    double ms;
+    long round;
+    long node;
+    long len;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "c:h?i:j:n:p:s:vx:")) != -1) {
+	switch (ch) {
+	case 'c':
+	    count = atol(optarg);
+	    break;
+	case 'i':
+	    host = optarg;
+	    break;
+	case 'j':
+	    jobs = atol(optarg);
+	    break;
+	case 'n':
+	    nodes = atol(optarg);
+	    break;
+	case 'p':
+	    port = atol(optarg);
+	    break;
+	case 's':
+	    interval = atof(optarg);
+	    break;
+	case 'v':
+	    verbose++;
+	    break;
+	case 'x':
+	    strncpy(database, optarg, 63);
+	    break;
+	default:
+	    hint(argv[0]);
+	    exit(0);
+	}
+    }
+    if (optind != argc - 1 || nodes < 1 || count < 1 || jobs < 1 || interval < 0.0) {
+	hint(argv[0]);
+	exit(1);
+    }
+    load(argv[optind]);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fds = malloc(nodes * sizeof(int));
+    for (node = 0; node < nodes; node++)
+	fds[node] = node_connect();
+    printf("%ld %s samples, %ld nodes connected to %s:%ld\n", samples_count, json ? "njmon JSON" : "nimon Line Protocol", nodes, host, port);
+
+    start = now_seconds();
+    next_report = start + 10.0;
+    for (round = 0; round < count; round++) {
+	for (node = 0; node < nodes; node++) {
+	    target = start + round * interval + node * interval / nodes;
+	    now = now_seconds();
+	    if (target > now) {
+		ts.tv_sec = (long) (target - now);
+		ts.tv_nsec = (long) ((target - now - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	    } else if (now - target > interval / 2) {
+		late++;
+	    }
+	    render(samples[(node + round) % samples_count], sample_lens[(node + round) % samples_count], node, time(0));
+	    if (!json) {
+		len = snprintf(header, sizeof(header), "POST /write?db=%s&precision=s HTTP/1.1\r\nHost: %s:%ld\r\nContent-Length: %ld\r\n\r\n",
+			       database, host, port, out_len);
+		memmove(&out[len], out, out_len);	/* one write so Nagle does not hold the body back */
+		memcpy(out, header, len);
+		out_len += len;
+	    }
+	    sent = now_seconds();
+	    if (!write_all(fds[node], out, out_len))
+		goto broken;
+	    sent_bytes += out_len;
+	    sent_samples++;
+	    if (!json) {
+		if (!reply(fds[node]))
+		    goto broken;
+		ms = (now_seconds() - sent) * 1000.0;
+		replies++;
+		reply_total_ms += ms;
+		if (ms > reply_max_ms)
+		    reply_max_ms = ms;
+	    }
+	    if (verbose && now_seconds() >= next_report) {
+		report(now_seconds() - start);
+		next_report += 10.0;
+	    }
+	}
+    }
+    report(now_seconds() - start);
+    return 0;
+
+  broken:
+    fprintf(stderr, "njmon_relay_load: node %ld connection broken\n", node);
+    report(now_seconds() - start);
+    return 1;
+}
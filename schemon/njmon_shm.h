@@ -0,0 +1,153 @@
+/*
+ * njmon_shm.h -- the shared memory segment njmon -o name keeps the latest sample's numbers in
+ *                and the inline functions for programs on the same server reading it.
+ *
+ * /dev/shm/name is a struct njmon_shm header followed by cpus_max struct njmon_shm_cpu (by CPU
+ * number) and pods_max struct njmon_shm_pod, at cpus_offset and pods_offset. The sizes are
+ * fixed when njmon starts. At the end of every sample njmon makes seq odd, copies everything
+ * after seq in and makes seq even again (a seqlock), so a reader copies the segment and if seq
+ * was odd or changed while it copied it tries again. That is all memory reads, no system
+ * calls or parsing after njmon_shm_open().
+ *
+ *     struct njmon_shm *shm = njmon_shm_open("njmon");
+ *     struct njmon_shm *copy = malloc(shm->size);
+ *     if (njmon_shm_read(shm, copy))
+ *         printf("%.1f%% busy, memory some avg10 %.2f\n", 100.0 - copy->total.idle, copy->psi[1].some_avg10);
+ *
+ * Rates are per second and percentages of the interval, like the text sections, so
+ * total.user is the cpu_total user and total.counters[] the perf_counters counts.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NJMON_SHM_MAGIC "NJSHM01"
+#define NJMON_SHM_VERSION 1
+#define NJMON_SHM_COUNTERS 16	/* the -E events, as COUNTERS_MAX */
+
+#define NJMON_SHM_CPU_PSI 0	/* psi[] and pressure[] */
+#define NJMON_SHM_MEMORY_PSI 1
+#define NJMON_SHM_IO_PSI 2
+
+struct njmon_shm_cpu {
+    double user;		/* percent */
+    double nice;
+    double sys;
+    double idle;
+    double iowait;
+    double hardirq;
+    double softirq;
+    double steal;
+    double guest;
+    double guestnice;
+    double counters[NJMON_SHM_COUNTERS];	/* -E counts this interval */
+    int32_t online;		/* 1 if in this sample, total has the number online */
+    int32_t pad;
+};
+
+struct njmon_shm_pressure {
+    double some_avg10;
+    double some_avg60;
+    double some_avg300;
+    double full_avg10;
+    double full_avg60;
+    double full_avg300;
+    uint64_t some_total_us;
+    uint64_t full_total_us;
+};
+
+struct njmon_shm_pod {
+    char uid[64];		/* empty for an unused slot */
+    char qos[16];
+    double cpu_percent;		/* -G */
+    double throttled_percent;
+    uint64_t memory_current;
+    uint64_t io_rbytes;
+    uint64_t io_wbytes;
+    struct njmon_shm_pressure pressure[3];
+    double counters[NJMON_SHM_COUNTERS];	/* -g */
+};
+
+struct njmon_shm {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t size;		/* of the whole segment */
+    uint64_t seq;		/* odd while njmon is writing */
+    /* from here on is copied in every sample */
+    uint64_t samples;
+    int64_t epoch_us;		/* when the sample finished */
+    double elapsed;		/* seconds the rates are over */
+    uint32_t cpus_max;
+    uint32_t pods_max;
+    uint32_t cpus_offset;
+    uint32_t pods_offset;
+    uint32_t counters;		/* names in counter_names */
+    uint32_t pods;		/* slots in use */
+    char counter_names[NJMON_SHM_COUNTERS][32];
+    struct njmon_shm_cpu total;
+    struct njmon_shm_pressure psi[3];	/* the host's /proc/pressure */
+};
+
+#define NJMON_SHM_CPU(shm, cpu) ((struct njmon_shm_cpu *)((char *)(shm) + (shm)->cpus_offset) + (cpu))
+#define NJMON_SHM_POD(shm, pod) ((struct njmon_shm_pod *)((char *)(shm) + (shm)->pods_offset) + (pod))
+
+/* map /dev/shm/name read only, NULL if njmon -o name has not made it */
+static inline struct njmon_shm *njmon_shm_open(const char *name)
+{
+    struct njmon_shm *shm;
+    struct stat st;
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    if ((fd = shm_open(path, O_RDONLY, 0)) == -1)
+	return NULL;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(struct njmon_shm)) {
+	close(fd);
+	return NULL;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+	return NULL;
+    if (memcmp(shm->magic, NJMON_SHM_MAGIC, 8) || shm->version != NJMON_SHM_VERSION || shm->size != (uint64_t) st.st_size) {
+	munmap(shm, st.st_size);
+	return NULL;
+    }
+    return shm;
+}
+
+/* a consistent copy of the latest sample in to copy (shm->size bytes), returns 0 if there is
+ * no sample yet or njmon kept writing for the whole of the tries */
+static inline int njmon_shm_read(const struct njmon_shm *shm, struct njmon_shm *copy)
+{
+    uint64_t seq;
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+	seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+	    continue;
+	memcpy(copy, shm, shm->size);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+	    return copy->samples > 0;
+    }
+    return 0;
+}
+
+/* the seq of the latest sample, to poll for a new one without copying */
+static inline uint64_t njmon_shm_seq(const struct njmon_shm *shm)
+{
+    return __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline void njmon_shm_close(struct njmon_shm *shm)
+{
+    munmap(shm, shm->size);
+}
@@ -0,0 +1,96 @@
+/*
+ * njmon_shm_reader.c -- an example reader of the shared memory segment from njmon -o name.
+ *                       Waits for each new sample and prints the CPU, PSI and pod numbers in it
+ *                       and how long the copy out of shared memory took.
+ * (C) Copyright 2018 Nigel Griffiths
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    Find the GNU General Public License here <http://www.gnu.org/licenses/>.
+ */
+
+/* Compile example: cc -O4 -g -o njmon_shm_reader njmon_shm_reader.c -lrt
+ * Usage: njmon -s 10 -o njmon
+ *        njmon_shm_reader njmon [samples]
+ */
+#include <stdlib.h>
+#include <time.h>
+#include "njmon_shm.h"
+
+double now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    struct njmon_shm *shm;
+    struct njmon_shm *copy;
+    struct njmon_shm_pod *pod;
+    uint64_t seq = 0;
+    double start;
+    double took;
+    long samples = -1;
+    int cpus;
+    int i;
+    int j;
+
+    if (argc < 2) {
+	fprintf(stderr, "Usage: %s name [samples]   for njmon -o name\n", argv[0]);
+	exit(1);
+    }
+    if (argc > 2)
+	samples = atol(argv[2]);
+    while ((shm = njmon_shm_open(argv[1])) == NULL) {
+	fprintf(stderr, "njmon_shm_reader: waiting for /dev/shm/%s\n", argv[1]);
+	sleep(1);
+    }
+    copy = malloc(shm->size);
+    while (samples != 0) {
+	if (njmon_shm_seq(shm) == seq) {
+	    usleep(10000);
+	    continue;
+	}
+	start = now_us();
+	if (!njmon_shm_read(shm, copy))
+	    continue;
+	took = now_us() - start;
+	seq = njmon_shm_seq(shm);
+
+	for (i = 0, cpus = 0; i < copy->cpus_max; i++)
+	    if (NJMON_SHM_CPU(copy, i)->online)
+		cpus++;
+	printf("sample %llu epoch_us %lld read %.2f us (%llu bytes)\n",
+	       (unsigned long long) copy->samples, (long long) copy->epoch_us, took, (unsigned long long) copy->size);
+	printf("  cpu_total user %.2f sys %.2f idle %.2f iowait %.2f online %d cpus %d\n",
+	       copy->total.user, copy->total.sys, copy->total.idle, copy->total.iowait, copy->total.online, cpus);
+	for (j = 0; j < copy->counters; j++)
+	    printf("  %s %.0f\n", copy->counter_names[j], copy->total.counters[j]);
+	printf("  psi cpu some %.2f memory some %.2f full %.2f io some %.2f full %.2f\n",
+	       copy->psi[NJMON_SHM_CPU_PSI].some_avg10,
+	       copy->psi[NJMON_SHM_MEMORY_PSI].some_avg10, copy->psi[NJMON_SHM_MEMORY_PSI].full_avg10,
+	       copy->psi[NJMON_SHM_IO_PSI].some_avg10, copy->psi[NJMON_SHM_IO_PSI].full_avg10);
+	for (i = 0; i < copy->pods; i++) {
+	    pod = NJMON_SHM_POD(copy, i);
+	    printf("  pod %s %s cpu %.2f%% throttled %.2f%% memory %llu memory some %.2f\n",
+		   pod->uid, pod->qos, pod->cpu_percent, pod->throttled_percent,
+		   (unsigned long long) pod->memory_current, pod->pressure[NJMON_SHM_MEMORY_PSI].some_avg10);
+	}
+	fflush(stdout);
+	if (samples > 0)
+	    samples--;
+    }
+    njmon_shm_close(shm);
+    return 0;
+}
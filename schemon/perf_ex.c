@@ -14,7 +14,8 @@ static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 
 int main() {
     struct perf_event_attr pe;
-    int fd[8];
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    int *fd = malloc(sizeof(int) * cpus);
 
     memset(&pe, 0, sizeof(struct perf_event_attr));
     pe.type = PERF_TYPE_RAW;
@@ -24,11 +25,11 @@ int main() {
     pe.exclude_kernel = 0; // exclude kernel space
     pe.exclude_hv = 1; // exclude hypervisor space
 
-    for(auto i = 0; i <= 7; i++) {
+    for(auto i = 0; i < cpus; i++) {
     fd[i] = perf_event_open(&pe, -1, i, -1, 0);
     if (fd[i] == -1) {
-        perror("Error opening perf event");
-        exit(EXIT_FAILURE);
+        perror("Error opening perf event"); // offline CPU
+        continue;
     }
     
 
@@ -40,7 +41,9 @@ int main() {
     sleep(5);
     // Stop counting
     long long count;
-    for(auto i = 0; i <= 7; i++) {
+    for(auto i = 0; i < cpus; i++) {
+    if (fd[i] == -1)
+        continue;
     ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
 
     // Read the counter value